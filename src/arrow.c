@@ -0,0 +1,488 @@
+/*============================================================================
+  epub2txt v2
+  arrow.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  An Arrow IPC stream is a schema message, then a message for each
+  record batch, then an end-of-stream marker. Each message is a
+  continuation marker, the length of its metadata, the metadata, which
+  is a FlatBuffer (Message.fbs and Schema.fbs, in the Arrow sources),
+  and, for a record batch, the body, which is the column buffers one
+  after another.
+
+  There is no FlatBuffers library here: the few tables that are needed
+  are laid out by hand, from the front of the buffer to the back, so
+  that every offset points forwards, as a FlatBuffer's must. FlatBuffers
+  are always little-endian, whatever the machine.
+
+  The columns are collected in buffers of their own, as the paragraphs
+  arrive, so that a batch is written straight from them.
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "arrow.h"
+
+// Column buffers start on this boundary in the body
+#define ARROW_ALIGN 64
+
+#define ARROW_NCOLUMNS 5
+#define ARROW_NBUFFERS 12
+
+// From Schema.fbs and Message.fbs
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_LARGE_UTF8 20
+
+typedef struct _ArrowWriter
+  {
+  ParaSink sink;
+  BOOL started;          // The schema has been written
+  int book_id;
+  int spine_index;       // -1 for metadata
+  int para_index;
+  // The batch being collected
+  uint32_t rows;
+  uint32_t nulls;        // Rows whose spine_index is null
+  Buffer *book;          // int32
+  Buffer *valid;         // Bitmap of the spine_index that are not null
+  Buffer *spine;         // int32
+  Buffer *para;          // int32
+  Buffer *kind_offsets;  // int32
+  Buffer *kind;
+  Buffer *text_offsets;  // int64
+  Buffer *text;
+  Buffer *meta;          // Metadata of a message
+  } ArrowWriter;
+
+// A field of a FlatBuffer table: size is 0 if the field is left out
+typedef struct _FbField
+  {
+  int size;
+  uint64_t value;
+  size_t pos;            // Set by fb_table(), for an offset to patch
+  } FbField;
+
+static const char arrow_zeros [ARROW_ALIGN];
+
+
+/*============================================================================
+  fb_put
+  Append a little-endian integer of size bytes
+============================================================================*/
+static void fb_put (Buffer *b, uint64_t value, int size)
+  {
+  char bytes [8];
+  int i;
+  for (i = 0; i < size; i++)
+    bytes[i] = (char)(value >> (8 * i));
+  buffer_append (b, bytes, size);
+  }
+
+
+/*============================================================================
+  fb_pad
+  Pad with zeros until the length is rem, modulo align
+============================================================================*/
+static void fb_pad (Buffer *b, size_t align, size_t rem)
+  {
+  while (b->len % align != rem)
+    buffer_append (b, "", 1);
+  }
+
+
+/*============================================================================
+  fb_patch
+  Point the offset at pos to target, which is after it
+============================================================================*/
+static void fb_patch (Buffer *b, size_t pos, size_t target)
+  {
+  uint32_t offset = (uint32_t)(target - pos);
+  int i;
+  for (i = 0; i < 4; i++)
+    b->data[pos + i] = (char)(offset >> (8 * i));
+  }
+
+
+/*============================================================================
+  fb_table
+  Append a table, with its vtable just before it, and return its
+  position. The fields are in the order of their ids; offsets among
+  them are written as 0, to be patched when what they point to has
+  been written
+============================================================================*/
+static size_t fb_table (Buffer *b, FbField *fields, int n)
+  {
+  int offsets [16];
+  int i, size, table_size = 4;
+
+  // Widest first, so that each is aligned if the table's first field is
+  //  aligned to 8
+  for (size = 8; size >= 1; size /= 2)
+    for (i = 0; i < n; i++)
+      if (fields[i].size == size)
+        {
+        offsets[i] = table_size;
+        table_size += size;
+        }
+
+  fb_pad (b, 2, 0);
+  size_t vtable = b->len;
+  fb_put (b, 4 + 2 * n, 2);
+  fb_put (b, table_size, 2);
+  for (i = 0; i < n; i++)
+    fb_put (b, fields[i].size ? offsets[i] : 0, 2);
+
+  fb_pad (b, 8, 4);
+  size_t table = b->len;
+  fb_put (b, table - vtable, 4);
+  for (size = 8; size >= 1; size /= 2)
+    for (i = 0; i < n; i++)
+      if (fields[i].size == size)
+        {
+        fields[i].pos = table + offsets[i];
+        fb_put (b, fields[i].value, size);
+        }
+  return table;
+  }
+
+
+/*============================================================================
+  fb_vector
+  Append the length of a vector of n elements, aligned so that its
+  elements are aligned to align, and return its position
+============================================================================*/
+static size_t fb_vector (Buffer *b, uint32_t n, size_t align)
+  {
+  fb_pad (b, align, (align - 4 % align) % align);
+  size_t pos = b->len;
+  fb_put (b, n, 4);
+  return pos;
+  }
+
+
+/*============================================================================
+  fb_string
+============================================================================*/
+static size_t fb_string (Buffer *b, const char *s)
+  {
+  size_t pos = fb_vector (b, strlen (s), 4);
+  buffer_append (b, s, strlen (s) + 1);
+  return pos;
+  }
+
+
+/*============================================================================
+  arrow_message
+  Start a message, with room for its prefix, and the given header, and
+  return the position of the offset of the header, to patch
+============================================================================*/
+static size_t arrow_message (Buffer *b, int header_type,
+       uint64_t body_length)
+  {
+  FbField message [] =
+    {
+    { 2, ARROW_METADATA_V5, 0 },  // version
+    { 1, header_type, 0 },        // header_type
+    { 4, 0, 0 },                  // header
+    { 8, body_length, 0 }         // bodyLength
+    };
+  buffer_clear (b);
+  fb_put (b, 0, 8);
+  fb_put (b, 0, 4);
+  fb_patch (b, 8, fb_table (b, message, 4));
+  return message[2].pos;
+  }
+
+
+/*============================================================================
+  arrow_write_message
+  Write the message's prefix and metadata, padded so that the body that
+  follows starts on an 8-byte boundary
+============================================================================*/
+static void arrow_write_message (ArrowWriter *self)
+  {
+  Buffer *b = self->meta;
+  fb_pad (b, 8, 0);
+  uint64_t prefix = 0xFFFFFFFF | (uint64_t)(b->len - 8) << 32;
+  int i;
+  for (i = 0; i < 8; i++)
+    b->data[i] = (char)(prefix >> (8 * i));
+  parasink_write (&self->sink, b->data, b->len);
+  }
+
+
+/*============================================================================
+  arrow_write_schema
+  Write the schema, if it has not been written; this is not done until
+  something else is, so that the output can be changed after the sink
+  has been created
+============================================================================*/
+static void arrow_write_schema (ArrowWriter *self)
+  {
+  if (self->started) return;
+  self->started = TRUE;
+  static const struct { const char *name; int type; BOOL nullable; }
+    columns [ARROW_NCOLUMNS] =
+    {
+    { "book_id", ARROW_TYPE_INT, FALSE },
+    { "spine_index", ARROW_TYPE_INT, TRUE },
+    { "para_index", ARROW_TYPE_INT, FALSE },
+    { "kind", ARROW_TYPE_UTF8, FALSE },
+    { "text", ARROW_TYPE_LARGE_UTF8, FALSE }
+    };
+  const uint16_t one = 1;
+  Buffer *b = self->meta;
+  int i;
+
+  size_t header = arrow_message (b, ARROW_HEADER_SCHEMA, 0);
+  FbField schema [] =
+    {
+    { 2, *(const BYTE *)&one ? 0 : 1, 0 },  // endianness
+    { 4, 0, 0 }                              // fields
+    };
+  fb_patch (b, header, fb_table (b, schema, 2));
+  size_t vector = fb_vector (b, ARROW_NCOLUMNS, 4);
+  fb_patch (b, schema[1].pos, vector);
+  for (i = 0; i < ARROW_NCOLUMNS; i++)
+    fb_put (b, 0, 4);
+
+  for (i = 0; i < ARROW_NCOLUMNS; i++)
+    {
+    FbField field [] =
+      {
+      { 4, 0, 0 },                   // name
+      { 1, columns[i].nullable, 0 }, // nullable
+      { 1, columns[i].type, 0 },     // type_type
+      { 4, 0, 0 },                   // type
+      { 0, 0, 0 },                   // dictionary
+      { 4, 0, 0 }                    // children
+      };
+    fb_patch (b, vector + 4 + 4 * i, fb_table (b, field, 6));
+    fb_patch (b, field[0].pos, fb_string (b, columns[i].name));
+    if (columns[i].type == ARROW_TYPE_INT)
+      {
+      FbField type [] =
+        {
+        { 4, 32, 0 },                // bitWidth
+        { 1, 1, 0 }                  // is_signed
+        };
+      fb_patch (b, field[3].pos, fb_table (b, type, 2));
+      }
+    else
+      fb_patch (b, field[3].pos, fb_table (b, NULL, 0));
+    // Readers want the children, even if there are none
+    fb_patch (b, field[5].pos, fb_vector (b, 0, 4));
+    }
+
+  arrow_write_message (self);
+  }
+
+
+/*============================================================================
+  arrow_start_batch
+============================================================================*/
+static void arrow_start_batch (ArrowWriter *self)
+  {
+  int64_t zero = 0;
+  self->rows = 0;
+  self->nulls = 0;
+  buffer_clear (self->book);
+  buffer_clear (self->valid);
+  buffer_clear (self->spine);
+  buffer_clear (self->para);
+  buffer_clear (self->kind_offsets);
+  buffer_clear (self->kind);
+  buffer_clear (self->text_offsets);
+  buffer_clear (self->text);
+  buffer_append (self->kind_offsets, (const char *)&zero, 4);
+  buffer_append (self->text_offsets, (const char *)&zero, 8);
+  }
+
+
+/*============================================================================
+  arrow_write_batch
+============================================================================*/
+static void arrow_write_batch (ArrowWriter *self)
+  {
+  if (self->rows == 0) return;
+  // A bitmap is not needed if nothing is null
+  const Buffer empty = { NULL, 0, 0 };
+  const Buffer *buffers [ARROW_NBUFFERS] =
+    {
+    &empty, self->book,
+    self->nulls ? self->valid : &empty, self->spine,
+    &empty, self->para,
+    &empty, self->kind_offsets, self->kind,
+    &empty, self->text_offsets, self->text
+    };
+  const uint32_t null_counts [ARROW_NCOLUMNS] = { 0, self->nulls, 0, 0, 0 };
+  Buffer *b = self->meta;
+  uint64_t body_length = 0;
+  int i;
+
+  for (i = 0; i < ARROW_NBUFFERS; i++)
+    body_length += (buffers[i]->len + ARROW_ALIGN - 1)
+      / ARROW_ALIGN * ARROW_ALIGN;
+
+  size_t header = arrow_message (b, ARROW_HEADER_RECORD_BATCH,
+    body_length);
+  FbField batch [] =
+    {
+    { 8, self->rows, 0 },      // length
+    { 4, 0, 0 },               // nodes
+    { 4, 0, 0 }                // buffers
+    };
+  fb_patch (b, header, fb_table (b, batch, 3));
+  fb_patch (b, batch[1].pos, fb_vector (b, ARROW_NCOLUMNS, 8));
+  for (i = 0; i < ARROW_NCOLUMNS; i++)
+    {
+    fb_put (b, self->rows, 8);
+    fb_put (b, null_counts[i], 8);
+    }
+  fb_patch (b, batch[2].pos, fb_vector (b, ARROW_NBUFFERS, 8));
+  uint64_t offset = 0;
+  for (i = 0; i < ARROW_NBUFFERS; i++)
+    {
+    fb_put (b, offset, 8);
+    fb_put (b, buffers[i]->len, 8);
+    offset += (buffers[i]->len + ARROW_ALIGN - 1) / ARROW_ALIGN * ARROW_ALIGN;
+    }
+  arrow_write_message (self);
+
+  for (i = 0; i < ARROW_NBUFFERS; i++)
+    {
+    size_t len = buffers[i]->len;
+    if (len == 0) continue;
+    parasink_write (&self->sink, buffers[i]->data, len);
+    parasink_write (&self->sink, arrow_zeros,
+      (ARROW_ALIGN - len % ARROW_ALIGN) % ARROW_ALIGN);
+    }
+
+  arrow_start_batch (self);
+  }
+
+
+/*============================================================================
+  arrow_begin_book
+============================================================================*/
+static void arrow_begin_book (ParaSink *sink, const char *book)
+  {
+  ArrowWriter *self = (ArrowWriter *)sink;
+  (void)book;
+  arrow_write_schema (self);
+  self->book_id++;
+  self->spine_index = -1;
+  self->para_index = 0;
+  }
+
+
+/*============================================================================
+  arrow_begin_section
+============================================================================*/
+static void arrow_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  ArrowWriter *self = (ArrowWriter *)sink;
+  self->spine_index = href ? spine_index : -1;
+  self->para_index = 0;
+  }
+
+
+/*============================================================================
+  arrow_para
+============================================================================*/
+static void arrow_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  ArrowWriter *self = (ArrowWriter *)sink;
+  int32_t n;
+
+  n = self->book_id;
+  buffer_append (self->book, (const char *)&n, 4);
+
+  if (self->rows % 8 == 0)
+    buffer_append (self->valid, "", 1);
+  if (self->spine_index >= 0)
+    self->valid->data[self->rows / 8] |= (char)(1 << (self->rows % 8));
+  else
+    self->nulls++;
+  n = self->spine_index >= 0 ? self->spine_index : 0;
+  buffer_append (self->spine, (const char *)&n, 4);
+
+  n = self->para_index++;
+  buffer_append (self->para, (const char *)&n, 4);
+
+  if (kind == PARA_META)
+    buffer_append (self->kind, "meta", 4);
+  else if (kind == PARA_HEADING)
+    buffer_append (self->kind, "heading", 7);
+  else
+    buffer_append (self->kind, "paragraph", 9);
+  n = (int32_t)self->kind->len;
+  buffer_append (self->kind_offsets, (const char *)&n, 4);
+
+  buffer_append (self->text, text, len);
+  int64_t offset = (int64_t)self->text->len;
+  buffer_append (self->text_offsets, (const char *)&offset, 8);
+
+  self->rows++;
+  if (self->rows >= ARROW_BATCH_ROWS || self->text->len >= ARROW_BATCH_BYTES)
+    arrow_write_batch (self);
+  }
+
+
+/*============================================================================
+  arrow_destroy
+============================================================================*/
+static void arrow_destroy (ParaSink *sink)
+  {
+  ArrowWriter *self = (ArrowWriter *)sink;
+  arrow_write_schema (self);
+  arrow_write_batch (self);
+  static const char end [8] = { '\xFF', '\xFF', '\xFF', '\xFF', 0, 0, 0, 0 };
+  parasink_write (sink, end, sizeof (end));
+  buffer_destroy (self->book);
+  buffer_destroy (self->valid);
+  buffer_destroy (self->spine);
+  buffer_destroy (self->para);
+  buffer_destroy (self->kind_offsets);
+  buffer_destroy (self->kind);
+  buffer_destroy (self->text_offsets);
+  buffer_destroy (self->text);
+  buffer_destroy (self->meta);
+  free (self);
+  }
+
+
+/*============================================================================
+  arrow_create
+============================================================================*/
+ParaSink *arrow_create (Compressor *compressor)
+  {
+  ArrowWriter *self = malloc (sizeof (ArrowWriter));
+  memset (self, 0, sizeof (ArrowWriter));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = arrow_begin_book;
+  self->sink.begin_section = arrow_begin_section;
+  self->sink.para = arrow_para;
+  self->sink.destroy = arrow_destroy;
+  self->book_id = -1;
+  self->spine_index = -1;
+  self->book = buffer_create ();
+  self->valid = buffer_create ();
+  self->spine = buffer_create ();
+  self->para = buffer_create ();
+  self->kind_offsets = buffer_create ();
+  self->kind = buffer_create ();
+  self->text_offsets = buffer_create ();
+  self->text = buffer_create ();
+  self->meta = buffer_create ();
+  arrow_start_batch (self);
+  return &self->sink;
+  }
@@ -0,0 +1,31 @@
+/*============================================================================
+  epub2txt v2
+  arrow.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Apache Arrow output: rather than wrapped text, a paragraph sink that
+  writes an Arrow IPC stream, which pyarrow, DuckDB, Polars, and the
+  like can read without parsing text. It has one row per paragraph,
+  with the columns
+
+  book_id      int32       The position of the book among the files
+                           given, from 0
+  spine_index  int32       null for metadata
+  para_index   int32       As --format=jsonl numbers the paragraphs
+  kind         utf8        "paragraph", "heading", or "meta"
+  text         large_utf8  Hard line breaks are kept as '\n'
+
+  The rows are written in record batches of up to ARROW_BATCH_ROWS rows,
+  or about ARROW_BATCH_BYTES bytes of text, whichever comes first. Each
+  buffer in a batch starts on a 64-byte boundary, as Arrow recommends;
+  the data is in the byte order of the machine, as the schema says.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_BATCH_BYTES (8 * 1024 * 1024)
+
+ParaSink *arrow_create (Compressor *compressor);
@@ -0,0 +1,765 @@
+/*============================================================================
+  epub2txt v2
+  batchio.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The io_uring ring is set up with system calls, as liburing is not
+  needed for so little. Reads and writes are submitted as soon as they
+  are made, and completions are only reaped when something has to be
+  waited for. A read opens and sizes the file at the same time, then
+  reads it whole, and then closes it. Each submission carries a pointer
+  to its read, or to the BatchIo for a write, with what it was in the
+  low two bits.
+
+  Output is written in blocks, with one block being written while the
+  next is filled. The blocks are written in order, and only one is ever
+  being written, so there is no need for a write to stdout to know where
+  in the file it is.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+#include "batchio.h"
+#include "log.h"
+
+// Writing at the current position needs Linux 5.6, as do openat and
+//   statx in a ring
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) \
+  && defined(STATX_SIZE)
+#define BATCHIO_HAVE_URING
+#endif
+
+// Worker threads, when io_uring is not used
+#define BATCHIO_WORKERS 4
+// Entries in the ring: each read has up to two operations in flight
+#define BATCHIO_RING_SIZE (2 * BATCHIO_DEPTH + 2)
+// The largest single read
+#define BATCHIO_MAX_READ (1 << 30)
+
+// What a completion is for, in the low bits of its user data
+#define BATCHIO_OP_OPEN 0
+#define BATCHIO_OP_STAT 1
+#define BATCHIO_OP_READ 2
+#define BATCHIO_OP_WRITE 3
+#define BATCHIO_OP_MASK 3
+
+struct _BatchIoRead
+  {
+  char *path;
+  int fd;
+  int pending;               // Operations in flight
+  char *data;
+  size_t size;               // As the file was when it was opened
+  size_t len;                // Read so far
+  char *error;
+  BOOL done;
+  BatchIoRead *next;         // In the workers' queue
+#ifdef BATCHIO_HAVE_URING
+  struct statx stx;
+#endif
+  };
+
+struct _BatchIo
+  {
+  BatchIoMethod method;
+  char *block;               // Being filled
+  size_t block_len;
+  char *writing;             // Being written
+  size_t writing_len;
+  size_t written;
+  BOOL write_busy;
+  char *write_error;
+
+  // Threads
+  pthread_t workers [BATCHIO_WORKERS];
+  int nworkers;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;       // Signalled when there is something to do
+  pthread_cond_t finished;   // Signalled when something has been done
+  BatchIoRead *head;         // Reads not yet started
+  BatchIoRead *tail;
+  BOOL write_taken;          // A worker is writing
+  BOOL closing;
+
+#ifdef BATCHIO_HAVE_URING
+  int ring_fd;
+  unsigned inflight;
+  unsigned entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+#endif
+  };
+
+
+/*============================================================================
+  batchio_parse
+============================================================================*/
+BOOL batchio_parse (const char *spec, BatchIoMethod *method, char **error)
+  {
+  if (strcmp (spec, "uring") == 0)
+    *method = BATCHIO_URING;
+  else if (strcmp (spec, "threads") == 0)
+    *method = BATCHIO_THREADS;
+  else
+    {
+    asprintf (error, "Unknown I/O method '%s': use uring or threads", spec);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  batchio_read_fail
+  Record the first thing to go wrong with a read
+============================================================================*/
+static void batchio_read_fail (BatchIoRead *read, int err)
+  {
+  if (read->error) return;
+  asprintf (&read->error, "Can't read %s: %s", read->path, strerror (err));
+  }
+
+
+/*============================================================================
+  batchio_read_finish
+============================================================================*/
+static void batchio_read_finish (BatchIoRead *read)
+  {
+  if (read->fd >= 0) close (read->fd);
+  read->fd = -1;
+  if (!read->error)
+    {
+    if (!read->data) read->data = malloc (1);
+    read->data[read->len] = 0;
+    }
+  }
+
+
+/*============================================================================
+  batchio_read_sync
+  Read a whole file with ordinary system calls
+============================================================================*/
+static void batchio_read_sync (BatchIoRead *read)
+  {
+  struct stat sb;
+  read->fd = open (read->path, O_RDONLY);
+  if (read->fd < 0 || fstat (read->fd, &sb) != 0)
+    {
+    batchio_read_fail (read, errno);
+    batchio_read_finish (read);
+    return;
+    }
+  read->size = sb.st_size;
+  read->data = malloc (read->size + 1);
+  while (read->len < read->size)
+    {
+    ssize_t n = pread (read->fd, read->data + read->len,
+      read->size - read->len, read->len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) { batchio_read_fail (read, errno); break; }
+    if (n == 0) break;
+    read->len += n;
+    }
+  batchio_read_finish (read);
+  }
+
+
+/*============================================================================
+  batchio_write_sync
+  Write the block being written with ordinary system calls; returns the
+  error number, or 0
+============================================================================*/
+static int batchio_write_sync (BatchIo *self)
+  {
+  while (self->written < self->writing_len)
+    {
+    ssize_t n = write (STDOUT_FILENO, self->writing + self->written,
+      self->writing_len - self->written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return errno;
+    if (n == 0) return EIO;
+    self->written += n;
+    }
+  return 0;
+  }
+
+
+/*============================================================================
+  batchio_write_failed
+============================================================================*/
+static void batchio_write_failed (BatchIo *self, int err)
+  {
+  if (self->write_error) return;
+  asprintf (&self->write_error, "Can't write output: %s", strerror (err));
+  }
+
+
+#ifdef BATCHIO_HAVE_URING
+
+/*============================================================================
+  uring_setup
+============================================================================*/
+static BOOL uring_setup (BatchIo *self)
+  {
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  int fd = syscall (__NR_io_uring_setup, BATCHIO_RING_SIZE, &p);
+  if (fd < 0) return FALSE;
+  if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+    close (fd);
+    return FALSE;
+    }
+
+  self->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  self->cq_ring_size = p.cq_off.cqes
+    + p.cq_entries * sizeof (struct io_uring_cqe);
+  self->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  BOOL single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && self->cq_ring_size > self->sq_ring_size)
+    self->sq_ring_size = self->cq_ring_size;
+
+  self->sq_ring = mmap (NULL, self->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  self->cq_ring = single ? self->sq_ring : mmap (NULL, self->cq_ring_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_CQ_RING);
+  self->sqes = mmap (NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (self->sq_ring == MAP_FAILED || self->cq_ring == MAP_FAILED
+      || self->sqes == MAP_FAILED)
+    {
+    if (self->sqes != MAP_FAILED) munmap (self->sqes, self->sqes_size);
+    if (!single && self->cq_ring != MAP_FAILED)
+      munmap (self->cq_ring, self->cq_ring_size);
+    if (self->sq_ring != MAP_FAILED)
+      munmap (self->sq_ring, self->sq_ring_size);
+    close (fd);
+    return FALSE;
+    }
+
+  char *sq = self->sq_ring;
+  char *cq = self->cq_ring;
+  self->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  self->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  self->sq_array = (unsigned *)(sq + p.sq_off.array);
+  self->cq_head = (unsigned *)(cq + p.cq_off.head);
+  self->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  self->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  self->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  self->entries = p.sq_entries;
+  self->ring_fd = fd;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  uring_teardown
+============================================================================*/
+static void uring_teardown (BatchIo *self)
+  {
+  munmap (self->sqes, self->sqes_size);
+  if (self->cq_ring != self->sq_ring)
+    munmap (self->cq_ring, self->cq_ring_size);
+  munmap (self->sq_ring, self->sq_ring_size);
+  close (self->ring_fd);
+  }
+
+
+/*============================================================================
+  uring_sqe
+  The next submission entry, cleared
+============================================================================*/
+static struct io_uring_sqe *uring_sqe (BatchIo *self)
+  {
+  unsigned index = *self->sq_tail & *self->sq_mask;
+  struct io_uring_sqe *sqe = &self->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+  }
+
+
+/*============================================================================
+  uring_submit
+  Submit the entry filled in by uring_sqe()
+============================================================================*/
+static void uring_submit (BatchIo *self)
+  {
+  unsigned tail = *self->sq_tail;
+  self->sq_array[tail & *self->sq_mask] = tail & *self->sq_mask;
+  __atomic_store_n (self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  self->inflight++;
+  // Without polling, the kernel takes the entry before this returns
+  while (syscall (__NR_io_uring_enter, self->ring_fd, 1, 0, 0, NULL, 0) < 0
+      && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+    ;
+  }
+
+
+/*============================================================================
+  uring_submit_read
+============================================================================*/
+static void uring_submit_read (BatchIo *self, BatchIoRead *read)
+  {
+  size_t len = read->size - read->len;
+  if (len > BATCHIO_MAX_READ) len = BATCHIO_MAX_READ;
+  struct io_uring_sqe *sqe = uring_sqe (self);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = read->fd;
+  sqe->addr = (uintptr_t)(read->data + read->len);
+  sqe->len = len;
+  sqe->off = read->len;
+  sqe->user_data = (uintptr_t)read | BATCHIO_OP_READ;
+  read->pending++;
+  uring_submit (self);
+  }
+
+
+/*============================================================================
+  uring_submit_write
+============================================================================*/
+static void uring_submit_write (BatchIo *self)
+  {
+  struct io_uring_sqe *sqe = uring_sqe (self);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = STDOUT_FILENO;
+  sqe->addr = (uintptr_t)(self->writing + self->written);
+  sqe->len = self->writing_len - self->written;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = (uintptr_t)self | BATCHIO_OP_WRITE;
+  uring_submit (self);
+  }
+
+
+/*============================================================================
+  uring_write_done
+============================================================================*/
+static void uring_write_done (BatchIo *self, int res)
+  {
+  if (res == -EINTR || res == -EAGAIN)
+    {
+    uring_submit_write (self);
+    return;
+    }
+  if (res <= 0)
+    batchio_write_failed (self, res == 0 ? EIO : -res);
+  else
+    {
+    self->written += res;
+    if (self->written < self->writing_len)
+      {
+      uring_submit_write (self);
+      return;
+      }
+    }
+  self->write_busy = FALSE;
+  }
+
+
+/*============================================================================
+  uring_read_done
+============================================================================*/
+static void uring_read_done (BatchIo *self, BatchIoRead *read, int op,
+       int res)
+  {
+  read->pending--;
+  switch (op)
+    {
+    case BATCHIO_OP_OPEN:
+      if (res < 0) batchio_read_fail (read, -res);
+      else read->fd = res;
+      break;
+    case BATCHIO_OP_STAT:
+      if (res < 0) batchio_read_fail (read, -res);
+      else read->size = read->stx.stx_size;
+      break;
+    default:
+      if (res == -EINTR || res == -EAGAIN)
+        {
+        uring_submit_read (self, read);
+        return;
+        }
+      if (res < 0) batchio_read_fail (read, -res);
+      else if (res == 0) read->size = read->len; // It got shorter
+      else read->len += res;
+    }
+  if (read->pending) return;
+  if (!read->error && read->len < read->size)
+    {
+    if (!read->data) read->data = malloc (read->size + 1);
+    uring_submit_read (self, read);
+    return;
+    }
+  batchio_read_finish (read);
+  read->done = TRUE;
+  }
+
+
+/*============================================================================
+  uring_reap
+  Deal with the completions there are; if there are none, and wait is
+  set, wait for one
+============================================================================*/
+static void uring_reap (BatchIo *self, BOOL wait)
+  {
+  unsigned head = *self->cq_head;
+  while (wait && head == __atomic_load_n (self->cq_tail, __ATOMIC_ACQUIRE))
+    {
+    if (syscall (__NR_io_uring_enter, self->ring_fd, 0, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      {
+      log_error ("io_uring_enter: %s", strerror (errno));
+      exit (-1);
+      }
+    }
+  while (head != __atomic_load_n (self->cq_tail, __ATOMIC_ACQUIRE))
+    {
+    struct io_uring_cqe *cqe = &self->cqes[head & *self->cq_mask];
+    uint64_t data = cqe->user_data;
+    int res = cqe->res;
+    head++;
+    __atomic_store_n (self->cq_head, head, __ATOMIC_RELEASE);
+    self->inflight--;
+    int op = data & BATCHIO_OP_MASK;
+    void *p = (void *)(uintptr_t)(data & ~(uint64_t)BATCHIO_OP_MASK);
+    if (op == BATCHIO_OP_WRITE)
+      uring_write_done (p, res);
+    else
+      uring_read_done (self, p, op, res);
+    }
+  }
+
+
+/*============================================================================
+  uring_read
+  Open and size the file at once
+============================================================================*/
+static void uring_read (BatchIo *self, BatchIoRead *read)
+  {
+  while (self->inflight + 2 > self->entries) uring_reap (self, TRUE);
+
+  struct io_uring_sqe *sqe = uring_sqe (self);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)read->path;
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = (uintptr_t)read | BATCHIO_OP_OPEN;
+  read->pending++;
+  uring_submit (self);
+
+  sqe = uring_sqe (self);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)read->path;
+  sqe->len = STATX_SIZE;
+  sqe->off = (uintptr_t)&read->stx;
+  sqe->user_data = (uintptr_t)read | BATCHIO_OP_STAT;
+  read->pending++;
+  uring_submit (self);
+  }
+
+#endif
+
+
+/*============================================================================
+  batchio_worker
+============================================================================*/
+static void *batchio_worker (void *arg)
+  {
+  BatchIo *self = arg;
+  pthread_mutex_lock (&self->mutex);
+  for (;;)
+    {
+    if (self->write_busy && !self->write_taken)
+      {
+      // Output comes first, as the parser may be waiting for it
+      self->write_taken = TRUE;
+      pthread_mutex_unlock (&self->mutex);
+      int err = batchio_write_sync (self);
+      pthread_mutex_lock (&self->mutex);
+      if (err) batchio_write_failed (self, err);
+      self->write_busy = FALSE;
+      self->write_taken = FALSE;
+      pthread_cond_broadcast (&self->finished);
+      }
+    else if (self->head)
+      {
+      BatchIoRead *read = self->head;
+      self->head = read->next;
+      if (!self->head) self->tail = NULL;
+      pthread_mutex_unlock (&self->mutex);
+      batchio_read_sync (read);
+      pthread_mutex_lock (&self->mutex);
+      read->done = TRUE;
+      pthread_cond_broadcast (&self->finished);
+      }
+    else if (self->closing)
+      break;
+    else
+      pthread_cond_wait (&self->work, &self->mutex);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+
+/*============================================================================
+  batchio_create
+============================================================================*/
+BatchIo *batchio_create (BatchIoMethod method)
+  {
+  BatchIo *self = malloc (sizeof (BatchIo));
+  memset (self, 0, sizeof (BatchIo));
+  self->block = malloc (BATCHIO_BLOCK_SIZE);
+  self->writing = malloc (BATCHIO_BLOCK_SIZE);
+  self->method = BATCHIO_THREADS;
+  if (method == BATCHIO_URING)
+    {
+#ifdef BATCHIO_HAVE_URING
+    if (uring_setup (self))
+      self->method = BATCHIO_URING;
+    else
+#endif
+      log_info ("io_uring is not available; using threads for I/O");
+    }
+  if (self->method == BATCHIO_THREADS)
+    {
+    pthread_mutex_init (&self->mutex, NULL);
+    pthread_cond_init (&self->work, NULL);
+    pthread_cond_init (&self->finished, NULL);
+    while (self->nworkers < BATCHIO_WORKERS
+        && pthread_create (&self->workers[self->nworkers], NULL,
+             batchio_worker, self) == 0)
+      self->nworkers++;
+    if (!self->nworkers)
+      log_warning ("Can't start threads for I/O; it will be done "
+        "without them");
+    }
+  return self;
+  }
+
+
+/*============================================================================
+  batchio_method
+============================================================================*/
+BatchIoMethod batchio_method (const BatchIo *self)
+  {
+  return self->method;
+  }
+
+
+/*============================================================================
+  batchio_read
+============================================================================*/
+BatchIoRead *batchio_read (BatchIo *self, const char *path)
+  {
+  BatchIoRead *read = malloc (sizeof (BatchIoRead));
+  memset (read, 0, sizeof (BatchIoRead));
+  read->path = strdup (path);
+  read->fd = -1;
+#ifdef BATCHIO_HAVE_URING
+  if (self->method == BATCHIO_URING)
+    {
+    uring_read (self, read);
+    return read;
+    }
+#endif
+  if (!self->nworkers)
+    {
+    batchio_read_sync (read);
+    read->done = TRUE;
+    return read;
+    }
+  pthread_mutex_lock (&self->mutex);
+  if (self->tail) self->tail->next = read;
+  else self->head = read;
+  self->tail = read;
+  pthread_cond_signal (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  return read;
+  }
+
+
+/*============================================================================
+  batchio_read_wait
+============================================================================*/
+char *batchio_read_wait (BatchIo *self, BatchIoRead *read, size_t *len,
+       char **error)
+  {
+#ifdef BATCHIO_HAVE_URING
+  if (self->method == BATCHIO_URING)
+    while (!read->done) uring_reap (self, TRUE);
+#endif
+  if (self->method == BATCHIO_THREADS && self->nworkers)
+    {
+    pthread_mutex_lock (&self->mutex);
+    while (!read->done) pthread_cond_wait (&self->finished, &self->mutex);
+    pthread_mutex_unlock (&self->mutex);
+    }
+  char *data = read->data;
+  if (read->error)
+    {
+    *error = read->error;
+    free (data);
+    data = NULL;
+    }
+  else
+    *len = read->len;
+  free (read->path);
+  free (read);
+  return data;
+  }
+
+
+/*============================================================================
+  batchio_wait_write
+  Wait for the block being written to be written
+============================================================================*/
+static void batchio_wait_write (BatchIo *self)
+  {
+#ifdef BATCHIO_HAVE_URING
+  if (self->method == BATCHIO_URING)
+    while (self->write_busy) uring_reap (self, TRUE);
+#endif
+  if (self->method == BATCHIO_THREADS && self->nworkers)
+    {
+    pthread_mutex_lock (&self->mutex);
+    while (self->write_busy)
+      pthread_cond_wait (&self->finished, &self->mutex);
+    pthread_mutex_unlock (&self->mutex);
+    }
+  }
+
+
+/*============================================================================
+  batchio_start_write
+  Start writing the block being filled, once the last one is written
+============================================================================*/
+static void batchio_start_write (BatchIo *self)
+  {
+  batchio_wait_write (self);
+  char *t = self->writing;
+  self->writing = self->block;
+  self->writing_len = self->block_len;
+  self->written = 0;
+  self->block = t;
+  self->block_len = 0;
+  // After a failure, output is thrown away
+  if (self->write_error) return;
+#ifdef BATCHIO_HAVE_URING
+  if (self->method == BATCHIO_URING)
+    {
+    while (self->inflight + 1 > self->entries) uring_reap (self, TRUE);
+    self->write_busy = TRUE;
+    uring_submit_write (self);
+    return;
+    }
+#endif
+  if (!self->nworkers)
+    {
+    int err = batchio_write_sync (self);
+    if (err) batchio_write_failed (self, err);
+    return;
+    }
+  pthread_mutex_lock (&self->mutex);
+  self->write_busy = TRUE;
+  pthread_cond_signal (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*============================================================================
+  batchio_write
+============================================================================*/
+void batchio_write (BatchIo *self, const char *s, size_t len)
+  {
+  while (len)
+    {
+    size_t n = BATCHIO_BLOCK_SIZE - self->block_len;
+    if (n > len) n = len;
+    memcpy (self->block + self->block_len, s, n);
+    self->block_len += n;
+    s += n;
+    len -= n;
+    if (self->block_len == BATCHIO_BLOCK_SIZE) batchio_start_write (self);
+    }
+  }
+
+
+/*============================================================================
+  batchio_flush
+============================================================================*/
+BOOL batchio_flush (BatchIo *self, char **error)
+  {
+  if (self->block_len) batchio_start_write (self);
+  batchio_wait_write (self);
+  if (self->write_error)
+    {
+    *error = strdup (self->write_error);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  batchio_close
+============================================================================*/
+BOOL batchio_close (BatchIo *self, char **error)
+  {
+  BOOL ret = batchio_flush (self, error);
+#ifdef BATCHIO_HAVE_URING
+  if (self->method == BATCHIO_URING)
+    {
+    while (self->inflight) uring_reap (self, TRUE);
+    uring_teardown (self);
+    }
+#endif
+  if (self->method == BATCHIO_THREADS)
+    {
+    int i;
+    pthread_mutex_lock (&self->mutex);
+    self->closing = TRUE;
+    pthread_cond_broadcast (&self->work);
+    pthread_mutex_unlock (&self->mutex);
+    for (i = 0; i < self->nworkers; i++)
+      pthread_join (self->workers[i], NULL);
+    pthread_mutex_destroy (&self->mutex);
+    pthread_cond_destroy (&self->work);
+    pthread_cond_destroy (&self->finished);
+    }
+  free (self->write_error);
+  free (self->block);
+  free (self->writing);
+  free (self);
+  return ret;
+  }
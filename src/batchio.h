@@ -0,0 +1,57 @@
+/*============================================================================
+  epub2txt v2
+  batchio.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Batched I/O (--io): reading whole files ahead of when they are needed,
+  and writing stdout in the background, so that the parser is not held
+  up by the latency of a slow or network filesystem. With io_uring,
+  where the kernel has it, the opening, sizing, and reading of many
+  files are all in flight at once, as is the write of the last block of
+  output; otherwise, the same is done by a few worker threads, with
+  ordinary system calls. Without --io, none of this is used.
+
+  A BatchIo is used by one thread at a time.
+============================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+
+// Files read ahead, and ring entries, at most
+#define BATCHIO_DEPTH 32
+// Output is written in blocks of this size
+#define BATCHIO_BLOCK_SIZE (1024 * 1024)
+
+typedef enum { BATCHIO_URING = 0, BATCHIO_THREADS } BatchIoMethod;
+
+typedef struct _BatchIo BatchIo;
+typedef struct _BatchIoRead BatchIoRead;
+
+/** Parse "uring" or "threads". */
+BOOL        batchio_parse (const char *spec, BatchIoMethod *method,
+              char **error);
+
+/** Start; if io_uring is asked for, but is not available, threads are
+    used instead. */
+BatchIo    *batchio_create (BatchIoMethod method);
+BatchIoMethod batchio_method (const BatchIo *self);
+
+/** Start reading the whole of a file. */
+BatchIoRead *batchio_read (BatchIo *self, const char *path);
+
+/** Wait for a read to finish, and return the contents of the file,
+    NUL-terminated, which the caller must free; or NULL, with error
+    set, if it could not be read. The read is freed. */
+char       *batchio_read_wait (BatchIo *self, BatchIoRead *read,
+              size_t *len, char **error);
+
+/** Write to stdout, in order, in the background. */
+void        batchio_write (BatchIo *self, const char *s, size_t len);
+
+/** Write what is left, and wait for all writes to finish. */
+BOOL        batchio_flush (BatchIo *self, char **error);
+
+/** Flush, and free everything; every read must have been waited for. */
+BOOL        batchio_close (BatchIo *self, char **error);
@@ -0,0 +1,518 @@
+/*============================================================================
+  epub2txt v2
+  bloom.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Building and reading Bloom filters of books; see bloom.h for the
+  format. While a book is read, the trigrams that have been seen are
+  marked in a bitmap of all 2^24 of them, which makes counting the
+  distinct ones, to size the filter, cheap; only the marked bits are
+  cleared for the next book. The whole filter file is read into memory,
+  as it is small, and rewritten when filters are added to it.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bloom.h"
+#include "store.h"
+#include "fold.h"
+
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+#define BLOOM_FOLD (FOLD_CASE | FOLD_DIACRITICS)
+
+// One book's filter, in memory
+typedef struct _BloomFilter
+  {
+  char *path;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t *blocks;
+  uint64_t nblocks;
+  } BloomFilter;
+
+struct _BloomFile
+  {
+  BloomFilter *filters;   // Sorted by path
+  uint64_t nfilters;
+  };
+
+typedef struct _BloomBuilder
+  {
+  ParaSink sink;
+  char *filename;
+  char *book;
+  uint64_t *seen;         // Bitmap of trigrams
+  uint32_t *keys;         // The trigrams that are marked in it
+  uint64_t nkeys;
+  uint64_t keys_size;
+  BloomFile built;
+  Buffer *word;
+  } BloomBuilder;
+
+typedef struct _BloomCheck
+  {
+  const BloomFilter *filter;
+  BOOL may_contain;
+  } BloomCheck;
+
+
+/*============================================================================
+  bloom_filter_test
+  Whether all a key's bits are set in a filter or, if set is TRUE, set
+  them
+============================================================================*/
+static BOOL bloom_filter_test (const BloomFilter *filter, uint32_t key,
+       BOOL set)
+  {
+  // Offset the key first, as splitmix64 does, so that key 0 does not
+  //  hash to 0
+  uint64_t h = store_mix (key + 0x9E3779B97F4A7C15ULL);
+  uint64_t *block = filter->blocks
+    + ((h >> 32) % filter->nblocks) * BLOOM_BLOCK_WORDS;
+  uint32_t h1 = h & 0xFFFF, h2 = ((h >> 16) & 0xFFFF) | 1;
+  int i;
+  for (i = 0; i < BLOOM_HASHES; i++)
+    {
+    uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    if (set)
+      block[bit / 64] |= mask;
+    else if (!(block[bit / 64] & mask))
+      return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  bloom_trigram
+============================================================================*/
+static inline uint32_t bloom_trigram (const char *s)
+  {
+  return ((BYTE)s[0] << 16) | ((BYTE)s[1] << 8) | (BYTE)s[2];
+  }
+
+
+/*============================================================================
+  bloom_file_clear
+============================================================================*/
+static void bloom_file_clear (BloomFile *self)
+  {
+  uint64_t i;
+  for (i = 0; i < self->nfilters; i++)
+    {
+    free (self->filters[i].path);
+    free (self->filters[i].blocks);
+    }
+  if (self->filters) free (self->filters);
+  self->filters = NULL;
+  self->nfilters = 0;
+  }
+
+
+/*============================================================================
+  bloom_file_close
+============================================================================*/
+void bloom_file_close (BloomFile *self)
+  {
+  bloom_file_clear (self);
+  free (self);
+  }
+
+
+/*============================================================================
+  bloom_read_chunk
+============================================================================*/
+static void *bloom_read_chunk (FILE *f, uint64_t offset, uint64_t count,
+       size_t size, uint64_t file_len)
+  {
+  if (offset > file_len || count > (file_len - offset) / size) return NULL;
+  void *data = malloc (count * size + 1);
+  if (fseek (f, offset, SEEK_SET) != 0
+       || (count && fread (data, count * size, 1, f) != 1))
+    {
+    free (data);
+    return NULL;
+    }
+  return data;
+  }
+
+
+/*============================================================================
+  bloom_file_read
+  Read a filter file into self; a file that does not exist is empty, if
+  missing_ok is TRUE
+============================================================================*/
+static BOOL bloom_file_read (BloomFile *self, const char *filename,
+       BOOL missing_ok, char **error)
+  {
+  FILE *f = fopen (filename, "rb");
+  if (!f)
+    {
+    if (missing_ok && errno == ENOENT) return TRUE;
+    asprintf (error, "Can't open file '%s' for reading: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  BloomFileHeader header;
+  fseek (f, 0, SEEK_END);
+  uint64_t file_len = ftell (f);
+  fseek (f, 0, SEEK_SET);
+  if (fread (&header, sizeof (header), 1, f) != 1
+       || memcmp (header.magic, BLOOM_FILE_MAGIC, 4) != 0
+       || header.version != BLOOM_FILE_VERSION
+       || header.byte_order != BLOOM_FILE_BYTE_ORDER)
+    {
+    asprintf (error, "'%s' is not a usable filter file", filename);
+    fclose (f);
+    return FALSE;
+    }
+
+  BloomBook *books = bloom_read_chunk (f, header.books_offset,
+    header.nbooks, sizeof (BloomBook), file_len);
+  char *strings = bloom_read_chunk (f, header.strings_offset,
+    header.strings_len, 1, file_len);
+  uint64_t *blocks = bloom_read_chunk (f, header.blocks_offset,
+    header.nblocks, BLOOM_BLOCK_BITS / 8, file_len);
+  fclose (f);
+
+  BOOL ok = books && strings && blocks;
+  uint64_t i;
+  if (ok)
+    {
+    strings[header.strings_len] = 0;
+    self->filters = calloc (header.nbooks + 1, sizeof (BloomFilter));
+    }
+  for (i = 0; ok && i < header.nbooks; i++)
+    {
+    const BloomBook *book = &books[i];
+    if (book->path >= header.strings_len || book->nblocks == 0
+         || book->first_block > header.nblocks
+         || book->nblocks > header.nblocks - book->first_block)
+      {
+      ok = FALSE;
+      break;
+      }
+    BloomFilter *filter = &self->filters[self->nfilters++];
+    filter->path = strdup (strings + book->path);
+    filter->size = book->size;
+    filter->mtime = book->mtime;
+    filter->nblocks = book->nblocks;
+    filter->blocks = malloc (book->nblocks * BLOOM_BLOCK_BITS / 8);
+    memcpy (filter->blocks, blocks + book->first_block * BLOOM_BLOCK_WORDS,
+      book->nblocks * BLOOM_BLOCK_BITS / 8);
+    }
+  if (!ok)
+    {
+    asprintf (error, "'%s' is damaged", filename);
+    bloom_file_clear (self);
+    }
+  if (books) free (books);
+  if (strings) free (strings);
+  if (blocks) free (blocks);
+  return ok;
+  }
+
+
+/*============================================================================
+  bloom_file_open
+============================================================================*/
+BloomFile *bloom_file_open (const char *filename, char **error)
+  {
+  BloomFile *self = malloc (sizeof (BloomFile));
+  memset (self, 0, sizeof (BloomFile));
+  if (!bloom_file_read (self, filename, FALSE, error))
+    {
+    free (self);
+    return NULL;
+    }
+  return self;
+  }
+
+
+/*============================================================================
+  bloom_file_find
+  The filter for a book, if there is one that is up to date
+============================================================================*/
+static const BloomFilter *bloom_file_find (const BloomFile *self,
+       const char *book)
+  {
+  struct stat st;
+  char *path = realpath (book, NULL);
+  if (!path) return NULL;
+  const BloomFilter *filter = NULL;
+  uint64_t lo = 0, hi = self->nfilters;
+  while (lo < hi)
+    {
+    uint64_t mid = (lo + hi) / 2;
+    int c = strcmp (self->filters[mid].path, path);
+    if (c == 0)
+      {
+      filter = &self->filters[mid];
+      break;
+      }
+    if (c < 0) lo = mid + 1; else hi = mid;
+    }
+  if (filter && (stat (path, &st) != 0
+       || (uint64_t)st.st_size != filter->size
+       || (int64_t)st.st_mtime != filter->mtime))
+    filter = NULL;
+  free (path);
+  return filter;
+  }
+
+
+/*============================================================================
+  bloom_check_word
+============================================================================*/
+static void bloom_check_word (void *context, const char *word, size_t len)
+  {
+  BloomCheck *check = context;
+  size_t i;
+  for (i = 0; check->may_contain && i + 3 <= len; i++)
+    if (!bloom_filter_test (check->filter, bloom_trigram (word + i), FALSE))
+      check->may_contain = FALSE;
+  }
+
+
+/*============================================================================
+  bloom_file_may_contain
+============================================================================*/
+BOOL bloom_file_may_contain (const BloomFile *self, const char *book,
+       const char *pattern)
+  {
+  BloomCheck check;
+  check.filter = bloom_file_find (self, book);
+  check.may_contain = TRUE;
+  if (!check.filter) return TRUE;
+  Buffer *word = buffer_create ();
+  fold_words (pattern, strlen (pattern), BLOOM_FOLD, word, bloom_check_word,
+    &check);
+  buffer_destroy (word);
+  return check.may_contain;
+  }
+
+
+/*============================================================================
+  bloom_add_word
+============================================================================*/
+static void bloom_add_word (void *context, const char *word, size_t len)
+  {
+  BloomBuilder *self = context;
+  size_t i;
+  for (i = 0; i + 3 <= len; i++)
+    {
+    uint32_t key = bloom_trigram (word + i);
+    uint64_t mask = (uint64_t)1 << (key % 64);
+    if (self->seen[key / 64] & mask) continue;
+    self->seen[key / 64] |= mask;
+    if (self->nkeys == self->keys_size)
+      {
+      self->keys_size = self->keys_size ? self->keys_size * 2 : 4096;
+      self->keys = realloc (self->keys, self->keys_size * sizeof (uint32_t));
+      }
+    self->keys[self->nkeys++] = key;
+    }
+  }
+
+
+/*============================================================================
+  bloom_para
+============================================================================*/
+static void bloom_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  BloomBuilder *self = (BloomBuilder *)sink;
+  (void)kind;
+  fold_words (text, len, BLOOM_FOLD, self->word, bloom_add_word, self);
+  }
+
+
+/*============================================================================
+  bloom_begin_book
+============================================================================*/
+static void bloom_begin_book (ParaSink *sink, const char *book)
+  {
+  BloomBuilder *self = (BloomBuilder *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  }
+
+
+/*============================================================================
+  bloom_end_book
+============================================================================*/
+static void bloom_end_book (ParaSink *sink)
+  {
+  BloomBuilder *self = (BloomBuilder *)sink;
+  struct stat st;
+  char *path = realpath (self->book, NULL);
+  if (path && stat (path, &st) == 0)
+    {
+    BloomFile *built = &self->built;
+    uint64_t i;
+    // The same book twice in one run: keep the later one
+    for (i = 0; i < built->nfilters; i++)
+      if (strcmp (built->filters[i].path, path) == 0) break;
+    if (i == built->nfilters)
+      {
+      built->filters = realloc (built->filters,
+        (built->nfilters + 1) * sizeof (BloomFilter));
+      built->nfilters++;
+      }
+    else
+      {
+      free (built->filters[i].path);
+      free (built->filters[i].blocks);
+      }
+    BloomFilter *filter = &built->filters[i];
+    filter->path = path;
+    path = NULL;
+    filter->size = st.st_size;
+    filter->mtime = st.st_mtime;
+    filter->nblocks = (self->nkeys * BLOOM_BITS_PER_KEY
+      + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+    if (filter->nblocks == 0) filter->nblocks = 1;
+    filter->blocks = calloc (filter->nblocks, BLOOM_BLOCK_BITS / 8);
+    for (i = 0; i < self->nkeys; i++)
+      bloom_filter_test (filter, self->keys[i], TRUE);
+    }
+  if (path) free (path);
+
+  uint64_t i;
+  for (i = 0; i < self->nkeys; i++)
+    self->seen[self->keys[i] / 64] = 0;
+  self->nkeys = 0;
+  }
+
+
+/*============================================================================
+  bloom_compare_filters
+============================================================================*/
+static int bloom_compare_filters (const void *a, const void *b)
+  {
+  return strcmp (((const BloomFilter *)a)->path,
+    ((const BloomFilter *)b)->path);
+  }
+
+
+/*============================================================================
+  bloom_write
+============================================================================*/
+BOOL bloom_write (ParaSink *sink, char **error)
+  {
+  BloomBuilder *self = (BloomBuilder *)sink;
+  BloomFile file;
+  memset (&file, 0, sizeof (file));
+  if (!bloom_file_read (&file, self->filename, TRUE, error)) return FALSE;
+
+  // Keep the old filters of books that have not been rebuilt
+  BloomFile *built = &self->built;
+  uint64_t i, n = 0;
+  BloomFilter *all = malloc ((file.nfilters + built->nfilters + 1)
+    * sizeof (BloomFilter));
+  for (i = 0; i < built->nfilters; i++)
+    all[n++] = built->filters[i];
+  qsort (all, n, sizeof (BloomFilter), bloom_compare_filters);
+  for (i = 0; i < file.nfilters; i++)
+    if (!bsearch (&file.filters[i], all, built->nfilters,
+         sizeof (BloomFilter), bloom_compare_filters))
+      all[n++] = file.filters[i];
+  qsort (all, n, sizeof (BloomFilter), bloom_compare_filters);
+
+  BloomFileHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, BLOOM_FILE_MAGIC, 4);
+  header.version = BLOOM_FILE_VERSION;
+  header.byte_order = BLOOM_FILE_BYTE_ORDER;
+  header.nbooks = n;
+  BloomBook *books = malloc ((n + 1) * sizeof (BloomBook));
+  Buffer *strings = buffer_create ();
+  for (i = 0; i < n; i++)
+    {
+    books[i].path = strings->len;
+    buffer_append (strings, all[i].path, strlen (all[i].path) + 1);
+    books[i].size = all[i].size;
+    books[i].mtime = all[i].mtime;
+    books[i].first_block = header.nblocks;
+    books[i].nblocks = all[i].nblocks;
+    header.nblocks += all[i].nblocks;
+    }
+  header.strings_len = strings->len;
+
+  // Written under a temporary name, and then renamed, so that a search
+  //  never sees half of a file
+  char *temp;
+  asprintf (&temp, "%s.tmp", self->filename);
+  BOOL ok = FALSE;
+  FILE *f = fopen (temp, "wb");
+  if (f)
+    {
+    ok = fwrite (&header, sizeof (header), 1, f) == 1
+      && store_write_chunk (f, books, n * sizeof (BloomBook),
+           &header.books_offset)
+      && store_write_chunk (f, strings->data, strings->len,
+           &header.strings_offset)
+      && store_write_chunk (f, NULL, 0, &header.blocks_offset);
+    for (i = 0; ok && i < n; i++)
+      ok = fwrite (all[i].blocks, all[i].nblocks * BLOOM_BLOCK_BITS / 8,
+        1, f) == 1;
+    ok = ok && fseek (f, 0, SEEK_SET) == 0
+      && fwrite (&header, sizeof (header), 1, f) == 1;
+    if (fclose (f) != 0) ok = FALSE;
+    }
+  if (ok && rename (temp, self->filename) != 0) ok = FALSE;
+  if (!ok)
+    {
+    asprintf (error, "Can't write filter file '%s': %s", self->filename,
+      strerror (errno));
+    unlink (temp);
+    }
+
+  free (temp);
+  buffer_destroy (strings);
+  free (books);
+  free (all);
+  bloom_file_clear (&file);
+  return ok;
+  }
+
+
+/*============================================================================
+  bloom_destroy
+============================================================================*/
+static void bloom_destroy (ParaSink *sink)
+  {
+  BloomBuilder *self = (BloomBuilder *)sink;
+  bloom_file_clear (&self->built);
+  free (self->filename);
+  if (self->book) free (self->book);
+  free (self->seen);
+  if (self->keys) free (self->keys);
+  buffer_destroy (self->word);
+  free (self);
+  }
+
+
+/*============================================================================
+  bloom_create
+============================================================================*/
+ParaSink *bloom_create (const char *filename)
+  {
+  BloomBuilder *self = malloc (sizeof (BloomBuilder));
+  memset (self, 0, sizeof (BloomBuilder));
+  parasink_init (&self->sink, NULL);
+  self->sink.begin_book = bloom_begin_book;
+  self->sink.end_book = bloom_end_book;
+  self->sink.para = bloom_para;
+  self->sink.destroy = bloom_destroy;
+  self->filename = strdup (filename);
+  self->seen = calloc ((1 << 24) / 64, sizeof (uint64_t));
+  self->word = buffer_create ();
+  return &self->sink;
+  }
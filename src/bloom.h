@@ -0,0 +1,90 @@
+/*============================================================================
+  epub2txt v2
+  bloom.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Bloom filters of books, so that a search can pass over books that
+  cannot match without unzipping them. A filter file holds one filter
+  for each book that has been added to it, keyed by the book's real
+  path, size and modification time, so that a filter is not used for
+  a book that has changed since.
+
+  What a book's filter holds is its vocabulary: every run of three
+  bytes in every word, after the words have been folded (see fold.h).
+  That is enough to rule out any literal search pattern, with or
+  without folding, that has a word of three bytes or more in it: each
+  of the word's trigrams must be in the filter of a book that matches.
+
+  The filters are blocked: all the bits for one trigram are in the
+  same 64-byte block, so a lookup reads one cache line. With
+  BLOOM_BITS_PER_KEY bits per distinct trigram, and BLOOM_HASHES bits
+  set for each, about one lookup in a hundred gives a false positive.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "parasink.h"
+
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+#define BLOOM_BLOCK_BITS 512
+
+typedef struct _BloomFile BloomFile;
+
+/** Create a sink that writes no text, but builds a filter for each
+    book, to be added to the filter file by bloom_write(). */
+ParaSink   *bloom_create (const char *filename);
+
+/** Add the filters that have been built to the file, replacing any
+    older ones for the same books; then the sink should be closed with
+    parasink_close(). */
+BOOL        bloom_write (ParaSink *sink, char **error);
+
+/** Read a filter file. */
+BloomFile  *bloom_file_open (const char *filename, char **error);
+
+void        bloom_file_close (BloomFile *self);
+
+/** Returns FALSE if the book certainly does not contain the literal
+    pattern; TRUE if it might, or if there is no up-to-date filter for
+    it. */
+BOOL        bloom_file_may_contain (const BloomFile *self,
+              const char *book, const char *pattern);
+
+/*============================================================================
+  Filter files
+
+  A header, followed by three arrays, each aligned to eight bytes, in the
+  byte order of the machine that wrote the file: the books, sorted by
+  path, the string table that holds their paths, and the filters'
+  blocks, each of BLOOM_BLOCK_BITS bits, as uint64_t words.
+============================================================================*/
+
+#define BLOOM_FILE_MAGIC "E2B\x1A"
+#define BLOOM_FILE_VERSION 1
+#define BLOOM_FILE_BYTE_ORDER 0x01020304
+
+typedef struct _BloomFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t reserved;
+  uint64_t books_offset;    // Array of BloomBook
+  uint64_t nbooks;
+  uint64_t strings_offset;
+  uint64_t strings_len;
+  uint64_t blocks_offset;
+  uint64_t nblocks;
+  } BloomFileHeader;
+
+typedef struct _BloomBook
+  {
+  uint64_t path;            // Offset in the string table
+  uint64_t size;            // Of the EPUB file
+  int64_t mtime;            // Of the EPUB file
+  uint64_t first_block;
+  uint64_t nblocks;
+  } BloomBook;
+
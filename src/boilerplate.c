@@ -0,0 +1,271 @@
+/*============================================================================
+  epub2txt v2
+  boilerplate.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The paragraphs are hashed in one pass over the document, counting
+  each hash in an open-addressing table, and looked up again in a
+  second; a 64-bit hash is taken to identify a paragraph.
+
+  A boilerplate sink records each call with the number of the document
+  paragraph that was being built when it was made. The text of each
+  paragraph is added to the document as a single token, which hashes
+  as its words would.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "boilerplate.h"
+#include "fold.h"
+#include "wstring.h"
+#include "buffer.h"
+
+typedef struct _BoilerplateEntry
+  {
+  uint64_t hash;       // 0 if the entry is free
+  uint32_t count;      // Spine items the paragraph is in
+  uint32_t section;    // The last of them, plus 1
+  } BoilerplateEntry;
+
+typedef struct _BoilerplateSink
+  {
+  ParaSink sink;
+  Document *doc;
+  Buffer *calls;
+  Buffer *text;        // Of the paragraph being recorded
+  BOOL open;           // A paragraph has ended at a line break
+  } BoilerplateSink;
+
+
+/*============================================================================
+  boilerplate_next
+  The end of the paragraph that starts at document paragraph p
+============================================================================*/
+static uint32_t boilerplate_next (const Document *doc, uint32_t p,
+       uint32_t end)
+  {
+  while (p < end && doc->paras[p].brk == DOC_BREAK_LINE) p++;
+  return p < end ? p + 1 : end;
+  }
+
+
+/*============================================================================
+  boilerplate_hash
+  FNV-1a of the folded words of document paragraphs first to last, or 0
+  if there are none
+============================================================================*/
+static uint64_t boilerplate_hash (const Document *doc, uint32_t first,
+       uint32_t last, Buffer *folded)
+  {
+  uint32_t t, t0 = doc->paras[first].token, t1 = doc->paras[last].token;
+  if (t0 == t1) return 0;
+  const char *text = doc->text + doc->paras[first].text;
+  const char *text_end = doc->text + doc->text_len;
+  buffer_clear (folded);
+  for (t = t0; t < t1; t++)
+    {
+    uint32_t len = doc->tokens[t].len;
+    if (text + len > text_end) break;
+    if (t > t0) buffer_append (folded, " ", 1);
+    fold_utf8 (text, len, FOLD_CASE, folded, NULL);
+    text += len;
+    }
+
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < folded->len; i++)
+    h = (h ^ (BYTE)folded->data[i]) * 1099511628211ULL;
+  return h ? h : 1;
+  }
+
+
+/*============================================================================
+  boilerplate_lookup
+============================================================================*/
+static BoilerplateEntry *boilerplate_lookup (BoilerplateEntry *table,
+       uint64_t mask, uint64_t hash)
+  {
+  uint64_t i = hash & mask;
+  while (table[i].hash && table[i].hash != hash) i = (i + 1) & mask;
+  return &table[i];
+  }
+
+
+/*============================================================================
+  boilerplate_find
+============================================================================*/
+BOOL *boilerplate_find (const Document *doc, int max)
+  {
+  uint64_t size = 16;
+  while (size < 2 * (uint64_t)doc->nparas) size *= 2;
+  uint64_t mask = size - 1;
+  BoilerplateEntry *table = calloc (size, sizeof (BoilerplateEntry));
+  Buffer *folded = buffer_create ();
+  BOOL *flags = NULL;
+  uint32_t s, p, next;
+  int pass;
+
+  for (pass = 0; pass < 2; pass++)
+    {
+    for (s = 0; s < doc->nsections; s++)
+      {
+      const DocumentSection *section = &doc->sections[s];
+      if (section->kind != DOC_SECTION_SPINE) continue;
+      uint32_t end = section[1].para;
+      for (p = section->para; p < end; p = next)
+        {
+        next = boilerplate_next (doc, p, end);
+        uint64_t hash = boilerplate_hash (doc, p, next, folded);
+        if (!hash) continue;
+        BoilerplateEntry *e = boilerplate_lookup (table, mask, hash);
+        if (pass == 0)
+          {
+          e->hash = hash;
+          if (e->section != s + 1)
+            {
+            e->count++;
+            e->section = s + 1;
+            }
+          }
+        else if (e->count > (uint32_t)max)
+          {
+          if (!flags) flags = calloc (doc->nparas, sizeof (BOOL));
+          // Blank lines after it go with it
+          while (next < end 
+               && doc->paras[next].token == doc->paras[next + 1].token)
+            next++;
+          for (; p < next; p++) flags[p] = TRUE;
+          }
+        }
+      }
+    }
+
+  buffer_destroy (folded);
+  free (table);
+  return flags;
+  }
+
+
+/*============================================================================
+  boilerplate_sink_end_para
+  Add the text of the paragraph so far to the document
+============================================================================*/
+static void boilerplate_sink_end_para (BoilerplateSink *self,
+       DocumentBreak brk)
+  {
+  Buffer *text = self->text;
+  while (text->len && text->data[text->len - 1] == ' ') text->len--;
+  if (text->len)
+    {
+    buffer_append (text, "", 1);
+    uint32_t *s = wstring_convert_utf8_to_utf32 (text->data);
+    int len = 0;
+    while (s[len]) len++;
+    document_add_token (self->doc, s, len, len, 0, 0);
+    free (s);
+    buffer_clear (text);
+    }
+  else if (!self->open || brk == DOC_BREAK_LINE)
+    return;
+  document_end_para (self->doc, brk, 0);
+  self->open = brk == DOC_BREAK_LINE;
+  }
+
+
+/*============================================================================
+  boilerplate_sink_forward
+============================================================================*/
+static void boilerplate_sink_forward (ParaSink *sink, 
+       const ParaSinkCall *call)
+  {
+  BoilerplateSink *self = (BoilerplateSink *)sink;
+  parasink_record (self->calls, call, self->doc->nparas);
+
+  size_t i;
+  switch (call->op)
+    {
+    case PARASINK_TEXT:
+      // Runs of spaces are collapsed, as the sink would
+      for (i = 0; i < call->len; i++)
+        {
+        Buffer *text = self->text;
+        if (call->s[i] == ' ' 
+             && (text->len == 0 || text->data[text->len - 1] == ' '))
+          continue;
+        buffer_append (text, call->s + i, 1);
+        }
+      break;
+    case PARASINK_LINE_BREAK:
+      boilerplate_sink_end_para (self, DOC_BREAK_LINE);
+      break;
+    case PARASINK_BEGIN_SECTION:
+      boilerplate_sink_end_para (self, DOC_BREAK_PARA);
+      document_begin_section (self->doc, call->s ? DOC_SECTION_SPINE 
+        : DOC_SECTION_META, call->s);
+      break;
+    case PARASINK_EMPHASIS:
+      break;
+    default:
+      boilerplate_sink_end_para (self, DOC_BREAK_PARA);
+    }
+  }
+
+
+/*============================================================================
+  boilerplate_sink_replay
+============================================================================*/
+void boilerplate_sink_replay (ParaSink *sink, ParaSink *to, int max)
+  {
+  BoilerplateSink *self = (BoilerplateSink *)sink;
+  boilerplate_sink_end_para (self, DOC_BREAK_PARA);
+  BOOL *flags = boilerplate_find (self->doc, max);
+  size_t pos = 0;
+  ParaSinkCall call;
+  uint32_t para;
+  while (!to->done && parasink_recorded (self->calls, &pos, &call, &para))
+    {
+    if (flags && para < self->doc->nparas && flags[para]
+         && (call.op == PARASINK_TEXT || call.op == PARASINK_LINE_BREAK))
+      continue;
+    parasink_call (to, &call);
+    }
+  if (flags) free (flags);
+
+  buffer_clear (self->calls);
+  document_destroy (self->doc);
+  self->doc = document_create ();
+  self->open = FALSE;
+  }
+
+
+/*============================================================================
+  boilerplate_sink_destroy
+============================================================================*/
+static void boilerplate_sink_destroy (ParaSink *sink)
+  {
+  BoilerplateSink *self = (BoilerplateSink *)sink;
+  document_destroy (self->doc);
+  buffer_destroy (self->calls);
+  buffer_destroy (self->text);
+  free (self);
+  }
+
+
+/*============================================================================
+  boilerplate_sink_create
+============================================================================*/
+ParaSink *boilerplate_sink_create (void)
+  {
+  BoilerplateSink *self = malloc (sizeof (BoilerplateSink));
+  memset (self, 0, sizeof (BoilerplateSink));
+  parasink_init (&self->sink, NULL);
+  self->sink.forward = boilerplate_sink_forward;
+  self->sink.destroy = boilerplate_sink_destroy;
+  self->doc = document_create ();
+  self->calls = buffer_create ();
+  self->text = buffer_create ();
+  return &self->sink;
+  }
@@ -0,0 +1,44 @@
+/*============================================================================
+  epub2txt v2
+  boilerplate.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Boilerplate: paragraphs, such as running headers, copyright notices,
+  and "Back to contents" links, that are repeated in many spine items
+  of a book. Whether a paragraph is boilerplate is only known when the
+  whole book has been read, so the book is recorded as a document (see
+  document.h), which is searched, and then laid out without the
+  paragraphs that were found; nothing is parsed twice.
+
+  A paragraph here is what ends at a paragraph break, including any
+  lines in it that end at hard line breaks. Paragraphs are compared by
+  a hash of their words, folded to lower case, so that differences in
+  spacing, style, and case do not count; each is counted once for each
+  spine item it is in. Metadata is never boilerplate.
+
+  Paragraph sinks are given no layout, so for them the calls to the
+  sink are held back instead: a boilerplate sink records them, and a 
+  document with the text of each paragraph, and once the book has been
+  read, makes them again to the real sink, leaving out those that add
+  the text of the paragraphs found in the document.
+============================================================================*/
+
+#pragma once
+
+#include "document.h"
+#include "parasink.h"
+
+/** Find the paragraphs of the spine items of doc that are in more than
+    max spine items. Returns an array of doc->nparas flags, which are
+    TRUE for the document paragraphs that make them up, or NULL if there
+    are none. */
+BOOL       *boilerplate_find (const Document *doc, int max);
+
+/** A sink that records what is passed to it, for 
+    boilerplate_sink_replay(). */
+ParaSink   *boilerplate_sink_create (void);
+
+/** Pass what has been recorded since the last call on to sink, leaving
+    out the text of paragraphs that are in more than max spine items. */
+void        boilerplate_sink_replay (ParaSink *self, ParaSink *sink, 
+              int max);
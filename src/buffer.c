@@ -0,0 +1,167 @@
+/*============================================================================
+  epub2txt v2
+  buffer.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+============================================================================*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "buffer.h"
+
+/*============================================================================
+  buffer_create
+============================================================================*/
+Buffer *buffer_create (void)
+  {
+  Buffer *self = malloc (sizeof (Buffer));
+  memset (self, 0, sizeof (Buffer));
+  return self;
+  }
+
+
+/*============================================================================
+  buffer_destroy
+============================================================================*/
+void buffer_destroy (Buffer *self)
+  {
+  if (self->data) free (self->data);
+  free (self);
+  }
+
+
+/*============================================================================
+  buffer_clear
+============================================================================*/
+void buffer_clear (Buffer *self)
+  {
+  self->len = 0;
+  }
+
+
+/*============================================================================
+  buffer_reserve
+============================================================================*/
+void buffer_reserve (Buffer *self, size_t n)
+  {
+  if (self->len + n <= self->size) return;
+  while (self->len + n > self->size)
+    self->size = self->size ? self->size * 2 : 4096;
+  self->data = realloc (self->data, self->size);
+  }
+
+
+/*============================================================================
+  buffer_append
+============================================================================*/
+void buffer_append (Buffer *self, const char *s, size_t len)
+  {
+  if (len == 0) return;
+  buffer_reserve (self, len);
+  memcpy (self->data + self->len, s, len);
+  self->len += len;
+  }
+
+
+/*============================================================================
+  buffer_json_clean
+  The number of bytes at the start of s that need no escaping in a JSON
+  string. The text is scanned eight bytes at a time, using the usual 
+  bit tricks to test a whole word for control characters, quotes and
+  backslashes, and only a word that has one is looked at bytewise. 
+============================================================================*/
+#define BUFFER_ONES 0x0101010101010101ULL
+#define BUFFER_HIGHS 0x8080808080808080ULL
+#define BUFFER_HAS_ZERO(v) (((v) - BUFFER_ONES) & ~(v) & BUFFER_HIGHS)
+#define BUFFER_HAS_LESS(v,n) (((v) - BUFFER_ONES * (n)) & ~(v) & BUFFER_HIGHS)
+static size_t buffer_json_clean (const char *s, size_t len)
+  {
+  size_t i = 0;
+  while (i + 8 <= len)
+    {
+    uint64_t v;
+    memcpy (&v, s + i, 8);
+    if (BUFFER_HAS_LESS (v, 0x20) 
+         || BUFFER_HAS_ZERO (v ^ (BUFFER_ONES * '"'))
+         || BUFFER_HAS_ZERO (v ^ (BUFFER_ONES * '\\')))
+      break;
+    i += 8;
+    }
+  for (; i < len; i++)
+    {
+    unsigned char c = s[i];
+    if (c < 0x20 || c == '"' || c == '\\') break;
+    }
+  return i;
+  }
+
+
+/*============================================================================
+  buffer_append_json_chars
+============================================================================*/
+void buffer_append_json_chars (Buffer *self, const char *s, size_t len)
+  {
+  static const char hex[] = "0123456789abcdef";
+  buffer_reserve (self, len);
+  while (len)
+    {
+    size_t n = buffer_json_clean (s, len);
+    buffer_append (self, s, n);
+    s += n;
+    len -= n;
+    if (!len) break;
+    unsigned char c = *s++;
+    len--;
+    char esc[6] = { '\\', c, 0, 0, 0, 0 };
+    int esc_len = 2;
+    if (c == '\n') esc[1] = 'n';
+    else if (c == '\t') esc[1] = 't';
+    else if (c == '\r') esc[1] = 'r';
+    else if (c < 0x20)
+      {
+      memcpy (esc + 1, "u00", 3);
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 15];
+      esc_len = 6;
+      }
+    buffer_append (self, esc, esc_len);
+    }
+  }
+
+
+/*============================================================================
+  buffer_append_json_n
+============================================================================*/
+void buffer_append_json_n (Buffer *self, const char *s, size_t len)
+  {
+  buffer_reserve (self, len + 2);
+  self->data[self->len++] = '"';
+  buffer_append_json_chars (self, s, len);
+  buffer_append (self, "\"", 1);
+  }
+
+
+/*============================================================================
+  buffer_append_json
+============================================================================*/
+void buffer_append_json (Buffer *self, const char *s)
+  {
+  if (s)
+    buffer_append_json_n (self, s, strlen (s));
+  else
+    buffer_append (self, "null", 4);
+  }
+
+
+/*============================================================================
+  buffer_write_file
+============================================================================*/
+BOOL buffer_write_file (const Buffer *self, const char *filename)
+  {
+  FILE *f = fopen (filename, "wb");
+  if (!f) return FALSE;
+  BOOL ok = self->len == 0 || fwrite (self->data, self->len, 1, f) == 1;
+  if (fclose (f) != 0) ok = FALSE;
+  return ok;
+  }
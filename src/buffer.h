@@ -0,0 +1,48 @@
+/*============================================================================
+  epub2txt v2
+  buffer.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  A growable byte buffer, for text that is built up in memory before it
+  is written out. Clearing a buffer keeps its memory, so one buffer can
+  be reused for many pieces of text without reallocating.
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "defs.h"
+
+typedef struct _Buffer
+  {
+  char *data;
+  size_t len;
+  size_t size;
+  } Buffer;
+
+Buffer     *buffer_create (void);
+void        buffer_destroy (Buffer *self);
+
+/** Empty the buffer, but keep its memory. */
+void        buffer_clear (Buffer *self);
+
+/** Make room for at least n more bytes. */
+void        buffer_reserve (Buffer *self, size_t n);
+
+void        buffer_append (Buffer *self, const char *s, size_t len);
+
+/** Append s as a JSON string, with quotes; or null, if s is NULL. */
+void        buffer_append_json (Buffer *self, const char *s);
+
+/** Append len bytes of UTF-8 as a JSON string, with quotes. */
+void        buffer_append_json_n (Buffer *self, const char *s, size_t len);
+
+/** Append len bytes of UTF-8, escaped for a JSON string, but without 
+    quotes, so that a string can be appended in pieces. */
+void        buffer_append_json_chars (Buffer *self, const char *s, 
+              size_t len);
+
+/** Write the contents to a file; returns FALSE, with errno set, on 
+    failure. */
+BOOL        buffer_write_file (const Buffer *self, const char *filename);
@@ -0,0 +1,291 @@
+/*============================================================================
+  epub2txt v2
+  chapters.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Workers take the next spine item from a shared counter, which is the
+  only thing that they share: each has its own copy of the options, 
+  which sends the text to the worker's buffer rather than to stdout, and
+  each item's file is written by the worker that converted it.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "chapters.h"
+#include "xhtml.h"
+#include "log.h"
+
+// More workers than this would just wait for the disk
+#define CHAPTERS_MAX_WORKERS 16
+
+// The book directories written so far in this run
+static char **chapters_dirs = NULL;
+static int chapters_ndirs = 0;
+
+typedef struct _ChaptersJob
+  {
+  const char *dir;
+  char *const *paths;
+  int n;
+  int next;                // The next item to convert
+  int *errors;             // For each item: 0 if it was written, or errno
+  const Epub2TxtOptions *options;
+  } ChaptersJob;
+
+
+/*============================================================================
+  chapters_file
+  The file that spine item i is written to
+============================================================================*/
+static char *chapters_file (const char *dir, int i)
+  {
+  char *file;
+  asprintf (&file, "%s/%04d.txt", dir, i + 1);
+  return file;
+  }
+
+
+/*============================================================================
+  chapters_worker
+============================================================================*/
+static void *chapters_worker (void *arg)
+  {
+  ChaptersJob *job = arg;
+  Epub2TxtOptions options = *job->options;
+  options.output = buffer_create ();
+  options.section_separator = NULL;
+
+  int i;
+  while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+    {
+    if (!job->paths[i]) continue;
+    char *error = NULL;
+    buffer_clear (options.output);
+    xhtml_file_to_stdout (job->paths[i], &options, &error);
+    if (error)
+      {
+      log_warning ("Error processing spine item %s: %s (continuing)", 
+        job->paths[i], error);
+      free (error);
+      }
+    char *file = chapters_file (job->dir, i);
+    job->errors[i] = buffer_write_file (options.output, file) ? 0 : errno;
+    free (file);
+    }
+
+  buffer_destroy (options.output);
+  return NULL;
+  }
+
+
+/*============================================================================
+  chapters_mkdir
+============================================================================*/
+static BOOL chapters_mkdir (const char *dir, char **error)
+  {
+  if (mkdir (dir, 0777) == 0 || errno == EEXIST) return TRUE;
+  asprintf (error, "Can't create directory '%s': %s", dir, strerror (errno));
+  return FALSE;
+  }
+
+
+/*============================================================================
+  chapters_book_dir
+  The book's directory: the name of the file, without its extension; if
+  another book of the same name has already been written in this run,
+  -2, -3, and so on, are added, so that it is not overwritten
+============================================================================*/
+static char *chapters_book_dir (const char *output_dir, const char *book)
+  {
+  const char *name = strrchr (book, '/');
+  name = name ? name + 1 : book;
+  const char *dot = strrchr (name, '.');
+  int len = dot && dot != name ? dot - name : (int)strlen (name);
+  char *dir;
+  asprintf (&dir, "%s/%.*s", output_dir, len, name);
+  int i, n = 1;
+  for (i = 0; i < chapters_ndirs; i++)
+    {
+    if (strcmp (chapters_dirs[i], dir) != 0) continue;
+    free (dir);
+    asprintf (&dir, "%s/%.*s-%d", output_dir, len, name, ++n);
+    i = -1;
+    }
+  chapters_dirs = realloc (chapters_dirs, 
+    (chapters_ndirs + 1) * sizeof (char *));
+  chapters_dirs[chapters_ndirs++] = strdup (dir);
+  return dir;
+  }
+
+
+/*============================================================================
+  chapters_clean
+  Remove the files of an earlier run from a book's directory, so that
+  none are left over from a longer book
+============================================================================*/
+static void chapters_clean (const char *dir)
+  {
+  DIR *d = opendir (dir);
+  if (!d) return;
+  struct dirent *de;
+  while ((de = readdir (d)))
+    {
+    const char *name = de->d_name;
+    if (strcmp (name, "meta.txt") == 0 || strcmp (name, "manifest.json") == 0
+        || (strlen (name) == 8 && strspn (name, "0123456789") == 4
+          && strcmp (name + 4, ".txt") == 0))
+      {
+      char *file;
+      asprintf (&file, "%s/%s", dir, name);
+      unlink (file);
+      free (file);
+      }
+    }
+  closedir (d);
+  }
+
+
+/*============================================================================
+  chapters_write_manifest
+============================================================================*/
+static BOOL chapters_write_manifest (const char *dir, const char *book, 
+       const char *const *hrefs, const int *errors, int n, const Document *toc, 
+       BOOL meta)
+  {
+  Buffer *b = buffer_create ();
+  buffer_append (b, "{\n  \"book\": ", 12);
+  buffer_append_json (b, book);
+  buffer_append (b, ",\n  \"meta\": ", 12);
+  buffer_append_json (b, meta ? "meta.txt" : NULL);
+  buffer_append (b, ",\n  \"chapters\": [", 17);
+  int i;
+  BOOL first = TRUE;
+  for (i = 0; i < n; i++)
+    {
+    if (errors[i]) continue;
+    char name[16];
+    snprintf (name, sizeof (name), "%04d.txt", i + 1);
+    char *entry;
+    int len = asprintf (&entry, "%s\n    {\"file\": \"%s\", \"spine_index\": %d"
+      ", \"href\": ", first ? "" : ",", name, i);
+    buffer_append (b, entry, len);
+    free (entry);
+    buffer_append_json (b, hrefs[i]);
+    buffer_append (b, ", \"title\": ", 11);
+    buffer_append_json (b, document_toc_title (toc, hrefs[i]));
+    buffer_append (b, "}", 1);
+    first = FALSE;
+    }
+  buffer_append (b, "\n  ]\n}\n", 7);
+
+  char *file;
+  asprintf (&file, "%s/manifest.json", dir);
+  BOOL ok = buffer_write_file (b, file);
+  free (file);
+  buffer_destroy (b);
+  return ok;
+  }
+
+
+/*============================================================================
+  chapters_write
+============================================================================*/
+BOOL chapters_write (const char *book, const char *const *hrefs, 
+       char *const *paths, int n, const Document *toc, const Buffer *meta,
+       const Epub2TxtOptions *options, char **error)
+  {
+  IN
+  char *dir = chapters_book_dir (options->output_dir, book);
+  if (!chapters_mkdir (options->output_dir, error) 
+       || !chapters_mkdir (dir, error))
+    {
+    free (dir);
+    OUT
+    return FALSE;
+    }
+  chapters_clean (dir);
+  log_debug ("Writing %d spine items to %s", n, dir);
+
+  BOOL ok = TRUE;
+  if (meta)
+    {
+    char *file;
+    asprintf (&file, "%s/meta.txt", dir);
+    if (!buffer_write_file (meta, file))
+      {
+      asprintf (error, "Can't write '%s': %s", file, strerror (errno));
+      ok = FALSE;
+      }
+    free (file);
+    }
+
+  ChaptersJob job;
+  job.dir = dir;
+  job.paths = paths;
+  job.n = n;
+  job.next = 0;
+  job.errors = malloc ((n + 1) * sizeof (int));
+  job.options = options;
+  int i;
+  for (i = 0; i < n; i++)
+    job.errors[i] = paths[i] ? 0 : ENOENT;
+
+  long nworkers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nworkers > CHAPTERS_MAX_WORKERS) nworkers = CHAPTERS_MAX_WORKERS;
+  if (nworkers > n) nworkers = n;
+  pthread_t threads [CHAPTERS_MAX_WORKERS];
+  int nthreads = 0;
+  while (nthreads < nworkers && pthread_create (&threads[nthreads], NULL,
+           chapters_worker, &job) == 0)
+    nthreads++;
+  if (nthreads == 0)
+    chapters_worker (&job);
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < n && ok; i++)
+    {
+    if (paths[i] && job.errors[i])
+      {
+      char *file = chapters_file (dir, i);
+      asprintf (error, "Can't write '%s': %s", file, 
+        strerror (job.errors[i]));
+      free (file);
+      ok = FALSE;
+      }
+    }
+
+  if (!chapters_write_manifest (dir, book, hrefs, job.errors, n, toc, 
+        meta != NULL) && ok)
+    {
+    asprintf (error, "Can't write manifest in '%s': %s", dir, 
+      strerror (errno));
+    ok = FALSE;
+    }
+
+  free (job.errors);
+  free (dir);
+  OUT
+  return ok;
+  }
+
+
+/*============================================================================
+  chapters_cleanup
+============================================================================*/
+void chapters_cleanup (void)
+  {
+  int i;
+  for (i = 0; i < chapters_ndirs; i++)
+    free (chapters_dirs[i]);
+  free (chapters_dirs);
+  chapters_dirs = NULL;
+  chapters_ndirs = 0;
+  }
@@ -0,0 +1,29 @@
+/*============================================================================
+  epub2txt v2
+  chapters.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Writing each spine item of a book to its own file, for tools such as
+  search indexers that want the text split by chapter. The items are
+  independent of one another, so they are converted by parallel
+  workers, each with its own output buffer, and written as they are
+  finished, in no particular order.
+============================================================================*/
+
+#pragma once
+
+#include "epub2txt.h"
+
+/** Write the text of a book to a directory, named after the book file,
+    in options->output_dir: 0001.txt for the first spine item, 0002.txt
+    for the second, and so on. paths[i] is the XHTML file of the spine
+    item whose href is hrefs[i], or NULL if the item is to be skipped.
+    The metadata, if meta is not NULL, goes in meta.txt. A manifest.json
+    lists the files that were written, with their hrefs and their titles
+    in the TOC. */
+BOOL chapters_write (const char *book, const char *const *hrefs, 
+       char *const *paths, int n, const Document *toc, const Buffer *meta,
+       const Epub2TxtOptions *options, char **error);
+
+/** Forget the directories written so far. */
+void chapters_cleanup (void);
@@ -0,0 +1,451 @@
+/*============================================================================
+  epub2txt v2
+  chunk.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The text of the spine item is copied once, into a ring buffer, as the
+  paragraphs arrive; sentences are noted as byte offsets into it, and
+  chunks are written straight from the ring, in at most two pieces. The
+  ring only has to hold the text from the start of the chunk being
+  built, including its overlap, so it stays about the size of a chunk,
+  however long the spine item is.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "chunk.h"
+#include "store.h"
+#include "fold.h"
+#include "linebreak.h"
+
+typedef struct _ChunkSentence
+  {
+  uint64_t start;        // Byte offsets in the text of the spine item
+  uint64_t end;
+  uint32_t words;
+  uint32_t para;
+  BOOL para_end;         // The last sentence of its paragraph
+  } ChunkSentence;
+
+typedef struct _Chunker
+  {
+  ParaSink sink;
+  int max_words;
+  int overlap;
+  char *book;
+  Buffer *prefix;        // The record, up to the chunk index
+  Buffer *out;           // The record being built
+  char *ring;            // The text, at offset & (ring_size - 1)
+  uint64_t ring_size;
+  uint64_t head;         // Length of the text so far
+  ChunkSentence *sentences;
+  uint64_t nsentences;
+  uint64_t sentences_size;
+  uint64_t first;        // The first sentence of the next chunk
+  uint64_t written;      // Sentences before this have been written
+  uint32_t para_index;
+  int chunk_index;
+  } Chunker;
+
+
+/*============================================================================
+  chunk_base
+  The offset of the first byte of text that is still needed
+============================================================================*/
+static uint64_t chunk_base (const Chunker *self)
+  {
+  return self->first < self->nsentences
+    ? self->sentences[self->first].start : self->head;
+  }
+
+
+/*============================================================================
+  chunk_ring_append
+============================================================================*/
+static void chunk_ring_append (Chunker *self, const char *s, size_t len)
+  {
+  uint64_t base = chunk_base (self);
+  if (self->head + len - base > self->ring_size)
+    {
+    uint64_t size = self->ring_size, pos;
+    while (self->head + len - base > size) size *= 2;
+    char *ring = malloc (size);
+    for (pos = base; pos < self->head; pos++)
+      ring[pos & (size - 1)] = self->ring[pos & (self->ring_size - 1)];
+    free (self->ring);
+    self->ring = ring;
+    self->ring_size = size;
+    }
+  uint64_t i = self->head & (self->ring_size - 1);
+  size_t n = self->ring_size - i < len ? self->ring_size - i : len;
+  memcpy (self->ring + i, s, n);
+  memcpy (self->ring, s + n, len - n);
+  self->head += len;
+  }
+
+
+/*============================================================================
+  chunk_write
+  Write the sentences from first up to last as a chunk
+============================================================================*/
+static void chunk_write (Chunker *self, uint64_t first, uint64_t last)
+  {
+  const ChunkSentence *s = self->sentences;
+  uint64_t i, words = 0;
+  for (i = first; i < last; i++) words += s[i].words;
+  uint64_t start = s[first].start, end = s[last - 1].end;
+
+  Buffer *out = self->out;
+  buffer_clear (out);
+  char number [160];
+  int len = snprintf (number, sizeof (number), "%d, \"first_para\": %u, "
+    "\"last_para\": %u, \"start\": %llu, \"end\": %llu, \"words\": %llu, "
+    "\"text\": \"", self->chunk_index++, s[first].para, s[last - 1].para,
+    (unsigned long long)start, (unsigned long long)end,
+    (unsigned long long)words);
+  buffer_append (out, self->prefix->data, self->prefix->len);
+  buffer_append (out, number, len);
+  uint64_t at = start & (self->ring_size - 1);
+  uint64_t n = self->ring_size - at < end - start
+    ? self->ring_size - at : end - start;
+  buffer_append_json_chars (out, self->ring + at, n);
+  buffer_append_json_chars (out, self->ring, end - start - n);
+  buffer_append (out, "\"}\n", 3);
+  parasink_write (&self->sink, out->data, out->len);
+  }
+
+
+/*============================================================================
+  chunk_split
+  Split sentence i so that its last words words are a sentence of their
+  own, which is then sentence i + 1
+============================================================================*/
+static void chunk_split (Chunker *self, uint64_t i, uint32_t words)
+  {
+  STORE_GROW (self->sentences, self->sentences_size, self->nsentences + 1);
+  ChunkSentence *s = self->sentences + i;
+  memmove (s + 1, s, (self->nsentences++ - i) * sizeof (ChunkSentence));
+
+  // Find the start of the word, counting words as chunk_para() does
+  uint32_t word = 0, target = s->words - words;
+  uint64_t pos = s->start, word_end = pos, mask = self->ring_size - 1;
+  BOOL in_word = FALSE;
+  while (pos < s->end)
+    {
+    uint64_t p = pos;
+    uint32_t c = (BYTE)self->ring[pos++ & mask];
+    if (c >= 0xC0)
+      {
+      int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+      c &= 0x3F >> n;
+      while (n-- && pos < s->end)
+        c = (c << 6) | ((BYTE)self->ring[pos++ & mask] & 0x3F);
+      }
+    int kind = fold_char_kind (c);
+    if (kind && (kind == 2 || !in_word) && word++ == target)
+      {
+      pos = p;
+      break;
+      }
+    in_word = kind == 1;
+    if (kind) word_end = pos;
+    }
+
+  s[0].end = word_end;
+  s[0].words = target;
+  s[0].para_end = FALSE;
+  s[1].start = pos;
+  s[1].words = words;
+  }
+
+
+/*============================================================================
+  chunk_emit
+  Write the chunks that can be written; with final, the rest too
+============================================================================*/
+static void chunk_emit (Chunker *self, BOOL final)
+  {
+  const ChunkSentence *s = self->sentences;
+  uint64_t n = self->nsentences;
+  while (self->first < n)
+    {
+    uint64_t first = self->first, k = first, j, last;
+    uint64_t words = 0;
+    while (k < n && words + s[k].words <= (uint64_t)self->max_words)
+      words += s[k++].words;
+    // If only the overlap fits, the next sentence is split at a word, so
+    //  that the chunk has something new in it
+    if (k < n && k <= self->written)
+      {
+      chunk_split (self, k, s[k].words - (self->max_words - words));
+      s = self->sentences;
+      n = self->nsentences;
+      words += s[k++].words;
+      }
+    if (k == n)
+      {
+      // More text may fit in this chunk, unless there is no more
+      if (final && n > self->written) chunk_write (self, first, n);
+      if (final) self->first = n;
+      break;
+      }
+
+    // End at a paragraph, if that leaves the chunk three-quarters full,
+    //  and with something that the last one did not have
+    last = k;
+    words = 0;
+    for (j = first; j < k; j++)
+      {
+      words += s[j].words;
+      if (s[j].para_end && j >= self->written
+           && words >= (uint64_t)self->max_words * 3 / 4)
+        last = j + 1;
+      }
+    chunk_write (self, first, last);
+    self->written = last;
+
+    // The next chunk starts with whole sentences from the end of this
+    //  one, but always after the start of this one
+    uint64_t overlap = self->overlap;
+    words = 0;
+    while (last > first + 1 && words + s[last - 1].words <= overlap)
+      words += s[--last].words;
+    // If that is short of the overlap, the sentence before those is
+    //  split at a word, as a sentence that is too long is
+    if (words < overlap && s[last - 1].words > overlap - words)
+      {
+      chunk_split (self, last - 1, overlap - words);
+      s = self->sentences;
+      n = self->nsentences;
+      self->written++;
+      }
+    self->first = last;
+    }
+
+  // Sentences before the next chunk are not needed again
+  if (self->first)
+    {
+    memmove (self->sentences, self->sentences + self->first,
+      (n - self->first) * sizeof (ChunkSentence));
+    self->nsentences -= self->first;
+    self->written = self->written > self->first
+      ? self->written - self->first : 0;
+    self->first = 0;
+    }
+  }
+
+
+/*============================================================================
+  chunk_add_sentence
+============================================================================*/
+static void chunk_add_sentence (Chunker *self, uint64_t start,
+       uint64_t end, uint32_t words, BOOL para_end)
+  {
+  STORE_GROW (self->sentences, self->sentences_size, self->nsentences + 1);
+  ChunkSentence *s = &self->sentences[self->nsentences++];
+  s->start = start;
+  s->end = end;
+  s->words = words;
+  s->para = self->para_index;
+  s->para_end = para_end;
+  }
+
+
+/*============================================================================
+  chunk_para
+============================================================================*/
+static void chunk_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  Chunker *self = (Chunker *)sink;
+  if (kind == PARA_META) return;
+  if (self->head) chunk_ring_append (self, "\n\n", 2);
+  uint64_t offset = self->head;
+  chunk_ring_append (self, text, len);
+
+  const BYTE *s = (const BYTE *)text, *end = s + len;
+  uint64_t start = 0, word_end = 0, boundary = 0;
+  uint32_t words = 0;
+  BOOL in_word = FALSE, stop = FALSE;
+  while (s < end)
+    {
+    const BYTE *p = s;
+    uint32_t c = *s++;
+    if (c >= 0xC0)
+      {
+      int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+      c &= 0x3F >> n;
+      while (n-- && s < end) c = (c << 6) | (*s++ & 0x3F);
+      }
+    uint64_t pos = offset + (p - (const BYTE *)text);
+    int char_kind = fold_char_kind (c);
+    if (char_kind)
+      {
+      if (char_kind == 2 || !in_word)
+        {
+        // A word starts: end the sentence, if it has ended, or is full
+        if (words && (boundary || words == (uint32_t)self->max_words))
+          {
+          chunk_add_sentence (self, start, boundary ? boundary : word_end,
+            words, FALSE);
+          words = 0;
+          }
+        if (!words) start = pos;
+        words++;
+        }
+      in_word = char_kind == 1;
+      stop = FALSE;
+      boundary = 0;
+      word_end = offset + (s - (const BYTE *)text);
+      continue;
+      }
+    in_word = FALSE;
+    if (c == '.' || c == '!' || c == '?' || c == 0x2026)
+      stop = TRUE;
+    else if (c == 0x3002 || c == 0xFF01 || c == 0xFF1F)
+      {
+      // Ideographic stops need no space after them
+      stop = TRUE;
+      if (!boundary) boundary = offset + (s - (const BYTE *)text);
+      }
+    else if ((c == ' ' || c == '\n' || c == '\t' || c == 0xA0) && stop
+         && !boundary)
+      boundary = pos;
+    }
+  if (words) chunk_add_sentence (self, start, offset + len, words, TRUE);
+  else if (self->nsentences)
+    self->sentences[self->nsentences - 1].para_end = TRUE;
+  self->para_index++;
+  chunk_emit (self, FALSE);
+  }
+
+
+/*============================================================================
+  chunk_begin_section
+============================================================================*/
+static void chunk_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  Chunker *self = (Chunker *)sink;
+  char number [32];
+  chunk_emit (self, TRUE);
+  self->nsentences = 0;
+  self->first = 0;
+  self->written = 0;
+  self->head = 0;
+  self->para_index = 0;
+  self->chunk_index = 0;
+  buffer_clear (self->prefix);
+  buffer_append (self->prefix, "{\"book\": ", 9);
+  buffer_append_json (self->prefix, self->book);
+  buffer_append (self->prefix, ", \"spine_index\": ", 17);
+  if (href)
+    {
+    int len = snprintf (number, sizeof (number), "%d", spine_index);
+    buffer_append (self->prefix, number, len);
+    }
+  else
+    buffer_append (self->prefix, "null", 4);
+  buffer_append (self->prefix, ", \"href\": ", 10);
+  buffer_append_json (self->prefix, href);
+  buffer_append (self->prefix, ", \"chunk_index\": ", 17);
+  }
+
+
+/*============================================================================
+  chunk_begin_book
+============================================================================*/
+static void chunk_begin_book (ParaSink *sink, const char *book)
+  {
+  Chunker *self = (Chunker *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  chunk_begin_section (sink, -1, NULL);
+  }
+
+
+/*============================================================================
+  chunk_end_book
+============================================================================*/
+static void chunk_end_book (ParaSink *sink)
+  {
+  Chunker *self = (Chunker *)sink;
+  chunk_emit (self, TRUE);
+  }
+
+
+/*============================================================================
+  chunk_destroy
+============================================================================*/
+static void chunk_destroy (ParaSink *sink)
+  {
+  Chunker *self = (Chunker *)sink;
+  free (self->book);
+  free (self->ring);
+  if (self->sentences) free (self->sentences);
+  buffer_destroy (self->prefix);
+  buffer_destroy (self->out);
+  free (self);
+  }
+
+
+/*============================================================================
+  chunk_parse
+============================================================================*/
+BOOL chunk_parse (const char *spec, int *words, int *overlap, char **error)
+  {
+  *words = CHUNK_DEFAULT_WORDS;
+  *overlap = CHUNK_DEFAULT_OVERLAP;
+  while (*spec)
+    {
+    size_t len = strcspn (spec, ",");
+    const char *value = memchr (spec, '=', len);
+    if (value && value - spec == 5 && strncmp (spec, "words", 5) == 0)
+      *words = atoi (value + 1);
+    else if (value && value - spec == 7 && strncmp (spec, "overlap", 7) == 0)
+      *overlap = atoi (value + 1);
+    else
+      {
+      asprintf (error, "Unknown chunk setting '%.*s'", (int)len, spec);
+      return FALSE;
+      }
+    spec += len;
+    if (*spec == ',') spec++;
+    }
+  if (*words < 1 || *overlap < 0 || *overlap >= *words)
+    {
+    asprintf (error, "Chunks must have at least one word, and overlap "
+      "by fewer words than that");
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  chunk_create
+============================================================================*/
+ParaSink *chunk_create (int words, int overlap, Compressor *compressor)
+  {
+  Chunker *self = malloc (sizeof (Chunker));
+  memset (self, 0, sizeof (Chunker));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = chunk_begin_book;
+  self->sink.end_book = chunk_end_book;
+  self->sink.begin_section = chunk_begin_section;
+  self->sink.para = chunk_para;
+  self->sink.destroy = chunk_destroy;
+  self->max_words = words;
+  self->overlap = overlap;
+  self->book = strdup ("");
+  self->prefix = buffer_create ();
+  self->out = buffer_create ();
+  self->ring_size = 65536;
+  self->ring = malloc (self->ring_size);
+  linebreak_init ();
+  chunk_begin_section (&self->sink, -1, NULL);
+  return &self->sink;
+  }
@@ -0,0 +1,44 @@
+/*============================================================================
+  epub2txt v2
+  chunk.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Chunks, for embedding: a paragraph sink that cuts the text of each
+  spine item into chunks of at most a given number of words, each of
+  which overlaps the one before by about a given number of words, and
+  writes one JSON record per chunk:
+
+  {"book": ..., "spine_index": N, "href": ..., "chunk_index": N,
+   "first_para": N, "last_para": N, "start": N, "end": N, "words": N,
+   "text": ...}
+
+  Chunks end at the ends of sentences, and, where that does not make
+  them much shorter, of paragraphs; a sentence longer than a whole chunk
+  is cut between words. The overlap is made of whole sentences where
+  they fit, and is made up from the end of the sentence before them,
+  cut between words, where they do not; if only the overlap fits in a
+  chunk, the next sentence is cut to fill the rest of it. Words
+  are split as they are for --stats-only and the search index (see
+  fold.h); sentences end at a full stop, exclamation or question mark,
+  or ellipsis, that is followed by a space, and at an ideographic full
+  stop. Chunks do not cross spine items, and metadata is not included.
+
+  The paragraphs are numbered as --format=jsonl numbers them; start and
+  end are the byte offsets of the chunk's text in the text of the spine
+  item, as its paragraphs would be with a blank line between each. In
+  the chunk's text, too, paragraphs are separated by a blank line.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define CHUNK_DEFAULT_WORDS 512
+#define CHUNK_DEFAULT_OVERLAP 64
+
+/** Parse a specification such as "words=512,overlap=64"; either part
+    can be left out, for its default. */
+BOOL        chunk_parse (const char *spec, int *words, int *overlap,
+              char **error);
+
+ParaSink   *chunk_create (int words, int overlap, Compressor *compressor);
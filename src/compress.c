@@ -0,0 +1,330 @@
+/*============================================================================
+  epub2txt v2
+  compress.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The blocks are a ring, shared by the writer and the workers. The 
+  writer fills the block after the last one it handed over, and the
+  workers take handed-over blocks in turn; the writer writes them out
+  in the same order, as they are finished, and only then reuses them. So
+  no more than a ring's worth of text is ever held in memory, however
+  slow the output is.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "buffer.h"
+#include "log.h"
+
+#define COMPRESS_MAX_WORKERS 8
+
+typedef struct _CompressBlock
+  {
+  Buffer *in;
+  Buffer *out;
+  BOOL done;        // Compressed, and not yet written
+  BOOL ok;
+  } CompressBlock;
+
+struct _Compressor
+  {
+  FILE *f;
+  CompressMethod method;
+  int level;
+  CompressBlock *blocks;
+  int nblocks;
+  uint64_t filled;  // Blocks handed to the workers
+  uint64_t taken;   // Blocks taken by a worker
+  uint64_t written; // Blocks written
+  BOOL closing;
+  BOOL compress_ok;
+  BOOL write_ok;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;  // A block has been handed over, or we're closing
+  pthread_cond_t done;  // A block has been compressed
+  pthread_t threads [COMPRESS_MAX_WORKERS];
+  int nthreads;
+  };
+
+
+/*============================================================================
+  compress_parse
+============================================================================*/
+BOOL compress_parse (const char *spec, CompressMethod *method, int *level,
+       char **error)
+  {
+  const char *colon = strchr (spec, ':');
+  size_t len = colon ? (size_t)(colon - spec) : strlen (spec);
+  int max_level;
+  *level = colon ? atoi (colon + 1) : 0;
+  if (len == 4 && strncmp (spec, "gzip", 4) == 0)
+    {
+    *method = COMPRESS_GZIP;
+    max_level = 9;
+#ifndef HAVE_ZLIB
+    asprintf (error, "This program was built without gzip support");
+    return FALSE;
+#endif
+    }
+  else if (len == 4 && strncmp (spec, "zstd", 4) == 0)
+    {
+    *method = COMPRESS_ZSTD;
+    max_level = 22;
+#ifndef HAVE_ZSTD
+    asprintf (error, "This program was built without zstd support");
+    return FALSE;
+#endif
+    }
+  else
+    {
+    asprintf (error, "Unknown compression method '%.*s'", (int)len, spec);
+    return FALSE;
+    }
+  if (*level < 0 || *level > max_level || (colon && *level == 0))
+    {
+    asprintf (error, "Compression level must be from 1 to %d", max_level);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  compress_block
+  Compress one block, as a complete gzip member or zstd frame
+============================================================================*/
+static BOOL compress_block (const Compressor *self, CompressBlock *block)
+  {
+  buffer_clear (block->out);
+  switch (self->method)
+    {
+#ifdef HAVE_ZLIB
+    case COMPRESS_GZIP:
+      {
+      const Buffer *in = block->in;
+      Buffer *out = block->out;
+      z_stream z;
+      memset (&z, 0, sizeof (z));
+      // 16 + 15: a gzip header and trailer, and the largest window
+      if (deflateInit2 (&z, self->level ? self->level 
+            : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, 
+            Z_DEFAULT_STRATEGY) != Z_OK)
+        return FALSE;
+      uLong bound = deflateBound (&z, in->len);
+      buffer_reserve (out, bound);
+      z.next_in = (Bytef *)in->data;
+      z.avail_in = in->len;
+      z.next_out = (Bytef *)out->data;
+      z.avail_out = bound;
+      BOOL ok = deflate (&z, Z_FINISH) == Z_STREAM_END;
+      out->len = z.total_out;
+      deflateEnd (&z);
+      return ok;
+      }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+      {
+      const Buffer *in = block->in;
+      Buffer *out = block->out;
+      size_t bound = ZSTD_compressBound (in->len);
+      buffer_reserve (out, bound);
+      // Level 0 is zstd's default
+      size_t n = ZSTD_compress (out->data, bound, in->data, in->len, 
+        self->level);
+      if (ZSTD_isError (n)) return FALSE;
+      out->len = n;
+      return TRUE;
+      }
+#endif
+    default:
+      return FALSE;
+    }
+  }
+
+
+/*============================================================================
+  compressor_worker
+============================================================================*/
+static void *compressor_worker (void *arg)
+  {
+  Compressor *self = arg;
+  pthread_mutex_lock (&self->mutex);
+  for (;;)
+    {
+    while (self->taken == self->filled && !self->closing)
+      pthread_cond_wait (&self->work, &self->mutex);
+    if (self->taken == self->filled) break;
+    CompressBlock *block = &self->blocks[self->taken++ % self->nblocks];
+    pthread_mutex_unlock (&self->mutex);
+    block->ok = compress_block (self, block);
+    pthread_mutex_lock (&self->mutex);
+    block->done = TRUE;
+    pthread_cond_broadcast (&self->done);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+
+/*============================================================================
+  compressor_create
+============================================================================*/
+Compressor *compressor_create (FILE *f, CompressMethod method, int level)
+  {
+  Compressor *self = malloc (sizeof (Compressor));
+  memset (self, 0, sizeof (Compressor));
+  self->f = f;
+  self->method = method;
+  self->level = level;
+  self->compress_ok = TRUE;
+  self->write_ok = TRUE;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->work, NULL);
+  pthread_cond_init (&self->done, NULL);
+
+  // Two blocks per worker: one being compressed, and one being filled
+  //  or waiting
+  long nworkers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1) nworkers = 1;
+  if (nworkers > COMPRESS_MAX_WORKERS) nworkers = COMPRESS_MAX_WORKERS;
+  self->nblocks = 2 * nworkers;
+  self->blocks = malloc (self->nblocks * sizeof (CompressBlock));
+  int i;
+  for (i = 0; i < self->nblocks; i++)
+    {
+    self->blocks[i].in = buffer_create ();
+    self->blocks[i].out = buffer_create ();
+    self->blocks[i].done = FALSE;
+    }
+  while (self->nthreads < nworkers && pthread_create 
+          (&self->threads[self->nthreads], NULL, compressor_worker, self) == 0)
+    self->nthreads++;
+  log_debug ("Compressing with %d workers", self->nthreads);
+  return self;
+  }
+
+
+/*============================================================================
+  compressor_drain
+  Write finished blocks, in order, waiting for them if necessary until 
+  `upto` have been written
+============================================================================*/
+static void compressor_drain (Compressor *self, uint64_t upto)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (self->written < self->filled)
+    {
+    CompressBlock *block = &self->blocks[self->written % self->nblocks];
+    if (!block->done)
+      {
+      if (self->written >= upto) break;
+      pthread_cond_wait (&self->done, &self->mutex);
+      continue;
+      }
+    pthread_mutex_unlock (&self->mutex);
+    if (!block->ok)
+      self->compress_ok = FALSE;
+    else if (block->out->len 
+         && fwrite (block->out->data, block->out->len, 1, self->f) != 1)
+      self->write_ok = FALSE;
+    buffer_clear (block->in);
+    pthread_mutex_lock (&self->mutex);
+    block->done = FALSE;
+    self->written++;
+    }
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*============================================================================
+  compressor_submit
+  Hand over the block being filled, and make sure that the next one is
+  free
+============================================================================*/
+static void compressor_submit (Compressor *self)
+  {
+  if (self->nthreads == 0)
+    {
+    CompressBlock *block = &self->blocks[self->filled % self->nblocks];
+    block->ok = compress_block (self, block);
+    block->done = TRUE;
+    }
+  pthread_mutex_lock (&self->mutex);
+  self->filled++;
+  pthread_cond_signal (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  uint64_t upto = self->filled >= (uint64_t)self->nblocks 
+    ? self->filled - self->nblocks + 1 : 0;
+  compressor_drain (self, upto);
+  }
+
+
+/*============================================================================
+  compressor_write
+============================================================================*/
+void compressor_write (Compressor *self, const char *s, size_t len)
+  {
+  while (len)
+    {
+    Buffer *in = self->blocks[self->filled % self->nblocks].in;
+    size_t n = COMPRESS_BLOCK_SIZE - in->len;
+    if (n > len) n = len;
+    buffer_append (in, s, n);
+    s += n;
+    len -= n;
+    if (in->len == COMPRESS_BLOCK_SIZE) compressor_submit (self);
+    }
+  }
+
+
+/*============================================================================
+  compressor_close
+============================================================================*/
+BOOL compressor_close (Compressor *self, char **error)
+  {
+  // An empty output is still one (empty) member or frame, so that it 
+  //  can be decompressed
+  if (self->blocks[self->filled % self->nblocks].in->len || self->filled == 0)
+    compressor_submit (self);
+  pthread_mutex_lock (&self->mutex);
+  self->closing = TRUE;
+  pthread_cond_broadcast (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  compressor_drain (self, self->filled);
+  int i;
+  for (i = 0; i < self->nthreads; i++)
+    pthread_join (self->threads[i], NULL);
+  if (fflush (self->f) != 0) self->write_ok = FALSE;
+
+  BOOL ok = self->compress_ok && self->write_ok;
+  if (!self->compress_ok)
+    asprintf (error, "Compression failed");
+  else if (!self->write_ok)
+    asprintf (error, "Can't write compressed output: %s", strerror (errno));
+
+  for (i = 0; i < self->nblocks; i++)
+    {
+    buffer_destroy (self->blocks[i].in);
+    buffer_destroy (self->blocks[i].out);
+    }
+  free (self->blocks);
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->work);
+  pthread_cond_destroy (&self->done);
+  free (self);
+  return ok;
+  }
@@ -0,0 +1,42 @@
+/*============================================================================
+  epub2txt v2
+  compress.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Compressed output. The text is cut into blocks, which are compressed
+  by worker threads, each on its own, and written in order: each block
+  is a complete gzip member or zstd frame, and a series of these is a
+  valid gzip or zstd stream, which the usual tools decompress as one.
+  zlib and libzstd are optional, and are only used if the program is 
+  built with them (make WITH_ZLIB=1 WITH_ZSTD=1).
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "defs.h"
+
+// Text is compressed in blocks of this size; smaller blocks compress
+//  less well, and larger ones leave workers idle on short outputs
+#define COMPRESS_BLOCK_SIZE (1024 * 1024)
+
+typedef enum { COMPRESS_NONE = 0, COMPRESS_GZIP, COMPRESS_ZSTD } 
+  CompressMethod;
+
+typedef struct _Compressor Compressor;
+
+/** Parse a method, with an optional level: "gzip", "zstd:19". A level of
+    zero means the library's default. Fails if the method is unknown, or
+    was not built in. */
+BOOL        compress_parse (const char *spec, CompressMethod *method,
+              int *level, char **error);
+
+/** Start compressing to f. */
+Compressor *compressor_create (FILE *f, CompressMethod method, int level);
+
+void        compressor_write (Compressor *self, const char *s, size_t len);
+
+/** Compress and write what is left, wait for the workers to finish, and
+    destroy the compressor. */
+BOOL        compressor_close (Compressor *self, char **error);
@@ -0,0 +1,461 @@
+/*============================================================================
+  epub2txt v2
+  document.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Building the intermediate representation of a document. See
+  document.h for the layout. Documents are built by the wrapper, when
+  it has a document to record into (see wraptext_context_set_document),
+  and laid out again by wraptext_wrap_document.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "document.h"
+#include "store.h"
+#include "convertutf.h"
+
+
+/*============================================================================
+  document_create
+============================================================================*/
+Document *document_create (void)
+  {
+  Document *self = malloc (sizeof (Document));
+  memset (self, 0, sizeof (Document));
+  // The sentinel entries at the ends of the arrays, and the empty string
+  STORE_GROW (self->paras, self->paras_size, 1);
+  memset (&self->paras[0], 0, sizeof (DocumentPara));
+  STORE_GROW (self->sections, self->sections_size, 1);
+  memset (&self->sections[0], 0, sizeof (DocumentSection));
+  STORE_GROW (self->strings, self->strings_size, 1);
+  self->strings[0] = 0;
+  self->strings_len = 1;
+  return self;
+  }
+
+
+/*============================================================================
+  document_destroy
+============================================================================*/
+void document_destroy (Document *self)
+  {
+  if (!self) return;
+  if (self->map)
+    {
+    munmap (self->map, self->map_len);
+    free (self);
+    return;
+    }
+  if (self->text) free (self->text);
+  if (self->tokens) free (self->tokens);
+  if (self->runs) free (self->runs);
+  if (self->paras) free (self->paras);
+  if (self->sections) free (self->sections);
+  if (self->strings) free (self->strings);
+  if (self->toc) free (self->toc);
+  if (self->raw) free (self->raw);
+  free (self);
+  }
+
+
+/*============================================================================
+  document_add_string
+============================================================================*/
+uint32_t document_add_string (Document *self, const char *s)
+  {
+  if (!s || !*s) return 0;
+  uint32_t ret = self->strings_len;
+  int len = strlen (s) + 1;
+  STORE_GROW (self->strings, self->strings_size, self->strings_len + len);
+  memcpy (self->strings + self->strings_len, s, len);
+  self->strings_len += len;
+  return ret;
+  }
+
+
+/*============================================================================
+  document_string
+============================================================================*/
+const char *document_string (const Document *self, uint32_t offset)
+  {
+  if (offset >= self->strings_len) return "";
+  return self->strings + offset;
+  }
+
+
+/*============================================================================
+  document_toc_title
+============================================================================*/
+const char *document_toc_title (const Document *self, const char *href)
+  {
+  size_t len = strlen (href);
+  uint32_t i;
+  for (i = 0; i < self->ntoc; i++)
+    {
+    const char *toc_href = document_string (self, self->toc[i].href);
+    if (strncmp (toc_href, href, len) == 0
+         && (toc_href[len] == 0 || toc_href[len] == '#'))
+      return document_string (self, self->toc[i].title);
+    }
+  return NULL;
+  }
+
+
+/*============================================================================
+  document_add_run
+  Start a new style run, if the format has changed since the last one.
+============================================================================*/
+static void document_add_run (Document *self, unsigned int fmt)
+  {
+  DocumentPara *para = &self->paras[self->nparas];
+  uint32_t token = self->ntokens - para->token;
+  if (self->nruns > para->run && self->runs[self->nruns - 1].fmt == fmt)
+    return;
+  if (self->nruns > para->run && self->runs[self->nruns - 1].token == token)
+    {
+    // Nothing was written in the previous format
+    self->runs[self->nruns - 1].fmt = fmt;
+    if (self->nruns - 1 > para->run
+         && self->runs[self->nruns - 2].fmt == fmt)
+      self->nruns--;
+    return;
+    }
+  STORE_GROW (self->runs, self->runs_size, self->nruns + 1);
+  self->runs[self->nruns].token = token;
+  self->runs[self->nruns].fmt = fmt;
+  self->nruns++;
+  }
+
+
+/*============================================================================
+  document_begin_section
+============================================================================*/
+void document_begin_section (Document *self, DocumentSectionKind kind,
+       const char *href)
+  {
+  if (self->in_para)
+    document_end_para (self, DOC_BREAK_PARA,
+      self->runs[self->nruns - 1].fmt);
+  STORE_GROW (self->sections, self->sections_size, self->nsections + 2);
+  DocumentSection *section = &self->sections[self->nsections];
+  section->para = self->nparas;
+  section->kind = kind;
+  section->href = document_add_string (self, href);
+  section->raw = self->raw_len;
+  self->nsections++;
+  memset (&self->sections[self->nsections], 0, sizeof (DocumentSection));
+  self->sections[self->nsections].para = self->nparas;
+  self->sections[self->nsections].raw = self->raw_len;
+  }
+
+
+/*============================================================================
+  document_add_raw
+  Add to the raw text of the current section
+============================================================================*/
+void document_add_raw (Document *self, const char *s, size_t len)
+  {
+  if (self->nsections == 0)
+    document_begin_section (self, DOC_SECTION_SPINE, NULL);
+  if (len == 0) return;
+
+  STORE_GROW (self->raw, self->raw_size, self->raw_len + len);
+  memcpy (self->raw + self->raw_len, s, len);
+  self->raw_len += len;
+  self->sections[self->nsections].raw = self->raw_len;
+  }
+
+
+/*============================================================================
+  document_add_token
+============================================================================*/
+void document_add_token (Document *self, const uint32_t *s, int len,
+       int width, unsigned int fmt, unsigned int flags)
+  {
+  if (self->nsections == 0)
+    document_begin_section (self, DOC_SECTION_SPINE, NULL);
+
+  self->in_para = TRUE;
+  document_add_run (self, fmt);
+
+  // UTF-8 needs at most four bytes for each character
+  STORE_GROW (self->text, self->text_size, self->text_len + 4 * len);
+  const UTF32 *in = (const UTF32 *)s;
+  UTF8 *out = (UTF8 *)self->text + self->text_len;
+  ConvertUTF32toUTF8 (&in, in + len, &out,
+    (UTF8 *)self->text + self->text_size, lenientConversion);
+  uint32_t bytes = (char *)out - (self->text + self->text_len);
+  self->text_len += bytes;
+
+  STORE_GROW (self->tokens, self->tokens_size, self->ntokens + 1);
+  DocumentToken *token = &self->tokens[self->ntokens++];
+  token->len = bytes;
+  token->width = width > 0xFFFF ? 0xFFFF : width;
+  token->flags = flags;
+  }
+
+
+/*============================================================================
+  document_add_space
+============================================================================*/
+void document_add_space (Document *self)
+  {
+  if (self->ntokens > 0)
+    self->tokens[self->ntokens - 1].flags |= DOC_TOKEN_SPACE;
+  }
+
+
+/*============================================================================
+  document_end_para
+============================================================================*/
+void document_end_para (Document *self, DocumentBreak brk, unsigned int fmt)
+  {
+  if (self->nsections == 0)
+    document_begin_section (self, DOC_SECTION_SPINE, NULL);
+
+  document_add_run (self, fmt);
+  self->paras[self->nparas].brk = brk;
+  self->nparas++;
+  self->in_para = FALSE;
+
+  STORE_GROW (self->paras, self->paras_size, self->nparas + 1);
+  DocumentPara *next = &self->paras[self->nparas];
+  next->text = self->text_len;
+  next->token = self->ntokens;
+  next->run = self->nruns;
+  next->brk = DOC_BREAK_PARA;
+  self->sections[self->nsections].para = self->nparas;
+  }
+
+
+/*============================================================================
+  document_add_toc
+============================================================================*/
+void document_add_toc (Document *self, const char *title, const char *href,
+       int depth)
+  {
+  STORE_GROW (self->toc, self->toc_size, self->ntoc + 1);
+  DocumentTocEntry *entry = &self->toc[self->ntoc++];
+  entry->title = document_add_string (self, title);
+  entry->href = document_add_string (self, href);
+  entry->depth = depth;
+  }
+
+
+/*============================================================================
+  document_write_file
+============================================================================*/
+BOOL document_write_file (const Document *self, const char *filename,
+       char **error)
+  {
+  const void *data [DOC_NUM_CHUNKS] = { self->text, self->tokens,
+    self->runs, self->paras, self->sections, self->strings, self->toc,
+    self->raw };
+  const size_t size [DOC_NUM_CHUNKS] = { 1, sizeof (DocumentToken),
+    sizeof (DocumentRun), sizeof (DocumentPara), sizeof (DocumentSection),
+    1, sizeof (DocumentTocEntry), 1 };
+  const uint64_t count [DOC_NUM_CHUNKS] = { self->text_len, self->ntokens,
+    self->nruns, self->nparas + 1, self->nsections + 1, self->strings_len,
+    self->ntoc, self->raw_len };
+  static const char zeros[8];
+
+  DocumentFileHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, DOC_FILE_MAGIC, 4);
+  header.version = DOC_FILE_VERSION;
+  header.byte_order = DOC_FILE_BYTE_ORDER;
+  header.nchunks = DOC_NUM_CHUNKS;
+  uint64_t offset = sizeof (header);
+  int i;
+  for (i = 0; i < DOC_NUM_CHUNKS; i++)
+    {
+    offset = (offset + 7) & ~(uint64_t)7;
+    header.chunks[i].offset = offset;
+    header.chunks[i].count = count[i];
+    offset += count[i] * size[i];
+    }
+
+  FILE *f = fopen (filename, "wb");
+  if (!f)
+    {
+    asprintf (error, "Can't open file '%s' for writing: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  BOOL ok = fwrite (&header, sizeof (header), 1, f) == 1;
+  offset = sizeof (header);
+  for (i = 0; i < DOC_NUM_CHUNKS && ok; i++)
+    {
+    size_t pad = header.chunks[i].offset - offset;
+    if (pad) ok = fwrite (zeros, 1, pad, f) == pad;
+    if (count[i] && ok)
+      ok = fwrite (data[i], size[i], count[i], f) == count[i];
+    offset = header.chunks[i].offset + count[i] * size[i];
+    }
+  if (fclose (f) != 0) ok = FALSE;
+  if (!ok)
+    {
+    asprintf (error, "Can't write file '%s': %s", filename, strerror (errno));
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  document_check
+  Check that the arrays of a document read from a file are consistent,
+  so that laying it out will not stray outside them.
+============================================================================*/
+static BOOL document_check (const Document *self)
+  {
+  uint32_t i;
+  if (self->strings_len == 0 || self->strings[self->strings_len - 1] != 0)
+    return FALSE;
+  for (i = 0; i <= self->nparas; i++)
+    {
+    const DocumentPara *p = &self->paras[i];
+    if (p->token > self->ntokens || p->run > self->nruns 
+         || p->text > self->text_len)
+      return FALSE;
+    if (i < self->nparas && (p[1].token < p->token || p[1].text < p->text
+         || p[1].run <= p->run))
+      return FALSE;
+    // The tokens must take up the paragraph's text exactly; the last
+    //  entry has any tokens after the last paragraph
+    uint32_t t, end = i < self->nparas ? p[1].token : self->ntokens;
+    uint64_t len = 0;
+    for (t = p->token; t < end; t++) len += self->tokens[t].len;
+    if (len != (i < self->nparas ? p[1].text : self->text_len) - p->text)
+      return FALSE;
+    }
+  for (i = 0; i <= self->nsections; i++)
+    {
+    const DocumentSection *s = &self->sections[i];
+    if (s->para > self->nparas || s->href >= self->strings_len
+         || s->raw > self->raw_len)
+      return FALSE;
+    if (i < self->nsections && (s[1].para < s->para || s[1].raw < s->raw))
+      return FALSE;
+    }
+  for (i = 0; i < self->ntoc; i++)
+    if (self->toc[i].title >= self->strings_len
+         || self->toc[i].href >= self->strings_len)
+      return FALSE;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  document_create_from_file
+============================================================================*/
+BOOL document_create_from_file (const char *filename, Document **result,
+       char **error)
+  {
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+    asprintf (error, "Can't open file '%s' for reading: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  struct stat sb;
+  if (fstat (fd, &sb) != 0)
+    {
+    asprintf (error, "Can't read file '%s': %s", filename, strerror (errno));
+    close (fd);
+    return FALSE;
+    }
+  size_t len = sb.st_size;
+  if (len < sizeof (DocumentFileHeader))
+    {
+    asprintf (error, "'%s' is not an epub2txt document file", filename);
+    close (fd);
+    return FALSE;
+    }
+  void *map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+    asprintf (error, "Can't map file '%s': %s", filename, strerror (errno));
+    return FALSE;
+    }
+
+  const DocumentFileHeader *header = map;
+  if (memcmp (header->magic, DOC_FILE_MAGIC, 4) != 0)
+    {
+    asprintf (error, "'%s' is not an epub2txt document file", filename);
+    munmap (map, len);
+    return FALSE;
+    }
+  if (header->byte_order != DOC_FILE_BYTE_ORDER 
+       || header->version != DOC_FILE_VERSION
+       || header->nchunks != DOC_NUM_CHUNKS)
+    {
+    asprintf (error, "'%s' was written by an incompatible version, "
+      "or on an incompatible machine", filename);
+    munmap (map, len);
+    return FALSE;
+    }
+
+  const size_t size [DOC_NUM_CHUNKS] = { 1, sizeof (DocumentToken),
+    sizeof (DocumentRun), sizeof (DocumentPara), sizeof (DocumentSection),
+    1, sizeof (DocumentTocEntry), 1 };
+  void *data [DOC_NUM_CHUNKS];
+  uint32_t count [DOC_NUM_CHUNKS];
+  int i;
+  for (i = 0; i < DOC_NUM_CHUNKS; i++)
+    {
+    const DocumentFileChunk *chunk = &header->chunks[i];
+    if (chunk->offset % 8 || chunk->offset > len 
+         || chunk->count > UINT32_MAX
+         || chunk->count > (len - chunk->offset) / size[i])
+      {
+      asprintf (error, "'%s' is damaged", filename);
+      munmap (map, len);
+      return FALSE;
+      }
+    data[i] = (char *)map + chunk->offset;
+    count[i] = chunk->count;
+    }
+
+  Document *self = malloc (sizeof (Document));
+  memset (self, 0, sizeof (Document));
+  self->map = map;
+  self->map_len = len;
+  self->text = data[DOC_CHUNK_TEXT];
+  self->text_len = count[DOC_CHUNK_TEXT];
+  self->tokens = data[DOC_CHUNK_TOKENS];
+  self->ntokens = count[DOC_CHUNK_TOKENS];
+  self->runs = data[DOC_CHUNK_RUNS];
+  self->nruns = count[DOC_CHUNK_RUNS];
+  self->paras = data[DOC_CHUNK_PARAS];
+  self->nparas = count[DOC_CHUNK_PARAS] - 1;
+  self->sections = data[DOC_CHUNK_SECTIONS];
+  self->nsections = count[DOC_CHUNK_SECTIONS] - 1;
+  self->strings = data[DOC_CHUNK_STRINGS];
+  self->strings_len = count[DOC_CHUNK_STRINGS];
+  self->toc = data[DOC_CHUNK_TOC];
+  self->ntoc = count[DOC_CHUNK_TOC];
+  self->raw = data[DOC_CHUNK_RAW];
+  self->raw_len = count[DOC_CHUNK_RAW];
+  self->keep_raw = self->raw_len > 0;
+  if (count[DOC_CHUNK_PARAS] == 0 || count[DOC_CHUNK_SECTIONS] == 0
+       || !document_check (self))
+    {
+    asprintf (error, "'%s' is damaged", filename);
+    document_destroy (self);
+    return FALSE;
+    }
+
+  *result = self;
+  return TRUE;
+  }
@@ -0,0 +1,191 @@
+/*============================================================================
+  epub2txt v2
+  document.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  An intermediate representation of a parsed document, from which the
+  text can be wrapped again, at any width, without unzipping or parsing
+  anything. It records what the XHTML parser fed to the wrapper, after
+  the wrapper has split it into tokens: for each paragraph, the tokens
+  (with their display widths, whether a space follows them, and whether
+  a line can break before them), the style runs, and how the paragraph
+  ends. None of this depends on the width, so the wrapper can lay the
+  paragraphs out again in one pass.
+
+  A document is divided into sections, each of which is what one call
+  to xhtml_to_stdout() would have written: a spine item, or an item of
+  metadata. If keep_raw is set when it is recorded, the document also 
+  keeps the text of each section exactly as --raw writes it, since raw
+  text is not laid out by the wrapper, and cannot be got back from the
+  tokens.
+
+  A document can be saved to a file (by convention, with extension .e2t)
+  and mapped back into memory later; see "Document files" below.
+============================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "defs.h"
+
+// How a paragraph ends
+typedef enum { DOC_BREAK_PARA = 0, // End of paragraph
+               DOC_BREAK_LINE,     // Hard line break, e.g., <br/>
+               DOC_BREAK_GAP       // No tokens: a blank line between paras
+               } DocumentBreak;
+
+typedef enum { DOC_SECTION_SPINE = 0, // A spine item, i.e., an XHTML file
+               DOC_SECTION_META,      // A line of metadata
+               DOC_SECTION_CALIBRE    // A line of Calibre metadata
+               } DocumentSectionKind;
+
+// Token flags
+#define DOC_TOKEN_SPACE 0x0001 // A space follows the token
+#define DOC_TOKEN_JOIN  0x0002 // The token follows the one before it with
+                               //  no break, as after a change of format
+                               //  in the middle of a word
+
+typedef struct _DocumentToken
+  {
+  uint32_t len;      // Length of the text, in bytes of UTF-8
+  uint16_t width;    // Display width, in columns (at most 65535)
+  uint16_t flags;
+  } DocumentToken;
+
+// A style run: the format applies from the token onwards, to the next run
+//  or the end of the paragraph. Every paragraph has at least one run;
+//  a run can start at the end of the paragraph, if the format changed
+//  after its last token
+typedef struct _DocumentRun
+  {
+  uint32_t token;    // Index of the first token, relative to the paragraph
+  uint32_t fmt;      // Wrapper format bits
+  } DocumentRun;
+
+typedef struct _DocumentPara
+  {
+  uint32_t text;     // Offset of the text of the first token
+  uint32_t token;    // Index of the first token
+  uint32_t run;      // Index of the first style run
+  uint32_t brk;      // DocumentBreak
+  } DocumentPara;
+
+typedef struct _DocumentSection
+  {
+  uint32_t para;     // Index of the first paragraph
+  uint32_t kind;     // DocumentSectionKind
+  uint32_t href;     // Offset of the href (for metadata, the key) in
+                     //  the string table
+  uint32_t raw;      // Offset of the raw text
+  } DocumentSection;
+
+// An entry in the table of contents, from the NCX or EPUB 3 navigation
+//  document
+typedef struct _DocumentTocEntry
+  {
+  uint32_t title;    // Offset of the title in the string table
+  uint32_t href;     // Offset of the href, relative to the OPF, in the
+                     //  string table; it may have a #fragment
+  uint32_t depth;    // Nesting level, from 0
+  } DocumentTocEntry;
+
+// The arrays of paragraphs and sections each have an extra entry at the
+//  end, so the extent of entry i is always [i].x .. [i+1].x
+typedef struct _Document
+  {
+  char *text;        // Token text, UTF-8, in order, with no separators
+  uint32_t text_len;
+  DocumentToken *tokens;
+  uint32_t ntokens;
+  DocumentRun *runs;
+  uint32_t nruns;
+  DocumentPara *paras;
+  uint32_t nparas;
+  DocumentSection *sections;
+  uint32_t nsections;
+  char *strings;     // String table: NUL-terminated, offset 0 is ""
+  uint32_t strings_len;
+  DocumentTocEntry *toc;
+  uint32_t ntoc;
+  char *raw;         // Raw text of the sections, if keep_raw was set
+  uint32_t raw_len;
+  // Allocated sizes, while the document is being built
+  uint32_t text_size;
+  uint32_t tokens_size;
+  uint32_t runs_size;
+  uint32_t paras_size;
+  uint32_t sections_size;
+  uint32_t strings_size;
+  uint32_t toc_size;
+  uint32_t raw_size;
+  BOOL keep_raw;     // Record the raw text, as well as the tokens
+  BOOL in_para;      // Tokens have been added since the last break
+  // If the document was read from a file, the mapping; the arrays above
+  //  point into it, and the document cannot be added to
+  void *map;
+  size_t map_len;
+  } Document;
+
+Document   *document_create (void);
+void        document_destroy (Document *self);
+
+void        document_begin_section (Document *self,
+              DocumentSectionKind kind, const char *href);
+void        document_add_token (Document *self, const uint32_t *s,
+              int len, int width, unsigned int fmt, unsigned int flags);
+/** Let a space follow the last token, after all. */
+void        document_add_space (Document *self);
+void        document_end_para (Document *self, DocumentBreak brk,
+              unsigned int fmt);
+void        document_add_raw (Document *self, const char *s, size_t len);
+uint32_t    document_add_string (Document *self, const char *s);
+void        document_add_toc (Document *self, const char *title,
+              const char *href, int depth);
+
+/** The text of the string table at offset. */
+const char *document_string (const Document *self, uint32_t offset);
+
+/** The title of the first TOC entry that points into the spine item 
+    href, or NULL if there is none. */
+const char *document_toc_title (const Document *self, const char *href);
+
+/*============================================================================
+  Document files
+
+  A document file is a header followed by the arrays of the document,
+  each aligned to eight bytes, in the byte order of the machine that
+  wrote it. The header gives the offset and number of elements of each 
+  array, in the order of DocumentChunk. A file can therefore be mapped
+  into memory and used in place: nothing is read until it is needed.
+  Readers reject files with the wrong magic number, version, or byte 
+  order, or with arrays that are out of bounds or inconsistent.
+============================================================================*/
+
+#define DOC_FILE_MAGIC "E2T\x1A"
+#define DOC_FILE_VERSION 2
+#define DOC_FILE_BYTE_ORDER 0x01020304
+
+typedef enum { DOC_CHUNK_TEXT = 0, DOC_CHUNK_TOKENS, DOC_CHUNK_RUNS,
+               DOC_CHUNK_PARAS, DOC_CHUNK_SECTIONS, DOC_CHUNK_STRINGS,
+               DOC_CHUNK_TOC, DOC_CHUNK_RAW, DOC_NUM_CHUNKS } DocumentChunk;
+
+typedef struct _DocumentFileChunk
+  {
+  uint64_t offset;   // From the start of the file
+  uint64_t count;    // Number of elements, including any sentinel
+  } DocumentFileChunk;
+
+typedef struct _DocumentFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t nchunks;
+  DocumentFileChunk chunks [DOC_NUM_CHUNKS];
+  } DocumentFileHeader;
+
+BOOL        document_write_file (const Document *self, const char *filename,
+              char **error);
+BOOL        document_create_from_file (const char *filename,
+              Document **result, char **error);
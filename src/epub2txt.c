@@ -42,7 +42,11 @@ extern char *mkdtemp(char *template);
 #include "custom_string.h"
 #include "sxmlc.h"
 #include "xhtml.h"
+#include "pages.h"
+#include "pager.h"
+#include "chapters.h"
 #include "util.h"
+#include "boilerplate.h"
 
 // APPNAME is defined by the Makefile compiler arguments, e.g., -DAPPNAME=\"epub2txt\"
 
@@ -108,6 +112,12 @@ static void epub2txt_format_meta (const Epub2TxtOptions *options,
     char *s = NULL; // Initialize to NULL
     asprintf (&s, "%s: %s", key, ss);
     char *error = NULL;
+    if (options->document)
+      document_begin_section (options->document, 
+        strncmp (key, "Calibre", 7) == 0 
+          ? DOC_SECTION_CALIBRE : DOC_SECTION_META, key);
+    else if (options->source_map)
+      sourcemap_begin_section (options->source_map, NULL);
     xhtml_utf8_to_stdout (s, options, &error);
     if (error) free (error);
     if (s) free (s); // Check if s was allocated
@@ -350,6 +360,219 @@ List *epub2txt_get_items (const char *opf_canonical_path, char **error)
   return ret;
   }
 
+/*============================================================================
+  epub2txt_tag_is
+  Compare an XML tag with a name, ignoring any namespace prefix
+============================================================================*/
+static BOOL epub2txt_tag_is (const char *tag, const char *name)
+  {
+  const char *p = strrchr (tag, ':');
+  return strcmp (p ? p + 1 : tag, name) == 0;
+  }
+
+/*============================================================================
+  epub2txt_get_attr
+============================================================================*/
+static const char *epub2txt_get_attr (const XMLNode *node, const char *name)
+  {
+  int i;
+  for (i = 0; i < node->n_attributes; i++)
+    if (epub2txt_tag_is (node->attributes[i].name, name))
+      return node->attributes[i].value;
+  return NULL;
+  }
+
+/*============================================================================
+  epub2txt_node_text
+  Append the text of a node, and of all its descendants
+============================================================================*/
+static void epub2txt_node_text (const XMLNode *node, String *s)
+  {
+  int i;
+  if (node->text)
+    {
+    if (string_length (s)) string_append (s, " ");
+    string_append (s, node->text);
+    }
+  for (i = 0; i < node->n_children; i++)
+    epub2txt_node_text (node->children[i], s);
+  }
+
+/*============================================================================
+  epub2txt_add_toc_entry
+============================================================================*/
+static void epub2txt_add_toc_entry (Document *doc, const String *title,
+       const char *dir, const char *src, int depth)
+  {
+  char *t = epub2txt_unescape_html (string_cstr (title));
+  char *href = decode_url (src);
+  char *path;
+  asprintf (&path, "%s%s", dir, href);
+  document_add_toc (doc, t, path, depth);
+  free (path);
+  free (href);
+  free (t);
+  }
+
+/*============================================================================
+  epub2txt_ncx_toc
+  Add the navPoints of an EPUB 2 NCX file, recursively
+============================================================================*/
+static void epub2txt_ncx_toc (const XMLNode *node, Document *doc,
+       const char *dir, int depth)
+  {
+  int i, j;
+  for (i = 0; i < node->n_children; i++)
+    {
+    const XMLNode *child = node->children[i];
+    if (epub2txt_tag_is (child->tag, "navMap"))
+      epub2txt_ncx_toc (child, doc, dir, depth);
+    else if (epub2txt_tag_is (child->tag, "navPoint"))
+      {
+      String *title = string_create_empty();
+      const char *src = NULL;
+      for (j = 0; j < child->n_children; j++)
+        {
+        const XMLNode *c = child->children[j];
+        if (epub2txt_tag_is (c->tag, "navLabel"))
+          epub2txt_node_text (c, title);
+        else if (epub2txt_tag_is (c->tag, "content"))
+          src = epub2txt_get_attr (c, "src");
+        }
+      if (src)
+        epub2txt_add_toc_entry (doc, title, dir, src, depth);
+      string_destroy (title);
+      epub2txt_ncx_toc (child, doc, dir, depth + 1);
+      }
+    }
+  }
+
+/*============================================================================
+  epub2txt_nav_toc
+  Add the entries of an EPUB 3 navigation document: the links in the
+  nested lists of the <nav> element with epub:type="toc". 
+============================================================================*/
+static void epub2txt_nav_toc (const XMLNode *node, Document *doc,
+       const char *dir, int depth, BOOL in_toc)
+  {
+  int i;
+  for (i = 0; i < node->n_children; i++)
+    {
+    const XMLNode *child = node->children[i];
+    if (epub2txt_tag_is (child->tag, "nav"))
+      {
+      const char *type = epub2txt_get_attr (child, "type");
+      if (type && strstr (type, "toc"))
+        epub2txt_nav_toc (child, doc, dir, -1, TRUE);
+      }
+    else if (in_toc && epub2txt_tag_is (child->tag, "ol"))
+      epub2txt_nav_toc (child, doc, dir, depth + 1, TRUE);
+    else if (in_toc && epub2txt_tag_is (child->tag, "a"))
+      {
+      const char *href = epub2txt_get_attr (child, "href");
+      if (href)
+        {
+        String *title = string_create_empty();
+        epub2txt_node_text (child, title);
+        epub2txt_add_toc_entry (doc, title, dir, href, depth);
+        string_destroy (title);
+        }
+      }
+    else
+      epub2txt_nav_toc (child, doc, dir, depth, in_toc);
+    }
+  }
+
+/*============================================================================
+  epub2txt_get_toc
+  Read the table of contents into a document, from the NCX file if there
+  is one, or the EPUB 3 navigation document if not. The hrefs are made
+  relative to the OPF, as the spine hrefs are. A missing or unreadable
+  table of contents is not an error.
+============================================================================*/
+static void epub2txt_get_toc (const char *opf_canonical_path, 
+       const char *content_dir, Document *doc)
+  {
+  IN
+  String *buff = NULL;
+  char *error = NULL;
+  char *toc_href = NULL;
+  BOOL is_ncx = FALSE;
+  if (string_create_from_utf8_file (opf_canonical_path, &buff, &error))
+    {
+    XMLDoc xml;
+    XMLDoc_init (&xml);
+    if (XMLDoc_parse_buffer_DOM (string_cstr (buff), APPNAME, &xml))
+      {
+      XMLNode *root = XMLDoc_root (&xml);
+      int i, j;
+      for (i = 0; root && i < root->n_children; i++)
+        {
+        XMLNode *manifest = root->children[i];
+        if (!epub2txt_tag_is (manifest->tag, "manifest")) continue;
+        for (j = 0; j < manifest->n_children; j++)
+          {
+          XMLNode *item = manifest->children[j];
+          const char *href = epub2txt_get_attr (item, "href");
+          const char *type = epub2txt_get_attr (item, "media-type");
+          const char *props = epub2txt_get_attr (item, "properties");
+          if (!href) continue;
+          if (type && strcmp (type, "application/x-dtbncx+xml") == 0)
+            {
+            if (toc_href) free (toc_href);
+            toc_href = decode_url (href);
+            is_ncx = TRUE;
+            }
+          else if (props && strstr (props, "nav") && !toc_href)
+            toc_href = decode_url (href);
+          }
+        }
+      XMLDoc_free (&xml);
+      }
+    string_destroy (buff);
+    }
+  if (error) free (error);
+
+  if (toc_href)
+    {
+    char *path, *canon;
+    asprintf (&path, "%s/%s", content_dir, toc_href);
+    canon = realpath (path, NULL);
+    if (canon && is_subpath (content_dir, canon))
+      {
+      // Links in the table of contents are relative to it
+      char *dir = strdup (toc_href);
+      char *p = strrchr (dir, '/');
+      if (p) p[1] = 0; else dir[0] = 0;
+      error = NULL;
+      if (string_create_from_utf8_file (canon, &buff, &error))
+        {
+        XMLDoc xml;
+        XMLDoc_init (&xml);
+        if (XMLDoc_parse_buffer_DOM (string_cstr (buff), APPNAME, &xml))
+          {
+          XMLNode *root = XMLDoc_root (&xml);
+          if (root && is_ncx)
+            epub2txt_ncx_toc (root, doc, dir, 0);
+          else if (root)
+            epub2txt_nav_toc (root, doc, dir, 0, FALSE);
+          XMLDoc_free (&xml);
+          }
+        string_destroy (buff);
+        }
+      if (error) free (error);
+      free (dir);
+      }
+    else
+      log_warning ("Can't read table of contents \"%s\"", toc_href);
+    if (canon) free (canon);
+    free (path);
+    free (toc_href);
+    }
+  log_debug ("Table of contents has %d entries", doc->ntoc);
+  OUT
+  }
+
 /*============================================================================
   epub2txt_get_root_file
 ============================================================================*/
@@ -440,6 +663,55 @@ void epub2txt_cleanup (void)
     }
   }
 
+/*============================================================================
+  epub2txt_spine_path
+  The canonical path of a spine item, or NULL, with a warning, if it
+  does not exist, or is outside the content directory
+============================================================================*/
+static char *epub2txt_spine_path (const char *content_dir, 
+       const char *item_rel_path)
+  {
+  char *item_constr_path;
+  asprintf (&item_constr_path, "%s/%s", content_dir, item_rel_path);
+  if (!item_constr_path) return NULL; // Malloc error
+
+  char *item_canon_path = realpath (item_constr_path, NULL);
+  free (item_constr_path);
+
+  if (item_canon_path == NULL || !is_subpath (content_dir, item_canon_path))
+    {
+    if (item_canon_path == NULL)
+      log_warning ("Skipping EPUB spine item \"%s\": invalid path (realpath: %s)",
+        item_rel_path, strerror(errno));
+    else
+      log_warning ("Skipping EPUB spine item \"%s\" (%s): outside content directory (%s)",
+        item_rel_path, item_canon_path, content_dir);
+    if(item_canon_path) free(item_canon_path);
+    return NULL;
+    }
+  return item_canon_path;
+  }
+
+
+/*============================================================================
+  epub2txt_wait_item
+  Wait for a spine item that is being read ahead, and return its text,
+  without any UTF-8 BOM
+============================================================================*/
+static WString *epub2txt_wait_item (BatchIo *io, BatchIoRead *read, 
+       char **error)
+  {
+  size_t len;
+  char *buff = batchio_read_wait (io, read, &len, error);
+  if (!buff) return NULL;
+  const char *s = buff;
+  if (len >= 3 && memcmp (s, "\xEF\xBB\xBF", 3) == 0) s += 3;
+  WString *ws = wstring_create_from_utf8 (s);
+  free (buff);
+  return ws;
+  }
+
+
 /*============================================================================
   epub2txt_do_file
 ============================================================================*/
@@ -449,6 +721,57 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
   IN
   *error = NULL;
 
+  // Boilerplate is only known once the whole book has been read, so the
+  //  book is recorded first, and then laid out from the record; or, for
+  //  a paragraph sink, the calls to it are held back until then
+  if (options->boilerplate > 0 && options->para_sink && !options->document)
+    {
+    Epub2TxtOptions held_options = *options;
+    held_options.boilerplate = 0;
+    held_options.para_sink = boilerplate_sink_create ();
+    epub2txt_do_file (file, &held_options, error);
+    boilerplate_sink_replay (held_options.para_sink, options->para_sink,
+      options->boilerplate);
+    parasink_close (held_options.para_sink);
+    OUT
+    return;
+    }
+  if (options->boilerplate > 0 && !options->document)
+    {
+    Document *doc = epub2txt_load_document (file, FALSE, options, error);
+    if (doc)
+      {
+      xhtml_document_to_stdout (doc, options);
+      document_destroy (doc);
+      }
+    OUT
+    return;
+    }
+
+  // A recorded document holds everything that could be shown
+  Epub2TxtOptions record_options;
+  if (options->document)
+    {
+    record_options = *options;
+    record_options.meta = TRUE;
+    record_options.calibre = TRUE;
+    record_options.notext = FALSE;
+    options = &record_options;
+    }
+
+  // Per-chapter files: the metadata is collected first, and the spine 
+  //  items are converted together, once all their paths are known
+  Epub2TxtOptions dir_options;
+  Buffer *meta = NULL;
+  Document *toc = NULL;
+  if (options->output_dir)
+    {
+    dir_options = *options;
+    if (options->meta) dir_options.output = meta = buffer_create ();
+    options = &dir_options;
+    toc = document_create ();
+    }
+
   log_debug ("epub2txt_do_file: %s", file);
   if (access (file, R_OK) == 0)
     {
@@ -561,6 +884,11 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
       }
       log_debug ("Content directory is: %s", content_dir);
 
+      if (options->document)
+        epub2txt_get_toc (opf_canonical, content_dir, options->document);
+      if (toc)
+        epub2txt_get_toc (opf_canonical, content_dir, toc);
+
       if (options->meta)
         {
         epub2txt_dump_metadata (opf_canonical, options, error);
@@ -579,32 +907,71 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
           {
           log_debug ("EPUB spine has %d items", list_length (spine_items));
           int i, l = list_length (spine_items);
+          const char **hrefs = NULL;
+          char **paths = NULL;
+          if (options->output_dir)
+            {
+            hrefs = malloc ((l + 1) * sizeof (char *));
+            paths = malloc ((l + 1) * sizeof (char *));
+            }
+          // Reads of the spine items, started up to BATCHIO_DEPTH ahead
+          BatchIoRead **reads = NULL;
+          int ahead = 0;
+          if (options->io && !paths)
+            reads = malloc ((l + 1) * sizeof (BatchIoRead *));
           for (i = 0; i < l; i++)
             {
+            // A paragraph sink may have seen all it needs of this book
+            if (options->para_sink && options->para_sink->done) break;
             const char *item_rel_path = (const char *)list_get (spine_items, i);
-            char *item_constr_path;
-            asprintf (&item_constr_path, "%s/%s", content_dir, item_rel_path);
-            if (!item_constr_path) { /* Malloc error */ continue; } // Skip item
-
-            char *item_canon_path = realpath (item_constr_path, NULL);
-            free (item_constr_path);
+            if (hrefs) hrefs[i] = item_rel_path;
 
-            if (item_canon_path == NULL || !is_subpath (content_dir, item_canon_path))
+            char *item_canon_path = NULL;
+            if (reads)
+              {
+              for (; ahead < l && ahead < i + BATCHIO_DEPTH; ahead++)
+                {
+                char *path = epub2txt_spine_path (content_dir, 
+                  (const char *)list_get (spine_items, ahead));
+                reads[ahead] = path ? batchio_read (options->io, path) : NULL;
+                free (path);
+                }
+              if (!reads[i]) continue;
+              }
+            else
               {
-              if (item_canon_path == NULL)
-                log_warning ("Skipping EPUB spine item \"%s\": invalid path (realpath: %s)",
-                  item_rel_path, strerror(errno));
-              else
-                log_warning ("Skipping EPUB spine item \"%s\" (%s): outside content directory (%s)",
-                  item_rel_path, item_canon_path, content_dir);
-              if(item_canon_path) free(item_canon_path);
-              continue;
+              item_canon_path = epub2txt_spine_path (content_dir, 
+                item_rel_path);
+              if (paths) paths[i] = item_canon_path;
+              if (!item_canon_path || paths) continue;
               }
 
-            if (options->section_separator)
-              printf ("%s\n", options->section_separator);
+            if (options->document)
+              document_begin_section (options->document, DOC_SECTION_SPINE,
+                item_rel_path);
+            else if (options->para_sink)
+              parasink_begin_section (options->para_sink, i, item_rel_path);
+            else 
+              {
+              if (options->source_map)
+                sourcemap_begin_section (options->source_map, item_rel_path);
+              if (options->line_index)
+                lineindex_begin_section (options->line_index, i);
+              xhtml_write_separator (options);
+              }
 
-            xhtml_file_to_stdout (item_canon_path, options, error);
+            if (reads)
+              {
+              WString *s = epub2txt_wait_item (options->io, reads[i], error);
+              reads[i] = NULL;
+              if (s)
+                {
+                xhtml_to_stdout (s, options, error);
+                wstring_destroy (s);
+                }
+              }
+            else
+              xhtml_file_to_stdout (item_canon_path, options, error);
             free(item_canon_path);
             if (*error) {
                 log_warning("Error processing spine item %s: %s (continuing)", item_rel_path, *error);
@@ -612,6 +979,28 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
                 *error = NULL;
             }
             }
+          if (reads)
+            {
+            // Reads still going, if the loop was left early
+            for (; i < ahead; i++)
+              {
+              char *e = NULL;
+              size_t len;
+              if (reads[i]) 
+                free (batchio_read_wait (options->io, reads[i], &len, &e));
+              free (e);
+              }
+            free (reads);
+            }
+          if (paths)
+            {
+            chapters_write (file, hrefs, paths, l, toc, meta, options, 
+              error);
+            for (i = 0; i < l; i++)
+              if (paths[i]) free (paths[i]);
+            free (paths);
+            free (hrefs);
+            }
           list_destroy (spine_items);
           }
          else if (*error) {
@@ -621,6 +1010,9 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
              log_warning("Spine items list is NULL but no specific error reported by epub2txt_get_items.");
         }
         }
+      // With no text, there is only the metadata to write
+      if (options->output_dir && options->notext && *error == NULL)
+        chapters_write (file, NULL, NULL, 0, toc, meta, options, error);
       free (content_dir);
       free (opf_canonical);
       }
@@ -639,5 +1031,166 @@ void epub2txt_do_file (const char *file, const Epub2TxtOptions *options,
     asprintf (error, "File not found or not readable: %s", file);
     }
 
+  if (meta) buffer_destroy (meta);
+  if (toc) document_destroy (toc);
   OUT
-  }
\ No newline at end of file
+  }
+
+/*============================================================================
+  epub2txt_emit_ir
+  Read an EPUB file, and save it as a document file, which can be 
+  rendered later by epub2txt_do_ir_file 
+============================================================================*/
+void epub2txt_emit_ir (const char *file, const char *ir_file,
+     const Epub2TxtOptions *options, char **error)
+  {
+  IN
+  Epub2TxtOptions record_options = *options;
+  record_options.document = document_create ();
+  record_options.document->keep_raw = TRUE;
+  epub2txt_do_file (file, &record_options, error);
+  if (*error == NULL)
+    document_write_file (record_options.document, ir_file, error);
+  document_destroy (record_options.document);
+  OUT
+  }
+
+/*============================================================================
+  epub2txt_do_ir_file
+  Render a document file written by epub2txt_emit_ir
+============================================================================*/
+void epub2txt_do_ir_file (const char *file, const Epub2TxtOptions *options,
+     char **error)
+  {
+  IN
+  *error = NULL;
+  Document *doc = NULL;
+  if (document_create_from_file (file, &doc, error))
+    {
+    xhtml_document_to_stdout (doc, options);
+    document_destroy (doc);
+    }
+  OUT
+  }
+
+
+/*============================================================================
+  epub2txt_load_document
+  Get a document, either by reading an EPUB file or by mapping a 
+  document file, if from_ir is set. Returns NULL and sets error if 
+  it can't. 
+============================================================================*/
+Document *epub2txt_load_document (const char *file, BOOL from_ir,
+     const Epub2TxtOptions *options, char **error)
+  {
+  IN
+  *error = NULL;
+  Document *doc = NULL;
+  if (from_ir)
+    {
+    document_create_from_file (file, &doc, error);
+    }
+  else
+    {
+    Epub2TxtOptions record_options = *options;
+    record_options.document = document_create ();
+    epub2txt_do_file (file, &record_options, error);
+    doc = record_options.document;
+    if (*error)
+      {
+      document_destroy (doc);
+      doc = NULL;
+      }
+    }
+  OUT
+  return doc;
+  }
+
+/*============================================================================
+  epub2txt_get_pages
+  Get the page index for a document, at the height in the options. If 
+  index_file is given, and holds an index for this document and layout, 
+  use it; otherwise lay the document out, and save the index to 
+  index_file for next time. Failing to save it is not an error. 
+============================================================================*/
+PageIndex *epub2txt_get_pages (const Document *doc, const char *index_file,
+     const Epub2TxtOptions *options)
+  {
+  IN
+  PageIndex *index = NULL;
+  char *error = NULL;
+  if (index_file && access (index_file, R_OK) == 0)
+    {
+    if (pages_create_from_file (index_file, &index, &error))
+      {
+      if (!pages_matches (index, doc, options, options->height))
+        {
+        log_info ("Page index %s is for a different layout", index_file);
+        pages_destroy (index);
+        index = NULL;
+        }
+      }
+    else
+      {
+      log_warning ("%s", error);
+      free (error);
+      error = NULL;
+      }
+    }
+
+  if (!index)
+    {
+    index = pages_create (doc, options, options->height);
+    if (index_file && !pages_write_file (index, index_file, &error))
+      {
+      log_warning ("%s", error);
+      free (error);
+      }
+    }
+  OUT
+  return index;
+  }
+
+/*============================================================================
+  epub2txt_do_pages
+  Print one page of a document (counting from 1) or, if page is zero,
+  the number of pages
+============================================================================*/
+void epub2txt_do_pages (const char *file, BOOL from_ir, 
+     const char *index_file, int page, const Epub2TxtOptions *options, 
+     char **error)
+  {
+  IN
+  Document *doc = epub2txt_load_document (file, from_ir, options, error);
+  if (doc)
+    {
+    PageIndex *index = epub2txt_get_pages (doc, index_file, options);
+    if (page == 0)
+      printf ("%d\n", (int)index->npages);
+    else if (page > (int)index->npages)
+      asprintf (error, "%s has only %d pages", file, (int)index->npages);
+    else
+      pages_render (index, doc, options, page - 1, 0, options->height,
+        wraptext_stdout_output_fn, NULL);
+    pages_destroy (index);
+    document_destroy (doc);
+    }
+  OUT
+  }
+
+/*============================================================================
+  epub2txt_do_pager
+  Show a document in the built-in pager
+============================================================================*/
+void epub2txt_do_pager (const char *file, BOOL from_ir, 
+     const Epub2TxtOptions *options, char **error)
+  {
+  IN
+  Document *doc = epub2txt_load_document (file, from_ir, options, error);
+  if (doc)
+    {
+    pager_run (doc, options, error);
+    document_destroy (doc);
+    }
+  OUT
+  }
@@ -7,21 +7,63 @@
 #pragma once
 
 #include "defs.h"
+#include "hyphen.h"
+#include "document.h"
+#include "sourcemap.h"
+#include "lineindex.h"
+#include "buffer.h"
+#include "compress.h"
+#include "parasink.h"
+#include "batchio.h"
+
+struct _PageIndex;
 
 typedef struct _Epub2TxtOptions
   {
   int width; // Screen width
+  int height; // Screen height, or page length
   BOOL ascii; // Reduce output to ASCII
   BOOL ansi; // Emit ANSI terminal codes
   BOOL raw; // Completely unformatted output 
   BOOL meta; // Show metadata
   BOOL notext; // Don't dump text 
   BOOL calibre; // Show Calibre metadata 
+  BOOL optimal; // Optimal-fit, rather than greedy, line wrapping
+  BOOL justify; // Justify wrapped lines (implies optimal)
   char *section_separator; // Section separator; may be NULL
+  Hyphenator *hyphenator; // Hyphenation patterns; may be NULL
+  Document *document; // If set, record the text here, rather than output it
+  SourceMap *source_map; // If set, note where the text came from
+  LineIndex *line_index; // If set, note where lines and sections start
+  char *output_dir; // If set, write each spine item to its own file here
+  Buffer *output; // If set, write the text here, rather than to stdout
+  ParaSink *para_sink; // If set, send the text here, rather than wrap it
+  Compressor *compressor; // If set, compress what would go to stdout
+  int boilerplate; // If > 0, drop paragraphs in more spine items than this
+  BatchIo *io; // If set, read spine items ahead, and write stdout, with this
   } Epub2TxtOptions;
 
 void epub2txt_do_file (const char *file, const Epub2TxtOptions *options, 
      char **error);
 
+void epub2txt_emit_ir (const char *file, const char *ir_file, 
+     const Epub2TxtOptions *options, char **error);
+
+void epub2txt_do_ir_file (const char *file, const Epub2TxtOptions *options, 
+     char **error);
+
+Document *epub2txt_load_document (const char *file, BOOL from_ir,
+     const Epub2TxtOptions *options, char **error);
+
+struct _PageIndex *epub2txt_get_pages (const Document *doc, 
+     const char *index_file, const Epub2TxtOptions *options);
+
+void epub2txt_do_pages (const char *file, BOOL from_ir, 
+     const char *index_file, int page, const Epub2TxtOptions *options, 
+     char **error);
+
+void epub2txt_do_pager (const char *file, BOOL from_ir, 
+     const Epub2TxtOptions *options, char **error);
+
 void epub2txt_cleanup (void);
 
@@ -0,0 +1,462 @@
+/*============================================================================
+  epub2txt v2
+  fingerprint.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Each word is hashed once, and each shingle is hashed from the hashes
+  of its words, which are kept in a ring. The MinHash functions are
+  a * x + b, for odd multipliers a, taking the top 32 bits; the same
+  shingle hash updates both the spine item's signature and the book's.
+
+  For the buckets, the band keys of all the signatures are sorted, one
+  band at a time, so that only one band's keys are in memory at once;
+  the candidate pairs from all the bands are then sorted, to drop
+  repeats, and checked against the whole signatures.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "fingerprint.h"
+#include "store.h"
+#include "fold.h"
+
+#define FINGERPRINT_FOLD (FOLD_CASE | FOLD_DIACRITICS)
+
+#define FINGERPRINT_ROWS (FINGERPRINT_MINHASHES / FINGERPRINT_BANDS)
+
+typedef struct _FingerprintSig
+  {
+  uint64_t shingles;
+  int32_t bits [64];                        // SimHash votes
+  uint32_t min [FINGERPRINT_MINHASHES];
+  } FingerprintSig;
+
+typedef struct _Fingerprint
+  {
+  ParaSink sink;
+  char *book;
+  char *href;
+  FingerprintSig chapter;
+  FingerprintSig whole;
+  uint64_t ring [FINGERPRINT_SHINGLE];      // Hashes of the last words
+  int nwords;
+  int next;
+  uint64_t a [FINGERPRINT_MINHASHES];
+  uint64_t b [FINGERPRINT_MINHASHES];
+  Buffer *word;
+  } Fingerprint;
+
+// A signature read back from a file
+typedef struct _FingerprintRecord
+  {
+  uint64_t book;                            // Offsets in the strings
+  uint64_t href;
+  uint64_t simhash;
+  uint32_t min [FINGERPRINT_MINHASHES];
+  } FingerprintRecord;
+
+typedef struct _FingerprintKey
+  {
+  uint64_t key;
+  uint32_t record;
+  } FingerprintKey;
+
+
+/*============================================================================
+  fingerprint_hash
+  FNV-1a
+============================================================================*/
+static uint64_t fingerprint_hash (const char *s, size_t len)
+  {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (BYTE)s[i]) * 1099511628211ULL;
+  return h;
+  }
+
+
+/*============================================================================
+  fingerprint_sig_reset
+============================================================================*/
+static void fingerprint_sig_reset (FingerprintSig *sig)
+  {
+  sig->shingles = 0;
+  memset (sig->bits, 0, sizeof (sig->bits));
+  memset (sig->min, 0xFF, sizeof (sig->min));
+  }
+
+
+/*============================================================================
+  fingerprint_sig_add
+============================================================================*/
+static void fingerprint_sig_add (FingerprintSig *sig, uint64_t h,
+       const uint32_t *values)
+  {
+  int i;
+  sig->shingles++;
+  for (i = 0; i < 64; i++)
+    sig->bits[i] += (h >> i) & 1 ? 1 : -1;
+  for (i = 0; i < FINGERPRINT_MINHASHES; i++)
+    if (values[i] < sig->min[i]) sig->min[i] = values[i];
+  }
+
+
+/*============================================================================
+  fingerprint_add_word
+============================================================================*/
+static void fingerprint_add_word (void *context, const char *word,
+       size_t len)
+  {
+  Fingerprint *self = context;
+  int i;
+  self->ring[self->next] = fingerprint_hash (word, len);
+  self->next = (self->next + 1) % FINGERPRINT_SHINGLE;
+  if (self->nwords < FINGERPRINT_SHINGLE) self->nwords++;
+  if (self->nwords < FINGERPRINT_SHINGLE) return;
+
+  uint64_t h = 0;
+  for (i = 0; i < FINGERPRINT_SHINGLE; i++)
+    h = store_mix (h ^ self->ring[(self->next + i) % FINGERPRINT_SHINGLE]);
+  uint32_t values [FINGERPRINT_MINHASHES];
+  for (i = 0; i < FINGERPRINT_MINHASHES; i++)
+    values[i] = (self->a[i] * h + self->b[i]) >> 32;
+  fingerprint_sig_add (&self->chapter, h, values);
+  fingerprint_sig_add (&self->whole, h, values);
+  }
+
+
+/*============================================================================
+  fingerprint_write
+  Write a signature, if it has any shingles, and start it again
+============================================================================*/
+static void fingerprint_write (Fingerprint *self, FingerprintSig *sig,
+       const char *href)
+  {
+  if (sig->shingles)
+    {
+    ParaSink *sink = &self->sink;
+    uint64_t simhash = 0;
+    char number [64];
+    int i, len;
+    for (i = 0; i < 64; i++)
+      if (sig->bits[i] > 0) simhash |= 1ULL << i;
+    parasink_write (sink, self->book, strlen (self->book));
+    parasink_write (sink, "\t", 1);
+    parasink_write (sink, href, strlen (href));
+    len = snprintf (number, sizeof (number), "\t%llu\t%016llx\t",
+      (unsigned long long)sig->shingles, (unsigned long long)simhash);
+    parasink_write (sink, number, len);
+    for (i = 0; i < FINGERPRINT_MINHASHES; i++)
+      {
+      len = snprintf (number, sizeof (number), "%08x", sig->min[i]);
+      parasink_write (sink, number, len);
+      }
+    parasink_write (sink, "\n", 1);
+    }
+  fingerprint_sig_reset (sig);
+  }
+
+
+/*============================================================================
+  fingerprint_para
+============================================================================*/
+static void fingerprint_para (ParaSink *sink, ParaKind kind,
+       const char *text, size_t len)
+  {
+  Fingerprint *self = (Fingerprint *)sink;
+  if (kind == PARA_META) return;
+  fold_words (text, len, FINGERPRINT_FOLD, self->word,
+    fingerprint_add_word, self);
+  }
+
+
+/*============================================================================
+  fingerprint_begin_section
+============================================================================*/
+static void fingerprint_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  Fingerprint *self = (Fingerprint *)sink;
+  (void)spine_index;
+  if (self->href) fingerprint_write (self, &self->chapter, self->href);
+  if (self->href) free (self->href);
+  self->href = href ? strdup (href) : NULL;
+  self->nwords = 0;
+  self->next = 0;
+  }
+
+
+/*============================================================================
+  fingerprint_begin_book
+============================================================================*/
+static void fingerprint_begin_book (ParaSink *sink, const char *book)
+  {
+  Fingerprint *self = (Fingerprint *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  if (self->href) free (self->href);
+  self->href = NULL;
+  fingerprint_sig_reset (&self->chapter);
+  fingerprint_sig_reset (&self->whole);
+  }
+
+
+/*============================================================================
+  fingerprint_end_book
+============================================================================*/
+static void fingerprint_end_book (ParaSink *sink)
+  {
+  Fingerprint *self = (Fingerprint *)sink;
+  if (self->href) fingerprint_write (self, &self->chapter, self->href);
+  fingerprint_write (self, &self->whole, "");
+  }
+
+
+/*============================================================================
+  fingerprint_destroy
+============================================================================*/
+static void fingerprint_destroy (ParaSink *sink)
+  {
+  Fingerprint *self = (Fingerprint *)sink;
+  free (self->book);
+  if (self->href) free (self->href);
+  buffer_destroy (self->word);
+  free (self);
+  }
+
+
+/*============================================================================
+  fingerprint_create
+============================================================================*/
+ParaSink *fingerprint_create (Compressor *compressor)
+  {
+  Fingerprint *self = malloc (sizeof (Fingerprint));
+  memset (self, 0, sizeof (Fingerprint));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = fingerprint_begin_book;
+  self->sink.end_book = fingerprint_end_book;
+  self->sink.begin_section = fingerprint_begin_section;
+  self->sink.para = fingerprint_para;
+  self->sink.destroy = fingerprint_destroy;
+  self->book = strdup ("");
+  self->word = buffer_create ();
+  // The hash functions must be the same in every run
+  int i;
+  for (i = 0; i < FINGERPRINT_MINHASHES; i++)
+    {
+    self->a[i] = store_mix (2 * i + 1) | 1;
+    self->b[i] = store_mix (2 * i + 2);
+    }
+  fingerprint_sig_reset (&self->chapter);
+  fingerprint_sig_reset (&self->whole);
+  return &self->sink;
+  }
+
+
+/*============================================================================
+  fingerprint_hex
+  Parse len hex digits, returning FALSE if they are not all hex
+============================================================================*/
+static BOOL fingerprint_hex (const char *s, int len, uint64_t *result)
+  {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < len; i++)
+    {
+    char c = s[i];
+    if (c >= '0' && c <= '9') v = v << 4 | (c - '0');
+    else if (c >= 'a' && c <= 'f') v = v << 4 | (c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F') v = v << 4 | (c - 'A' + 10);
+    else return FALSE;
+    }
+  *result = v;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  fingerprint_parse
+  Parse one line into a record, adding its names to strings. Returns
+  FALSE if the line is not a fingerprint; sets *keep to FALSE if it is
+  one that should not be compared
+============================================================================*/
+static BOOL fingerprint_parse (char *line, Buffer *strings,
+       uint64_t *last_book, FingerprintRecord *record, BOOL *keep)
+  {
+  char *fields [5];
+  int i;
+  fields[0] = line;
+  for (i = 1; i < 5; i++)
+    {
+    char *tab = strchr (fields[i - 1], '\t');
+    if (!tab) return FALSE;
+    *tab = 0;
+    fields[i] = tab + 1;
+    }
+  size_t len = strlen (fields[4]);
+  while (len && (fields[4][len - 1] == '\n' || fields[4][len - 1] == '\r'))
+    len--;
+  if (len != 8 * FINGERPRINT_MINHASHES || strlen (fields[3]) != 16
+       || !fingerprint_hex (fields[3], 16, &record->simhash))
+    return FALSE;
+  for (i = 0; i < FINGERPRINT_MINHASHES; i++)
+    {
+    uint64_t v;
+    if (!fingerprint_hex (fields[4] + 8 * i, 8, &v)) return FALSE;
+    record->min[i] = v;
+    }
+  *keep = strtoull (fields[2], NULL, 10) >= FINGERPRINT_MIN_SHINGLES;
+
+  // A book's lines are together, so its name is stored only once
+  if (*last_book >= strings->len
+       || strcmp (strings->data + *last_book, fields[0]) != 0)
+    {
+    *last_book = strings->len;
+    buffer_append (strings, fields[0], strlen (fields[0]) + 1);
+    }
+  record->book = *last_book;
+  record->href = strings->len;
+  buffer_append (strings, fields[1], strlen (fields[1]) + 1);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  fingerprint_compare_keys
+============================================================================*/
+static int fingerprint_compare_keys (const void *a, const void *b)
+  {
+  const FingerprintKey *ka = a, *kb = b;
+  if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+  if (ka->record != kb->record) return ka->record < kb->record ? -1 : 1;
+  return 0;
+  }
+
+
+/*============================================================================
+  fingerprint_compare_pairs
+============================================================================*/
+static int fingerprint_compare_pairs (const void *a, const void *b)
+  {
+  uint64_t pa = *(const uint64_t *)a, pb = *(const uint64_t *)b;
+  return pa < pb ? -1 : pa > pb;
+  }
+
+
+/*============================================================================
+  fingerprint_near_duplicates
+============================================================================*/
+BOOL fingerprint_near_duplicates (char **files, int nfiles,
+       double similarity, BOOL *found, char **error)
+  {
+  FingerprintRecord *records = NULL;
+  uint64_t nrecords = 0, records_size = 0, last_book = 0;
+  Buffer *strings = buffer_create ();
+  char *line = NULL;
+  size_t line_size = 0;
+  BOOL ok = TRUE;
+  int i;
+  *found = FALSE;
+
+  for (i = 0; i < nfiles && ok; i++)
+    {
+    FILE *f = strcmp (files[i], "-") == 0 ? stdin : fopen (files[i], "r");
+    if (!f)
+      {
+      asprintf (error, "Can't open file '%s' for reading: %s", files[i],
+        strerror (errno));
+      ok = FALSE;
+      break;
+      }
+    uint64_t line_number = 0;
+    while (getline (&line, &line_size, f) >= 0)
+      {
+      FingerprintRecord record;
+      BOOL keep;
+      line_number++;
+      if (!fingerprint_parse (line, strings, &last_book, &record, 
+           &keep))
+        {
+        asprintf (error, "%s:%llu: not a fingerprint", files[i],
+          (unsigned long long)line_number);
+        ok = FALSE;
+        break;
+        }
+      if (!keep) continue;
+      STORE_GROW (records, records_size, nrecords + 1);
+      records[nrecords++] = record;
+      }
+    if (f != stdin) fclose (f);
+    }
+  free (line);
+
+  // Candidate pairs, as the lower record number in the top 32 bits
+  uint64_t *pairs = NULL;
+  uint64_t npairs = 0, pairs_size = 0;
+  FingerprintKey *keys = ok && nrecords
+    ? malloc (nrecords * sizeof (FingerprintKey)) : NULL;
+  int band;
+  for (band = 0; band < FINGERPRINT_BANDS && keys; band++)
+    {
+    uint64_t r, j, k;
+    for (r = 0; r < nrecords; r++)
+      {
+      // Books and spine items go into different buckets
+      uint64_t h = store_mix (band * 2
+        + (strings->data[records[r].href] == 0));
+      for (j = 0; j < FINGERPRINT_ROWS; j++)
+        h = store_mix (h ^ records[r].min[band * FINGERPRINT_ROWS + j]);
+      keys[r].key = h;
+      keys[r].record = r;
+      }
+    qsort (keys, nrecords, sizeof (FingerprintKey), fingerprint_compare_keys);
+    for (r = 0; r < nrecords; r = j)
+      {
+      for (j = r + 1; j < nrecords && keys[j].key == keys[r].key; j++);
+      if (j - r == 1) continue;
+      BOOL large = j - r > FINGERPRINT_MAX_BUCKET;
+      for (k = r; k < (large ? r + 1 : j); k++)
+        {
+        uint64_t l;
+        for (l = k + 1; l < j; l++)
+          {
+          STORE_GROW (pairs, pairs_size, npairs + 1);
+          pairs[npairs++] = (uint64_t)keys[k].record << 32 | keys[l].record;
+          }
+        }
+      }
+    }
+  if (keys) free (keys);
+
+  if (npairs)
+    qsort (pairs, npairs, sizeof (uint64_t), fingerprint_compare_pairs);
+  uint64_t p;
+  for (p = 0; p < npairs; p++)
+    {
+    if (p > 0 && pairs[p] == pairs[p - 1]) continue;
+    const FingerprintRecord *a = &records[pairs[p] >> 32];
+    const FingerprintRecord *b = &records[pairs[p] & 0xFFFFFFFF];
+    const char *book_a = strings->data + a->book;
+    const char *book_b = strings->data + b->book;
+    if (strcmp (book_a, book_b) == 0) continue;
+    int j, same = 0;
+    for (j = 0; j < FINGERPRINT_MINHASHES; j++)
+      if (a->min[j] == b->min[j]) same++;
+    double s = (double)same / FINGERPRINT_MINHASHES;
+    if (s < similarity) continue;
+    printf ("%s\t%s\t%s\t%s\t%.3f\t%d\n", book_a, strings->data + a->href,
+      book_b, strings->data + b->href, s,
+      __builtin_popcountll (a->simhash ^ b->simhash));
+    *found = TRUE;
+    }
+
+  if (pairs) free (pairs);
+  if (records) free (records);
+  buffer_destroy (strings);
+  return ok;
+  }
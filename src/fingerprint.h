@@ -0,0 +1,62 @@
+/*============================================================================
+  epub2txt v2
+  fingerprint.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Fingerprints, for finding books, and chapters, that are nearly the
+  same: different editions of one text, for example. The fingerprint
+  sink writes no text, but, in one pass, a SimHash and a MinHash
+  signature of each spine item and of each whole book. They are taken
+  over shingles of FINGERPRINT_SHINGLE consecutive words, folded to
+  lower case and without accents (see fold.h), so that they do not
+  depend on line breaks, punctuation, or where paragraphs end. Shingles
+  run across paragraphs, but not across spine items; metadata is not
+  included. There is one line for each spine item with any words in it,
+  and then one for the book, with an empty href:
+
+  book<TAB>href<TAB>shingles<TAB>simhash<TAB>minhash
+
+  where simhash is 16 hex digits, and minhash is FINGERPRINT_MINHASHES
+  minimum hashes of 8 hex digits each, run together.
+
+  fingerprint_near_duplicates() reads these lines back, and reports the
+  pairs of books, or of spine items, whose MinHash signatures agree in
+  at least the given fraction of places, which estimates the Jaccard
+  similarity of their shingles. Rather than compare every pair, it
+  puts each signature into a bucket for each of FINGERPRINT_BANDS bands
+  of its hashes (locality-sensitive hashing), and compares only those
+  that share a bucket; two signatures with similarity s share at least
+  one bucket with probability 1 - (1 - s^r)^b, for r hashes in each of
+  b bands, which is above 0.99 for s = 0.8.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define FINGERPRINT_SHINGLE 4
+#define FINGERPRINT_MINHASHES 64
+#define FINGERPRINT_BANDS 16
+
+// Spine items with fewer shingles than this are not compared: title
+//  pages and the like are the same in too many books
+#define FINGERPRINT_MIN_SHINGLES 32
+
+// Members of a bucket with more than this many are compared only with
+//  its first member, not with each other
+#define FINGERPRINT_MAX_BUCKET 64
+
+#define FINGERPRINT_DEFAULT_SIMILARITY 0.8
+
+ParaSink   *fingerprint_create (Compressor *compressor);
+
+/** Read the fingerprints in files, and print each near-duplicate pair
+    as:
+
+    book<TAB>href<TAB>book<TAB>href<TAB>similarity<TAB>distance
+
+    where distance is the number of bits in which the SimHashes differ.
+    Books are compared only with books, and spine items only with spine
+    items of other books. Sets *found to whether there were any. */
+BOOL        fingerprint_near_duplicates (char **files, int nfiles,
+              double similarity, BOOL *found, char **error);
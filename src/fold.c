@@ -0,0 +1,201 @@
+/*============================================================================
+  epub2txt v2
+  fold.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+============================================================================*/
+
+#include <string.h>
+#include "fold.h"
+#include "linebreak.h"
+
+// The unaccented letter for each character from U+00C0 to U+017F, or
+//  '.' if it has none
+static const char fold_latin[] = 
+  "AAAAAA.CEEEEIIII.NOOOOO.OUUUUY.."  // U+00C0
+  "aaaaaa.ceeeeiiii.nooooo.ouuuuy.y"  // U+00E0
+  "AaAaAaCcCcCcCcDdDdEeEeEeEeEeGgGg"  // U+0100
+  "GgGgHhHhIiIiIiIiIi..JjKk.LlLlLlL"  // U+0120
+  "lLlNnNnNn...OoOoOo..RrRrRrSsSsSs"  // U+0140
+  "SsTtTtTtUuUuUuUuUuUuWwYyYZzZzZzs"; // U+0160
+
+
+/*============================================================================
+  fold_lower
+============================================================================*/
+static uint32_t fold_lower (uint32_t c)
+  {
+  if (c < 0x80)
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+  if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+    return c + 32;
+  if (c >= 0x100 && c <= 0x17F)
+    {
+    if (c == 0x130) return 'i';
+    if (c == 0x178) return 0xFF;
+    // Pairs start on an even code point, except in these two ranges
+    if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+      return c & 1 ? c + 1 : c;
+    if (c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F)
+      return c;
+    return c | 1;
+    }
+  if (c >= 0x391 && c <= 0x3AB && c != 0x3A2)
+    return c + 32;
+  // Greek capitals with tonos
+  if (c == 0x386) return 0x3AC;
+  if (c >= 0x388 && c <= 0x38A) return c + 37;
+  if (c == 0x38C) return 0x3CC;
+  if (c == 0x38E || c == 0x38F) return c + 63;
+  if (c == 0x3C2) // Final sigma
+    return 0x3C3;
+  if (c >= 0x410 && c <= 0x42F)
+    return c + 32;
+  if (c >= 0x400 && c <= 0x40F)
+    return c + 80;
+  return c;
+  }
+
+
+/*============================================================================
+  fold_char
+============================================================================*/
+uint32_t fold_char (uint32_t c, int flags)
+  {
+  if (flags & FOLD_DIACRITICS)
+    {
+    if (c >= 0x300 && c <= 0x36F) return 0; // Combining accents
+    if (c >= 0xC0 && c <= 0x17F && fold_latin[c - 0xC0] != '.')
+      c = (BYTE)fold_latin[c - 0xC0];
+    }
+  if (flags & FOLD_CASE)
+    c = fold_lower (c);
+  return c;
+  }
+
+
+/*============================================================================
+  fold_utf8
+============================================================================*/
+size_t fold_utf8 (const char *s, size_t len, int flags, Buffer *out,
+         uint32_t *map)
+  {
+  const BYTE *p = (const BYTE *)s, *end = p + len;
+  size_t start = out->len;
+  buffer_reserve (out, len);
+  while (p < end)
+    {
+    uint32_t offset = p - (const BYTE *)s;
+    uint32_t c = *p++;
+    if (c >= 0xC0)
+      {
+      int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+      c &= 0x3F >> n;
+      while (n-- && p < end) c = (c << 6) | (*p++ & 0x3F);
+      }
+    c = fold_char (c, flags);
+    char *q = out->data + out->len;
+    int n;
+    if (c == 0)
+      n = 0;
+    else if (c < 0x80)
+      {
+      q[0] = c;
+      n = 1;
+      }
+    else if (c < 0x800)
+      {
+      q[0] = 0xC0 | (c >> 6);
+      q[1] = 0x80 | (c & 0x3F);
+      n = 2;
+      }
+    else if (c < 0x10000)
+      {
+      q[0] = 0xE0 | (c >> 12);
+      q[1] = 0x80 | ((c >> 6) & 0x3F);
+      q[2] = 0x80 | (c & 0x3F);
+      n = 3;
+      }
+    else
+      {
+      q[0] = 0xF0 | (c >> 18);
+      q[1] = 0x80 | ((c >> 12) & 0x3F);
+      q[2] = 0x80 | ((c >> 6) & 0x3F);
+      q[3] = 0x80 | (c & 0x3F);
+      n = 4;
+      }
+    if (map)
+      {
+      int i;
+      for (i = 0; i < n; i++) map[out->len - start + i] = offset;
+      }
+    out->len += n;
+    }
+  if (map) map[out->len - start] = len;
+  return out->len - start;
+  }
+
+
+/*============================================================================
+  fold_char_kind
+============================================================================*/
+int fold_char_kind (uint32_t c)
+  {
+  if (c < 0x80)
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+      || (c >= '0' && c <= '9');
+  switch (linebreak_class (c))
+    {
+    case LB_AL: case LB_HL: case LB_NU: case LB_CM: case LB_ZWJ:
+    case LB_H2: case LB_H3: case LB_JL: case LB_JV: case LB_JT:
+      return 1;
+    case LB_ID: case LB_EB: case LB_EM:
+      return 2;
+    default:
+      return 0;
+    }
+  }
+
+
+/*============================================================================
+  fold_emit_word
+============================================================================*/
+static void fold_emit_word (const BYTE *s, size_t len, int flags,
+       Buffer *word, FoldWordFn fn, void *context)
+  {
+  buffer_clear (word);
+  fold_utf8 ((const char *)s, len, flags, word, NULL);
+  if (word->len) fn (context, word->data, word->len);
+  }
+
+
+/*============================================================================
+  fold_words
+============================================================================*/
+void fold_words (const char *text, size_t len, int flags, Buffer *word, 
+       FoldWordFn fn, void *context)
+  {
+  const BYTE *s = (const BYTE *)text, *end = s + len;
+  const BYTE *start = NULL;
+  linebreak_init ();
+  while (s < end)
+    {
+    const BYTE *p = s;
+    uint32_t c = *s++;
+    if (c >= 0xC0)
+      {
+      int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+      c &= 0x3F >> n;
+      while (n-- && s < end) c = (c << 6) | (*s++ & 0x3F);
+      }
+    int kind = fold_char_kind (c);
+    if (kind == 1)
+      {
+      if (!start) start = p;
+      continue;
+      }
+    if (start) fold_emit_word (start, p - start, flags, word, fn, context);
+    start = NULL;
+    if (kind == 2) fold_emit_word (p, s - p, flags, word, fn, context);
+    }
+  if (start) fold_emit_word (start, end - start, flags, word, fn, context);
+  }
@@ -0,0 +1,49 @@
+/*============================================================================
+  epub2txt v2
+  fold.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Folding text for searching: to lower case, and without accents, so
+  that, e.g., "Élan" matches "elan". Case is folded for the Latin, 
+  Greek and Cyrillic alphabets; accents are removed from the letters of
+  Latin-1 and Latin Extended-A, and combining accents are dropped. 
+  Folded text is never longer, in UTF-8, than the text it came from.
+
+  For indexing, text can also be split into folded words: a word is a
+  run of letters, digits and combining marks, or a single ideograph,
+  kana or emoji, by the characters' line-break classes.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "defs.h"
+#include "buffer.h"
+
+#define FOLD_CASE       0x0001
+#define FOLD_DIACRITICS 0x0002
+
+/** Fold one character; returns 0 if it should be dropped. */
+uint32_t    fold_char (uint32_t c, int flags);
+
+/** Append the folded form of len bytes of UTF-8 to out. If map is not 
+    NULL, it must have room for len + 1 entries; map[i] is set to the
+    offset in s of the character that byte i of the folded text came
+    from, and there is one more entry, for the end of s. Returns the
+    number of bytes appended. */
+size_t      fold_utf8 (const char *s, size_t len, int flags, Buffer *out,
+              uint32_t *map);
+
+/** 1 for a character that is part of a word, 2 for one that is a word by
+    itself, such as an ideograph, and 0 for anything else. Words are 
+    split this way by fold_words(); linebreak_init() must have been 
+    called. */
+int         fold_char_kind (uint32_t c);
+
+typedef void (*FoldWordFn) (void *context, const char *word, size_t len);
+
+/** Split len bytes of UTF-8 into words, fold each one, in word, with 
+    flags, and pass it to fn, unless it folds to nothing. */
+void        fold_words (const char *s, size_t len, int flags, Buffer *word,
+              FoldWordFn fn, void *context);
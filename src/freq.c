@@ -0,0 +1,384 @@
+/*============================================================================
+  epub2txt v2
+  freq.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The counts are kept in an open-addressing hash table of indexes into
+  an array of entries, with the bytes of the n-grams in one arena; all
+  three are emptied, but not freed, between books or spine items. The
+  last n words of the paragraph are kept in a window, one space apart,
+  so that each n-gram that ends at a word is a tail of the window.
+  The most frequent n-grams are picked out with a heap, so a short list
+  from a large vocabulary does not need it all to be sorted.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freq.h"
+#include "store.h"
+#include "fold.h"
+
+typedef struct _FreqEntry
+  {
+  uint64_t key;           // Offset in the arena
+  uint32_t len;
+  uint32_t hash;
+  uint64_t count;
+  uint32_t n;             // Words in the n-gram
+  } FreqEntry;
+
+// An entry, for sorting
+typedef struct _FreqItem
+  {
+  const char *key;
+  uint32_t len;
+  uint32_t n;
+  uint64_t count;
+  } FreqItem;
+
+typedef struct _Freq
+  {
+  ParaSink sink;
+  int ngram;
+  int top;
+  int flags;
+  FreqEntry *entries;
+  uint64_t nentries;
+  uint64_t entries_size;
+  uint32_t *table;        // Index in entries, plus 1, or 0 if free
+  uint64_t table_size;
+  char *arena;
+  uint64_t arena_len;
+  uint64_t arena_size;
+  char *book;
+  char *href;
+  Buffer *window;         // The last ngram words, one space apart
+  size_t starts [FREQ_MAX_NGRAM];
+  int nwords;
+  Buffer *word;
+  } Freq;
+
+
+/*============================================================================
+  freq_hash
+  FNV-1a
+============================================================================*/
+static uint32_t freq_hash (const char *s, size_t len)
+  {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (BYTE)s[i]) * 16777619u;
+  return h;
+  }
+
+
+/*============================================================================
+  freq_rehash
+============================================================================*/
+static void freq_rehash (Freq *self, uint64_t size)
+  {
+  free (self->table);
+  self->table_size = size;
+  self->table = calloc (size, sizeof (uint32_t));
+  uint64_t i, mask = size - 1;
+  for (i = 0; i < self->nentries; i++)
+    {
+    uint64_t p = self->entries[i].hash & mask;
+    while (self->table[p]) p = (p + 1) & mask;
+    self->table[p] = i + 1;
+    }
+  }
+
+
+/*============================================================================
+  freq_count
+============================================================================*/
+static void freq_count (Freq *self, const char *key, size_t len, int n)
+  {
+  uint32_t hash = freq_hash (key, len);
+  uint64_t mask = self->table_size - 1;
+  uint64_t p = hash & mask;
+  while (self->table[p])
+    {
+    FreqEntry *e = &self->entries[self->table[p] - 1];
+    if (e->hash == hash && e->len == len
+         && memcmp (self->arena + e->key, key, len) == 0)
+      {
+      e->count++;
+      return;
+      }
+    p = (p + 1) & mask;
+    }
+
+  STORE_GROW (self->entries, self->entries_size, self->nentries + 1);
+  FreqEntry *e = &self->entries[self->nentries++];
+  e->key = self->arena_len;
+  e->len = len;
+  e->hash = hash;
+  e->count = 1;
+  e->n = n;
+  STORE_GROW (self->arena, self->arena_size, self->arena_len + len);
+  memcpy (self->arena + self->arena_len, key, len);
+  self->arena_len += len;
+  self->table[p] = self->nentries;
+  if (self->nentries * 2 >= self->table_size)
+    freq_rehash (self, self->table_size * 2);
+  }
+
+
+/*============================================================================
+  freq_add_word
+============================================================================*/
+static void freq_add_word (void *context, const char *word, size_t len)
+  {
+  Freq *self = context;
+  Buffer *window = self->window;
+  int i;
+  if (self->nwords == self->ngram)
+    {
+    size_t shift = self->starts[1];
+    memmove (window->data, window->data + shift, window->len - shift);
+    window->len -= shift;
+    for (i = 1; i < self->nwords; i++)
+      self->starts[i - 1] = self->starts[i] - shift;
+    self->nwords--;
+    }
+  if (self->nwords) buffer_append (window, " ", 1);
+  self->starts[self->nwords++] = window->len;
+  buffer_append (window, word, len);
+  for (i = 1; i <= self->nwords; i++)
+    {
+    size_t start = self->starts[self->nwords - i];
+    freq_count (self, window->data + start, window->len - start, i);
+    }
+  }
+
+
+/*============================================================================
+  freq_better
+  Whether a comes before b in the output
+============================================================================*/
+static int freq_better (const FreqItem *a, const FreqItem *b)
+  {
+  if (a->count != b->count) return a->count > b->count;
+  int c = memcmp (a->key, b->key, a->len < b->len ? a->len : b->len);
+  if (c != 0) return c < 0;
+  return a->len < b->len;
+  }
+
+
+/*============================================================================
+  freq_compare_items
+============================================================================*/
+static int freq_compare_items (const void *a, const void *b)
+  {
+  if (freq_better (a, b)) return -1;
+  if (freq_better (b, a)) return 1;
+  return 0;
+  }
+
+
+/*============================================================================
+  freq_sift_down
+  Restore a heap whose root is the item that comes last
+============================================================================*/
+static void freq_sift_down (FreqItem *heap, uint64_t n, uint64_t i)
+  {
+  for (;;)
+    {
+    uint64_t worst = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && freq_better (&heap[worst], &heap[l])) worst = l;
+    if (r < n && freq_better (&heap[worst], &heap[r])) worst = r;
+    if (worst == i) return;
+    FreqItem t = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = t;
+    i = worst;
+    }
+  }
+
+
+/*============================================================================
+  freq_put_varint
+============================================================================*/
+static void freq_put_varint (ParaSink *sink, uint64_t v)
+  {
+  BYTE b [STORE_VARINT_MAX];
+  parasink_write (sink, (const char *)b, store_put_varint (b, v));
+  }
+
+
+/*============================================================================
+  freq_write
+  Write out the counts so far, and start again
+============================================================================*/
+static void freq_write (Freq *self)
+  {
+  uint64_t i, n = 0, total = self->nentries;
+  if (total == 0) return;
+  uint64_t k = self->top > 0 && (uint64_t)self->top < total
+    ? (uint64_t)self->top : total;
+  FreqItem *items = malloc (k * sizeof (FreqItem));
+  for (i = 0; i < total; i++)
+    {
+    const FreqEntry *e = &self->entries[i];
+    FreqItem item;
+    item.key = self->arena + e->key;
+    item.len = e->len;
+    item.n = e->n;
+    item.count = e->count;
+    if (n < k)
+      {
+      items[n++] = item;
+      // Once the heap is full, its root is the last of the top k
+      if (n == k && k < total)
+        {
+        uint64_t j;
+        for (j = k / 2 + 1; j-- > 0;) freq_sift_down (items, k, j);
+        }
+      }
+    else if (freq_better (&item, &items[0]))
+      {
+      items[0] = item;
+      freq_sift_down (items, k, 0);
+      }
+    }
+  qsort (items, n, sizeof (FreqItem), freq_compare_items);
+
+  ParaSink *sink = &self->sink;
+  const char *href = self->flags & FREQ_BY_CHAPTER && self->href
+    ? self->href : "";
+  if (self->flags & FREQ_BINARY)
+    {
+    freq_put_varint (sink, strlen (self->book));
+    parasink_write (sink, self->book, strlen (self->book));
+    freq_put_varint (sink, strlen (href));
+    parasink_write (sink, href, strlen (href));
+    freq_put_varint (sink, n);
+    }
+  for (i = 0; i < n; i++)
+    {
+    const FreqItem *item = &items[i];
+    if (self->flags & FREQ_BINARY)
+      {
+      freq_put_varint (sink, item->n);
+      freq_put_varint (sink, item->count);
+      freq_put_varint (sink, item->len);
+      }
+    else
+      {
+      char number [64];
+      int len = snprintf (number, sizeof (number), "\t%u\t%llu\t",
+        item->n, (unsigned long long)item->count);
+      parasink_write (sink, self->book, strlen (self->book));
+      parasink_write (sink, "\t", 1);
+      parasink_write (sink, href, strlen (href));
+      parasink_write (sink, number, len);
+      }
+    parasink_write (sink, item->key, item->len);
+    if (!(self->flags & FREQ_BINARY)) parasink_write (sink, "\n", 1);
+    }
+  free (items);
+
+  self->nentries = 0;
+  self->arena_len = 0;
+  memset (self->table, 0, self->table_size * sizeof (uint32_t));
+  }
+
+
+/*============================================================================
+  freq_para
+============================================================================*/
+static void freq_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  Freq *self = (Freq *)sink;
+  if (kind == PARA_META) return;
+  buffer_clear (self->window);
+  self->nwords = 0;
+  fold_words (text, len, self->flags & FREQ_FOLD_CASE ? FOLD_CASE : 0,
+    self->word, freq_add_word, self);
+  }
+
+
+/*============================================================================
+  freq_begin_section
+============================================================================*/
+static void freq_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  Freq *self = (Freq *)sink;
+  (void)spine_index;
+  if (self->flags & FREQ_BY_CHAPTER) freq_write (self);
+  if (self->href) free (self->href);
+  self->href = href ? strdup (href) : NULL;
+  }
+
+
+/*============================================================================
+  freq_begin_book
+============================================================================*/
+static void freq_begin_book (ParaSink *sink, const char *book)
+  {
+  Freq *self = (Freq *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  }
+
+
+/*============================================================================
+  freq_end_book
+============================================================================*/
+static void freq_end_book (ParaSink *sink)
+  {
+  Freq *self = (Freq *)sink;
+  freq_write (self);
+  }
+
+
+/*============================================================================
+  freq_destroy
+============================================================================*/
+static void freq_destroy (ParaSink *sink)
+  {
+  Freq *self = (Freq *)sink;
+  if (self->entries) free (self->entries);
+  free (self->table);
+  if (self->arena) free (self->arena);
+  free (self->book);
+  if (self->href) free (self->href);
+  buffer_destroy (self->window);
+  buffer_destroy (self->word);
+  free (self);
+  }
+
+
+/*============================================================================
+  freq_create
+============================================================================*/
+ParaSink *freq_create (int ngram, int top, int flags, Compressor *compressor)
+  {
+  Freq *self = malloc (sizeof (Freq));
+  memset (self, 0, sizeof (Freq));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = freq_begin_book;
+  self->sink.end_book = freq_end_book;
+  self->sink.begin_section = freq_begin_section;
+  self->sink.para = freq_para;
+  self->sink.destroy = freq_destroy;
+  if (ngram < 1) ngram = 1;
+  if (ngram > FREQ_MAX_NGRAM) ngram = FREQ_MAX_NGRAM;
+  self->ngram = ngram;
+  self->top = top;
+  self->flags = flags;
+  self->book = strdup ("");
+  self->window = buffer_create ();
+  self->word = buffer_create ();
+  freq_rehash (self, 4096);
+  if (flags & FREQ_BINARY)
+    parasink_write (&self->sink, FREQ_FILE_MAGIC, 4);
+  return &self->sink;
+  }
@@ -0,0 +1,53 @@
+/*============================================================================
+  epub2txt v2
+  freq.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Word frequencies: a paragraph sink that writes no text, but counts the
+  words, and the runs of up to n words (n-grams), in each book or each
+  spine item, and writes them out, most frequent first, when the book
+  or spine item ends. Words are split as for the search index (see
+  fold.h), and optionally folded to lower case; n-grams do not cross
+  the ends of paragraphs, and metadata is not counted.
+
+  As TSV, there is a line for each n-gram:
+
+  book<TAB>href<TAB>n<TAB>count<TAB>words
+
+  where href is empty when counting by book, and the words of an n-gram
+  are separated by single spaces. Ties are in byte order of the words.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "parasink.h"
+
+#define FREQ_MAX_NGRAM 8
+
+#define FREQ_BY_CHAPTER 0x0001
+#define FREQ_FOLD_CASE  0x0002
+#define FREQ_BINARY     0x0004
+
+/** Create a sink that counts n-grams of 1 to ngram words, and writes
+    the top most frequent (or all, if top is 0) of each book, or of
+    each spine item, with FREQ_BY_CHAPTER. */
+ParaSink   *freq_create (int ngram, int top, int flags,
+              Compressor *compressor);
+
+/*============================================================================
+  Binary output
+
+  The file magic, and then a record for each book or spine item, with
+  all numbers as unsigned LEB128 varints:
+
+  length of book name, book name, length of href, href,
+  number of n-grams, and then for each n-gram:
+  n, count, length of words, words
+
+  The names and words are UTF-8, without terminators; the href is empty
+  when counting by book.
+============================================================================*/
+
+#define FREQ_FILE_MAGIC "E2F\x1A"
+
@@ -0,0 +1,390 @@
+/*============================================================================
+  epub2txt v2
+  grep.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  A literal pattern is found by looking for its rarest byte with 
+  memchr(), which the C library implements with vector instructions, 
+  and comparing the rest of the pattern only where that byte turns up.
+  Which byte is rarest is guessed from the frequency of letters in 
+  English text; anything outside ASCII is taken to be uncommon.
+
+  When the text is folded, a map from each byte of the folded text to 
+  the original is kept, so that the snippets show the text as it was.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <regex.h>
+#include "grep.h"
+#include "fold.h"
+
+typedef struct _Grep
+  {
+  ParaSink sink;
+  int flags;
+  int fold;          // FOLD_ flags for the text, if any
+  int context;
+  BOOL ansi;
+  char *pattern;     // Folded, for a literal pattern
+  size_t pattern_len;
+  size_t rare;       // Offset of the pattern's rarest byte
+  regex_t regex;
+  char *book;
+  char *href;
+  BOOL found;        // In any book
+  Buffer *folded;    // The folded paragraph
+  uint32_t *map;     // From the folded paragraph to the original
+  size_t map_size;
+  } Grep;
+
+
+/*============================================================================
+  grep_byte_rank
+  Roughly how common a byte is in text: higher is more common
+============================================================================*/
+static int grep_byte_rank (BYTE c)
+  {
+  static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+  const char *p = c ? strchr (common, c) : NULL;
+  if (p) return 255 - (p - common);
+  if (c >= 'A' && c <= 'Z') return 150;
+  if (c >= 0x80) return c >= 0xC0 ? 100 : 50; 
+  return 120;
+  }
+
+
+/*============================================================================
+  grep_find_literal
+  Find the pattern in len bytes of s, from start; returns the offset
+  of the match, or -1
+============================================================================*/
+static long grep_find_literal (const Grep *self, const char *s, size_t len,
+       size_t start)
+  {
+  size_t n = self->pattern_len;
+  if (len < n) return -1;
+  const char *p = s + start + self->rare;
+  const char *end = s + len - n + self->rare + 1; 
+  char rare = self->pattern[self->rare];
+  while (p < end && (p = memchr (p, rare, end - p)))
+    {
+    const char *candidate = p - self->rare;
+    if (memcmp (candidate, self->pattern, n) == 0) 
+      return candidate - s;
+    p++;
+    }
+  return -1;
+  }
+
+
+/*============================================================================
+  grep_find
+  Find the next match in the text, from start; returns FALSE if there is
+  none
+============================================================================*/
+static BOOL grep_find (Grep *self, const char *s, size_t len, size_t start,
+       size_t *match_start, size_t *match_end)
+  {
+  if (!(self->flags & GREP_REGEX))
+    {
+    long offset = grep_find_literal (self, s, len, start);
+    if (offset < 0) return FALSE;
+    *match_start = offset;
+    *match_end = offset + self->pattern_len;
+    return TRUE;
+    }
+  // s is NUL-terminated, for regexec(); empty matches are skipped
+  while (start < len)
+    {
+    regmatch_t m;
+    if (regexec (&self->regex, s + start, 1, &m, 
+          start ? REG_NOTBOL : 0) != 0) 
+      return FALSE;
+    if (m.rm_eo > m.rm_so)
+      {
+      *match_start = start + m.rm_so;
+      *match_end = start + m.rm_eo;
+      return TRUE;
+      }
+    start += m.rm_so + 1;
+    }
+  return FALSE;
+  }
+
+
+/*============================================================================
+  grep_write_snippet
+  Write text, with line breaks and tabs as spaces
+============================================================================*/
+static void grep_write_snippet (ParaSink *sink, const char *s, size_t len)
+  {
+  size_t i, from = 0;
+  for (i = 0; i < len; i++)
+    {
+    if (s[i] == '\n' || s[i] == '\t')
+      {
+      parasink_write (sink, s + from, i - from);
+      parasink_write (sink, " ", 1);
+      from = i + 1;
+      }
+    }
+  parasink_write (sink, s + from, len - from);
+  }
+
+
+/*============================================================================
+  grep_write_match
+============================================================================*/
+static void grep_write_match (Grep *self, const char *text, size_t len,
+       size_t start, size_t end)
+  {
+  size_t from = start, to = end;
+  int n;
+  // Back and forward by characters, not bytes
+  for (n = 0; n < self->context && from > 0; n++)
+    while (from > 0 && (text[--from] & 0xC0) == 0x80);
+  for (n = 0; n < self->context && to < len; n++)
+    while (++to < len && (text[to] & 0xC0) == 0x80);
+
+  ParaSink *sink = &self->sink;
+  parasink_write (sink, self->book, strlen (self->book));
+  parasink_write (sink, "\t", 1);
+  if (self->href) parasink_write (sink, self->href, strlen (self->href));
+  parasink_write (sink, "\t", 1);
+  if (from > 0) parasink_write (sink, "...", 3);
+  grep_write_snippet (sink, text + from, start - from);
+  if (self->ansi) parasink_write (sink, "\x1B[1m", 4);
+  grep_write_snippet (sink, text + start, end - start);
+  if (self->ansi) parasink_write (sink, "\x1B[0m", 4);
+  grep_write_snippet (sink, text + end, to - end);
+  if (to < len) parasink_write (sink, "...", 3);
+  parasink_write (sink, "\n", 1);
+  }
+
+
+/*============================================================================
+  grep_para
+============================================================================*/
+static void grep_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  Grep *self = (Grep *)sink;
+  (void)kind;
+  const char *s = text;
+  size_t s_len = len;
+  if (self->fold)
+    {
+    if (len + 1 > self->map_size)
+      {
+      self->map_size = len + 1;
+      self->map = realloc (self->map, self->map_size * sizeof (uint32_t));
+      }
+    buffer_clear (self->folded);
+    s_len = fold_utf8 (text, len, self->fold, self->folded, self->map);
+    s = self->folded->data;
+    }
+  if (self->flags & GREP_REGEX)
+    {
+    if (!self->fold)
+      {
+      buffer_clear (self->folded);
+      buffer_append (self->folded, text, len);
+      }
+    buffer_append (self->folded, "", 1);
+    s = self->folded->data;
+    }
+
+  size_t pos = 0, start, end;
+  while (pos < s_len && grep_find (self, s, s_len, pos, &start, &end))
+    {
+    self->found = TRUE;
+    if (self->flags & GREP_FILES_ONLY)
+      {
+      parasink_write (sink, self->book, strlen (self->book));
+      parasink_write (sink, "\n", 1);
+      sink->done = TRUE;
+      return;
+      }
+    if (self->fold)
+      grep_write_match (self, text, len, self->map[start], self->map[end]);
+    else
+      grep_write_match (self, text, len, start, end);
+    pos = end;
+    }
+  }
+
+
+/*============================================================================
+  grep_begin_book
+============================================================================*/
+static void grep_begin_book (ParaSink *sink, const char *book)
+  {
+  Grep *self = (Grep *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  free (self->href);
+  self->href = NULL;
+  }
+
+
+/*============================================================================
+  grep_begin_section
+============================================================================*/
+static void grep_begin_section (ParaSink *sink, int spine_index, 
+       const char *href)
+  {
+  Grep *self = (Grep *)sink;
+  (void)spine_index;
+  free (self->href);
+  self->href = href ? strdup (href) : NULL;
+  }
+
+
+/*============================================================================
+  grep_destroy
+============================================================================*/
+static void grep_destroy (ParaSink *sink)
+  {
+  Grep *self = (Grep *)sink;
+  if (self->flags & GREP_REGEX) 
+    regfree (&self->regex);
+  else
+    free (self->pattern);
+  free (self->book);
+  free (self->href);
+  buffer_destroy (self->folded);
+  if (self->map) free (self->map);
+  free (self);
+  }
+
+
+/*============================================================================
+  grep_fold_regex
+  Fold the literal text of a regular expression as the paragraphs are
+  folded, leaving escapes, such as \W, and bracket expressions, whose
+  ranges folding would break, as they are; case in those is ignored by
+  regcomp() instead
+============================================================================*/
+static void grep_fold_regex (const char *pattern, int fold, Buffer *out)
+  {
+  const char *p = pattern;
+  while (*p)
+    {
+    size_t run = strcspn (p, "\\[");
+    fold_utf8 (p, run, fold, out, NULL);
+    p += run;
+    if (*p == '\\')
+      {
+      // The escape and the whole character after it
+      const char *q = p + 1;
+      if (*q) q++;
+      while ((*q & 0xC0) == 0x80) q++;
+      buffer_append (out, p, q - p);
+      p = q;
+      }
+    else if (*p == '[')
+      {
+      const char *q = p + 1;
+      if (*q == '^') q++;
+      if (*q == ']') q++;
+      while (*q && *q != ']')
+        {
+        // [:alpha:], [.x.] and [=e=] may contain ]
+        if (*q == '[' && (q[1] == ':' || q[1] == '.' || q[1] == '='))
+          {
+          const char *end = strchr (q + 2, q[1]);
+          while (end && end[1] != ']') end = strchr (end + 1, q[1]);
+          q = end ? end + 2 : q + strlen (q);
+          }
+        else
+          q++;
+        }
+      if (*q) q++;
+      buffer_append (out, p, q - p);
+      p = q;
+      }
+    }
+  }
+
+
+/*============================================================================
+  grep_create
+============================================================================*/
+BOOL grep_create (const char *pattern, int flags, int context, BOOL ansi,
+       Compressor *compressor, ParaSink **result, char **error)
+  {
+  int fold = 0;
+  if (flags & GREP_IGNORE_CASE) fold |= FOLD_CASE;
+  if (flags & GREP_IGNORE_DIACRITICS) fold |= FOLD_DIACRITICS;
+
+  Buffer *folded = buffer_create ();
+  if (fold && (flags & GREP_REGEX))
+    grep_fold_regex (pattern, fold, folded);
+  else if (fold)
+    fold_utf8 (pattern, strlen (pattern), fold, folded, NULL);
+  else
+    buffer_append (folded, pattern, strlen (pattern));
+  buffer_append (folded, "", 1);
+
+  if (!(flags & GREP_REGEX) && folded->len == 1)
+    {
+    asprintf (error, "The search pattern is empty");
+    buffer_destroy (folded);
+    return FALSE;
+    }
+
+  Grep *self = malloc (sizeof (Grep));
+  memset (self, 0, sizeof (Grep));
+  if (flags & GREP_REGEX)
+    {
+    int err = regcomp (&self->regex, folded->data, REG_EXTENDED 
+      | ((flags & GREP_IGNORE_CASE) ? REG_ICASE : 0));
+    if (err != 0)
+      {
+      char message [256];
+      regerror (err, &self->regex, message, sizeof (message));
+      asprintf (error, "Bad regular expression '%s': %s", pattern, message);
+      buffer_destroy (folded);
+      free (self);
+      return FALSE;
+      }
+    }
+  else
+    {
+    size_t i;
+    self->pattern = strdup (folded->data);
+    self->pattern_len = folded->len - 1;
+    for (i = 1; i < self->pattern_len; i++)
+      if (grep_byte_rank (self->pattern[i]) 
+           < grep_byte_rank (self->pattern[self->rare]))
+        self->rare = i;
+    }
+  buffer_destroy (folded);
+
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = grep_begin_book;
+  self->sink.begin_section = grep_begin_section;
+  self->sink.para = grep_para;
+  self->sink.destroy = grep_destroy;
+  self->flags = flags;
+  self->fold = fold;
+  self->context = context >= 0 ? context : GREP_DEFAULT_CONTEXT;
+  self->ansi = ansi;
+  self->book = strdup ("");
+  self->folded = buffer_create ();
+  *result = &self->sink;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  grep_found
+============================================================================*/
+BOOL grep_found (const ParaSink *sink)
+  {
+  return ((const Grep *)sink)->found;
+  }
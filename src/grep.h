@@ -0,0 +1,42 @@
+/*============================================================================
+  epub2txt v2
+  grep.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Searching: a paragraph sink that writes no text, but looks for a
+  pattern in each paragraph, and writes a line for each match:
+
+  book<TAB>href<TAB>snippet
+
+  where href is the spine item, or empty for metadata, and the snippet
+  is the match with up to a given number of characters (by default,
+  GREP_DEFAULT_CONTEXT) either side of it, from the same paragraph, with line breaks as spaces. With
+  GREP_FILES_ONLY, only the names of books that match are written, 
+  and the rest of a book is not read once it has matched.
+
+  The pattern is a literal string or, with GREP_REGEX, a POSIX 
+  extended regular expression. Either way, with GREP_IGNORE_CASE or
+  GREP_IGNORE_DIACRITICS, the pattern and the text are both folded 
+  (see fold.h) before they are compared.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define GREP_DEFAULT_CONTEXT 40
+
+#define GREP_REGEX             0x0001
+#define GREP_IGNORE_CASE       0x0002
+#define GREP_IGNORE_DIACRITICS 0x0004
+#define GREP_FILES_ONLY        0x0008
+
+/** Create a sink that looks for pattern, and shows context characters
+    either side of each match; if ansi is TRUE, matches are shown in
+    bold. Fails if the pattern is not a valid regular expression. */
+BOOL      grep_create (const char *pattern, int flags, int context, 
+            BOOL ansi, Compressor *compressor, ParaSink **result, 
+            char **error);
+
+/** Whether anything has matched, in any book. */
+BOOL      grep_found (const ParaSink *sink);
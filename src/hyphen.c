@@ -0,0 +1,646 @@
+/*============================================================================
+  epub2txt v2
+  hyphen.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Hyphenation by Liang's algorithm (F. M. Liang, "Word Hy-phen-a-tion by
+  Com-put-er", 1983), using the same patterns as TeX.
+
+  The patterns are read from a file at start-up, and compiled into a
+  packed trie: a double array, in which the transition from state s on
+  letter c is to state base[s] + c, provided that check[base[s] + c]
+  is s. The letters are first mapped to small integers, so the trie
+  for a full set of English patterns takes up a few hundred kilobytes
+  at most, and each step of a lookup is two array reads.
+
+  Hyphenating a word means looking up every substring of it in the
+  trie, which is not expensive, but a novel repeats the same words
+  over and over again; so results are kept in a hash table, keyed on
+  the word itself.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hyphen.h"
+#include "wstring.h"
+#include "fold.h"
+#include "log.h"
+
+// TeX's \lefthyphenmin and \righthyphenmin defaults
+#define HYPHEN_LEFT_MIN 2
+#define HYPHEN_RIGHT_MIN 3
+
+// The word cache is cleared when it gets this full
+#define HYPHEN_CACHE_SIZE 65536
+#define HYPHEN_CACHE_MAX (HYPHEN_CACHE_SIZE / 2)
+
+#define TRIE_FREE -1
+
+// A node of the trie under construction, before it is packed
+typedef struct _HyphenNode
+  {
+  int child;      // First child, or -1
+  int sibling;    // Next sibling, or -1
+  int symbol;     // Letter, mapped to the alphabet
+  int out;        // Offset of the pattern's values in the pool, or -1
+  } HyphenNode;
+
+// A cached hyphenation result. The key is stored in the cache's arena
+typedef struct _HyphenCacheEntry
+  {
+  uint32_t hash;
+  int key;        // Offset of the key in the arena, or -1 if empty
+  int len;
+  uint64_t points;
+  } HyphenCacheEntry;
+
+struct _Hyphenator
+  {
+  // Alphabet: sorted code points; the symbol for alphabet[i] is i + 1
+  uint32_t *alphabet;
+  int alphabet_len;
+  // Packed trie
+  int *base;
+  int *check;
+  int *out;
+  int trie_size;
+  // Pattern values: for each pattern, a length byte followed by the
+  //  digit values between (and around) its letters
+  BYTE *pool;
+  int pool_len;
+  // Exceptions from \hyphenation{}, and the cache of computed words,
+  //  share the same structure; exceptions are never evicted
+  HyphenCacheEntry *exceptions;
+  uint32_t *exception_keys;
+  int exception_keys_len;
+  HyphenCacheEntry *cache;
+  uint32_t *cache_keys;
+  int cache_keys_len;
+  int cache_keys_size;
+  int cache_count;
+  pthread_mutex_t mutex;
+  // Of the pattern file's text, to tell one set of patterns from another
+  uint64_t fingerprint;
+  };
+
+
+/*============================================================================
+  hyphen_symbol
+  Map a (folded) character to its alphabet symbol, or 0 if it does not
+  appear in any pattern.
+============================================================================*/
+static int hyphen_symbol (const Hyphenator *self, uint32_t c)
+  {
+  int lo = 0, hi = self->alphabet_len;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->alphabet[mid] < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+  if (lo < self->alphabet_len && self->alphabet[lo] == c) return lo + 1;
+  return 0;
+  }
+
+
+/*============================================================================
+  hyphen_hash
+============================================================================*/
+static uint32_t hyphen_hash (const uint32_t *word, int len)
+  {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++)
+    h = (h ^ word[i]) * 16777619u;
+  return h;
+  }
+
+
+/*============================================================================
+  hyphen_table_find
+  Find the slot for a word in an open-addressed table: either the slot
+  that holds it, or the empty slot where it would go.
+============================================================================*/
+static HyphenCacheEntry *hyphen_table_find (HyphenCacheEntry *table,
+       const uint32_t *keys, uint32_t hash, const uint32_t *word, int len)
+  {
+  uint32_t i = hash & (HYPHEN_CACHE_SIZE - 1);
+  while (TRUE)
+    {
+    HyphenCacheEntry *e = &table[i];
+    if (e->key < 0) return e;
+    if (e->hash == hash && e->len == len
+        && memcmp (keys + e->key, word, len * sizeof (uint32_t)) == 0)
+      return e;
+    i = (i + 1) & (HYPHEN_CACHE_SIZE - 1);
+    }
+  }
+
+
+/*============================================================================
+  hyphen_table_new
+============================================================================*/
+static HyphenCacheEntry *hyphen_table_new (void)
+  {
+  HyphenCacheEntry *table = malloc (HYPHEN_CACHE_SIZE
+    * sizeof (HyphenCacheEntry));
+  int i;
+  for (i = 0; i < HYPHEN_CACHE_SIZE; i++)
+    table[i].key = -1;
+  return table;
+  }
+
+
+/*============================================================================
+  hyphen_add_exception
+  Add a word from \hyphenation{}, like "ta-ble", to the exceptions.
+============================================================================*/
+static void hyphen_add_exception (Hyphenator *self, const uint32_t *s,
+       int len)
+  {
+  uint32_t word [HYPHEN_MAX_WORD];
+  uint64_t points = 0;
+  int i, n = 0;
+  for (i = 0; i < len && n < HYPHEN_MAX_WORD; i++)
+    {
+    if (s[i] == '-')
+      points |= (uint64_t)1 << n;
+    else
+      word[n++] = fold_char (s[i], FOLD_CASE);
+    }
+  if (n == 0 || i < len) return;
+  if (self->exception_keys_len >= HYPHEN_CACHE_MAX) return;
+
+  uint32_t hash = hyphen_hash (word, n);
+  HyphenCacheEntry *e = hyphen_table_find (self->exceptions,
+    self->exception_keys, hash, word, n);
+  if (e->key < 0)
+    {
+    self->exception_keys = realloc (self->exception_keys,
+      (self->exception_keys_len + n) * sizeof (uint32_t));
+    memcpy (self->exception_keys + self->exception_keys_len, word,
+      n * sizeof (uint32_t));
+    e->key = self->exception_keys_len;
+    e->len = n;
+    e->hash = hash;
+    self->exception_keys_len += n;
+    }
+  e->points = points;
+  }
+
+
+/*============================================================================
+  hyphen_add_pattern
+  Add a pattern, like ".ach4" or "1ba", to the unpacked trie. The
+  alphabet must already be complete.
+============================================================================*/
+static void hyphen_add_pattern (Hyphenator *self, HyphenNode **nodes,
+       int *nnodes, const uint32_t *s, int len)
+  {
+  BYTE values [HYPHEN_MAX_WORD + 2];
+  int symbols [HYPHEN_MAX_WORD + 2];
+  int i, n = 0;
+  memset (values, 0, sizeof (values));
+  for (i = 0; i < len && n <= HYPHEN_MAX_WORD; i++)
+    {
+    if (s[i] >= '0' && s[i] <= '9')
+      values[n] = s[i] - '0';
+    else
+      symbols[n++] = hyphen_symbol (self, fold_char (s[i], FOLD_CASE));
+    }
+  if (n == 0 || i < len) return;
+
+  int node = 0;
+  for (i = 0; i < n; i++)
+    {
+    int child = (*nodes)[node].child;
+    while (child >= 0 && (*nodes)[child].symbol != symbols[i])
+      child = (*nodes)[child].sibling;
+    if (child < 0)
+      {
+      *nodes = realloc (*nodes, (*nnodes + 1) * sizeof (HyphenNode));
+      child = (*nnodes)++;
+      (*nodes)[child].child = -1;
+      (*nodes)[child].symbol = symbols[i];
+      (*nodes)[child].out = -1;
+      (*nodes)[child].sibling = (*nodes)[node].child;
+      (*nodes)[node].child = child;
+      }
+    node = child;
+    }
+
+  self->pool = realloc (self->pool, self->pool_len + n + 2);
+  (*nodes)[node].out = self->pool_len;
+  self->pool[self->pool_len++] = (BYTE)(n + 1);
+  memcpy (self->pool + self->pool_len, values, n + 1);
+  self->pool_len += n + 1;
+  }
+
+
+/*============================================================================
+  hyphen_pack
+  Pack the unpacked trie into the double array. Each node's children
+  are placed at the lowest base at which all their slots are free. The
+  packed state of each node is recorded in its 'sibling' field, which
+  is no longer needed by then.
+============================================================================*/
+static void hyphen_grow (Hyphenator *self, int size)
+  {
+  if (size <= self->trie_size) return;
+  int newsize = self->trie_size ? self->trie_size : 1024;
+  while (newsize < size) newsize *= 2;
+  self->base = realloc (self->base, newsize * sizeof (int));
+  self->check = realloc (self->check, newsize * sizeof (int));
+  self->out = realloc (self->out, newsize * sizeof (int));
+  int i;
+  for (i = self->trie_size; i < newsize; i++)
+    {
+    self->base[i] = 0;
+    self->check[i] = TRIE_FREE;
+    self->out[i] = -1;
+    }
+  self->trie_size = newsize;
+  }
+
+static void hyphen_pack (Hyphenator *self, HyphenNode *nodes, int nnodes)
+  {
+  int *queue = malloc (nnodes * sizeof (int));
+  int head = 0, tail = 0;
+  int first_free = 1;
+
+  hyphen_grow (self, self->alphabet_len + 2);
+  self->check[0] = 0; // The root is state 0
+  nodes[0].sibling = 0;
+  queue[tail++] = 0;
+
+  while (head < tail)
+    {
+    int node = queue[head++];
+    int state = nodes[node].sibling;
+    if (nodes[node].child < 0) continue;
+
+    while (first_free < self->trie_size && self->check[first_free]
+             != TRIE_FREE)
+      first_free++;
+
+    int b, child;
+    for (b = first_free - 1; ; b++)
+      {
+      BOOL fits = TRUE;
+      if (b < 1) continue;
+      hyphen_grow (self, b + self->alphabet_len + 1);
+      for (child = nodes[node].child; child >= 0 && fits;
+             child = nodes[child].sibling)
+        {
+        if (self->check[b + nodes[child].symbol] != TRIE_FREE) fits = FALSE;
+        }
+      if (fits) break;
+      }
+
+    self->base[state] = b;
+    child = nodes[node].child;
+    while (child >= 0)
+      {
+      int next = nodes[child].sibling;
+      int t = b + nodes[child].symbol;
+      self->check[t] = state;
+      self->out[t] = nodes[child].out;
+      nodes[child].sibling = t;
+      queue[tail++] = child;
+      child = next;
+      }
+    }
+
+  free (queue);
+  }
+
+
+/*============================================================================
+  hyphen_next_word
+  Return the next whitespace-delimited word in s, starting at *pos,
+  skipping %-comments. Returns the length, or 0 at the end.
+============================================================================*/
+static int hyphen_next_word (const uint32_t *s, int len, int *pos,
+       int *start)
+  {
+  int i = *pos;
+  while (i < len)
+    {
+    if (s[i] == '%')
+      {
+      while (i < len && s[i] != '\n') i++;
+      }
+    else if (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')
+      i++;
+    else
+      break;
+    }
+  *start = i;
+  // A command ends at a brace, so that "\patterns{a1b" is two words
+  BOOL command = i < len && s[i] == '\\';
+  while (i < len && s[i] != ' ' && s[i] != '\t' && s[i] != '\n'
+           && s[i] != '\r' && s[i] != '%' && !(command && s[i] == '{'))
+    i++;
+  *pos = i;
+  return i - *start;
+  }
+
+
+/*============================================================================
+  hyphen_is_command
+============================================================================*/
+static BOOL hyphen_is_command (const uint32_t *s, int len, const char *cmd)
+  {
+  int i, l = strlen (cmd);
+  if (len < l) return FALSE;
+  for (i = 0; i < l; i++)
+    if (s[i] != (uint32_t)cmd[i]) return FALSE;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  hyphenator_create_from_file
+  Read a TeX pattern file. Patterns are taken from \patterns{...} and
+  exceptions from \hyphenation{...}; if there is no \patterns command,
+  every word in the file is taken to be a pattern, as in the plain-text
+  files distributed with hyph-utf8.
+============================================================================*/
+BOOL hyphenator_create_from_file (const char *filename,
+       Hyphenator **result, char **error)
+  {
+  IN
+  WString *ws = NULL;
+  if (!wstring_create_from_utf8_file (filename, &ws, error))
+    {
+    OUT
+    return FALSE;
+    }
+
+  const uint32_t *s = wstring_wstr (ws);
+  int len = wstring_length (ws);
+  Hyphenator *self = malloc (sizeof (Hyphenator));
+  memset (self, 0, sizeof (Hyphenator));
+  pthread_mutex_init (&self->mutex, NULL);
+  self->exceptions = hyphen_table_new ();
+  self->cache = hyphen_table_new ();
+  self->fingerprint = 0xCBF29CE484222325ULL;
+  int i;
+  for (i = 0; i < len; i++)
+    self->fingerprint = (self->fingerprint ^ s[i]) * 0x100000001B3ULL;
+
+  BOOL has_patterns = FALSE;
+  int pass, pos, start, l;
+  for (pos = 0; (l = hyphen_next_word (s, len, &pos, &start)) > 0; )
+    if (hyphen_is_command (s + start, l, "\\patterns")) has_patterns = TRUE;
+
+  // Pass 0 collects the alphabet; pass 1 builds the trie, once the
+  //  alphabet is known and sorted
+  HyphenNode *nodes = malloc (sizeof (HyphenNode));
+  nodes[0].child = -1;
+  nodes[0].sibling = -1;
+  nodes[0].symbol = 0;
+  nodes[0].out = -1;
+  int nnodes = 1, npatterns = 0;
+  for (pass = 0; pass < 2; pass++)
+    {
+    typedef enum { IN_NONE, IN_PATTERNS, IN_EXCEPTIONS } Section;
+    Section section = has_patterns ? IN_NONE : IN_PATTERNS;
+    for (pos = 0; (l = hyphen_next_word (s, len, &pos, &start)) > 0; )
+      {
+      const uint32_t *w = s + start;
+      if (hyphen_is_command (w, l, "\\patterns"))
+        {
+        section = IN_PATTERNS;
+        continue;
+        }
+      if (hyphen_is_command (w, l, "\\hyphenation"))
+        {
+        section = IN_EXCEPTIONS;
+        continue;
+        }
+      if (section == IN_NONE) continue;
+      BOOL end = FALSE;
+      if (w[l - 1] == '}')
+        {
+        l--;
+        end = TRUE;
+        }
+      if (w[0] == '{')
+        {
+        w++;
+        l--;
+        }
+      if (l > 0 && w[0] != '\\')
+        {
+        if (section == IN_EXCEPTIONS)
+          {
+          if (pass == 1) hyphen_add_exception (self, w, l);
+          }
+        else if (pass == 0)
+          {
+          for (i = 0; i < l; i++)
+            {
+            uint32_t c = fold_char (w[i], FOLD_CASE);
+            if (c >= '0' && c <= '9') continue;
+            if (hyphen_symbol (self, c)) continue;
+            // Insertion sort: the alphabet is small
+            self->alphabet = realloc (self->alphabet,
+              (self->alphabet_len + 1) * sizeof (uint32_t));
+            int j = self->alphabet_len++;
+            while (j > 0 && self->alphabet[j - 1] > c)
+              {
+              self->alphabet[j] = self->alphabet[j - 1];
+              j--;
+              }
+            self->alphabet[j] = c;
+            }
+          }
+        else
+          {
+          hyphen_add_pattern (self, &nodes, &nnodes, w, l);
+          npatterns++;
+          }
+        }
+      if (end) section = has_patterns ? IN_NONE : IN_PATTERNS;
+      }
+    }
+  wstring_destroy (ws);
+
+  if (npatterns == 0)
+    {
+    asprintf (error, "No hyphenation patterns found in '%s'", filename);
+    free (nodes);
+    hyphenator_destroy (self);
+    OUT
+    return FALSE;
+    }
+
+  hyphen_pack (self, nodes, nnodes);
+  free (nodes);
+  log_debug ("Read %d hyphenation patterns, %d letters, trie size %d",
+    npatterns, self->alphabet_len, self->trie_size);
+
+  *result = self;
+  OUT
+  return TRUE;
+  }
+
+
+/*============================================================================
+  hyphenator_fingerprint
+============================================================================*/
+uint64_t hyphenator_fingerprint (const Hyphenator *self)
+  {
+  return self->fingerprint;
+  }
+
+
+/*============================================================================
+  hyphenator_destroy
+============================================================================*/
+void hyphenator_destroy (Hyphenator *self)
+  {
+  if (!self) return;
+  if (self->alphabet) free (self->alphabet);
+  if (self->base) free (self->base);
+  if (self->check) free (self->check);
+  if (self->out) free (self->out);
+  if (self->pool) free (self->pool);
+  if (self->exceptions) free (self->exceptions);
+  if (self->exception_keys) free (self->exception_keys);
+  if (self->cache) free (self->cache);
+  if (self->cache_keys) free (self->cache_keys);
+  pthread_mutex_destroy (&self->mutex);
+  free (self);
+  }
+
+
+/*============================================================================
+  hyphen_compute
+  Apply the patterns to a (folded) word of n letters, given as alphabet
+  symbols.
+============================================================================*/
+static uint64_t hyphen_compute (const Hyphenator *self, const int *word,
+       int n)
+  {
+  // The word is matched with a '.' at each end, as in TeX
+  int dotted [HYPHEN_MAX_WORD + 2];
+  BYTE values [HYPHEN_MAX_WORD + 3];
+  int dot = hyphen_symbol (self, '.');
+  int i, len = n + 2;
+  dotted[0] = dot;
+  memcpy (dotted + 1, word, n * sizeof (int));
+  dotted[n + 1] = dot;
+  memset (values, 0, sizeof (values));
+
+  for (i = 0; i < len; i++)
+    {
+    int state = 0, j;
+    for (j = i; j < len && dotted[j]; j++)
+      {
+      int t = self->base[state] + dotted[j];
+      if (t >= self->trie_size || self->check[t] != state) break;
+      state = t;
+      if (self->out[t] >= 0)
+        {
+        const BYTE *v = self->pool + self->out[t];
+        int k, vl = v[0];
+        for (k = 0; k < vl; k++)
+          if (v[k + 1] > values[i + k]) values[i + k] = v[k + 1];
+        }
+      }
+    }
+
+  // values[k] is the value before dotted[k], which is before letter k-1
+  uint64_t points = 0;
+  for (i = HYPHEN_LEFT_MIN; i <= n - HYPHEN_RIGHT_MIN; i++)
+    if (values[i + 1] & 1) points |= (uint64_t)1 << i;
+  return points;
+  }
+
+
+/*============================================================================
+  hyphenator_hyphenate
+============================================================================*/
+uint64_t hyphenator_hyphenate (Hyphenator *self, const uint32_t *token,
+       int len)
+  {
+  // Only the letters are hyphenated: leading and trailing punctuation
+  //  is skipped, and a token with anything else inside it (a number,
+  //  or an existing hyphen) is left alone
+  uint32_t folded [HYPHEN_MAX_WORD];
+  int symbols [HYPHEN_MAX_WORD];
+  int first = 0, last = len;
+  while (first < len
+      && !hyphen_symbol (self, fold_char (token[first], FOLD_CASE)))
+    first++;
+  while (last > first
+      && !hyphen_symbol (self, fold_char (token[last - 1], FOLD_CASE)))
+    last--;
+  int i, n = last - first;
+  if (n < HYPHEN_LEFT_MIN + HYPHEN_RIGHT_MIN || n > HYPHEN_MAX_WORD)
+    return 0;
+  for (i = 0; i < n; i++)
+    {
+    folded[i] = fold_char (token[first + i], FOLD_CASE);
+    symbols[i] = hyphen_symbol (self, folded[i]);
+    if (!symbols[i] || folded[i] == '.') return 0;
+    }
+
+  uint32_t hash = hyphen_hash (folded, n);
+  uint64_t points;
+
+  pthread_mutex_lock (&self->mutex);
+  HyphenCacheEntry *e = hyphen_table_find (self->exceptions,
+    self->exception_keys, hash, folded, n);
+  if (e->key >= 0)
+    points = e->points;
+  else
+    {
+    e = hyphen_table_find (self->cache, self->cache_keys, hash, folded, n);
+    if (e->key >= 0)
+      points = e->points;
+    else
+      {
+      points = hyphen_compute (self, symbols, n);
+      if (self->cache_count >= HYPHEN_CACHE_MAX)
+        {
+        // Start again, rather than evicting entries one by one
+        int j;
+        for (j = 0; j < HYPHEN_CACHE_SIZE; j++)
+          self->cache[j].key = -1;
+        self->cache_count = 0;
+        self->cache_keys_len = 0;
+        e = hyphen_table_find (self->cache, self->cache_keys, hash,
+          folded, n);
+        }
+      if (self->cache_keys_len + n > self->cache_keys_size)
+        {
+        self->cache_keys_size = self->cache_keys_size
+          ? self->cache_keys_size * 2 : 4096;
+        self->cache_keys = realloc (self->cache_keys,
+          self->cache_keys_size * sizeof (uint32_t));
+        }
+      memcpy (self->cache_keys + self->cache_keys_len, folded,
+        n * sizeof (uint32_t));
+      e->key = self->cache_keys_len;
+      e->len = n;
+      e->hash = hash;
+      e->points = points;
+      self->cache_keys_len += n;
+      self->cache_count++;
+      }
+    }
+  pthread_mutex_unlock (&self->mutex);
+
+  // Points past bit 63 cannot be reported, and shifting a uint64_t by
+  //  64 or more is undefined
+  if (first >= 64) return 0;
+  return points << first;
+  }
@@ -0,0 +1,36 @@
+/*============================================================================
+  epub2txt v2
+  hyphen.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Word hyphenation using Liang's algorithm, as in TeX, with patterns
+  read from a TeX pattern file (e.g., hyph-en-us.tex).
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// Words longer than this are never hyphenated
+#define HYPHEN_MAX_WORD 64
+
+struct _Hyphenator;
+typedef struct _Hyphenator Hyphenator;
+
+BOOL hyphenator_create_from_file (const char *filename,
+       Hyphenator **result, char **error);
+void hyphenator_destroy (Hyphenator *self);
+
+/** A hash of the text of the pattern file, which differs, in all
+    likelihood, between files that hyphenate differently. */
+uint64_t hyphenator_fingerprint (const Hyphenator *self);
+
+/** Find the hyphenation points in a token of len characters, which may
+    include leading and trailing punctuation. Returns a bit mask in which
+    bit i is set if the token can be broken (with a hyphen) before
+    character i; points at character 64 or later are not reported.
+    Results are cached, so calling this repeatedly for the
+    same words is cheap. It is safe to call from multiple threads. */
+uint64_t hyphenator_hyphenate (Hyphenator *self, const uint32_t *token,
+       int len);
@@ -0,0 +1,120 @@
+/*============================================================================
+  epub2txt v2
+  jsonl.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The fields that are the same for every record of a section are escaped
+  once, when the section starts, and kept as a prefix.
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jsonl.h"
+
+typedef struct _JsonlWriter
+  {
+  ParaSink sink;
+  char *book;
+  Buffer *prefix;  // The record, up to the paragraph index
+  Buffer *out;     // The record being built
+  int para_index;
+  } JsonlWriter;
+
+
+/*============================================================================
+  jsonl_destroy
+============================================================================*/
+static void jsonl_destroy (ParaSink *sink)
+  {
+  JsonlWriter *self = (JsonlWriter *)sink;
+  free (self->book);
+  buffer_destroy (self->prefix);
+  buffer_destroy (self->out);
+  free (self);
+  }
+
+
+/*============================================================================
+  jsonl_begin_section
+============================================================================*/
+static void jsonl_begin_section (ParaSink *sink, int spine_index, 
+       const char *href)
+  {
+  JsonlWriter *self = (JsonlWriter *)sink;
+  char number [32];
+  buffer_clear (self->prefix);
+  buffer_append (self->prefix, "{\"book\": ", 9);
+  buffer_append_json (self->prefix, self->book);
+  buffer_append (self->prefix, ", \"spine_index\": ", 17);
+  if (href)
+    {
+    int len = snprintf (number, sizeof (number), "%d", spine_index);
+    buffer_append (self->prefix, number, len);
+    }
+  else
+    buffer_append (self->prefix, "null", 4);
+  buffer_append (self->prefix, ", \"href\": ", 10);
+  buffer_append_json (self->prefix, href);
+  buffer_append (self->prefix, ", \"para_index\": ", 16);
+  self->para_index = 0;
+  }
+
+
+/*============================================================================
+  jsonl_begin_book
+============================================================================*/
+static void jsonl_begin_book (ParaSink *sink, const char *book)
+  {
+  JsonlWriter *self = (JsonlWriter *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  jsonl_begin_section (sink, -1, NULL);
+  }
+
+
+/*============================================================================
+  jsonl_para
+============================================================================*/
+static void jsonl_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  JsonlWriter *self = (JsonlWriter *)sink;
+  char number [32];
+  int n = snprintf (number, sizeof (number), "%d", self->para_index++);
+  Buffer *out = self->out;
+  buffer_clear (out);
+  buffer_append (out, self->prefix->data, self->prefix->len);
+  buffer_append (out, number, n);
+  buffer_append (out, ", \"kind\": ", 10);
+  if (kind == PARA_META)
+    buffer_append (out, "\"meta\"", 6);
+  else if (kind == PARA_HEADING)
+    buffer_append (out, "\"heading\"", 9);
+  else
+    buffer_append (out, "\"paragraph\"", 11);
+  buffer_append (out, ", \"text\": ", 10);
+  buffer_append_json_n (out, text, len);
+  buffer_append (out, "}\n", 2);
+  parasink_write (sink, out->data, out->len);
+  }
+
+
+/*============================================================================
+  jsonl_create
+============================================================================*/
+ParaSink *jsonl_create (Compressor *compressor)
+  {
+  JsonlWriter *self = malloc (sizeof (JsonlWriter));
+  memset (self, 0, sizeof (JsonlWriter));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = jsonl_begin_book;
+  self->sink.begin_section = jsonl_begin_section;
+  self->sink.para = jsonl_para;
+  self->sink.destroy = jsonl_destroy;
+  self->book = strdup ("");
+  self->prefix = buffer_create ();
+  self->out = buffer_create ();
+  jsonl_begin_section (&self->sink, -1, NULL);
+  return &self->sink;
+  }
@@ -0,0 +1,22 @@
+/*============================================================================
+  epub2txt v2
+  jsonl.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  JSON Lines output: rather than wrapped text, one record per paragraph,
+  with the book, spine item, and kind of block that it came from:
+
+  {"book": ..., "spine_index": N, "href": ..., "para_index": N, 
+   "kind": "paragraph", "text": ...}
+
+  kind is "paragraph", "heading" (h1 to h5), or "meta" (a line of
+  metadata, whose spine_index and href are null). Hard line breaks
+  within a paragraph are kept as "\n" in the text. The records are
+  written in large blocks.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+ParaSink *jsonl_create (Compressor *compressor);
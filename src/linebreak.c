@@ -0,0 +1,666 @@
+/*============================================================================
+  epub2txt v2
+  linebreak.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Line-break classification after UAX #14, "Unicode Line Breaking
+  Algorithm". This is not a complete implementation -- there is no
+  dictionary-based breaking for South-East Asian scripts, for example --
+  but it handles the cases that matter for wrapping book text: CJK
+  ideographs and kana, which have no spaces between words, hyphens and
+  dashes, punctuation that must not start a line, and non-breaking
+  spaces.
+
+  Code points are looked up in a two-stage table: the high bits select
+  a 128-entry block, and identical blocks are shared, so the whole of
+  planes 0-3 fits into a few tens of kilobytes that stay in cache. Each
+  table entry holds the line-break class and the display width. The
+  tables are generated from the range list below the first time they
+  are needed.
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "linebreak.h"
+
+#define LB_BLOCK_BITS 7
+#define LB_BLOCK_SIZE (1 << LB_BLOCK_BITS)
+#define LB_TABLE_LIMIT 0x40000
+#define LB_NUM_BLOCKS (LB_TABLE_LIMIT >> LB_BLOCK_BITS)
+
+// Table entry layout: low six bits are the class, then two width flags
+#define LB_CLASS_MASK 0x3F
+#define LB_WIDE 0x40
+#define LB_ZERO 0x80
+
+// Pair-table actions, as in the UAX #14 example implementation
+#define PAIR_UNSET 0
+#define PAIR_DIRECT 1                // Break allowed
+#define PAIR_INDIRECT 2              // Break allowed only after spaces
+#define PAIR_COMBINING_INDIRECT 3    // CM/ZWJ: like INDIRECT, else attach
+#define PAIR_COMBINING_PROHIBITED 4  // CM/ZWJ: no break, attach
+#define PAIR_PROHIBITED 5            // No break, even after spaces
+
+typedef struct _LineBreakRange
+  {
+  uint32_t first;
+  uint32_t last;
+  BYTE value;
+  } LineBreakRange;
+
+/* Ranges are applied in order, so later entries override earlier ones.
+   Anything not listed is AL (alphabetic), with width 1. Ambiguous (AI),
+   unknown (XX) and South-East Asian (SA) characters are resolved to AL,
+   and conditional Japanese starters (CJ) to NS, as UAX #14 suggests for
+   general-purpose line breaking. */
+static const LineBreakRange lb_ranges[] =
+  {
+  // Controls are combining marks in UAX #14, and have no width
+  { 0x0000, 0x001F, LB_CM | LB_ZERO },
+  { 0x007F, 0x009F, LB_CM | LB_ZERO },
+  { 0x0009, 0x0009, LB_BA },
+  { 0x000A, 0x000A, LB_LF },
+  { 0x000B, 0x000C, LB_BK },
+  { 0x000D, 0x000D, LB_CR },
+  { 0x0085, 0x0085, LB_NL },
+  { 0x0020, 0x0020, LB_SP },
+  { 0x0021, 0x0021, LB_EX },
+  { 0x0022, 0x0022, LB_QU },
+  { 0x0024, 0x0024, LB_PR },
+  { 0x0025, 0x0025, LB_PO },
+  { 0x0027, 0x0027, LB_QU },
+  { 0x0028, 0x0028, LB_OP },
+  { 0x0029, 0x0029, LB_CP },
+  { 0x002B, 0x002B, LB_PR },
+  { 0x002C, 0x002C, LB_IS },
+  { 0x002D, 0x002D, LB_HY },
+  { 0x002E, 0x002E, LB_IS },
+  { 0x002F, 0x002F, LB_SY },
+  { 0x0030, 0x0039, LB_NU },
+  { 0x003A, 0x003B, LB_IS },
+  { 0x003F, 0x003F, LB_EX },
+  { 0x005B, 0x005B, LB_OP },
+  { 0x005C, 0x005C, LB_PR },
+  { 0x005D, 0x005D, LB_CP },
+  { 0x007B, 0x007B, LB_OP },
+  { 0x007C, 0x007C, LB_BA },
+  { 0x007D, 0x007D, LB_CL },
+  { 0x00A0, 0x00A0, LB_GL },
+  { 0x00A1, 0x00A1, LB_OP },
+  { 0x00A2, 0x00A2, LB_PO },
+  { 0x00A3, 0x00A5, LB_PR },
+  { 0x00AB, 0x00AB, LB_QU },
+  { 0x00AD, 0x00AD, LB_BA | LB_ZERO }, // soft hyphen
+  { 0x00B0, 0x00B0, LB_PO },
+  { 0x00B1, 0x00B1, LB_PR },
+  { 0x00B4, 0x00B4, LB_BB },
+  { 0x00BB, 0x00BB, LB_QU },
+  { 0x00BF, 0x00BF, LB_OP },
+  { 0x02C8, 0x02C8, LB_BB },
+  { 0x02CC, 0x02CC, LB_BB },
+  { 0x02DF, 0x02DF, LB_BB },
+  { 0x0300, 0x036F, LB_CM | LB_ZERO },
+  { 0x034F, 0x034F, LB_GL | LB_ZERO },
+  { 0x037E, 0x037E, LB_IS },
+  { 0x0483, 0x0489, LB_CM | LB_ZERO },
+  { 0x0589, 0x0589, LB_IS },
+  { 0x058A, 0x058A, LB_BA },
+  { 0x0591, 0x05BD, LB_CM | LB_ZERO },
+  { 0x05BE, 0x05BE, LB_BA },
+  { 0x05BF, 0x05C7, LB_CM | LB_ZERO },
+  { 0x05C6, 0x05C6, LB_EX },
+  { 0x05D0, 0x05F2, LB_HL },
+  { 0x0609, 0x060B, LB_PO },
+  { 0x060C, 0x060D, LB_IS },
+  { 0x0610, 0x061A, LB_CM | LB_ZERO },
+  { 0x061B, 0x061B, LB_EX },
+  { 0x061E, 0x061F, LB_EX },
+  { 0x064B, 0x065F, LB_CM | LB_ZERO },
+  { 0x0660, 0x0669, LB_NU },
+  { 0x066A, 0x066A, LB_PO },
+  { 0x066B, 0x066C, LB_NU },
+  { 0x0670, 0x0670, LB_CM | LB_ZERO },
+  { 0x06D4, 0x06D4, LB_EX },
+  { 0x06D6, 0x06DC, LB_CM | LB_ZERO },
+  { 0x06DF, 0x06E4, LB_CM | LB_ZERO },
+  { 0x06E7, 0x06E8, LB_CM | LB_ZERO },
+  { 0x06EA, 0x06ED, LB_CM | LB_ZERO },
+  { 0x06F0, 0x06F9, LB_NU },
+  { 0x0900, 0x0903, LB_CM | LB_ZERO },
+  { 0x093A, 0x093C, LB_CM | LB_ZERO },
+  { 0x093E, 0x094F, LB_CM | LB_ZERO },
+  { 0x0951, 0x0957, LB_CM | LB_ZERO },
+  { 0x0962, 0x0963, LB_CM | LB_ZERO },
+  { 0x0964, 0x0965, LB_BA },
+  { 0x0966, 0x096F, LB_NU },
+  { 0x09E6, 0x09EF, LB_NU },
+  { 0x0E31, 0x0E31, LB_CM | LB_ZERO },
+  { 0x0E34, 0x0E3A, LB_CM | LB_ZERO },
+  { 0x0E3F, 0x0E3F, LB_PR },
+  { 0x0E47, 0x0E4E, LB_CM | LB_ZERO },
+  { 0x0E50, 0x0E59, LB_NU },
+  { 0x0F0B, 0x0F0B, LB_BA },
+  { 0x0F0C, 0x0F0C, LB_GL },
+  { 0x1100, 0x115F, LB_JL | LB_WIDE },
+  { 0x1160, 0x11A7, LB_JV | LB_ZERO },
+  { 0x11A8, 0x11FF, LB_JT | LB_ZERO },
+  { 0x1680, 0x1680, LB_BA },
+  { 0x180E, 0x180E, LB_GL | LB_ZERO },
+  { 0x1AB0, 0x1AFF, LB_CM | LB_ZERO },
+  { 0x1DC0, 0x1DFF, LB_CM | LB_ZERO },
+  { 0x2000, 0x2006, LB_BA },
+  { 0x2007, 0x2007, LB_GL },
+  { 0x2008, 0x200A, LB_BA },
+  { 0x200B, 0x200B, LB_ZW | LB_ZERO },
+  { 0x200C, 0x200C, LB_CM | LB_ZERO },
+  { 0x200D, 0x200D, LB_ZWJ | LB_ZERO },
+  { 0x2010, 0x2010, LB_BA },
+  { 0x2011, 0x2011, LB_GL },
+  { 0x2012, 0x2013, LB_BA },
+  { 0x2014, 0x2014, LB_B2 },
+  { 0x2018, 0x2019, LB_QU },
+  { 0x201A, 0x201A, LB_OP },
+  { 0x201B, 0x201D, LB_QU },
+  { 0x201E, 0x201E, LB_OP },
+  { 0x201F, 0x201F, LB_QU },
+  { 0x2024, 0x2026, LB_IN },
+  { 0x2027, 0x2027, LB_BA },
+  { 0x2028, 0x2029, LB_BK },
+  { 0x202F, 0x202F, LB_GL },
+  { 0x2030, 0x2037, LB_PO },
+  { 0x2039, 0x203A, LB_QU },
+  { 0x203C, 0x203D, LB_NS },
+  { 0x2044, 0x2044, LB_IS },
+  { 0x2045, 0x2045, LB_OP },
+  { 0x2046, 0x2046, LB_CL },
+  { 0x2047, 0x2049, LB_NS },
+  { 0x205F, 0x205F, LB_BA },
+  { 0x2060, 0x2060, LB_WJ | LB_ZERO },
+  { 0x207D, 0x207D, LB_OP },
+  { 0x207E, 0x207E, LB_CL },
+  { 0x208D, 0x208D, LB_OP },
+  { 0x208E, 0x208E, LB_CL },
+  { 0x20A0, 0x20BF, LB_PR },
+  { 0x20A7, 0x20A7, LB_PO },
+  { 0x20B6, 0x20B6, LB_PO },
+  { 0x20BB, 0x20BB, LB_PO },
+  { 0x20D0, 0x20FF, LB_CM | LB_ZERO },
+  { 0x2103, 0x2103, LB_PO },
+  { 0x2109, 0x2109, LB_PO },
+  { 0x2116, 0x2116, LB_PR },
+  { 0x2212, 0x2213, LB_PR },
+  { 0x22EF, 0x22EF, LB_IN },
+  { 0x2308, 0x2308, LB_OP },
+  { 0x2309, 0x2309, LB_CL },
+  { 0x230A, 0x230A, LB_OP },
+  { 0x230B, 0x230B, LB_CL },
+  { 0x2329, 0x2329, LB_OP | LB_WIDE },
+  { 0x232A, 0x232A, LB_CL | LB_WIDE },
+  { 0x275B, 0x2760, LB_QU },
+  { 0x2762, 0x2763, LB_EX },
+  { 0x2E3A, 0x2E3B, LB_B2 },
+  // CJK radicals, symbols, kana, Hangul compatibility and ideographs
+  { 0x2E80, 0x2FFF, LB_ID | LB_WIDE },
+  { 0x3000, 0x3000, LB_BA | LB_WIDE },
+  { 0x3001, 0x3002, LB_CL | LB_WIDE },
+  { 0x3003, 0x303E, LB_ID | LB_WIDE },
+  { 0x3005, 0x3005, LB_NS | LB_WIDE },
+  { 0x3008, 0x3008, LB_OP | LB_WIDE },
+  { 0x3009, 0x3009, LB_CL | LB_WIDE },
+  { 0x300A, 0x300A, LB_OP | LB_WIDE },
+  { 0x300B, 0x300B, LB_CL | LB_WIDE },
+  { 0x300C, 0x300C, LB_OP | LB_WIDE },
+  { 0x300D, 0x300D, LB_CL | LB_WIDE },
+  { 0x300E, 0x300E, LB_OP | LB_WIDE },
+  { 0x300F, 0x300F, LB_CL | LB_WIDE },
+  { 0x3010, 0x3010, LB_OP | LB_WIDE },
+  { 0x3011, 0x3011, LB_CL | LB_WIDE },
+  { 0x3014, 0x3014, LB_OP | LB_WIDE },
+  { 0x3015, 0x3015, LB_CL | LB_WIDE },
+  { 0x3016, 0x3016, LB_OP | LB_WIDE },
+  { 0x3017, 0x3017, LB_CL | LB_WIDE },
+  { 0x3018, 0x3018, LB_OP | LB_WIDE },
+  { 0x3019, 0x3019, LB_CL | LB_WIDE },
+  { 0x301A, 0x301A, LB_OP | LB_WIDE },
+  { 0x301B, 0x301B, LB_CL | LB_WIDE },
+  { 0x301C, 0x301C, LB_NS | LB_WIDE },
+  { 0x301D, 0x301D, LB_OP | LB_WIDE },
+  { 0x301E, 0x301F, LB_CL | LB_WIDE },
+  { 0x302A, 0x302F, LB_CM | LB_ZERO },
+  { 0x303B, 0x303C, LB_NS | LB_WIDE },
+  { 0x3041, 0x33FF, LB_ID | LB_WIDE },
+  { 0x3099, 0x309A, LB_CM | LB_ZERO },
+  { 0x309B, 0x309E, LB_NS | LB_WIDE },
+  { 0x30A0, 0x30A0, LB_NS | LB_WIDE },
+  { 0x30FB, 0x30FB, LB_NS | LB_WIDE },
+  { 0x30FC, 0x30FE, LB_NS | LB_WIDE },
+  // Small kana (CJ, resolved to NS)
+  { 0x3041, 0x3041, LB_NS | LB_WIDE },
+  { 0x3043, 0x3043, LB_NS | LB_WIDE },
+  { 0x3045, 0x3045, LB_NS | LB_WIDE },
+  { 0x3047, 0x3047, LB_NS | LB_WIDE },
+  { 0x3049, 0x3049, LB_NS | LB_WIDE },
+  { 0x3063, 0x3063, LB_NS | LB_WIDE },
+  { 0x3083, 0x3083, LB_NS | LB_WIDE },
+  { 0x3085, 0x3085, LB_NS | LB_WIDE },
+  { 0x3087, 0x3087, LB_NS | LB_WIDE },
+  { 0x308E, 0x308E, LB_NS | LB_WIDE },
+  { 0x3095, 0x3096, LB_NS | LB_WIDE },
+  { 0x30A1, 0x30A1, LB_NS | LB_WIDE },
+  { 0x30A3, 0x30A3, LB_NS | LB_WIDE },
+  { 0x30A5, 0x30A5, LB_NS | LB_WIDE },
+  { 0x30A7, 0x30A7, LB_NS | LB_WIDE },
+  { 0x30A9, 0x30A9, LB_NS | LB_WIDE },
+  { 0x30C3, 0x30C3, LB_NS | LB_WIDE },
+  { 0x30E3, 0x30E3, LB_NS | LB_WIDE },
+  { 0x30E5, 0x30E5, LB_NS | LB_WIDE },
+  { 0x30E7, 0x30E7, LB_NS | LB_WIDE },
+  { 0x30EE, 0x30EE, LB_NS | LB_WIDE },
+  { 0x30F5, 0x30F6, LB_NS | LB_WIDE },
+  { 0x31F0, 0x31FF, LB_NS | LB_WIDE },
+  { 0x3400, 0x4DBF, LB_ID | LB_WIDE },
+  { 0x4E00, 0x9FFF, LB_ID | LB_WIDE },
+  { 0xA000, 0xA4CF, LB_ID | LB_WIDE },
+  { 0xA015, 0xA015, LB_NS | LB_WIDE },
+  // Hangul syllables are H3, except every 28th, which is H2 (see below)
+  { 0xAC00, 0xD7A3, LB_H3 | LB_WIDE },
+  { 0xF900, 0xFAFF, LB_ID | LB_WIDE },
+  { 0xFB1D, 0xFB4F, LB_HL },
+  { 0xFE00, 0xFE0F, LB_CM | LB_ZERO },
+  { 0xFE10, 0xFE19, LB_IS | LB_WIDE },
+  { 0xFE11, 0xFE12, LB_CL | LB_WIDE },
+  { 0xFE15, 0xFE16, LB_EX | LB_WIDE },
+  { 0xFE19, 0xFE19, LB_IN | LB_WIDE },
+  { 0xFE20, 0xFE2F, LB_CM | LB_ZERO },
+  { 0xFE30, 0xFE6F, LB_ID | LB_WIDE },
+  { 0xFE50, 0xFE50, LB_CL | LB_WIDE },
+  { 0xFE52, 0xFE52, LB_CL | LB_WIDE },
+  { 0xFE54, 0xFE55, LB_NS | LB_WIDE },
+  { 0xFE56, 0xFE57, LB_EX | LB_WIDE },
+  { 0xFE59, 0xFE59, LB_OP | LB_WIDE },
+  { 0xFE5A, 0xFE5A, LB_CL | LB_WIDE },
+  { 0xFE69, 0xFE69, LB_PR | LB_WIDE },
+  { 0xFE6A, 0xFE6A, LB_PO | LB_WIDE },
+  { 0xFEFF, 0xFEFF, LB_WJ | LB_ZERO },
+  // Full-width forms
+  { 0xFF01, 0xFF60, LB_ID | LB_WIDE },
+  { 0xFF01, 0xFF01, LB_EX | LB_WIDE },
+  { 0xFF04, 0xFF04, LB_PR | LB_WIDE },
+  { 0xFF05, 0xFF05, LB_PO | LB_WIDE },
+  { 0xFF08, 0xFF08, LB_OP | LB_WIDE },
+  { 0xFF09, 0xFF09, LB_CL | LB_WIDE },
+  { 0xFF0C, 0xFF0C, LB_CL | LB_WIDE },
+  { 0xFF0E, 0xFF0E, LB_CL | LB_WIDE },
+  { 0xFF1A, 0xFF1B, LB_NS | LB_WIDE },
+  { 0xFF1F, 0xFF1F, LB_EX | LB_WIDE },
+  { 0xFF3B, 0xFF3B, LB_OP | LB_WIDE },
+  { 0xFF3D, 0xFF3D, LB_CL | LB_WIDE },
+  { 0xFF5B, 0xFF5B, LB_OP | LB_WIDE },
+  { 0xFF5D, 0xFF5D, LB_CL | LB_WIDE },
+  { 0xFF5F, 0xFF5F, LB_OP | LB_WIDE },
+  { 0xFF60, 0xFF60, LB_CL | LB_WIDE },
+  { 0xFF61, 0xFF61, LB_CL },
+  { 0xFF62, 0xFF62, LB_OP },
+  { 0xFF63, 0xFF64, LB_CL },
+  { 0xFF65, 0xFF65, LB_NS },
+  { 0xFF67, 0xFF70, LB_NS },
+  { 0xFF9E, 0xFF9F, LB_NS },
+  { 0xFFE0, 0xFFE0, LB_PO | LB_WIDE },
+  { 0xFFE1, 0xFFE1, LB_PR | LB_WIDE },
+  { 0xFFE2, 0xFFE4, LB_ID | LB_WIDE },
+  { 0xFFE5, 0xFFE6, LB_PR | LB_WIDE },
+  // Emoji and pictographs
+  { 0x1F000, 0x1FAFF, LB_ID },
+  { 0x1F1E6, 0x1F1FF, LB_RI },
+  { 0x1F300, 0x1F64F, LB_ID | LB_WIDE },
+  { 0x1F3FB, 0x1F3FF, LB_EM | LB_WIDE },
+  { 0x1F680, 0x1F6FF, LB_ID | LB_WIDE },
+  { 0x1F900, 0x1F9FF, LB_ID | LB_WIDE },
+  { 0x1FA70, 0x1FAFF, LB_ID | LB_WIDE },
+  // Emoji that take a skin-tone modifier (EB), which can't be split
+  //  from the modifier that follows (LB30b)
+  { 0x261D, 0x261D, LB_EB },
+  { 0x26F9, 0x26F9, LB_EB },
+  { 0x270A, 0x270B, LB_EB | LB_WIDE },
+  { 0x270C, 0x270D, LB_EB },
+  { 0x1F385, 0x1F385, LB_EB | LB_WIDE },
+  { 0x1F3C2, 0x1F3C4, LB_EB | LB_WIDE },
+  { 0x1F3C7, 0x1F3C7, LB_EB | LB_WIDE },
+  { 0x1F3CA, 0x1F3CC, LB_EB | LB_WIDE },
+  { 0x1F442, 0x1F443, LB_EB | LB_WIDE },
+  { 0x1F446, 0x1F450, LB_EB | LB_WIDE },
+  { 0x1F466, 0x1F478, LB_EB | LB_WIDE },
+  { 0x1F47C, 0x1F47C, LB_EB | LB_WIDE },
+  { 0x1F481, 0x1F483, LB_EB | LB_WIDE },
+  { 0x1F485, 0x1F487, LB_EB | LB_WIDE },
+  { 0x1F48F, 0x1F48F, LB_EB | LB_WIDE },
+  { 0x1F491, 0x1F491, LB_EB | LB_WIDE },
+  { 0x1F4AA, 0x1F4AA, LB_EB | LB_WIDE },
+  { 0x1F574, 0x1F575, LB_EB | LB_WIDE },
+  { 0x1F57A, 0x1F57A, LB_EB | LB_WIDE },
+  { 0x1F590, 0x1F590, LB_EB | LB_WIDE },
+  { 0x1F595, 0x1F596, LB_EB | LB_WIDE },
+  { 0x1F645, 0x1F647, LB_EB | LB_WIDE },
+  { 0x1F64B, 0x1F64F, LB_EB | LB_WIDE },
+  { 0x1F6A3, 0x1F6A3, LB_EB | LB_WIDE },
+  { 0x1F6B4, 0x1F6B6, LB_EB | LB_WIDE },
+  { 0x1F6C0, 0x1F6C0, LB_EB | LB_WIDE },
+  { 0x1F6CC, 0x1F6CC, LB_EB | LB_WIDE },
+  { 0x1F90C, 0x1F90C, LB_EB | LB_WIDE },
+  { 0x1F90F, 0x1F90F, LB_EB | LB_WIDE },
+  { 0x1F918, 0x1F91F, LB_EB | LB_WIDE },
+  { 0x1F926, 0x1F926, LB_EB | LB_WIDE },
+  { 0x1F930, 0x1F939, LB_EB | LB_WIDE },
+  { 0x1F93C, 0x1F93E, LB_EB | LB_WIDE },
+  { 0x1F977, 0x1F977, LB_EB | LB_WIDE },
+  { 0x1F9B5, 0x1F9B6, LB_EB | LB_WIDE },
+  { 0x1F9B8, 0x1F9B9, LB_EB | LB_WIDE },
+  { 0x1F9BB, 0x1F9BB, LB_EB | LB_WIDE },
+  { 0x1F9CD, 0x1F9CF, LB_EB | LB_WIDE },
+  { 0x1F9D1, 0x1F9DD, LB_EB | LB_WIDE },
+  { 0x1FAC3, 0x1FAC5, LB_EB | LB_WIDE },
+  { 0x1FAF0, 0x1FAF8, LB_EB | LB_WIDE },
+  // Supplementary ideographic planes
+  { 0x20000, 0x3FFFD, LB_ID | LB_WIDE },
+  };
+
+static pthread_once_t lb_once = PTHREAD_ONCE_INIT;
+static uint16_t lb_stage1 [LB_NUM_BLOCKS];
+static BYTE *lb_stage2 = NULL;
+static BYTE lb_pairs [LB_NUM_PAIR_CLASSES][LB_NUM_PAIR_CLASSES];
+
+/*============================================================================
+  linebreak_build_classes
+  Expand the range list into a flat table, then fold the flat table
+  into shared 128-entry blocks. Blocks are deduplicated using a small
+  hash table keyed on the block contents.
+============================================================================*/
+static void linebreak_build_classes (void)
+  {
+  BYTE *flat = malloc (LB_TABLE_LIMIT);
+  memset (flat, LB_AL, LB_TABLE_LIMIT);
+
+  int i, n = sizeof (lb_ranges) / sizeof (lb_ranges[0]);
+  for (i = 0; i < n; i++)
+    {
+    const LineBreakRange *r = &lb_ranges[i];
+    memset (flat + r->first, r->value, r->last - r->first + 1);
+    }
+  for (i = 0xAC00; i <= 0xD7A3; i += 28)
+    flat[i] = LB_H2 | LB_WIDE;
+
+  #define LB_HASH_SIZE 1024
+  int buckets [LB_HASH_SIZE];
+  int *chain = malloc (LB_NUM_BLOCKS * sizeof (int));
+  memset (buckets, 0xFF, sizeof (buckets));
+  lb_stage2 = malloc (LB_TABLE_LIMIT);
+  int nblocks = 0;
+
+  for (i = 0; i < LB_NUM_BLOCKS; i++)
+    {
+    const BYTE *block = flat + (i << LB_BLOCK_BITS);
+    uint32_t h = 2166136261u;
+    int j;
+    for (j = 0; j < LB_BLOCK_SIZE; j++)
+      h = (h ^ block[j]) * 16777619u;
+    h &= LB_HASH_SIZE - 1;
+
+    int b;
+    for (b = buckets[h]; b >= 0; b = chain[b])
+      {
+      if (memcmp (lb_stage2 + (b << LB_BLOCK_BITS), block,
+            LB_BLOCK_SIZE) == 0) break;
+      }
+    if (b < 0)
+      {
+      b = nblocks++;
+      memcpy (lb_stage2 + (b << LB_BLOCK_BITS), block, LB_BLOCK_SIZE);
+      chain[b] = buckets[h];
+      buckets[h] = b;
+      }
+    lb_stage1[i] = (uint16_t)b;
+    }
+
+  lb_stage2 = realloc (lb_stage2, nblocks << LB_BLOCK_BITS);
+  free (chain);
+  free (flat);
+  }
+
+/*============================================================================
+  linebreak_build_pairs
+  Derive the pair table from the UAX #14 rules LB8-LB30. Rules are applied
+  in order of precedence, and a cell once set is not overwritten, so the
+  first matching rule wins. Anything left over is a direct break (LB31).
+============================================================================*/
+#define IS(x, a) ((x) == (a))
+#define IS2(x, a, b) ((x) == (a) || (x) == (b))
+#define IS5(x, a, b, c, d, e) ((x) == (a) || (x) == (b) || (x) == (c) \
+    || (x) == (d) || (x) == (e))
+#define ALHL(x) IS2(x, LB_AL, LB_HL)
+#define KOREAN(x) IS5(x, LB_JL, LB_JV, LB_JT, LB_H2, LB_H3)
+
+static void linebreak_set_pair (int b, int a, BYTE action)
+  {
+  if (lb_pairs[b][a] == PAIR_UNSET) lb_pairs[b][a] = action;
+  }
+
+static void linebreak_build_pairs (void)
+  {
+  memset (lb_pairs, PAIR_UNSET, sizeof (lb_pairs));
+  int b, a;
+  for (b = 0; b < LB_NUM_PAIR_CLASSES; b++)
+    {
+    for (a = 0; a < LB_NUM_PAIR_CLASSES; a++)
+      {
+      // LB8: ZW SP* ÷
+      if (IS(b, LB_ZW))
+        linebreak_set_pair (b, a, PAIR_DIRECT);
+      // LB9, LB10: combining marks attach to their base
+      if (IS2(a, LB_CM, LB_ZWJ))
+        {
+        if (IS5(b, LB_OP, LB_QU, LB_GL, LB_WJ, LB_ZWJ))
+          linebreak_set_pair (b, a, PAIR_COMBINING_PROHIBITED);
+        else
+          linebreak_set_pair (b, a, PAIR_COMBINING_INDIRECT);
+        }
+      // LB11: × WJ, WJ ×
+      if (IS(a, LB_WJ)) linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      if (IS(b, LB_WJ)) linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB12: GL ×
+      if (IS(b, LB_GL)) linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB13: × CL, × CP, × EX, × IS, × SY
+      if (IS5(a, LB_CL, LB_CP, LB_EX, LB_IS, LB_SY))
+        linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      // LB12a: [^SP BA HY] × GL
+      if (IS(a, LB_GL) && !IS2(b, LB_BA, LB_HY))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB14: OP SP* ×
+      if (IS(b, LB_OP)) linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      // LB15: QU SP* × OP
+      if (IS(b, LB_QU) && IS(a, LB_OP))
+        linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      // LB16: (CL | CP) SP* × NS
+      if (IS2(b, LB_CL, LB_CP) && IS(a, LB_NS))
+        linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      // LB17: B2 SP* × B2
+      if (IS(b, LB_B2) && IS(a, LB_B2))
+        linebreak_set_pair (b, a, PAIR_PROHIBITED);
+      // LB19: × QU, QU ×
+      if (IS(a, LB_QU) || IS(b, LB_QU))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB21: × BA, × HY, × NS, BB ×
+      if (IS(a, LB_BA) || IS(a, LB_HY) || IS(a, LB_NS) || IS(b, LB_BB))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB21b: SY × HL
+      if (IS(b, LB_SY) && IS(a, LB_HL))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB22: × IN
+      if (IS(a, LB_IN)) linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB23: (AL | HL) × NU, NU × (AL | HL)
+      if ((ALHL(b) && IS(a, LB_NU)) || (IS(b, LB_NU) && ALHL(a)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB23a: PR × (ID | EB | EM), (ID | EB | EM) × PO
+      if (IS(b, LB_PR) && (IS(a, LB_ID) || IS2(a, LB_EB, LB_EM)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      if ((IS(b, LB_ID) || IS2(b, LB_EB, LB_EM)) && IS(a, LB_PO))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB24: (PR | PO) × (AL | HL), (AL | HL) × (PR | PO)
+      if ((IS2(b, LB_PR, LB_PO) && ALHL(a))
+          || (ALHL(b) && IS2(a, LB_PR, LB_PO)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB25: numbers, in the pairwise form of the earlier standard
+      if ((IS5(b, LB_CL, LB_CP, LB_NU, LB_NU, LB_NU) && IS2(a, LB_PO, LB_PR))
+          || (IS2(b, LB_PO, LB_PR) && IS2(a, LB_OP, LB_NU))
+          || (IS5(b, LB_HY, LB_IS, LB_NU, LB_SY, LB_SY) && IS(a, LB_NU)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB26, LB27: Korean syllable blocks
+      if ((IS(b, LB_JL) && (IS2(a, LB_JL, LB_JV) || IS2(a, LB_H2, LB_H3)))
+          || (IS2(b, LB_JV, LB_H2) && IS2(a, LB_JV, LB_JT))
+          || (IS2(b, LB_JT, LB_H3) && IS(a, LB_JT))
+          || (KOREAN(b) && IS(a, LB_PO))
+          || (IS(b, LB_PR) && KOREAN(a)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB28: (AL | HL) × (AL | HL)
+      if (ALHL(b) && ALHL(a)) linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB29: IS × (AL | HL)
+      if (IS(b, LB_IS) && ALHL(a)) linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB30: (AL | HL | NU) × OP, CP × (AL | HL | NU)
+      if ((IS5(b, LB_AL, LB_HL, LB_NU, LB_NU, LB_NU) && IS(a, LB_OP))
+          || (IS(b, LB_CP) && IS5(a, LB_AL, LB_HL, LB_NU, LB_NU, LB_NU)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB30a, LB30b: RI × RI, EB × EM
+      if ((IS(b, LB_RI) && IS(a, LB_RI)) || (IS(b, LB_EB) && IS(a, LB_EM)))
+        linebreak_set_pair (b, a, PAIR_INDIRECT);
+      // LB31: ÷ everywhere else
+      linebreak_set_pair (b, a, PAIR_DIRECT);
+      }
+    }
+  }
+
+/*============================================================================
+  linebreak_build
+============================================================================*/
+static void linebreak_build (void)
+  {
+  linebreak_build_classes ();
+  linebreak_build_pairs ();
+  }
+
+/*============================================================================
+  linebreak_init
+  Build the lookup tables, the first time this is called. It is cheap,
+  and safe to call from any thread: a thread that calls it while 
+  another is building the tables waits until they are complete.
+============================================================================*/
+void linebreak_init (void)
+  {
+  pthread_once (&lb_once, linebreak_build);
+  }
+
+/*============================================================================
+  linebreak_lookup
+============================================================================*/
+static inline BYTE linebreak_lookup (uint32_t c)
+  {
+  if (c < LB_TABLE_LIMIT)
+    return lb_stage2 [(lb_stage1 [c >> LB_BLOCK_BITS] << LB_BLOCK_BITS)
+      | (c & (LB_BLOCK_SIZE - 1))];
+  if (c >= 0xE0000 && c <= 0xE0FFF)
+    return LB_CM | LB_ZERO; // Tags and variation selectors
+  return LB_AL;
+  }
+
+/*============================================================================
+  linebreak_class
+============================================================================*/
+LineBreakClass linebreak_class (uint32_t c)
+  {
+  return linebreak_lookup (c) & LB_CLASS_MASK;
+  }
+
+/*============================================================================
+  linebreak_width
+  The number of terminal columns taken by a character: 0 for combining
+  marks and other invisible characters, 2 for East Asian wide and
+  full-width characters, and 1 for everything else.
+============================================================================*/
+int linebreak_width (uint32_t c)
+  {
+  BYTE v = linebreak_lookup (c);
+  if (v & LB_ZERO) return 0;
+  if (v & LB_WIDE) return 2;
+  return 1;
+  }
+
+/*============================================================================
+  linebreak_state_reset
+============================================================================*/
+void linebreak_state_reset (LineBreakState *state)
+  {
+  // Treating start-of-text as WJ prevents a break before the first
+  //  character (LB2)
+  state->prev = LB_WJ;
+  state->space = FALSE;
+  }
+
+/*============================================================================
+  linebreak_next
+  Given the state left by the previous character, determine whether a
+  line may be broken before c, and update the state. Each character is
+  examined once, so a paragraph is processed in one linear pass.
+============================================================================*/
+LineBreakAction linebreak_next (LineBreakState *state, uint32_t c)
+  {
+  LineBreakClass cls = linebreak_lookup (c) & LB_CLASS_MASK;
+
+  switch (cls)
+    {
+    case LB_SP:
+      // LB7: never break before a space
+      state->space = TRUE;
+      return LB_BREAK_NONE;
+
+    case LB_BK: case LB_CR: case LB_LF: case LB_NL:
+      linebreak_state_reset (state);
+      return LB_BREAK_MANDATORY;
+
+    default:
+      break;
+    }
+
+  LineBreakAction ret = LB_BREAK_NONE;
+  switch (lb_pairs [state->prev][cls])
+    {
+    case PAIR_DIRECT:
+      ret = LB_BREAK_ALLOWED;
+      break;
+
+    case PAIR_INDIRECT:
+      if (state->space) ret = LB_BREAK_ALLOWED;
+      break;
+
+    case PAIR_COMBINING_INDIRECT:
+      if (state->space)
+        {
+        // LB10: a combining mark after a space is treated as AL
+        ret = LB_BREAK_ALLOWED;
+        cls = LB_AL;
+        }
+      else
+        cls = state->prev; // LB9: the mark takes the class of its base
+      break;
+
+    case PAIR_COMBINING_PROHIBITED:
+      cls = state->space ? LB_AL : state->prev;
+      break;
+
+    default: // PAIR_PROHIBITED
+      break;
+    }
+
+  state->prev = cls;
+  state->space = FALSE;
+  return ret;
+  }
@@ -0,0 +1,46 @@
+/*============================================================================
+  epub2txt v2
+  linebreak.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Unicode line-break opportunities, after UAX #14. Each code point is
+  mapped to a line-break class (and a display width) through a two-stage
+  lookup table; break opportunities between successive classes come from
+  a pair table. Both tables are built once, on first use, from the
+  compact range list in linebreak.c.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// Line-break classes. The first group (up to LB_ZWJ) indexes the pair
+//  table; the remainder are resolved before the pair table is consulted
+typedef enum { LB_OP = 0, LB_CL, LB_CP, LB_QU, LB_GL, LB_NS, LB_EX, LB_SY,
+               LB_IS, LB_PR, LB_PO, LB_NU, LB_AL, LB_HL, LB_ID, LB_IN, LB_HY,
+               LB_BA, LB_BB, LB_B2, LB_ZW, LB_CM, LB_WJ, LB_H2, LB_H3,
+               LB_JL, LB_JV, LB_JT, LB_RI, LB_EB, LB_EM, LB_ZWJ,
+               LB_BK, LB_CR, LB_LF, LB_NL, LB_SP,
+               LB_NUM_CLASSES } LineBreakClass;
+
+#define LB_NUM_PAIR_CLASSES (LB_ZWJ + 1)
+
+typedef enum { LB_BREAK_NONE = 0, // No break before this character
+               LB_BREAK_ALLOWED,  // A break is allowed before this character
+               LB_BREAK_MANDATORY // A break is required before this character
+               } LineBreakAction;
+
+// Per-paragraph state for linebreak_next(). Initialize with
+//  linebreak_state_reset() at the start of every paragraph
+typedef struct _LineBreakState
+  {
+  BYTE prev;  // Class of the last non-space character
+  BOOL space; // Spaces seen since the last non-space character
+  } LineBreakState;
+
+void            linebreak_init (void);
+LineBreakClass  linebreak_class (uint32_t c);
+int             linebreak_width (uint32_t c);
+void            linebreak_state_reset (LineBreakState *state);
+LineBreakAction linebreak_next (LineBreakState *state, uint32_t c);
@@ -0,0 +1,172 @@
+/*============================================================================
+  epub2txt v2
+  lineindex.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Writing line indexes; see lineindex.h for the format. Everything is
+  kept in memory until the end: one entry per interval lines, and one
+  per spine item and book, is not much even for a very large output.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "lineindex.h"
+#include "store.h"
+
+struct _LineIndex
+  {
+  char *filename;
+  uint64_t interval;
+  uint64_t bytes;
+  uint64_t lines;
+  uint64_t *starts;
+  uint64_t nstarts;
+  uint64_t starts_size;
+  LineIndexMark *sections;
+  uint64_t nsections;
+  uint64_t sections_size;
+  LineIndexMark *books;
+  uint64_t nbooks;
+  uint64_t books_size;
+  char *strings;
+  uint64_t strings_len;
+  uint64_t strings_size;
+  };
+
+
+/*============================================================================
+  lineindex_create
+============================================================================*/
+LineIndex *lineindex_create (const char *filename, int interval)
+  {
+  LineIndex *self = malloc (sizeof (LineIndex));
+  memset (self, 0, sizeof (LineIndex));
+  self->filename = strdup (filename);
+  self->interval = interval > 0 ? interval : LINEINDEX_DEFAULT_INTERVAL;
+  // Line 0 starts at the start
+  STORE_GROW (self->starts, self->starts_size, 1);
+  self->starts[self->nstarts++] = 0;
+  STORE_GROW (self->strings, self->strings_size, 1);
+  self->strings[0] = 0;
+  self->strings_len = 1;
+  return self;
+  }
+
+
+/*============================================================================
+  lineindex_destroy
+============================================================================*/
+static void lineindex_destroy (LineIndex *self)
+  {
+  free (self->filename);
+  free (self->starts);
+  if (self->sections) free (self->sections);
+  if (self->books) free (self->books);
+  free (self->strings);
+  free (self);
+  }
+
+
+/*============================================================================
+  lineindex_mark
+============================================================================*/
+static void lineindex_mark (LineIndex *self, LineIndexMark *mark,
+       uint32_t number)
+  {
+  mark->offset = self->bytes;
+  mark->line = self->lines;
+  mark->book = self->nbooks ? self->nbooks - 1 : 0;
+  mark->number = number;
+  }
+
+
+/*============================================================================
+  lineindex_begin_book
+============================================================================*/
+void lineindex_begin_book (LineIndex *self, const char *name)
+  {
+  size_t len = strlen (name) + 1;
+  STORE_GROW (self->strings, self->strings_size, self->strings_len + len);
+  memcpy (self->strings + self->strings_len, name, len);
+  STORE_GROW (self->books, self->books_size, self->nbooks + 1);
+  self->nbooks++;
+  lineindex_mark (self, &self->books[self->nbooks - 1], self->strings_len);
+  self->strings_len += len;
+  }
+
+
+/*============================================================================
+  lineindex_begin_section
+============================================================================*/
+void lineindex_begin_section (LineIndex *self, int spine_index)
+  {
+  STORE_GROW (self->sections, self->sections_size, self->nsections + 1);
+  lineindex_mark (self, &self->sections[self->nsections++], spine_index);
+  }
+
+
+/*============================================================================
+  lineindex_count
+============================================================================*/
+void lineindex_count (LineIndex *self, const char *s, size_t len)
+  {
+  const char *end = s + len, *p = s;
+  while ((p = memchr (p, '\n', end - p)))
+    {
+    p++;
+    self->lines++;
+    if (self->lines % self->interval == 0)
+      {
+      STORE_GROW (self->starts, self->starts_size, self->nstarts + 1);
+      self->starts[self->nstarts++] = self->bytes + (p - s);
+      }
+    }
+  self->bytes += len;
+  }
+
+
+/*============================================================================
+  lineindex_close
+============================================================================*/
+BOOL lineindex_close (LineIndex *self, char **error)
+  {
+  LineIndexFileHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, LINEINDEX_FILE_MAGIC, 4);
+  header.version = LINEINDEX_FILE_VERSION;
+  header.byte_order = LINEINDEX_FILE_BYTE_ORDER;
+  header.interval = self->interval;
+  header.bytes = self->bytes;
+  header.lines = self->lines;
+  header.nlines = self->nstarts;
+  header.nsections = self->nsections;
+  header.nbooks = self->nbooks;
+  header.strings_len = self->strings_len;
+
+  BOOL ok = FALSE;
+  FILE *f = fopen (self->filename, "wb");
+  if (f)
+    {
+    ok = fwrite (&header, sizeof (header), 1, f) == 1
+      && store_write_chunk (f, self->starts,
+           self->nstarts * sizeof (uint64_t), &header.lines_offset)
+      && store_write_chunk (f, self->sections,
+           self->nsections * sizeof (LineIndexMark), &header.sections_offset)
+      && store_write_chunk (f, self->books,
+           self->nbooks * sizeof (LineIndexMark), &header.books_offset)
+      && store_write_chunk (f, self->strings, self->strings_len,
+           &header.strings_offset)
+      && fseek (f, 0, SEEK_SET) == 0
+      && fwrite (&header, sizeof (header), 1, f) == 1;
+    if (fclose (f) != 0) ok = FALSE;
+    }
+  if (!ok)
+    asprintf (error, "Can't write line index '%s': %s", self->filename,
+      strerror (errno));
+  lineindex_destroy (self);
+  return ok;
+  }
+
@@ -0,0 +1,82 @@
+/*============================================================================
+  epub2txt v2
+  lineindex.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Line index: a side output that records where lines, spine items and
+  books start in the text that epub2txt writes, so that a reader of a
+  large output -- e.g., of a batch run over many books -- can go
+  straight to a line or chapter, without reading what comes before it.
+  The index is built as the text is written, so it costs no extra pass.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "defs.h"
+
+#define LINEINDEX_DEFAULT_INTERVAL 100
+
+typedef struct _LineIndex LineIndex;
+
+/** Start an index, to be written to filename by lineindex_close(); the
+    start of every interval-th line is recorded. */
+LineIndex  *lineindex_create (const char *filename, int interval);
+
+/** Write the index to its file, and destroy it. */
+BOOL        lineindex_close (LineIndex *self, char **error);
+
+/** A book starts here. */
+void        lineindex_begin_book (LineIndex *self, const char *name);
+
+/** A spine item starts here: that is, its section separator, if there
+    is one, or else its text. */
+void        lineindex_begin_section (LineIndex *self, int spine_index);
+
+/** Count text written to the output. */
+void        lineindex_count (LineIndex *self, const char *s, size_t len);
+
+/*============================================================================
+  Line index files
+
+  A header, followed by four arrays, each aligned to eight bytes, in
+  the byte order of the machine that wrote the file. The first array
+  holds the byte offset at which line k * interval starts, for each k;
+  so line L is found by reading entry L / interval, and then skipping
+  L % interval lines from there. The second and third hold the start
+  of each spine item and each book, in order, and the fourth is a
+  string table with the books' names.
+============================================================================*/
+
+#define LINEINDEX_FILE_MAGIC "E2X\x1A"
+#define LINEINDEX_FILE_VERSION 1
+#define LINEINDEX_FILE_BYTE_ORDER 0x01020304
+
+typedef struct _LineIndexFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t interval;
+  uint64_t bytes;           // Total length of the text
+  uint64_t lines;           // Total number of newlines
+  uint64_t lines_offset;    // Array of uint64_t
+  uint64_t nlines;
+  uint64_t sections_offset; // Array of LineIndexMark
+  uint64_t nsections;
+  uint64_t books_offset;    // Array of LineIndexMark
+  uint64_t nbooks;
+  uint64_t strings_offset;
+  uint64_t strings_len;
+  } LineIndexFileHeader;
+
+typedef struct _LineIndexMark
+  {
+  uint64_t offset;   // Byte offset
+  uint64_t line;     // Line number, from 0
+  uint32_t book;     // Index of the book
+  uint32_t number;   // For a section, its index in the spine; for a
+                     //  book, the offset of its name in the string table
+  } LineIndexMark;
+
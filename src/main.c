@@ -14,9 +14,74 @@
 #include <getopt.h>
 #include <signal.h>
 #include "epub2txt.h" 
+#include "jsonl.h" 
+#include "markdown.h" 
+#include "arrow.h" 
+#include "stats.h" 
+#include "grep.h" 
+#include "searchindex.h" 
+#include "bloom.h" 
+#include "freq.h" 
+#include "fingerprint.h" 
+#include "chunk.h" 
+#include "textsink.h" 
+#include "tee.h" 
+#include "prefetch.h" 
+#include "chapters.h" 
 #include "defs.h" 
 #include "log.h" 
 
+// What is written: text, by default, or one of these, which can't be
+//   combined
+typedef enum
+  {
+  OUTPUT_TEXT = 0,
+  OUTPUT_PAGER,
+  OUTPUT_PAGES,
+  OUTPUT_IR,
+  OUTPUT_DIR,
+  OUTPUT_JSONL,
+  OUTPUT_MARKDOWN,
+  OUTPUT_ARROW,
+  OUTPUT_STATS,
+  OUTPUT_GREP,
+  OUTPUT_INDEX,
+  OUTPUT_BLOOM,
+  OUTPUT_FREQ,
+  OUTPUT_FINGERPRINT,
+  OUTPUT_CHUNK,
+  OUTPUT_OUTS,
+  OUTPUT_NUM_MODES
+  } OutputMode;
+
+// For each mode, the option that selects it, and whether it can read
+//   --from-ir, be combined with each of the options that change how
+//   output is made, and use ANSI codes
+static const struct
+  {
+  const char *option;
+  BOOL from_ir, source_map, line_index, compress, io, boilerplate, ansi;
+  } output_modes [OUTPUT_NUM_MODES] =
+  {
+  //                        from_ir smap   lindex compr  io     boiler ansi
+  { "text",                 TRUE,  TRUE,  TRUE,  TRUE,  TRUE,  TRUE,  TRUE },
+  { "--pager",              TRUE,  FALSE, FALSE, FALSE, FALSE, FALSE, TRUE },
+  { "--page",               TRUE,  FALSE, FALSE, FALSE, FALSE, FALSE, TRUE },
+  { "--emit-ir",            FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, TRUE },
+  { "--output-dir",         FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE },
+  { "--format=jsonl",       FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--format=markdown",    FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--format=arrow",       FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--stats-only",         FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--grep",               FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  TRUE },
+  { "--index-dir",          FALSE, FALSE, FALSE, FALSE, TRUE,  TRUE,  FALSE },
+  { "--bloom-file",         FALSE, FALSE, FALSE, FALSE, TRUE,  TRUE,  FALSE },
+  { "--freq",               FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--fingerprint",        FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--chunk",              FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  { "--out",                FALSE, FALSE, FALSE, TRUE,  TRUE,  TRUE,  FALSE },
+  };
+
 /*============================================================================
   sig_handler 
 ============================================================================*/
@@ -41,8 +106,53 @@ int main (int argc, char **argv)
   BOOL meta = FALSE;
   BOOL notext = FALSE;
   BOOL calibre = FALSE;
+  BOOL optimal = FALSE;
+  BOOL justify = FALSE;
   char *section_separator = NULL;
+  char *hyphenate = NULL;
+  char *emit_ir = NULL;
+  BOOL from_ir = FALSE;
+  char *page_index = NULL;
+  int page = -1;
+  BOOL pager = FALSE;
+  char *source_map = NULL;
+  int source_map_interval = SOURCEMAP_DEFAULT_INTERVAL;
+  long long find_source = -1;
+  char *line_index = NULL;
+  int line_index_interval = LINEINDEX_DEFAULT_INTERVAL;
+  char *output_dir = NULL;
+  BOOL jsonl = FALSE;
+  BOOL markdown = FALSE;
+  BOOL arrow = FALSE;
+  BOOL stats_only = FALSE;
+  char *grep = NULL;
+  int grep_flags = 0;
+  int grep_context = GREP_DEFAULT_CONTEXT;
+  char *index_dir = NULL;
+  char *query = NULL;
+  char *bloom_file = NULL;
+  BloomFile *bloom = NULL;
+  BOOL freq = FALSE;
+  int freq_flags = 0;
+  int ngram = 1;
+  int top = 0;
+  BOOL fingerprint = FALSE;
+  BOOL near_duplicates = FALSE;
+  double similarity = FINGERPRINT_DEFAULT_SIMILARITY;
+  int boilerplate = 0;
+  BOOL chunk = FALSE;
+  int chunk_words = CHUNK_DEFAULT_WORDS;
+  int chunk_overlap = CHUNK_DEFAULT_OVERLAP;
+  char **outs = NULL;
+  int nouts = 0;
+  BOOL out_threads = FALSE;
+  BOOL io = FALSE;
+  BatchIoMethod io_method = BATCHIO_URING;
+  int prefetch_depth = PREFETCH_DEFAULT_DEPTH;
+  CompressMethod compress = COMPRESS_NONE;
+  int compress_level = 0;
   int width = 80;
+  int height = 24;
 
   static struct option long_options[] =
     {
@@ -57,6 +167,47 @@ int main (int argc, char **argv)
      {"separator", required_argument, NULL, 's'},
      {"help", no_argument, NULL, 'h'},
      {"notext", no_argument, NULL, 0},
+     {"wrap", required_argument, NULL, 0},
+     {"justify", no_argument, NULL, 0},
+     {"hyphenate", required_argument, NULL, 0},
+     {"emit-ir", required_argument, NULL, 0},
+     {"from-ir", no_argument, NULL, 0},
+     {"height", required_argument, NULL, 0},
+     {"page", required_argument, NULL, 0},
+     {"page-index", required_argument, NULL, 0},
+     {"pager", no_argument, NULL, 'p'},
+     {"source-map", required_argument, NULL, 0},
+     {"source-map-interval", required_argument, NULL, 0},
+     {"find-source", required_argument, NULL, 0},
+     {"line-index", required_argument, NULL, 0},
+     {"line-index-interval", required_argument, NULL, 0},
+     {"output-dir", required_argument, NULL, 0},
+     {"format", required_argument, NULL, 0},
+     {"compress", required_argument, NULL, 0},
+     {"stats-only", no_argument, NULL, 0},
+     {"grep", required_argument, NULL, 0},
+     {"regex", no_argument, NULL, 0},
+     {"ignore-case", no_argument, NULL, 'i'},
+     {"ignore-diacritics", no_argument, NULL, 0},
+     {"files-with-matches", no_argument, NULL, 0},
+     {"grep-context", required_argument, NULL, 0},
+     {"index-dir", required_argument, NULL, 0},
+     {"query", required_argument, NULL, 0},
+     {"bloom-file", required_argument, NULL, 0},
+     {"freq", required_argument, NULL, 0},
+     {"ngram", required_argument, NULL, 0},
+     {"top", required_argument, NULL, 0},
+     {"fold-case", no_argument, NULL, 0},
+     {"freq-format", required_argument, NULL, 0},
+     {"fingerprint", no_argument, NULL, 0},
+     {"near-duplicates", no_argument, NULL, 0},
+     {"similarity", required_argument, NULL, 0},
+     {"boilerplate", required_argument, NULL, 0},
+     {"chunk", required_argument, NULL, 0},
+     {"out", required_argument, NULL, 0},
+     {"out-threads", no_argument, NULL, 0},
+     {"io", required_argument, NULL, 0},
+     {"prefetch", required_argument, NULL, 0},
      {0, 0, 0, 0}
     };
 
@@ -71,6 +222,7 @@ int main (int argc, char **argv)
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
       {
       width = ws.ws_col;
+      height = ws.ws_row;
       }
     is_a_tty = TRUE;
     }
@@ -86,6 +238,7 @@ int main (int argc, char **argv)
       if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
         {
         width = ws.ws_col;
+        height = ws.ws_row;
         }
       }
     is_a_tty = TRUE;
@@ -95,7 +248,7 @@ int main (int argc, char **argv)
   while (1)
     {
     int option_index = 0;
-    opt = getopt_long (argc, argv, "avw:l:nrmchs:",
+    opt = getopt_long (argc, argv, "avw:l:nrmchpis:",
       long_options, &option_index);
 
     if (opt == -1) break;
@@ -123,11 +276,211 @@ int main (int argc, char **argv)
           meta = TRUE; 
         else if (strcmp (long_options[option_index].name, "notext") == 0)
           notext = TRUE; 
+        else if (strcmp (long_options[option_index].name, "wrap") == 0)
+          {
+          if (strcmp (optarg, "optimal") == 0)
+            optimal = TRUE;
+          else if (strcmp (optarg, "greedy") == 0)
+            optimal = FALSE;
+          else
+            {
+            fprintf (stderr, "%s: unknown wrap mode '%s'\n", argv[0], optarg);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "justify") == 0)
+          justify = TRUE; 
+        else if (strcmp (long_options[option_index].name, "hyphenate") == 0)
+          hyphenate = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "emit-ir") == 0)
+          emit_ir = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "from-ir") == 0)
+          from_ir = TRUE; 
+        else if (strcmp (long_options[option_index].name, "height") == 0)
+          height = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "page") == 0)
+          page = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "page-index") == 0)
+          page_index = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "pager") == 0)
+          pager = TRUE; 
+        else if (strcmp (long_options[option_index].name, "source-map") == 0)
+          source_map = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, 
+            "source-map-interval") == 0)
+          source_map_interval = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "find-source") == 0)
+          find_source = atoll (optarg); 
+        else if (strcmp (long_options[option_index].name, "line-index") == 0)
+          line_index = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, 
+            "line-index-interval") == 0)
+          line_index_interval = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "output-dir") == 0)
+          output_dir = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "compress") == 0)
+          {
+          char *error = NULL;
+          if (!compress_parse (optarg, &compress, &compress_level, &error))
+            {
+            fprintf (stderr, "%s: %s\n", argv[0], error);
+            free (error);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "stats-only") == 0)
+          stats_only = TRUE; 
+        else if (strcmp (long_options[option_index].name, "grep") == 0)
+          grep = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "regex") == 0)
+          grep_flags |= GREP_REGEX; 
+        else if (strcmp (long_options[option_index].name, 
+            "ignore-diacritics") == 0)
+          grep_flags |= GREP_IGNORE_DIACRITICS; 
+        else if (strcmp (long_options[option_index].name, 
+            "files-with-matches") == 0)
+          grep_flags |= GREP_FILES_ONLY; 
+        else if (strcmp (long_options[option_index].name, 
+            "grep-context") == 0)
+          grep_context = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "index-dir") == 0)
+          index_dir = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "query") == 0)
+          query = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "bloom-file") == 0)
+          bloom_file = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "freq") == 0)
+          {
+          freq = TRUE;
+          if (strcmp (optarg, "chapter") == 0)
+            freq_flags |= FREQ_BY_CHAPTER;
+          else if (strcmp (optarg, "book") != 0)
+            {
+            fprintf (stderr, "%s: --freq must be book or chapter\n", 
+              argv[0]);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "ngram") == 0)
+          {
+          ngram = atoi (optarg); 
+          if (ngram < 1 || ngram > FREQ_MAX_NGRAM)
+            {
+            fprintf (stderr, "%s: --ngram must be from 1 to %d\n", 
+              argv[0], FREQ_MAX_NGRAM);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "top") == 0)
+          top = atoi (optarg); 
+        else if (strcmp (long_options[option_index].name, "fold-case") == 0)
+          freq_flags |= FREQ_FOLD_CASE; 
+        else if (strcmp (long_options[option_index].name, 
+            "freq-format") == 0)
+          {
+          if (strcmp (optarg, "binary") == 0)
+            freq_flags |= FREQ_BINARY;
+          else if (strcmp (optarg, "tsv") != 0)
+            {
+            fprintf (stderr, "%s: unknown --freq-format '%s'\n", 
+              argv[0], optarg);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, 
+            "fingerprint") == 0)
+          fingerprint = TRUE; 
+        else if (strcmp (long_options[option_index].name, 
+            "near-duplicates") == 0)
+          near_duplicates = TRUE; 
+        else if (strcmp (long_options[option_index].name, 
+            "similarity") == 0)
+          similarity = atof (optarg); 
+        else if (strcmp (long_options[option_index].name, 
+            "boilerplate") == 0)
+          {
+          boilerplate = atoi (optarg); 
+          if (boilerplate < 1)
+            {
+            fprintf (stderr, "%s: --boilerplate must be at least 1\n", 
+              argv[0]);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "chunk") == 0)
+          {
+          char *error = NULL;
+          chunk = TRUE;
+          if (!chunk_parse (optarg, &chunk_words, &chunk_overlap, &error))
+            {
+            fprintf (stderr, "%s: %s\n", argv[0], error);
+            free (error);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "out") == 0)
+          {
+          static const char *kinds [] = { "text", "jsonl", "markdown", 
+            "arrow", "stats", "freq", "fingerprint", "chunk", NULL };
+          size_t len = strcspn (optarg, ":");
+          int k;
+          for (k = 0; kinds[k]; k++)
+            if (strlen (kinds[k]) == len 
+                 && strncmp (kinds[k], optarg, len) == 0) break;
+          if (!kinds[k])
+            {
+            fprintf (stderr, "%s: unknown output '%.*s'\n", argv[0], 
+              (int)len, optarg);
+            exit (-1);
+            }
+          outs = realloc (outs, (nouts + 1) * sizeof (char *));
+          outs[nouts++] = strdup (optarg);
+          }
+        else if (strcmp (long_options[option_index].name, "out-threads") == 0)
+          out_threads = TRUE;
+        else if (strcmp (long_options[option_index].name, "prefetch") == 0)
+          {
+          prefetch_depth = atoi (optarg); 
+          if (prefetch_depth < 0)
+            {
+            fprintf (stderr, "%s: --prefetch must be at least 0\n", argv[0]);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "io") == 0)
+          {
+          char *error = NULL;
+          io = TRUE;
+          if (!batchio_parse (optarg, &io_method, &error))
+            {
+            fprintf (stderr, "%s: %s\n", argv[0], error);
+            free (error);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "format") == 0)
+          {
+          jsonl = markdown = arrow = FALSE;
+          if (strcmp (optarg, "jsonl") == 0)
+            jsonl = TRUE;
+          else if (strcmp (optarg, "markdown") == 0)
+            markdown = TRUE;
+          else if (strcmp (optarg, "arrow") == 0)
+            arrow = TRUE;
+          else if (strcmp (optarg, "text") == 0)
+            ;
+          else
+            {
+            fprintf (stderr, "%s: unknown format '%s'\n", argv[0], optarg);
+            exit (-1);
+            }
+          }
         else if (strcmp 
 	       (long_options[option_index].name, "separator") == 0)
           section_separator = strdup (optarg); 
         else
           exit (-1);
+        break;
       case 'a':
         ascii = TRUE; break;
       case 'c':
@@ -136,8 +489,12 @@ int main (int argc, char **argv)
         noansi = TRUE; break;
       case 'h':
         show_help = TRUE; break;
+      case 'i':
+        grep_flags |= GREP_IGNORE_CASE; break;
       case 'v':
         show_version = TRUE; break;
+      case 'p':
+        pager = TRUE; break;
       case 'r':
        raw = TRUE; break;
       case 'l':
@@ -163,19 +520,109 @@ int main (int argc, char **argv)
     {
     printf ("Usage: %s [options] {files...}\n", argv[0]);
     printf ("  -a,--ascii          try to output ASCII only\n");
+    printf ("     --bloom-file=file  build, or with --grep use, book filters\n");
+    printf ("     --boilerplate=N  drop paragraphs repeated in over N chapters\n");
     printf ("  -c,--calibre        show Calibre metadata (with -m)\n");
+    printf ("     --chunk=words=N,overlap=M  write overlapping chunks, as "
+      "JSONL\n");
+    printf ("     --compress=method[:level] compress output: gzip or zstd\n");
+    printf ("     --emit-ir=file   save the parsed document to file\n");
+    printf ("     --find-source=N  look up offset N in a --source-map file\n");
+    printf ("     --fingerprint    write SimHash and MinHash signatures\n");
+    printf ("     --files-with-matches  with --grep, show only matching books\n");
+    printf ("     --fold-case      with --freq, count words in lower case\n");
+    printf ("     --format=fmt     text (default), jsonl, markdown, or arrow\n");
+    printf ("     --freq=scope     count words by book or by chapter, as TSV\n");
+    printf ("     --freq-format=fmt  --freq output: tsv (default) or binary\n");
+    printf ("     --from-ir        files are saved documents, not EPUBs\n");
+    printf ("     --grep=pattern   search for pattern, showing where it is\n");
+    printf ("     --grep-context=N characters to show around each match\n");
     printf ("  -h,--help           show this message\n");
+    printf ("     --height=N       set page height, for --page\n");
+    printf ("     --hyphenate=file hyphenate using TeX patterns from file\n");
+    printf ("  -i,--ignore-case    with --grep, ignore case\n");
+    printf ("     --index-dir=dir  add the books to a search index in dir\n");
+    printf ("     --ignore-diacritics  with --grep, ignore accents\n");
+    printf ("     --io=method      read ahead, and write, in the background: "
+      "uring or threads\n");
+    printf ("     --justify        justify lines (implies --wrap=optimal)\n");
     printf ("  -l,--log=N          set log level, 0-4\n");
+    printf ("     --line-index=file save the offsets of lines and sections\n");
+    printf ("     --line-index-interval=N  lines between entries\n");
     printf ("  -m,--meta           dump document metadata\n");
     printf ("  -n,--noansi         don't output ANSI terminal codes\n");
+    printf ("     --near-duplicates  files are --fingerprint output; "
+      "show near-duplicates\n");
+    printf ("     --ngram=N        with --freq, count runs of up to N words\n");
     printf ("     --notext         don't output document body\n");
+    printf ("     --out=kind:file  also write text, jsonl, stats, etc., "
+      "to file\n");
+    printf ("     --out-threads    write each --out on a thread of its own\n");
+    printf ("     --output-dir=dir write each chapter to a file in dir\n");
+    printf ("     --page=N         output only page N (0: count pages)\n");
+    printf ("     --page-index=file save or reuse the page layout in file\n");
+    printf ("  -p,--pager          read in a built-in pager, on a terminal\n");
+    printf ("     --prefetch=N     read the next N books ahead (default %d; "
+      "0: off)\n", PREFETCH_DEFAULT_DEPTH);
+    printf ("     --query=words    look up words in the --index-dir index\n");
     printf ("  -r,--raw            no formatting at all\n");
+    printf ("     --regex          --grep pattern is a regular expression\n");
     printf ("  -s,--separator=text section separator text\n");
+    printf ("     --similarity=S   for --near-duplicates, 0 to 1 (default "
+      "0.8)\n");
+    printf ("     --source-map=file save a map from the text to the EPUB\n");
+    printf ("     --source-map-interval=N  bytes between checkpoints\n");
+    printf ("     --stats-only     count words, sentences, etc., as JSON\n");
+    printf ("     --top=N          with --freq, show only the N most frequent\n");
     printf ("  -v,--version        show version\n");
     printf ("  -w,--width=N        set output width\n");
+    printf ("     --wrap=mode      line wrapping: greedy (default) or optimal\n");
     exit (0);
     }
 
+  if (find_source >= 0)
+    {
+    char *error = NULL, *href = NULL;
+    uint32_t offset;
+    uint64_t distance;
+    if (!source_map)
+      {
+      fprintf (stderr, "%s: --find-source needs --source-map\n", argv[0]); 
+      exit (-1);
+      }
+    if (!sourcemap_find (source_map, find_source, &href, &offset, 
+          &distance, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      exit (-1);
+      }
+    printf ("%s\t%u\t%llu\n", href, offset, (unsigned long long)distance);
+    free (href);
+    free (source_map);
+    exit (0);
+    }
+
+  if (query)
+    {
+    char *error = NULL;
+    BOOL found = FALSE;
+    if (!index_dir)
+      {
+      fprintf (stderr, "%s: --query needs --index-dir\n", argv[0]); 
+      exit (-1);
+      }
+    if (!searchindex_query (index_dir, query, &found, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      exit (-1);
+      }
+    free (index_dir);
+    free (query);
+    exit (found ? 0 : 1);
+    }
+
   if (optind == argc)
     {
     fprintf (stderr, "%s: no files selected\n", argv[0]); 
@@ -183,41 +630,398 @@ int main (int argc, char **argv)
     exit (-1);
     }
 
+  if (near_duplicates)
+    {
+    char *error = NULL;
+    BOOL found = FALSE;
+    if (!fingerprint_near_duplicates (argv + optind, argc - optind, 
+          similarity, &found, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      exit (-1);
+      }
+    exit (found ? 0 : 1);
+    }
+
+  if (page_index && page < 0)
+    page = 0;
+
+  // With --grep, the filters are used; otherwise, they are built
+  const BOOL selected [OUTPUT_NUM_MODES] = { FALSE, FALSE, page >= 0, 
+    emit_ir != NULL, output_dir != NULL, jsonl, markdown, arrow, stats_only,
+    grep != NULL, index_dir != NULL, bloom_file && !grep, freq, fingerprint,
+    chunk, nouts > 0 };
+  OutputMode mode = OUTPUT_TEXT;
+  int m;
+  for (m = 0; m < OUTPUT_NUM_MODES; m++)
+    {
+    if (!selected[m]) continue;
+    if (mode != OUTPUT_TEXT)
+      {
+      fprintf (stderr, "%s: %s can't be used with %s\n", argv[0], 
+        output_modes[m].option, output_modes[mode].option); 
+      exit (-1);
+      }
+    mode = m;
+    }
+  // The pager is only for terminals; otherwise, just write the text
+  if (pager && mode == OUTPUT_TEXT && isatty (STDOUT_FILENO) && !compress 
+       && !io && !boilerplate)
+    mode = OUTPUT_PAGER;
+  pager = mode == OUTPUT_PAGER;
+  if (height <= 0)
+    height = 24;
+
+  const struct { BOOL used, allowed; const char *option; } modifiers [] =
+    {
+    { from_ir, output_modes[mode].from_ir, "--from-ir" },
+    { source_map != NULL, output_modes[mode].source_map, "--source-map" },
+    { line_index != NULL, output_modes[mode].line_index, "--line-index" },
+    { compress != COMPRESS_NONE, output_modes[mode].compress, "--compress" },
+    { io, output_modes[mode].io, "--io" },
+    { boilerplate > 0, output_modes[mode].boilerplate, "--boilerplate" },
+    };
+  for (m = 0; m < (int)(sizeof (modifiers) / sizeof (modifiers[0])); m++)
+    {
+    if (modifiers[m].used && !modifiers[m].allowed)
+      {
+      fprintf (stderr, "%s: %s can't be used with %s\n", argv[0], 
+        modifiers[m].option, output_modes[mode].option); 
+      exit (-1);
+      }
+    }
+
+  if (source_map && (from_ir || boilerplate))
+    {
+    fprintf (stderr, "%s: --source-map can't be used with %s\n", argv[0],
+      from_ir ? "--from-ir" : "--boilerplate"); 
+    exit (-1);
+    }
+  if ((emit_ir || source_map) && optind != argc - 1)
+    {
+    fprintf (stderr, "%s: %s needs exactly one EPUB file\n", argv[0], 
+      emit_ir ? "--emit-ir" : "--source-map"); 
+    exit (-1);
+    }
+
   Epub2TxtOptions options;
   memset (&options, 0, sizeof (options));
   options.width = width;
+  options.height = height;
   options.ascii = ascii;
   options.meta = meta;
   options.notext = notext;
   options.calibre = calibre;
   options.section_separator = section_separator;
+  options.optimal = optimal || justify;
+  options.justify = justify;
+  options.output_dir = output_dir;
+  options.boilerplate = boilerplate;
+  // With --out, each output has a compressor of its own
+  if (compress && !nouts)
+    options.compressor = compressor_create (stdout, compress, 
+      compress_level);
+  if (jsonl)
+    options.para_sink = jsonl_create (options.compressor);
+  if (markdown)
+    options.para_sink = markdown_create (options.compressor);
+  if (arrow)
+    options.para_sink = arrow_create (options.compressor);
+  if (stats_only)
+    options.para_sink = stats_create (options.compressor);
+  if (index_dir)
+    options.para_sink = searchindex_create (index_dir);
+  if (bloom_file && !grep)
+    options.para_sink = bloom_create (bloom_file);
+  if (freq)
+    options.para_sink = freq_create (ngram, top, freq_flags, 
+      options.compressor);
+  if (fingerprint)
+    options.para_sink = fingerprint_create (options.compressor);
+  if (chunk)
+    options.para_sink = chunk_create (chunk_words, chunk_overlap, 
+      options.compressor);
+  if (source_map)
+    options.source_map = sourcemap_create (source_map, source_map_interval);
+  if (line_index)
+    options.line_index = lineindex_create (line_index, line_index_interval);
+
+  if (hyphenate)
+    {
+    char *error = NULL;
+    if (!hyphenator_create_from_file (hyphenate, &options.hyphenator, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      exit (-1);
+      }
+    free (hyphenate);
+    }
 
   if (is_a_tty)
     options.ansi = TRUE;
-  if (noansi)
+  if (noansi || !output_modes[mode].ansi)
     options.ansi = FALSE; 
+
+  if (grep)
+    {
+    char *error = NULL;
+    BOOL highlight = options.ansi && isatty (STDOUT_FILENO) 
+      && !options.compressor;
+    if (!grep_create (grep, grep_flags, grep_context, highlight, 
+          options.compressor, &options.para_sink, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      exit (-1);
+      }
+    options.ansi = FALSE;
+    // The filters hold words, so they can't rule out a regular expression
+    if (bloom_file && !(grep_flags & GREP_REGEX))
+      {
+      bloom = bloom_file_open (bloom_file, &error);
+      if (!bloom)
+        {
+        fprintf (stderr, "%s: %s\n", argv[0], error);
+        free (error);
+        exit (-1);
+        }
+      }
+    }
  
   options.raw = raw;
 
+  // Anything already written must come first
+  if (io)
+    {
+    fflush (stdout);
+    options.io = batchio_create (io_method);
+    if (options.para_sink)
+      parasink_set_io (options.para_sink, options.io);
+    }
+
+  // One parse feeds every --out, each of which writes to its own file
+  FILE **out_files = NULL;
+  Compressor **out_compressors = NULL;
+  if (nouts)
+    {
+    BOOL to_stdout = FALSE;
+    int n;
+    out_files = malloc (nouts * sizeof (FILE *));
+    out_compressors = malloc (nouts * sizeof (Compressor *));
+    options.para_sink = tee_create (out_threads);
+    for (n = 0; n < nouts; n++)
+      {
+      const char *colon = strchr (outs[n], ':');
+      const char *file = colon ? colon + 1 : "-";
+      size_t len = colon ? (size_t)(colon - outs[n]) : strlen (outs[n]);
+      char *kind = strndup (outs[n], len);
+      if (strcmp (file, "-") == 0)
+        {
+        if (to_stdout)
+          {
+          fprintf (stderr, "%s: only one --out can be written to stdout\n", 
+            argv[0]);
+          exit (-1);
+          }
+        to_stdout = TRUE;
+        out_files[n] = stdout;
+        }
+      else if (!(out_files[n] = fopen (file, "w")))
+        {
+        fprintf (stderr, "%s: Can't open %s for writing: %s\n", argv[0], 
+          file, strerror (errno));
+        exit (-1);
+        }
+      Compressor *c = out_compressors[n] = compress 
+        ? compressor_create (out_files[n], compress, compress_level) : NULL;
+      ParaSink *sink = NULL;
+      if (strcmp (kind, "text") == 0)
+        {
+        // The text has ANSI codes, as it would have without --out
+        Epub2TxtOptions text_options = options;
+        text_options.ansi = is_a_tty && !noansi;
+        sink = textsink_create (&text_options, c);
+        }
+      else if (strcmp (kind, "jsonl") == 0)
+        sink = jsonl_create (c);
+      else if (strcmp (kind, "markdown") == 0)
+        sink = markdown_create (c);
+      else if (strcmp (kind, "arrow") == 0)
+        sink = arrow_create (c);
+      else if (strcmp (kind, "stats") == 0)
+        sink = stats_create (c);
+      else if (strcmp (kind, "freq") == 0)
+        sink = freq_create (ngram, top, freq_flags, c);
+      else if (strcmp (kind, "fingerprint") == 0)
+        sink = fingerprint_create (c);
+      else
+        sink = chunk_create (chunk_words, chunk_overlap, c);
+      free (kind);
+      parasink_set_output (sink, out_files[n]);
+      // With --out-threads, the sink would write from another thread
+      if (out_files[n] == stdout && options.io && !out_threads)
+        parasink_set_io (sink, options.io);
+      tee_add (options.para_sink, sink);
+      }
+    }
+
   signal (SIGPIPE, sig_handler);
   signal (SIGQUIT, sig_handler);
   signal (SIGINT, sig_handler);
   signal (SIGHUP, sig_handler);
 
+  // In a batch, the next books are read while this one is converted
+  Prefetch *prefetch = NULL;
+  if (prefetch_depth > 0 && argc - optind > 1 && !from_ir)
+    prefetch = prefetch_create (argv + optind, argc - optind, 
+      prefetch_depth);
+
+  int status = 0;
   int i;
   for (i = optind; i < argc; i++)
     {
     const char *file = argv[i]; 
     char *error = NULL;
-    epub2txt_do_file (file, &options, &error); 
+    if (prefetch) prefetch_book (prefetch, i - optind);
+    if (bloom && !bloom_file_may_contain (bloom, file, grep))
+      continue;
+    if (options.line_index)
+      lineindex_begin_book (options.line_index, file);
+    if (options.para_sink)
+      parasink_begin_book (options.para_sink, file);
+    if (emit_ir)
+      epub2txt_emit_ir (file, emit_ir, &options, &error); 
+    else if (pager)
+      epub2txt_do_pager (file, from_ir, &options, &error); 
+    else if (page >= 0)
+      epub2txt_do_pages (file, from_ir, page_index, page, &options, &error); 
+    else if (from_ir)
+      epub2txt_do_ir_file (file, &options, &error); 
+    else
+      epub2txt_do_file (file, &options, &error); 
+    if (options.para_sink)
+      parasink_end_book (options.para_sink);
     if (error)
       {
       fprintf (stderr, "%s: %s\n", argv[0], error);
       free (error);
+      // A page that can't be found is a failed lookup, as it is for
+      //  --find-source; other books are just skipped
+      if (page >= 0) status = -1;
+      }
+    }
+
+  if (prefetch) prefetch_destroy (prefetch);
+
+  if (options.source_map)
+    {
+    char *error = NULL;
+    if (!sourcemap_close (options.source_map, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    free (source_map);
+    }
+
+  if (options.line_index)
+    {
+    char *error = NULL;
+    fflush (stdout);
+    if (!lineindex_close (options.line_index, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    free (line_index);
+    }
+
+  // Like grep, the exit status says whether anything matched, unless
+  //  there was an error
+  if (status == 0 && grep && !grep_found (options.para_sink))
+    status = 1;
+  if (index_dir)
+    {
+    char *error = NULL;
+    if (!searchindex_write (options.para_sink, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    free (index_dir);
+    }
+  if (bloom_file && !grep)
+    {
+    char *error = NULL;
+    if (!bloom_write (options.para_sink, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    }
+  if (options.para_sink) parasink_close (options.para_sink);
+
+  for (i = 0; i < nouts; i++)
+    {
+    char *error = NULL;
+    if (out_compressors[i] && !compressor_close (out_compressors[i], &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    if (out_files[i] != stdout && fclose (out_files[i]) != 0)
+      {
+      fprintf (stderr, "%s: Can't write %s: %s\n", argv[0], 
+        strchr (outs[i], ':') + 1, strerror (errno));
+      status = -1;
+      }
+    free (outs[i]);
+    }
+  if (outs) free (outs);
+  if (out_files) free (out_files);
+  if (out_compressors) free (out_compressors);
+
+  if (options.compressor)
+    {
+    char *error = NULL;
+    if (!compressor_close (options.compressor, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
+      }
+    }
+
+  if (options.io)
+    {
+    char *error = NULL;
+    if (!batchio_close (options.io, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      status = -1;
       }
     }
 
   if (section_separator) free (section_separator);
-  exit (0);
+  if (emit_ir) free (emit_ir);
+  if (page_index) free (page_index);
+  if (output_dir) 
+    {
+    chapters_cleanup ();
+    free (output_dir);
+    }
+  if (grep) free (grep);
+  if (bloom) bloom_file_close (bloom);
+  if (bloom_file) free (bloom_file);
+  if (options.hyphenator) hyphenator_destroy (options.hyphenator);
+  exit (status);
   }
 
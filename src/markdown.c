@@ -0,0 +1,134 @@
+/*============================================================================
+  epub2txt v2
+  markdown.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The escaping of text, and the marking of emphasis, are done as the
+  paragraph is collected (see parasink.h), since only there is it known
+  which characters came from the text, and which are markers; this
+  sink lays out the blocks.
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "markdown.h"
+
+typedef struct _MarkdownWriter
+  {
+  ParaSink sink;
+  BOOL started;          // A block has been written
+  int quote;             // Blockquotes the last block was in
+  } MarkdownWriter;
+
+
+/*============================================================================
+  markdown_line_start
+  Write the start of a line of a block, escaping anything at the start
+  of the text that would make it a list item or a setext underline.
+  Returns the number of bytes of the text that have been written
+============================================================================*/
+static size_t markdown_line_start (MarkdownWriter *self, const char *s,
+       size_t len)
+  {
+  ParaSink *sink = &self->sink;
+  int i;
+  for (i = 0; i < sink->quote; i++)
+    parasink_write (sink, "> ", 2);
+  if (len && (s[0] == '-' || s[0] == '+' || s[0] == '='))
+    {
+    parasink_write (sink, "\\", 1);
+    return 0;
+    }
+  size_t n = 0;
+  while (n < len && n < 9 && s[n] >= '0' && s[n] <= '9') n++;
+  if (n && n < len && (s[n] == '.' || s[n] == ')'))
+    {
+    parasink_write (sink, s, n);
+    parasink_write (sink, "\\", 1);
+    return n;
+    }
+  return 0;
+  }
+
+
+/*============================================================================
+  markdown_para
+============================================================================*/
+static void markdown_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  MarkdownWriter *self = (MarkdownWriter *)sink;
+  int i;
+
+  // A blank line in a blockquote keeps the blockquote going
+  if (self->started)
+    {
+    int quote = sink->quote < self->quote ? sink->quote : self->quote;
+    for (i = 0; i < quote; i++)
+      parasink_write (sink, ">", 1);
+    parasink_write (sink, "\n", 1);
+    }
+  self->started = TRUE;
+  self->quote = sink->quote;
+
+  if (kind == PARA_HEADING)
+    {
+    for (i = 0; i < sink->quote; i++)
+      parasink_write (sink, "> ", 2);
+    for (i = 0; i < (sink->heading > 0 ? sink->heading : 1); i++)
+      parasink_write (sink, "#", 1);
+    parasink_write (sink, " ", 1);
+    // A heading is one line
+    const char *end = text + len;
+    while (text < end)
+      {
+      const char *nl = memchr (text, '\n', end - text);
+      if (!nl) nl = end;
+      parasink_write (sink, text, nl - text);
+      if (nl < end) parasink_write (sink, " ", 1);
+      text = nl + 1;
+      }
+    parasink_write (sink, "\n", 1);
+    }
+  else
+    {
+    const char *end = text + len;
+    BOOL first = TRUE;
+    while (text < end)
+      {
+      const char *nl = memchr (text, '\n', end - text);
+      if (!nl) nl = end;
+      if (!first) parasink_write (sink, "\\\n", 2);
+      first = FALSE;
+      size_t n = markdown_line_start (self, text, nl - text);
+      parasink_write (sink, text + n, nl - text - n);
+      text = nl + 1;
+      }
+    parasink_write (sink, "\n", 1);
+    }
+  }
+
+
+/*============================================================================
+  markdown_destroy
+============================================================================*/
+static void markdown_destroy (ParaSink *sink)
+  {
+  free (sink);
+  }
+
+
+/*============================================================================
+  markdown_create
+============================================================================*/
+ParaSink *markdown_create (Compressor *compressor)
+  {
+  MarkdownWriter *self = malloc (sizeof (MarkdownWriter));
+  memset (self, 0, sizeof (MarkdownWriter));
+  parasink_init (&self->sink, compressor);
+  self->sink.para = markdown_para;
+  self->sink.destroy = markdown_destroy;
+  self->sink.markdown = TRUE;
+  return &self->sink;
+  }
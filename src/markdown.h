@@ -0,0 +1,21 @@
+/*============================================================================
+  epub2txt v2
+  markdown.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Markdown output: rather than wrapped text, a paragraph sink that
+  writes each paragraph as a Markdown block, separated by blank lines.
+  Headings h1 to h5 become ATX headings, # to #####; b and i become
+  ** and *; each level of blockquote adds a > to the start of each
+  line; and hard line breaks within a paragraph become backslash line
+  breaks. Characters that Markdown would take as markup are escaped
+  with a backslash, as are those that would start a list at the start
+  of a line. Metadata, with -m, is written as ordinary paragraphs,
+  before the text. The output is written in large blocks.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+ParaSink *markdown_create (Compressor *compressor);
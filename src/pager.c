@@ -0,0 +1,653 @@
+/*============================================================================
+  epub2txt v2
+  pager.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  A built-in pager. Lines are numbered from the start of the document,
+  as they would be written to stdout at the terminal's width. The pager
+  keeps a window of wrapped lines: the screen that is shown, the one
+  after it, which is laid out while the user is reading, and at most one
+  screen before it. Anything else is laid out again when it is needed.
+
+  Laying out a line needs a place to start from. At first, the only
+  place known is the start of the document, which is enough to show
+  the first few screens at once. Meanwhile, a second thread builds the
+  page index, at the height of the screen, and finds the line on which
+  each chapter -- that is, each spine item -- starts; once that is
+  done, any line can be reached by laying out at most a page and a
+  paragraph. Going to the end, or to another chapter, waits for the
+  index if need be.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "pager.h"
+#include "pages.h"
+#include "xhtml.h"
+#include "log.h"
+
+// Keys other than plain characters
+#define PAGER_KEY_UP     0x101
+#define PAGER_KEY_DOWN   0x102
+#define PAGER_KEY_PGUP   0x103
+#define PAGER_KEY_PGDN   0x104
+#define PAGER_KEY_HOME   0x105
+#define PAGER_KEY_END    0x106
+#define PAGER_KEY_RESIZE 0x107
+
+typedef struct _PagerChapter
+  {
+  uint32_t section;
+  int line;            // First line of the chapter
+  const char *title;   // From the table of contents, or the href
+  } PagerChapter;
+
+typedef struct _Pager
+  {
+  const Document *doc;
+  Epub2TxtOptions options;
+  int rows;            // Lines of text on the screen, i.e., the page height
+  int cols;
+  BOOL follow_width;   // Lay out at the width of the terminal
+  // Built by the layout thread. Once ready is set, these do not change
+  //  until the thread is joined
+  pthread_t thread;
+  BOOL thread_running;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  BOOL ready;
+  PageIndex *index;
+  PagerChapter *chapters;
+  int nchapters;
+  // The window of lines
+  char **lines;
+  int first;           // Number of the line in lines[0]
+  int count;
+  int size;
+  int total;           // Lines in the document, or -1 if not known yet
+  int top;             // Line at the top of the screen
+  // Lines being laid out
+  char *line;
+  int line_len;
+  int line_size;
+  char **batch;
+  int batch_count;
+  int batch_size;
+  // Terminal
+  int tty;
+  struct termios saved_termios;
+  } Pager;
+
+static volatile sig_atomic_t pager_resized = FALSE;
+
+/*============================================================================
+  pager_sigwinch
+============================================================================*/
+static void pager_sigwinch (int signo)
+  {
+  (void)signo;
+  pager_resized = TRUE;
+  }
+
+/*============================================================================
+  pager_get_size
+============================================================================*/
+static void pager_get_size (int *rows, int *cols)
+  {
+  struct winsize ws;
+  *rows = 24;
+  *cols = 80;
+  if (ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1
+        && ws.ws_col > 0)
+    {
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+    }
+  }
+
+/*============================================================================
+  pager_chapter_title
+  The section's title in the TOC or, if it has none, its href
+============================================================================*/
+static const char *pager_chapter_title (const Document *doc,
+       const DocumentSection *section)
+  {
+  const char *href = document_string (doc, section->href);
+  const char *title = document_toc_title (doc, href);
+  if (title) return title;
+  return href;
+  }
+
+/*============================================================================
+  pager_layout_thread
+  Build the page index, and find where the chapters start
+============================================================================*/
+static void *pager_layout_thread (void *arg)
+  {
+  Pager *self = arg;
+  const Document *doc = self->doc;
+  PageIndex *index = pages_create (doc, &self->options, self->rows);
+
+  PagerChapter *chapters = malloc ((doc->nsections + 1)
+    * sizeof (PagerChapter));
+  int nchapters = 0;
+  uint32_t s;
+  for (s = 0; s < doc->nsections; s++)
+    {
+    const DocumentSection *section = &doc->sections[s];
+    if (section->kind != DOC_SECTION_SPINE) continue;
+    int line = pages_section_line (index, doc, &self->options, s);
+    if (line < 0) continue;
+    chapters[nchapters].section = s;
+    chapters[nchapters].line = line;
+    chapters[nchapters].title = pager_chapter_title (doc, section);
+    nchapters++;
+    }
+
+  pthread_mutex_lock (&self->mutex);
+  self->index = index;
+  self->chapters = chapters;
+  self->nchapters = nchapters;
+  self->ready = TRUE;
+  pthread_cond_broadcast (&self->cond);
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+/*============================================================================
+  pager_start_layout
+============================================================================*/
+static void pager_start_layout (Pager *self)
+  {
+  self->ready = FALSE;
+  self->index = NULL;
+  self->chapters = NULL;
+  self->nchapters = 0;
+  self->thread_running = pthread_create (&self->thread, NULL,
+    pager_layout_thread, self) == 0;
+  if (!self->thread_running)
+    pager_layout_thread (self);
+  }
+
+/*============================================================================
+  pager_stop_layout
+============================================================================*/
+static void pager_stop_layout (Pager *self)
+  {
+  if (self->thread_running)
+    pthread_join (self->thread, NULL);
+  self->thread_running = FALSE;
+  if (self->index) pages_destroy (self->index);
+  if (self->chapters) free (self->chapters);
+  self->index = NULL;
+  self->chapters = NULL;
+  self->ready = FALSE;
+  }
+
+/*============================================================================
+  pager_is_ready
+  TRUE if the page index is ready; if wait is set, wait until it is
+============================================================================*/
+static BOOL pager_is_ready (Pager *self, BOOL wait)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (wait && !self->ready)
+    pthread_cond_wait (&self->cond, &self->mutex);
+  BOOL ready = self->ready;
+  pthread_mutex_unlock (&self->mutex);
+  return ready;
+  }
+
+/*============================================================================
+  pager_collect_fn
+  Output function that splits the text into lines
+============================================================================*/
+static void pager_collect_fn (void *app_data, WT_UTF32 c)
+  {
+  Pager *self = app_data;
+  if (c == '\n')
+    {
+    if (self->batch_count == self->batch_size)
+      {
+      self->batch_size = self->batch_size ? self->batch_size * 2 : 64;
+      self->batch = realloc (self->batch, self->batch_size * sizeof (char *));
+      }
+    self->batch[self->batch_count++] = strndup (self->line, self->line_len);
+    self->line_len = 0;
+    return;
+    }
+  WT_UTF8 utf8 [WT_UTF8_MAX_BYTES];
+  wraptext_context_utf32_char_to_utf8 (c, utf8);
+  int len = strlen (utf8);
+  if (self->line_len + len >= self->line_size)
+    {
+    self->line_size = self->line_size ? self->line_size * 2 : 256;
+    self->line = realloc (self->line, self->line_size);
+    }
+  memcpy (self->line + self->line_len, utf8, len);
+  self->line_len += len;
+  }
+
+/*============================================================================
+  pager_has_text
+  TRUE if the line being laid out has anything but escape sequences
+============================================================================*/
+static BOOL pager_has_text (const Pager *self)
+  {
+  BOOL escape = FALSE;
+  int i;
+  for (i = 0; i < self->line_len; i++)
+    {
+    char c = self->line[i];
+    if (c == 0x1B)
+      escape = TRUE;
+    else if (!escape)
+      return TRUE;
+    else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+      escape = FALSE;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+  pager_render
+  Lay out lines [from, from + n) into the batch. Returns the number of
+  lines, which is less than n at the end of the document
+============================================================================*/
+static int pager_render (Pager *self, int from, int n)
+  {
+  self->batch_count = 0;
+  self->line_len = 0;
+  if (pager_is_ready (self, FALSE))
+    {
+    pages_render (self->index, self->doc, &self->options, from / self->rows,
+      from % self->rows, n, pager_collect_fn, self);
+    }
+  else
+    {
+    PageStart start;
+    memset (&start, 0, sizeof (start));
+    start.flags = PAGE_BLANK_LINE;
+    pages_render_from (self->doc, &self->options, &start, from, n,
+      pager_collect_fn, self);
+    }
+  // The last line of the document need not end with a newline
+  if (self->batch_count < n && pager_has_text (self))
+    pager_collect_fn (self, '\n');
+  if (self->batch_count < n && (self->batch_count > 0 || from == 0))
+    self->total = from + self->batch_count;
+  return self->batch_count;
+  }
+
+/*============================================================================
+  pager_clear_window
+============================================================================*/
+static void pager_clear_window (Pager *self)
+  {
+  int i;
+  for (i = 0; i < self->count; i++) free (self->lines[i]);
+  self->count = 0;
+  }
+
+/*============================================================================
+  pager_window_insert
+  Put the batch into the window, at position i
+============================================================================*/
+static void pager_window_insert (Pager *self, int i)
+  {
+  int n = self->batch_count;
+  if (self->count + n > self->size)
+    {
+    self->size = self->count + n + 64;
+    self->lines = realloc (self->lines, self->size * sizeof (char *));
+    }
+  memmove (self->lines + i + n, self->lines + i,
+    (self->count - i) * sizeof (char *));
+  memcpy (self->lines + i, self->batch, n * sizeof (char *));
+  self->count += n;
+  self->batch_count = 0;
+  }
+
+/*============================================================================
+  pager_fill
+  Make sure the window holds lines [from, to), or as many of them as
+  the document has, and drop lines more than a screen above the top
+============================================================================*/
+static void pager_fill (Pager *self, int from, int to)
+  {
+  if (from < 0) from = 0;
+  if (self->total >= 0 && to > self->total) to = self->total;
+  if (from >= to) return;
+
+  if (self->count == 0 || to < self->first
+        || from > self->first + self->count)
+    {
+    pager_clear_window (self);
+    self->first = from;
+    pager_render (self, from, to - from);
+    pager_window_insert (self, 0);
+    }
+  else
+    {
+    if (from < self->first)
+      {
+      pager_render (self, from, self->first - from);
+      pager_window_insert (self, 0);
+      self->first = from;
+      }
+    int end = self->first + self->count;
+    if (to > end && (self->total < 0 || end < self->total))
+      {
+      pager_render (self, end, to - end);
+      pager_window_insert (self, self->count);
+      }
+    }
+
+  int drop = self->top - self->rows - self->first;
+  if (drop > 0)
+    {
+    if (drop > self->count) drop = self->count;
+    int i;
+    for (i = 0; i < drop; i++) free (self->lines[i]);
+    memmove (self->lines, self->lines + drop,
+      (self->count - drop) * sizeof (char *));
+    self->count -= drop;
+    self->first += drop;
+    }
+  }
+
+/*============================================================================
+  pager_find_total
+  Count the lines in the document, using the page index
+============================================================================*/
+static void pager_find_total (Pager *self)
+  {
+  if (self->total >= 0) return;
+  pager_is_ready (self, TRUE);
+  int last = (self->index->npages - 1) * self->rows;
+  int n = pager_render (self, last, self->rows + 1);
+  int i;
+  for (i = 0; i < n; i++) free (self->batch[i]);
+  self->batch_count = 0;
+  self->total = last + n;
+  }
+
+/*============================================================================
+  pager_set_top
+  Move the top of the screen, but not past the last screenful
+============================================================================*/
+static void pager_set_top (Pager *self, int top)
+  {
+  if (top < 0) top = 0;
+  self->top = top;
+  pager_fill (self, top, top + self->rows);
+  if (self->total < 0 && top > 0
+       && (self->count == 0 || self->first + self->count <= top))
+    pager_find_total (self);
+  if (self->total >= 0)
+    {
+    int max = self->total - self->rows;
+    if (max < 0) max = 0;
+    if (self->top > max)
+      {
+      self->top = max;
+      pager_fill (self, self->top, self->top + self->rows);
+      }
+    }
+  }
+
+/*============================================================================
+  pager_chapter
+  The index of the chapter that the top line is in, or -1
+============================================================================*/
+static int pager_chapter (const Pager *self)
+  {
+  int i, ret = -1;
+  for (i = 0; i < self->nchapters; i++)
+    {
+    if (self->chapters[i].line > self->top) break;
+    ret = i;
+    }
+  return ret;
+  }
+
+/*============================================================================
+  pager_draw
+============================================================================*/
+static void pager_draw (Pager *self)
+  {
+  int i;
+  for (i = 0; i < self->rows; i++)
+    {
+    int n = self->top + i;
+    printf ("\x1B[%d;1H", i + 1);
+    if (n >= self->first && n < self->first + self->count)
+      fputs (self->lines[n - self->first], stdout);
+    fputs ("\x1B[0m\x1B[K", stdout);
+    }
+
+  // Status line: the chapter on the left, the page on the right
+  char right [64];
+  const char *title = "";
+  int page = self->top / self->rows + 1;
+  if (pager_is_ready (self, FALSE))
+    {
+    int c = pager_chapter (self);
+    if (c >= 0) title = self->chapters[c].title;
+    snprintf (right, sizeof (right), " page %d/%d ", page,
+      (int)self->index->npages);
+    }
+  else
+    snprintf (right, sizeof (right), " page %d (laying out) ", page);
+
+  int space = self->cols - (int)strlen (right) - 1;
+  printf ("\x1B[%d;1H\x1B[7m ", self->rows + 1);
+  const char *p = title;
+  while (*p && space > 0)
+    {
+    // Count characters, not bytes, of UTF-8
+    do putchar (*p++); while ((*p & 0xC0) == 0x80);
+    space--;
+    }
+  while (space-- > 0) putchar (' ');
+  fputs (right, stdout);
+  fputs ("\x1B[0m", stdout);
+  fflush (stdout);
+  }
+
+/*============================================================================
+  pager_read_key
+  Returns a character, a PAGER_KEY_ value, or -1 at end of input
+============================================================================*/
+static int pager_read_key (Pager *self)
+  {
+  unsigned char buff [16];
+  int n;
+  do
+    {
+    if (pager_resized) return PAGER_KEY_RESIZE;
+    n = read (self->tty, buff, sizeof (buff));
+    } while (n < 0 && errno == EINTR);
+  if (n <= 0) return -1;
+  if (buff[0] != 0x1B || n < 3) return buff[0];
+  if (buff[1] != '[' && buff[1] != 'O') return 0;
+  switch (buff[2])
+    {
+    case 'A': return PAGER_KEY_UP;
+    case 'B': return PAGER_KEY_DOWN;
+    case 'H': return PAGER_KEY_HOME;
+    case 'F': return PAGER_KEY_END;
+    case '1': return n > 3 && buff[3] == '~' ? PAGER_KEY_HOME : 0;
+    case '4': return n > 3 && buff[3] == '~' ? PAGER_KEY_END : 0;
+    case '5': return PAGER_KEY_PGUP;
+    case '6': return PAGER_KEY_PGDN;
+    }
+  return 0;
+  }
+
+/*============================================================================
+  pager_resize
+  Lay the document out again for the new size of the terminal, keeping
+  the paragraph at the top of the screen there
+============================================================================*/
+static void pager_resize (Pager *self)
+  {
+  int rows, cols;
+  pager_get_size (&rows, &cols);
+  rows--;
+  int width = self->follow_width ? cols : self->options.width;
+  self->cols = cols;
+  if (rows == self->rows && width == self->options.width) return;
+
+  BOOL anchored = FALSE;
+  PageStart anchor;
+  if (pager_is_ready (self, FALSE))
+    {
+    anchor = self->index->pages[self->top / self->rows];
+    anchored = TRUE;
+    }
+
+  pager_stop_layout (self);
+  pager_clear_window (self);
+  self->total = -1;
+  self->rows = rows;
+  self->options.width = width;
+  pager_start_layout (self);
+
+  if (anchored)
+    {
+    pager_is_ready (self, TRUE);
+    uint32_t p;
+    for (p = 0; p + 1 < self->index->npages; p++)
+      {
+      const PageStart *next = &self->index->pages[p + 1];
+      if (next->section > anchor.section || (next->section == anchor.section
+            && next->para > anchor.para))
+        break;
+      }
+    self->top = p * self->rows;
+    }
+  }
+
+/*============================================================================
+  pager_run
+============================================================================*/
+void pager_run (const Document *doc, const Epub2TxtOptions *options,
+       char **error)
+  {
+  IN
+  *error = NULL;
+  Pager *self = malloc (sizeof (Pager));
+  memset (self, 0, sizeof (Pager));
+  self->doc = doc;
+  self->options = *options;
+  self->options.document = NULL;
+  self->total = -1;
+
+  self->tty = open ("/dev/tty", O_RDONLY);
+  if (self->tty < 0 || tcgetattr (self->tty, &self->saved_termios) != 0)
+    {
+    asprintf (error, "Can't open terminal: %s", strerror (errno));
+    if (self->tty >= 0) close (self->tty);
+    free (self);
+    OUT
+    return;
+    }
+
+  pager_get_size (&self->rows, &self->cols);
+  self->rows--;
+  self->follow_width = options->width == self->cols;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->cond, NULL);
+  pager_start_layout (self);
+
+  struct termios t = self->saved_termios;
+  t.c_lflag &= ~(ICANON | ECHO | ISIG);
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+  tcsetattr (self->tty, TCSAFLUSH, &t);
+
+  struct sigaction sa, old_sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = pager_sigwinch;
+  sigaction (SIGWINCH, &sa, &old_sa);
+
+  // Alternate screen, no automatic margins, no cursor
+  fputs ("\x1B[?1049h\x1B[?7l\x1B[?25l\x1B[2J", stdout);
+
+  BOOL quit = FALSE;
+  pager_set_top (self, 0);
+  while (!quit)
+    {
+    pager_draw (self);
+    // Lay out the next screen while the user reads this one
+    pager_fill (self, self->top, self->top + 2 * self->rows);
+
+    int key = pager_read_key (self);
+    int c;
+    switch (key)
+      {
+      case -1: case 'q': case 'Q': case 3:
+        quit = TRUE; break;
+      case ' ': case 'f': case 6: case PAGER_KEY_PGDN:
+        pager_set_top (self, self->top + self->rows); break;
+      case 'b': case 2: case PAGER_KEY_PGUP:
+        pager_set_top (self, self->top - self->rows); break;
+      case 'j': case '\n': case '\r': case PAGER_KEY_DOWN:
+        pager_set_top (self, self->top + 1); break;
+      case 'k': case PAGER_KEY_UP:
+        pager_set_top (self, self->top - 1); break;
+      case 'g': case '<': case PAGER_KEY_HOME:
+        pager_set_top (self, 0); break;
+      case 'G': case '>': case PAGER_KEY_END:
+        pager_find_total (self);
+        pager_set_top (self, self->total); break;
+      case 'n':
+        pager_is_ready (self, TRUE);
+        c = pager_chapter (self) + 1;
+        if (c < self->nchapters)
+          pager_set_top (self, self->chapters[c].line);
+        break;
+      case 'p':
+        pager_is_ready (self, TRUE);
+        c = pager_chapter (self);
+        // From the start of a chapter, go to the one before
+        if (c >= 0 && self->chapters[c].line == self->top) c--;
+        if (c >= 0)
+          pager_set_top (self, self->chapters[c].line);
+        break;
+      case PAGER_KEY_RESIZE:
+        pager_resized = FALSE;
+        pager_resize (self);
+        fputs ("\x1B[2J", stdout);
+        pager_set_top (self, self->top);
+        break;
+      }
+    }
+
+  fputs ("\x1B[0m\x1B[?25h\x1B[?7h\x1B[?1049l", stdout);
+  fflush (stdout);
+  sigaction (SIGWINCH, &old_sa, NULL);
+  tcsetattr (self->tty, TCSAFLUSH, &self->saved_termios);
+  close (self->tty);
+
+  pager_stop_layout (self);
+  pager_clear_window (self);
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->cond);
+  if (self->lines) free (self->lines);
+  if (self->batch) free (self->batch);
+  if (self->line) free (self->line);
+  free (self);
+  OUT
+  }
+
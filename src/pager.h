@@ -0,0 +1,20 @@
+/*============================================================================
+  epub2txt v2
+  pager.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  A simple built-in pager, for reading a document in a terminal. Only the
+  lines on the screen, and the next screenful, are laid out; the page
+  index, which is needed to go backwards or jump to a chapter, is built
+  in the background.
+============================================================================*/
+
+#pragma once
+
+#include "epub2txt.h"
+
+/** Show the document in the terminal until the user quits. The terminal
+    must be on stdout. */
+void pager_run (const Document *doc, const Epub2TxtOptions *options,
+       char **error);
+
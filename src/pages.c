@@ -0,0 +1,538 @@
+/*============================================================================
+  epub2txt v2
+  pages.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Page-layout index. The index is built by laying out the whole
+  document once, with an output function that writes nothing, but counts
+  lines; at the start of each paragraph the wrapper state is noted, so
+  that when a page boundary falls in the paragraph, the page can be
+  found again by laying out the paragraph from its start, and skipping
+  the lines before the boundary. Rendering a page costs the page itself,
+  plus at most one paragraph.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pages.h"
+#include "xhtml.h"
+#include "wstring.h"
+#include "log.h"
+
+#define PAGES_FILE_MAGIC "E2P\x1A"
+#define PAGES_FILE_VERSION 1
+#define PAGES_FILE_BYTE_ORDER 0x01020304
+
+// Flags for the options that affect layout, other than width and height
+#define PAGES_OPTIMAL   0x0001
+#define PAGES_JUSTIFY   0x0002
+#define PAGES_ASCII     0x0004
+#define PAGES_META      0x0008
+#define PAGES_CALIBRE   0x0010
+#define PAGES_NOTEXT    0x0020
+#define PAGES_HYPHENATE 0x0040
+#define PAGES_RAW       0x0080
+
+typedef struct _PagesFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t width;
+  uint32_t height;
+  uint32_t layout;
+  uint64_t fingerprint;
+  uint32_t npages;
+  uint32_t reserved;
+  } PagesFileHeader;
+
+// State of a layout pass, either counting lines or rendering them
+typedef struct _PagesPass
+  {
+  WrapTextContext *context;
+  uint64_t lines;          // Newlines written so far
+  BOOL done;
+  // Counting
+  PageIndex *index;
+  uint64_t para_lines;     // Newlines written before the current paragraph
+  PageStart para_start;    // Where the current paragraph starts
+  BOOL dirty;              // Something, other than an escape sequence,
+                           //  has been written since the last page began
+  BOOL escape;             // In an ANSI escape sequence
+  // Rendering
+  WrapTextOutputFn fn;
+  void *app_data;
+  uint64_t first;          // First line to pass on
+  uint64_t last;           // Line after the last to pass on, or 0
+  // Finding the start of a section
+  BOOL find;
+  uint32_t find_section;
+  uint64_t found;          // Lines written before the section started
+  } PagesPass;
+
+
+/*============================================================================
+  pages_layout_flags
+============================================================================*/
+static uint32_t pages_layout_flags (const Epub2TxtOptions *options)
+  {
+  return (options->optimal ? PAGES_OPTIMAL : 0)
+    | (options->justify ? PAGES_JUSTIFY : 0)
+    | (options->ascii ? PAGES_ASCII : 0)
+    | (options->meta ? PAGES_META : 0)
+    | (options->calibre ? PAGES_CALIBRE : 0)
+    | (options->notext ? PAGES_NOTEXT : 0)
+    | (options->hyphenator ? PAGES_HYPHENATE : 0)
+    | (options->raw ? PAGES_RAW : 0);
+  }
+
+
+/*============================================================================
+  pages_hash
+============================================================================*/
+static uint64_t pages_hash (uint64_t h, const void *data, size_t len)
+  {
+  const BYTE *p = data;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001B3ULL;
+  return h;
+  }
+
+
+/*============================================================================
+  pages_fingerprint
+  Identify the document, and the options that affect layout. ANSI
+  highlighting does not, so one index serves with or without it. The
+  hyphenation points depend on the words, and on the patterns, not 
+  just on the lengths of the tokens, so both are part of it.
+============================================================================*/
+static uint64_t pages_fingerprint (const Document *doc,
+       const Epub2TxtOptions *options, int height)
+  {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  uint32_t layout [3] = { options->width, height,
+    pages_layout_flags (options) };
+  h = pages_hash (h, layout, sizeof (layout));
+  if (options->section_separator)
+    h = pages_hash (h, options->section_separator,
+      strlen (options->section_separator));
+  if (options->hyphenator)
+    {
+    uint64_t patterns = hyphenator_fingerprint (options->hyphenator);
+    h = pages_hash (h, &patterns, sizeof (patterns));
+    }
+  h = pages_hash (h, doc->text, doc->text_len);
+  h = pages_hash (h, doc->tokens, doc->ntokens * sizeof (DocumentToken));
+  h = pages_hash (h, doc->paras, (doc->nparas + 1) * sizeof (DocumentPara));
+  h = pages_hash (h, doc->sections,
+    (doc->nsections + 1) * sizeof (DocumentSection));
+  return h;
+  }
+
+
+/*============================================================================
+  pages_get_start
+  Note the position, and wrapper state, at the start of a paragraph
+============================================================================*/
+static void pages_get_start (WrapTextContext *context, uint32_t section,
+       uint32_t para, PageStart *start)
+  {
+  WrapTextState state;
+  wraptext_context_get_state (context, &state);
+  start->section = section;
+  start->para = para;
+  start->skip = 0;
+  start->column = state.column > 0xFFFF ? 0xFFFF : state.column;
+  start->fmt = (state.fmt & 0x0F) | ((state.out_fmt & 0x0F) << 4);
+  start->flags = state.blank_line ? PAGE_BLANK_LINE : 0;
+  }
+
+
+/*============================================================================
+  pages_set_start
+============================================================================*/
+static void pages_set_start (WrapTextContext *context,
+       const PageStart *start)
+  {
+  WrapTextState state;
+  state.column = start->column;
+  state.fmt = start->fmt & 0x0F;
+  state.out_fmt = start->fmt >> 4;
+  state.blank_line = (start->flags & PAGE_BLANK_LINE) != 0;
+  wraptext_context_set_state (context, &state);
+  }
+
+
+/*============================================================================
+  pages_count_fn
+  Output function for building the index
+============================================================================*/
+static void pages_count_fn (void *app_data, WT_UTF32 c)
+  {
+  PagesPass *pass = app_data;
+  PageIndex *index = pass->index;
+  if (c == '\n')
+    {
+    pass->lines++;
+    pass->dirty = TRUE;
+    if (pass->lines % index->height == 0)
+      {
+      if (index->npages + 1 > index->pages_size)
+        {
+        index->pages_size = index->pages_size ? index->pages_size * 2 : 256;
+        index->pages = realloc (index->pages,
+          index->pages_size * sizeof (PageStart));
+        }
+      PageStart *page = &index->pages[index->npages++];
+      *page = pass->para_start;
+      page->skip = pass->lines - pass->para_lines;
+      pass->dirty = FALSE;
+      }
+    }
+  else if (c == 0x1B)
+    pass->escape = TRUE;
+  else if (pass->escape)
+    {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+      pass->escape = FALSE;
+    }
+  else
+    pass->dirty = TRUE;
+  }
+
+
+/*============================================================================
+  pages_render_fn
+  Output function for rendering part of a page
+============================================================================*/
+static void pages_render_fn (void *app_data, WT_UTF32 c)
+  {
+  PagesPass *pass = app_data;
+  if (pass->done) return;
+  if (pass->lines >= pass->first)
+    pass->fn (pass->app_data, c);
+  if (c == '\n')
+    {
+    pass->lines++;
+    if (pass->last && pass->lines >= pass->last)
+      pass->done = TRUE;
+    }
+  }
+
+
+/*============================================================================
+  pages_layout
+  Lay out the document from a given start, as xhtml_document_to_stdout
+  would, until the pass is done
+============================================================================*/
+static void pages_layout (const Document *doc,
+       const Epub2TxtOptions *options, const PageStart *start,
+       WrapTextOutputFn fn, PagesPass *pass)
+  {
+  uint32_t s;
+  for (s = start->section; s < doc->nsections && !pass->done; s++)
+    {
+    const DocumentSection *section = &doc->sections[s];
+    if (!xhtml_section_shown (section, options)) continue;
+
+    WrapTextContext *context = xhtml_document_context_new (options);
+    wraptext_context_set_output_fn (context, fn);
+    wraptext_context_set_app_data (context, pass);
+    pass->context = context;
+
+    uint32_t p = section->para;
+    if (s == start->section)
+      {
+      p = start->para;
+      pages_set_start (context, start);
+      // Restore the highlighting, if the page starts in the middle of it
+      if (start->fmt >> 4)
+        xhtml_emit_fmt_change (context, 0, start->fmt >> 4);
+      }
+
+    if (pass->find && s == pass->find_section && p == section->para)
+      {
+      pass->found = pass->lines;
+      pass->done = TRUE;
+      wraptext_context_free (context);
+      break;
+      }
+
+    do
+      {
+      if (pass->index)
+        {
+        pages_get_start (context, s, p, &pass->para_start);
+        pass->para_lines = pass->lines;
+        }
+      if (p == section->para && section->kind == DOC_SECTION_SPINE
+           && options->section_separator)
+        {
+        WString *sep = wstring_create_from_utf8 (options->section_separator);
+        const uint32_t *ws = wstring_wstr (sep);
+        int i, l = wstring_length (sep);
+        for (i = 0; i < l; i++) fn (pass, ws[i]);
+        fn (pass, '\n');
+        wstring_destroy (sep);
+        }
+      if (p < section[1].para)
+        wraptext_wrap_document (context, doc, p, p + 1);
+      p++;
+      } while (p < section[1].para && !pass->done);
+
+    wraptext_flush (context);
+    if (pass->done && !pass->index)
+      {
+      // Don't leave the terminal highlighted
+      WrapTextState state;
+      wraptext_context_get_state (context, &state);
+      if (state.fmt | state.out_fmt)
+        {
+        wraptext_context_set_output_fn (context, pass->fn);
+        wraptext_context_set_app_data (context, pass->app_data);
+        xhtml_emit_fmt_change (context, state.fmt | state.out_fmt, 0);
+        }
+      }
+    wraptext_context_free (context);
+    pass->context = NULL;
+    }
+  }
+
+
+/*============================================================================
+  pages_create
+============================================================================*/
+PageIndex *pages_create (const Document *doc,
+       const Epub2TxtOptions *options, int height)
+  {
+  IN
+  PageIndex *self = malloc (sizeof (PageIndex));
+  memset (self, 0, sizeof (PageIndex));
+  self->width = options->width;
+  self->height = height > 0 ? height : 1;
+  self->layout = pages_layout_flags (options);
+  self->fingerprint = pages_fingerprint (doc, options, height);
+
+  // The first page starts at the start
+  PageStart start;
+  memset (&start, 0, sizeof (start));
+  start.flags = PAGE_BLANK_LINE;
+  self->pages_size = 256;
+  self->pages = malloc (self->pages_size * sizeof (PageStart));
+  self->pages[self->npages++] = start;
+
+  PagesPass pass;
+  memset (&pass, 0, sizeof (pass));
+  pass.index = self;
+  pages_layout (doc, options, &start, pages_count_fn, &pass);
+
+  // A page boundary at the very end does not start a new page
+  if (!pass.dirty && self->npages > 1)
+    self->npages--;
+
+  log_debug ("Layout %dx%d has %d pages", self->width, self->height,
+    self->npages);
+  OUT
+  return self;
+  }
+
+
+/*============================================================================
+  pages_destroy
+============================================================================*/
+void pages_destroy (PageIndex *self)
+  {
+  if (!self) return;
+  if (self->pages) free (self->pages);
+  free (self);
+  }
+
+
+/*============================================================================
+  pages_matches
+============================================================================*/
+BOOL pages_matches (const PageIndex *self, const Document *doc,
+       const Epub2TxtOptions *options, int height)
+  {
+  return self->width == (uint32_t)options->width
+    && self->height == (uint32_t)height
+    && self->layout == pages_layout_flags (options)
+    && self->fingerprint == pages_fingerprint (doc, options, height);
+  }
+
+
+/*============================================================================
+  pages_render_from
+============================================================================*/
+void pages_render_from (const Document *doc, const Epub2TxtOptions *options,
+       const PageStart *start, int skip, int nlines, WrapTextOutputFn fn,
+       void *app_data)
+  {
+  IN
+  PagesPass pass;
+  memset (&pass, 0, sizeof (pass));
+  pass.fn = fn;
+  pass.app_data = app_data;
+  pass.first = start->skip + (skip > 0 ? skip : 0);
+  pass.last = nlines > 0 ? pass.first + nlines : 0;
+  pages_layout (doc, options, start, pages_render_fn, &pass);
+  OUT
+  }
+
+
+/*============================================================================
+  pages_render
+============================================================================*/
+void pages_render (const PageIndex *self, const Document *doc,
+       const Epub2TxtOptions *options, int page, int skip, int nlines,
+       WrapTextOutputFn fn, void *app_data)
+  {
+  if (page < 0 || page >= (int)self->npages) return;
+  pages_render_from (doc, options, &self->pages[page], skip, nlines,
+    fn, app_data);
+  }
+
+
+/*============================================================================
+  pages_ignore_fn
+============================================================================*/
+static void pages_ignore_fn (void *app_data, WT_UTF32 c)
+  {
+  (void)app_data; (void)c;
+  }
+
+
+/*============================================================================
+  pages_section_line
+  Start from the last page that starts before the section, and lay out
+  until the section starts
+============================================================================*/
+int pages_section_line (const PageIndex *self, const Document *doc,
+       const Epub2TxtOptions *options, int section)
+  {
+  IN
+  int ret = -1;
+  if (section >= 0 && section < (int)doc->nsections
+       && xhtml_section_shown (&doc->sections[section], options))
+    {
+    uint32_t lo = 0, hi = self->npages;
+    while (hi - lo > 1)
+      {
+      uint32_t mid = (lo + hi) / 2;
+      if (self->pages[mid].section < (uint32_t)section)
+        lo = mid;
+      else
+        hi = mid;
+      }
+    const PageStart *start = &self->pages[lo];
+    if (start->section == (uint32_t)section)
+      {
+      // Only the first page can start at, rather than after, the section
+      ret = 0;
+      }
+    else
+      {
+      PagesPass pass;
+      memset (&pass, 0, sizeof (pass));
+      pass.fn = pages_ignore_fn;
+      pass.find = TRUE;
+      pass.find_section = section;
+      pages_layout (doc, options, start, pages_render_fn, &pass);
+      if (pass.done)
+        ret = lo * self->height + (int)(pass.found - start->skip);
+      }
+    }
+  OUT
+  return ret;
+  }
+
+
+/*============================================================================
+  pages_write_file
+============================================================================*/
+BOOL pages_write_file (const PageIndex *self, const char *filename,
+       char **error)
+  {
+  PagesFileHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, PAGES_FILE_MAGIC, 4);
+  header.version = PAGES_FILE_VERSION;
+  header.byte_order = PAGES_FILE_BYTE_ORDER;
+  header.width = self->width;
+  header.height = self->height;
+  header.layout = self->layout;
+  header.fingerprint = self->fingerprint;
+  header.npages = self->npages;
+
+  FILE *f = fopen (filename, "wb");
+  if (!f)
+    {
+    asprintf (error, "Can't open file '%s' for writing: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  BOOL ok = fwrite (&header, sizeof (header), 1, f) == 1
+    && fwrite (self->pages, sizeof (PageStart), self->npages, f)
+         == self->npages;
+  if (fclose (f) != 0) ok = FALSE;
+  if (!ok)
+    {
+    asprintf (error, "Can't write file '%s': %s", filename, strerror (errno));
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  pages_create_from_file
+  The index is checked against the document by pages_matches(), and the
+  page starts when they are used, so this only checks that the file
+  is complete.
+============================================================================*/
+BOOL pages_create_from_file (const char *filename, PageIndex **result,
+       char **error)
+  {
+  FILE *f = fopen (filename, "rb");
+  if (!f)
+    {
+    asprintf (error, "Can't open file '%s' for reading: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  PagesFileHeader header;
+  if (fread (&header, sizeof (header), 1, f) != 1
+       || memcmp (header.magic, PAGES_FILE_MAGIC, 4) != 0
+       || header.version != PAGES_FILE_VERSION
+       || header.byte_order != PAGES_FILE_BYTE_ORDER
+       || header.npages == 0 || header.npages > UINT32_MAX / 16)
+    {
+    asprintf (error, "'%s' is not a usable page index", filename);
+    fclose (f);
+    return FALSE;
+    }
+  PageIndex *self = malloc (sizeof (PageIndex));
+  memset (self, 0, sizeof (PageIndex));
+  self->width = header.width;
+  self->height = header.height;
+  self->layout = header.layout;
+  self->fingerprint = header.fingerprint;
+  self->npages = header.npages;
+  self->pages_size = header.npages;
+  self->pages = malloc (self->npages * sizeof (PageStart));
+  if (fread (self->pages, sizeof (PageStart), self->npages, f)
+        != self->npages)
+    {
+    asprintf (error, "'%s' is damaged", filename);
+    fclose (f);
+    pages_destroy (self);
+    return FALSE;
+    }
+  fclose (f);
+  *result = self;
+  return TRUE;
+  }
@@ -0,0 +1,77 @@
+/*============================================================================
+  epub2txt v2
+  pages.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Page-layout index for a recorded document. For one layout -- a width,
+  a page height, and the options that affect line breaking -- the index
+  records where each page starts: the paragraph, the number of lines of
+  that paragraph that fall on the previous page, and the state of the
+  wrapper at the start of the paragraph. Any page can then be laid out
+  by starting at that paragraph, rather than at the start of the book.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "epub2txt.h"
+#include "wrap.h"
+
+// Flags in PageStart
+#define PAGE_BLANK_LINE 0x01
+
+typedef struct _PageStart
+  {
+  uint32_t section;  // Section that the page starts in
+  uint32_t para;     // Paragraph that the page starts in
+  uint32_t skip;     // Lines of the paragraph (and, if it is the first in
+                     //  the section, the separator) on earlier pages
+  uint16_t column;   // Wrapper state at the start of the paragraph
+  BYTE fmt;          // Input format (low four bits), output format (high)
+  BYTE flags;
+  } PageStart;
+
+typedef struct _PageIndex
+  {
+  uint32_t width;
+  uint32_t height;
+  uint32_t layout;       // Flags for the options that affect layout
+  uint64_t fingerprint;  // Of the document, and the layout options
+  uint32_t npages;
+  PageStart *pages;
+  uint32_t pages_size;
+  } PageIndex;
+
+PageIndex *pages_create (const Document *doc,
+             const Epub2TxtOptions *options, int height);
+void       pages_destroy (PageIndex *self);
+
+/** TRUE if the index was made for this document, laid out with these
+    options, at this height. */
+BOOL       pages_matches (const PageIndex *self, const Document *doc,
+             const Epub2TxtOptions *options, int height);
+
+/** Lay out lines [skip, skip + nlines) from the start of a page (or
+    all the remaining lines if nlines is zero or less) and send them
+    to fn. */
+void       pages_render (const PageIndex *self, const Document *doc,
+             const Epub2TxtOptions *options, int page, int skip,
+             int nlines, WrapTextOutputFn fn, void *app_data);
+
+/** As pages_render, but from any position, which need not be the start 
+    of a page; in particular, a position whose para is the first of its
+    section, with skip zero and a zero state except for PAGE_BLANK_LINE,
+    is the start of that section. */
+void       pages_render_from (const Document *doc,
+             const Epub2TxtOptions *options, const PageStart *start,
+             int skip, int nlines, WrapTextOutputFn fn, void *app_data);
+
+/** The line, counting from zero, on which a section starts, or -1 if
+    the section is not shown. */
+int        pages_section_line (const PageIndex *self, const Document *doc,
+             const Epub2TxtOptions *options, int section);
+
+BOOL       pages_write_file (const PageIndex *self, const char *filename,
+             char **error);
+BOOL       pages_create_from_file (const char *filename, PageIndex **result,
+             char **error);
@@ -0,0 +1,472 @@
+/*============================================================================
+  epub2txt v2
+  parasink.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parasink.h"
+
+// Characters that are escaped with a backslash, for Markdown
+#define PARASINK_MARKDOWN_SPECIAL "\\`*_[]<>#"
+
+// The length of a recorded call whose string is NULL
+#define PARASINK_NULL UINT32_MAX
+
+// A recorded call, which is followed by its string, if any, and a NUL
+typedef struct _ParaSinkRecord
+  {
+  int32_t op;
+  int32_t n;
+  int32_t on;
+  uint32_t len;
+  uint32_t tag;
+  } ParaSinkRecord;
+
+/*============================================================================
+  parasink_init
+============================================================================*/
+void parasink_init (ParaSink *self, Compressor *compressor)
+  {
+  self->compressor = compressor;
+  self->out = stdout;
+  self->pending = buffer_create ();
+  self->text = buffer_create ();
+  self->kind = PARA_META;
+  self->meta = TRUE;
+  }
+
+
+/*============================================================================
+  parasink_write_out
+============================================================================*/
+static void parasink_write_out (ParaSink *self, const char *s, size_t len)
+  {
+  if (self->compressor)
+    compressor_write (self->compressor, s, len);
+  else if (self->io)
+    batchio_write (self->io, s, len);
+  else if (len)
+    fwrite (s, 1, len, self->out);
+  }
+
+
+/*============================================================================
+  parasink_flush
+  Write out what parasink_write() holds: at the end of each book, and
+  when the sink is closed
+============================================================================*/
+static void parasink_flush (ParaSink *self)
+  {
+  if (!self->pending || self->pending->len == 0) return;
+  parasink_write_out (self, self->pending->data, self->pending->len);
+  buffer_clear (self->pending);
+  }
+
+
+/*============================================================================
+  parasink_write
+============================================================================*/
+void parasink_write (ParaSink *self, const char *s, size_t len)
+  {
+  if (!self->pending)
+    {
+    parasink_write_out (self, s, len);
+    return;
+    }
+  buffer_append (self->pending, s, len);
+  if (self->pending->len >= PARASINK_FLUSH_SIZE) parasink_flush (self);
+  }
+
+
+/*============================================================================
+  parasink_close
+============================================================================*/
+void parasink_close (ParaSink *self)
+  {
+  // What the sink writes as it is destroyed goes straight out
+  parasink_flush (self);
+  buffer_destroy (self->pending);
+  self->pending = NULL;
+  buffer_destroy (self->text);
+  if (self->destroy) self->destroy (self);
+  }
+
+
+/*============================================================================
+  parasink_set_output
+============================================================================*/
+void parasink_set_output (ParaSink *self, FILE *f)
+  {
+  self->out = f;
+  }
+
+
+/*============================================================================
+  parasink_set_io
+============================================================================*/
+void parasink_set_io (ParaSink *self, BatchIo *io)
+  {
+  self->io = io;
+  }
+
+
+/*============================================================================
+  parasink_forward
+  If the sink passes its calls on, pass this one on, and return TRUE
+============================================================================*/
+static BOOL parasink_forward (ParaSink *self, ParaSinkOp op, int n, BOOL on,
+       const char *s, size_t len)
+  {
+  if (!self->forward) return FALSE;
+  ParaSinkCall call = { op, n, on, s, len };
+  self->forward (self, &call);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  parasink_begin_book
+============================================================================*/
+void parasink_begin_book (ParaSink *self, const char *book)
+  {
+  if (parasink_forward (self, PARASINK_BEGIN_BOOK, 0, FALSE, 
+       book, 0)) return;
+  buffer_clear (self->text);
+  self->meta = TRUE;
+  self->kind = PARA_META;
+  self->done = FALSE;
+  self->heading = 0;
+  self->quote = 0;
+  self->emphasis = 0;
+  self->nmarks = 0;
+  if (self->begin_book) self->begin_book (self, book);
+  }
+
+
+/*============================================================================
+  parasink_end_book
+============================================================================*/
+void parasink_end_book (ParaSink *self)
+  {
+  if (parasink_forward (self, PARASINK_END_BOOK, 0, FALSE, NULL, 0)) return;
+  parasink_end_para (self);
+  if (self->end_book) self->end_book (self);
+  parasink_flush (self);
+  }
+
+
+/*============================================================================
+  parasink_begin_section
+============================================================================*/
+void parasink_begin_section (ParaSink *self, int spine_index, 
+       const char *href)
+  {
+  if (parasink_forward (self, PARASINK_BEGIN_SECTION, spine_index, 
+       FALSE, href, 0)) return;
+  buffer_clear (self->text);
+  self->meta = href == NULL;
+  self->kind = self->meta ? PARA_META : PARA_TEXT;
+  self->heading = 0;
+  self->quote = 0;
+  self->emphasis = 0;
+  self->nmarks = 0;
+  if (self->begin_section) self->begin_section (self, spine_index, href);
+  }
+
+
+/*============================================================================
+  parasink_begin_heading
+============================================================================*/
+void parasink_begin_heading (ParaSink *self, int level)
+  {
+  if (parasink_forward (self, PARASINK_BEGIN_HEADING, level, FALSE,
+       NULL, 0)) return;
+  parasink_end_para (self);
+  if (self->meta) return;
+  self->kind = PARA_HEADING;
+  self->heading = level;
+  }
+
+
+/*============================================================================
+  parasink_begin_quote
+============================================================================*/
+void parasink_begin_quote (ParaSink *self)
+  {
+  if (parasink_forward (self, PARASINK_BEGIN_QUOTE, 0, FALSE, NULL, 0)) return;
+  parasink_end_para (self);
+  self->quote++;
+  }
+
+
+/*============================================================================
+  parasink_end_quote
+============================================================================*/
+void parasink_end_quote (ParaSink *self)
+  {
+  if (parasink_forward (self, PARASINK_END_QUOTE, 0, FALSE, NULL, 0)) return;
+  parasink_end_para (self);
+  if (self->quote) self->quote--;
+  }
+
+
+/*============================================================================
+  parasink_marker
+============================================================================*/
+static void parasink_marker (ParaSink *self, int emphasis)
+  {
+  if (emphasis == PARASINK_STRONG)
+    buffer_append (self->text, "**", 2);
+  else
+    buffer_append (self->text, "*", 1);
+  }
+
+
+/*============================================================================
+  parasink_marked
+  Whether emphasis has an open marker in the text
+============================================================================*/
+static BOOL parasink_marked (const ParaSink *self, int emphasis)
+  {
+  int i;
+  for (i = 0; i < self->nmarks; i++)
+    if (self->marks[i] == emphasis) return TRUE;
+  return FALSE;
+  }
+
+
+/*============================================================================
+  parasink_open_markers
+  Open the markers for emphasis that has started, just before the text 
+  that it applies to, since Markdown does not allow a space after them
+============================================================================*/
+static void parasink_open_markers (ParaSink *self)
+  {
+  int e;
+  for (e = PARASINK_STRONG; e <= PARASINK_EM; e <<= 1)
+    {
+    if (!(self->emphasis & e) || parasink_marked (self, e)) continue;
+    parasink_marker (self, e);
+    self->marks[self->nmarks++] = e;
+    }
+  }
+
+
+/*============================================================================
+  parasink_close_markers
+  Close all the open markers, innermost first, before any trailing
+  space; emphasis that goes on is marked again before the next text
+============================================================================*/
+static void parasink_close_markers (ParaSink *self)
+  {
+  Buffer *text = self->text;
+  BOOL space = text->len && text->data[text->len - 1] == ' ';
+  if (space) text->len--;
+  while (self->nmarks)
+    parasink_marker (self, self->marks[--self->nmarks]);
+  if (space) buffer_append (text, " ", 1);
+  }
+
+
+/*============================================================================
+  parasink_emphasis
+============================================================================*/
+void parasink_emphasis (ParaSink *self, int emphasis, BOOL on)
+  {
+  if (parasink_forward (self, PARASINK_EMPHASIS, emphasis, on, 
+       NULL, 0)) return;
+  if (!self->markdown) return;
+  if (on)
+    {
+    self->emphasis |= emphasis;
+    return;
+    }
+  self->emphasis &= ~emphasis;
+  if (parasink_marked (self, emphasis)) parasink_close_markers (self);
+  }
+
+
+/*============================================================================
+  parasink_text_markdown
+  As parasink_text, but escaping, and marking emphasis
+============================================================================*/
+static void parasink_text_markdown (ParaSink *self, const char *s, 
+       size_t len)
+  {
+  Buffer *text = self->text;
+  size_t i = 0, n;
+  while (i < len)
+    {
+    if (s[i] == ' ')
+      {
+      if (!(text->len == 0 || text->data[text->len - 1] == ' '
+           || text->data[text->len - 1] == '\n'))
+        buffer_append (text, " ", 1);
+      i++;
+      continue;
+      }
+    if (self->emphasis) parasink_open_markers (self);
+    for (n = i; n < len && s[n] != ' '
+         && !memchr (PARASINK_MARKDOWN_SPECIAL, s[n], 
+              sizeof (PARASINK_MARKDOWN_SPECIAL) - 1); n++);
+    if (n == i)
+      {
+      buffer_append (text, "\\", 1);
+      n++;
+      }
+    buffer_append (text, s + i, n - i);
+    i = n;
+    }
+  }
+
+
+/*============================================================================
+  parasink_text
+============================================================================*/
+void parasink_text (ParaSink *self, const char *s, size_t len)
+  {
+  if (parasink_forward (self, PARASINK_TEXT, 0, FALSE, s, len)) return;
+  if (self->markdown)
+    {
+    parasink_text_markdown (self, s, len);
+    return;
+    }
+  Buffer *text = self->text;
+  buffer_reserve (text, len);
+  size_t i;
+  for (i = 0; i < len; i++)
+    {
+    char c = s[i];
+    if (c == ' ' && (text->len == 0 || text->data[text->len - 1] == ' '
+         || text->data[text->len - 1] == '\n'))
+      continue;
+    text->data[text->len++] = c;
+    }
+  }
+
+
+/*============================================================================
+  parasink_trim
+  Remove trailing spaces and line breaks from the paragraph
+============================================================================*/
+static void parasink_trim (ParaSink *self)
+  {
+  Buffer *text = self->text;
+  while (text->len && (text->data[text->len - 1] == ' ' 
+          || text->data[text->len - 1] == '\n'))
+    text->len--;
+  }
+
+
+/*============================================================================
+  parasink_line_break
+============================================================================*/
+void parasink_line_break (ParaSink *self)
+  {
+  if (parasink_forward (self, PARASINK_LINE_BREAK, 0, FALSE, NULL, 0)) return;
+  parasink_trim (self);
+  if (self->text->len) buffer_append (self->text, "\n", 1);
+  }
+
+
+/*============================================================================
+  parasink_end_para
+============================================================================*/
+void parasink_end_para (ParaSink *self)
+  {
+  if (parasink_forward (self, PARASINK_END_PARA, 0, FALSE, NULL, 0)) return;
+  if (self->nmarks) 
+    {
+    parasink_trim (self);
+    parasink_close_markers (self);
+    }
+  parasink_trim (self);
+  if (self->text->len && self->para && !self->done)
+    self->para (self, self->kind, self->text->data, self->text->len);
+  buffer_clear (self->text);
+  if (!self->meta) self->kind = PARA_TEXT;
+  self->heading = 0;
+  }
+
+
+/*============================================================================
+  parasink_call
+============================================================================*/
+void parasink_call (ParaSink *self, const ParaSinkCall *call)
+  {
+  switch (call->op)
+    {
+    case PARASINK_BEGIN_BOOK:
+      parasink_begin_book (self, call->s); break;
+    case PARASINK_END_BOOK:
+      parasink_end_book (self); break;
+    case PARASINK_BEGIN_SECTION:
+      parasink_begin_section (self, call->n, call->s); break;
+    case PARASINK_BEGIN_HEADING:
+      parasink_begin_heading (self, call->n); break;
+    case PARASINK_BEGIN_QUOTE:
+      parasink_begin_quote (self); break;
+    case PARASINK_END_QUOTE:
+      parasink_end_quote (self); break;
+    case PARASINK_EMPHASIS:
+      parasink_emphasis (self, call->n, call->on); break;
+    case PARASINK_TEXT:
+      parasink_text (self, call->s, call->len); break;
+    case PARASINK_LINE_BREAK:
+      parasink_line_break (self); break;
+    case PARASINK_END_PARA:
+      parasink_end_para (self); break;
+    }
+  }
+
+
+/*============================================================================
+  parasink_record
+============================================================================*/
+void parasink_record (Buffer *block, const ParaSinkCall *call, uint32_t tag)
+  {
+  ParaSinkRecord record = { call->op, call->n, call->on, PARASINK_NULL, 
+    tag };
+  size_t len = 0;
+  if (call->s)
+    {
+    // A book or href is given as a string
+    len = call->op == PARASINK_TEXT ? call->len : strlen (call->s);
+    record.len = len;
+    }
+  buffer_append (block, (const char *)&record, sizeof (record));
+  if (call->s)
+    {
+    buffer_append (block, call->s, len);
+    buffer_append (block, "", 1);
+    }
+  }
+
+
+/*============================================================================
+  parasink_recorded
+============================================================================*/
+BOOL parasink_recorded (const Buffer *block, size_t *pos, 
+       ParaSinkCall *call, uint32_t *tag)
+  {
+  if (*pos >= block->len) return FALSE;
+  ParaSinkRecord record;
+  memcpy (&record, block->data + *pos, sizeof (record));
+  *pos += sizeof (record);
+  call->op = record.op;
+  call->n = record.n;
+  call->on = record.on;
+  call->s = NULL;
+  call->len = 0;
+  if (record.len != PARASINK_NULL)
+    {
+    call->s = block->data + *pos;
+    call->len = record.len;
+    *pos += record.len + 1;
+    }
+  if (tag) *tag = record.tag;
+  return TRUE;
+  }
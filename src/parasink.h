@@ -0,0 +1,148 @@
+/*============================================================================
+  epub2txt v2
+  parasink.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Paragraph sinks: consumers of the text of a book as a stream of whole
+  paragraphs, rather than as wrapped lines. When the options have a
+  sink, the XHTML parser passes its text here instead of to the wrapper,
+  so nothing is laid out; the functions below collect the text of each
+  paragraph (collapsing runs of spaces, and trimming the ends) and hand
+  it to the sink when the paragraph ends.
+
+  A sink is a structure that starts with a ParaSink, whose functions it
+  fills in, and whose create function calls parasink_init(). Anything
+  that a sink writes should go through parasink_write(), which sends it 
+  to stdout or, if the output is compressed, the compressor. What is
+  written is held until PARASINK_FLUSH_SIZE bytes have built up, or the
+  book ends.
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "defs.h"
+#include "buffer.h"
+#include "compress.h"
+#include "batchio.h"
+
+// Output is written out when this much is buffered
+#define PARASINK_FLUSH_SIZE 65536
+
+typedef enum { PARA_TEXT = 0,  // An ordinary paragraph
+               PARA_HEADING,   // h1 to h5
+               PARA_META       // A line of metadata
+               } ParaKind;
+
+typedef struct _ParaSink ParaSink;
+
+// The calls below, as data, for sinks that pass them on (see tee.h)
+typedef enum { PARASINK_BEGIN_BOOK = 0, PARASINK_END_BOOK, 
+               PARASINK_BEGIN_SECTION, PARASINK_BEGIN_HEADING,
+               PARASINK_BEGIN_QUOTE, PARASINK_END_QUOTE, PARASINK_EMPHASIS,
+               PARASINK_TEXT, PARASINK_LINE_BREAK, PARASINK_END_PARA
+               } ParaSinkOp;
+
+typedef struct _ParaSinkCall
+  {
+  ParaSinkOp op;
+  int n;             // Spine index, heading level, or emphasis
+  BOOL on;           // Whether emphasis starts or ends
+  const char *s;     // Book, href, or text; a book or href is NUL-
+  size_t len;        //  terminated, and the href may be NULL
+  } ParaSinkCall;
+
+struct _ParaSink
+  {
+  // Filled in by the sink; any may be NULL
+  void (*begin_book) (ParaSink *self, const char *book);
+  void (*end_book) (ParaSink *self);
+  /** href is NULL for the metadata */
+  void (*begin_section) (ParaSink *self, int spine_index, const char *href);
+  /** text is UTF-8, not NUL-terminated, and never empty; hard line 
+      breaks in it are '\n' */
+  void (*para) (ParaSink *self, ParaKind kind, const char *text, 
+         size_t len);
+  void (*destroy) (ParaSink *self);
+  /** If set, the calls below are passed to this, and nothing else is 
+      done with them; the sink collects no text of its own */
+  void (*forward) (ParaSink *self, const ParaSinkCall *call);
+  /** Set by the sink when it needs no more of the current book, so 
+      that the rest of it need not be parsed; cleared for each book */
+  BOOL done;
+  /** Set by the sink if it wants Markdown: then the text passed to 
+      para() has Markdown's special characters escaped, and bold and
+      italic text marked with ** and * */
+  BOOL markdown;
+  /** For the paragraph passed to para(): the level of a heading, from 1
+      to 5, and the number of blockquotes that it is in */
+  int heading;
+  int quote;
+  // Private
+  Compressor *compressor;
+  FILE *out;
+  BatchIo *io;
+  Buffer *pending;        // Output not yet written
+  Buffer *text;
+  ParaKind kind;
+  BOOL meta;
+  int emphasis;           // Bold and italic, as PARASINK_STRONG, etc.
+  int marks [2];          // Those with open markers in text, outermost
+  int nmarks;             //  first
+  };
+
+#define PARASINK_STRONG 0x0001
+#define PARASINK_EM     0x0002
+
+void        parasink_init (ParaSink *self, Compressor *compressor);
+
+/** Destroy the sink, which writes out anything that it still holds. */
+void        parasink_close (ParaSink *self);
+
+/** Write to f, rather than stdout, if there is no compressor. */
+void        parasink_set_output (ParaSink *self, FILE *f);
+
+/** Write through io, rather than to stdout, if there is no compressor. */
+void        parasink_set_io (ParaSink *self, BatchIo *io);
+
+void        parasink_write (ParaSink *self, const char *s, size_t len);
+
+/** Make a call, given as data. */
+void        parasink_call (ParaSink *self, const ParaSinkCall *call);
+
+/** Add a call to a block of recorded calls, with a tag of the caller's
+    own, such as where in the book it was made. The call's string, if
+    any, is copied. */
+void        parasink_record (Buffer *block, const ParaSinkCall *call,
+              uint32_t tag);
+
+/** Get the call recorded at *pos in a block, and its tag, and move pos
+    past it; returns FALSE at the end of the block. The call's string
+    points into the block. */
+BOOL        parasink_recorded (const Buffer *block, size_t *pos,
+              ParaSinkCall *call, uint32_t *tag);
+
+void        parasink_begin_book (ParaSink *self, const char *book);
+void        parasink_end_book (ParaSink *self);
+void        parasink_begin_section (ParaSink *self, int spine_index, 
+              const char *href);
+
+/** The paragraph that follows is a heading, of level 1 to 5. */
+void        parasink_begin_heading (ParaSink *self, int level);
+
+/** The paragraphs that follow, up to parasink_end_quote(), are in a 
+    blockquote. */
+void        parasink_begin_quote (ParaSink *self);
+void        parasink_end_quote (ParaSink *self);
+
+/** Start or end bold (PARASINK_STRONG) or italic (PARASINK_EM) text. */
+void        parasink_emphasis (ParaSink *self, int emphasis, BOOL on);
+
+/** Add text to the paragraph. */
+void        parasink_text (ParaSink *self, const char *s, size_t len);
+void        parasink_line_break (ParaSink *self);
+
+/** Pass the paragraph to the sink, unless it is blank. */
+void        parasink_end_para (ParaSink *self);
@@ -0,0 +1,308 @@
+/*============================================================================
+  epub2txt v2
+  prefetch.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The thread reads the end of each archive, to find the central
+  directory, and then the central directory itself, which are small,
+  and which unzip reads first. It then advises the kernel that the
+  entries of text will be needed, merging those that are close to one
+  another, and counts their bytes against the budget. The kernel reads
+  them in the background, so that the thread can move on at once.
+
+  An archive that cannot be read, or is not a ZIP file, or needs ZIP64,
+  is just not prefetched; converting it will report whatever is wrong.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "prefetch.h"
+#include "log.h"
+
+// The end of central directory record, without its comment
+#define PREFETCH_EOCD_SIZE 22
+// The most that is searched for it, with the longest comment
+#define PREFETCH_TAIL_SIZE (PREFETCH_EOCD_SIZE + 65535)
+// The largest central directory that is read
+#define PREFETCH_MAX_DIRECTORY (16 * 1024 * 1024)
+// The fixed part of a central directory entry, and of a local header
+#define PREFETCH_ENTRY_SIZE 46
+#define PREFETCH_LOCAL_SIZE 30
+// Entries closer together than this are read ahead as one
+#define PREFETCH_GAP (64 * 1024)
+
+struct _Prefetch
+  {
+  char *const *files;
+  int nfiles;
+  int depth;
+  size_t *cost;              // Bytes read ahead, for each file
+  int current;               // Being converted
+  int next;                  // The next to read ahead
+  size_t ahead;              // Bytes read ahead of the current file
+  BOOL closing;
+  pthread_t thread;
+  BOOL threaded;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  };
+
+
+/*============================================================================
+  prefetch_u16
+============================================================================*/
+static uint32_t prefetch_u16 (const unsigned char *p)
+  {
+  return p[0] | (uint32_t)p[1] << 8;
+  }
+
+
+/*============================================================================
+  prefetch_u32
+============================================================================*/
+static uint32_t prefetch_u32 (const unsigned char *p)
+  {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+    | (uint32_t)p[3] << 24;
+  }
+
+
+/*============================================================================
+  prefetch_advise
+  Ask the kernel to read a range of a file in the background
+============================================================================*/
+static void prefetch_advise (int fd, off_t offset, off_t len)
+  {
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise (fd, offset, len, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  struct radvisory ra = { offset, len };
+  fcntl (fd, F_RDADVISE, &ra);
+#else
+  (void)fd; (void)offset; (void)len;
+#endif
+  }
+
+
+/*============================================================================
+  prefetch_is_text
+  Whether an entry is one that the conversion reads
+============================================================================*/
+static BOOL prefetch_is_text (const char *name, size_t len)
+  {
+  static const char *suffixes [] = { ".xhtml", ".html", ".htm", ".xml",
+    ".opf", ".ncx", NULL };
+  int i;
+  for (i = 0; suffixes[i]; i++)
+    {
+    size_t n = strlen (suffixes[i]);
+    if (len >= n && strncasecmp (name + len - n, suffixes[i], n) == 0)
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+
+/*============================================================================
+  prefetch_directory
+  Read the central directory, and return its size, with its offset in
+  offset; or return 0
+============================================================================*/
+static size_t prefetch_directory (int fd, off_t size, off_t *offset,
+       unsigned char **directory)
+  {
+  off_t tail_size = size < PREFETCH_TAIL_SIZE ? size : PREFETCH_TAIL_SIZE;
+  if (tail_size < PREFETCH_EOCD_SIZE) return 0;
+  unsigned char *tail = malloc (tail_size);
+  size_t dir_size = 0;
+  if (pread (fd, tail, tail_size, size - tail_size) == tail_size)
+    {
+    off_t i;
+    for (i = tail_size - PREFETCH_EOCD_SIZE; i >= 0; i--)
+      if (prefetch_u32 (tail + i) == 0x06054b50) break;
+    if (i >= 0)
+      {
+      dir_size = prefetch_u32 (tail + i + 12);
+      *offset = prefetch_u32 (tail + i + 16);
+      // 0xFFFFFFFF means ZIP64
+      if (dir_size > PREFETCH_MAX_DIRECTORY
+           || *offset + (off_t)dir_size > size)
+        dir_size = 0;
+      }
+    }
+  free (tail);
+  if (dir_size == 0) return 0;
+  *directory = malloc (dir_size);
+  if (pread (fd, *directory, dir_size, *offset) != (ssize_t)dir_size)
+    {
+    free (*directory);
+    *directory = NULL;
+    return 0;
+    }
+  return dir_size;
+  }
+
+
+/*============================================================================
+  prefetch_archive
+  Read ahead the entries of text in an archive, and return how many
+  bytes were asked for
+============================================================================*/
+static size_t prefetch_archive (const char *file)
+  {
+  int fd = open (file, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat sb;
+  unsigned char *directory = NULL;
+  off_t dir_offset = 0;
+  size_t dir_size = 0;
+  if (fstat (fd, &sb) == 0 && S_ISREG (sb.st_mode))
+    dir_size = prefetch_directory (fd, sb.st_size, &dir_offset, &directory);
+
+  size_t cost = 0;
+  off_t start = 0, end = 0;  // The run of entries to read ahead
+  size_t pos = 0;
+  while (pos + PREFETCH_ENTRY_SIZE <= dir_size
+      && prefetch_u32 (directory + pos) == 0x02014b50)
+    {
+    const unsigned char *entry = directory + pos;
+    uint32_t compressed = prefetch_u32 (entry + 20);
+    uint32_t name_len = prefetch_u16 (entry + 28);
+    uint32_t extra_len = prefetch_u16 (entry + 30);
+    uint32_t comment_len = prefetch_u16 (entry + 32);
+    off_t local = prefetch_u32 (entry + 42);
+    size_t next = pos + PREFETCH_ENTRY_SIZE + name_len + extra_len
+      + comment_len;
+    if (next > dir_size) break;
+    if (local < sb.st_size && prefetch_is_text ((const char *)entry 
+          + PREFETCH_ENTRY_SIZE, name_len))
+      {
+      // The local extra field is not always the central one, so allow
+      //   for a little more
+      off_t len = PREFETCH_LOCAL_SIZE + name_len + extra_len + compressed
+        + 1024;
+      if (local + len > sb.st_size) len = sb.st_size - local;
+      if (end > start && local >= start && local <= end + PREFETCH_GAP)
+        {
+        if (local + len > end) end = local + len;
+        }
+      else
+        {
+        if (end > start)
+          {
+          prefetch_advise (fd, start, end - start);
+          cost += end - start;
+          }
+        start = local;
+        end = local + len;
+        }
+      }
+    pos = next;
+    }
+  if (end > start)
+    {
+    prefetch_advise (fd, start, end - start);
+    cost += end - start;
+    }
+
+  log_debug ("Prefetched %zu bytes of %s", cost, file);
+  free (directory);
+  close (fd);
+  return cost;
+  }
+
+
+/*============================================================================
+  prefetch_worker
+============================================================================*/
+static void *prefetch_worker (void *arg)
+  {
+  Prefetch *self = arg;
+  pthread_mutex_lock (&self->mutex);
+  for (;;)
+    {
+    while (!self->closing && self->next < self->nfiles
+        && (self->next > self->current + self->depth
+          || self->ahead >= PREFETCH_MAX_BYTES))
+      pthread_cond_wait (&self->cond, &self->mutex);
+    // Books already reached need not be read ahead
+    if (self->next <= self->current) self->next = self->current + 1;
+    if (self->closing || self->next >= self->nfiles) break;
+    int n = self->next++;
+    pthread_mutex_unlock (&self->mutex);
+    size_t cost = prefetch_archive (self->files[n]);
+    pthread_mutex_lock (&self->mutex);
+    // The book might already be being converted
+    self->cost[n] = cost;
+    if (n > self->current) self->ahead += cost;
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+
+/*============================================================================
+  prefetch_create
+============================================================================*/
+Prefetch *prefetch_create (char *const *files, int nfiles, int depth)
+  {
+  Prefetch *self = malloc (sizeof (Prefetch));
+  memset (self, 0, sizeof (Prefetch));
+  self->files = files;
+  self->nfiles = nfiles;
+  self->depth = depth;
+  self->cost = calloc (nfiles, sizeof (size_t));
+  self->next = 1;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->cond, NULL);
+  if (pthread_create (&self->thread, NULL, prefetch_worker, self) == 0)
+    self->threaded = TRUE;
+  else
+    log_warning ("Can't start a thread to read books ahead");
+  return self;
+  }
+
+
+/*============================================================================
+  prefetch_book
+============================================================================*/
+void prefetch_book (Prefetch *self, int n)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (self->current < n)
+    {
+    self->current++;
+    self->ahead -= self->cost[self->current];
+    }
+  pthread_cond_signal (&self->cond);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*============================================================================
+  prefetch_destroy
+============================================================================*/
+void prefetch_destroy (Prefetch *self)
+  {
+  if (self->threaded)
+    {
+    pthread_mutex_lock (&self->mutex);
+    self->closing = TRUE;
+    pthread_cond_signal (&self->cond);
+    pthread_mutex_unlock (&self->mutex);
+    pthread_join (self->thread, NULL);
+    }
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->cond);
+  free (self->cost);
+  free (self);
+  }
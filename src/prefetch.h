@@ -0,0 +1,33 @@
+/*============================================================================
+  epub2txt v2
+  prefetch.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Prefetching of books (--prefetch): while one book is converted, a
+  thread asks the kernel to start reading the next few, so that a batch
+  run over books that are not in the page cache is not held up waiting
+  for the disk at the start of each one. Only the parts of each archive
+  that the conversion reads are asked for -- its central directory, and
+  its XHTML, OPF, and NCX entries -- found from the central directory.
+  Books are read ahead up to a given number, and no more than
+  PREFETCH_MAX_BYTES of them at a time.
+============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+#define PREFETCH_DEFAULT_DEPTH 4
+#define PREFETCH_MAX_BYTES (128 * 1024 * 1024)
+
+typedef struct _Prefetch Prefetch;
+
+/** Start prefetching files[1] onwards; files must last as long as this
+    does. */
+Prefetch   *prefetch_create (char *const *files, int nfiles, int depth);
+
+/** Say that files[n] is being converted, so that those after it can be
+    read ahead. */
+void        prefetch_book (Prefetch *self, int n);
+
+void        prefetch_destroy (Prefetch *self);
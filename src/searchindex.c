@@ -0,0 +1,1149 @@
+/*============================================================================
+  epub2txt v2
+  searchindex.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Building and querying search indexes; see searchindex.h for the
+  format. In memory, the terms are kept in an open-addressing hash table
+  of indexes into an array of entries, with their bytes in one arena,
+  and each term's postings are encoded as they are added, so there is
+  nothing to do at the end but sort the terms and write them out.
+  Segments are read with mmap(), so that a query touches only the parts
+  of the index that it needs.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "searchindex.h"
+#include "store.h"
+#include "fold.h"
+
+// Longer words, in bytes, are not indexed
+#define SEARCHINDEX_MAX_WORD 64
+
+#define SEARCHINDEX_FOLD (FOLD_CASE | FOLD_DIACRITICS)
+
+// A term, in memory, with its postings so far
+typedef struct _IndexEntry
+  {
+  uint64_t term;          // Offset in the arena
+  uint32_t term_len;
+  uint32_t hash;
+  BYTE *postings;
+  uint64_t postings_len;
+  uint64_t postings_size;
+  uint32_t count;
+  uint32_t book;          // The last posting
+  uint32_t section;
+  uint32_t para;
+  uint32_t word;
+  } IndexEntry;
+
+typedef struct _SearchIndex
+  {
+  ParaSink sink;
+  char *dir;
+  char *error;            // The first error in writing a run
+  IndexEntry *entries;
+  uint64_t nentries;
+  uint64_t entries_size;
+  uint32_t *table;        // Index in entries, plus 1, or 0 if free
+  uint64_t table_size;
+  char *arena;
+  uint64_t arena_len;
+  uint64_t arena_size;
+  uint64_t memory;        // Roughly, the bytes held by all of the above
+  // Books and spine items since the last run was written
+  uint64_t *books;
+  uint64_t nbooks;
+  uint64_t books_size;
+  SearchIndexSection *sections;
+  uint64_t nsections;
+  uint64_t sections_size;
+  Buffer *strings;        // Book names and hrefs
+  // Where we are
+  uint32_t section;
+  uint32_t para;
+  uint32_t word;
+  BOOL in_section;
+  char **runs;            // Temporary segments
+  int nruns;
+  Buffer *token;
+  } SearchIndex;
+
+/*============================================================================
+  searchindex_put_varint
+  Add a varint to a term's postings
+============================================================================*/
+static void searchindex_put_varint (IndexEntry *e, uint64_t v)
+  {
+  STORE_GROW (e->postings, e->postings_size,
+    e->postings_len + STORE_VARINT_MAX);
+  e->postings_len += store_put_varint (e->postings + e->postings_len, v);
+  }
+
+
+/*============================================================================
+  searchindex_hash
+  FNV-1a
+============================================================================*/
+static uint32_t searchindex_hash (const char *s, size_t len)
+  {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (BYTE)s[i]) * 16777619u;
+  return h;
+  }
+
+
+/*============================================================================
+  searchindex_rehash
+============================================================================*/
+static void searchindex_rehash (SearchIndex *self)
+  {
+  self->memory -= self->table_size * sizeof (uint32_t);
+  self->table_size = self->table_size ? self->table_size * 2 : 4096;
+  free (self->table);
+  self->table = calloc (self->table_size, sizeof (uint32_t));
+  self->memory += self->table_size * sizeof (uint32_t);
+  uint64_t i, mask = self->table_size - 1;
+  for (i = 0; i < self->nentries; i++)
+    {
+    uint64_t p = self->entries[i].hash & mask;
+    while (self->table[p]) p = (p + 1) & mask;
+    self->table[p] = i + 1;
+    }
+  }
+
+
+/*============================================================================
+  searchindex_add_word
+============================================================================*/
+static void searchindex_add_word (void *context, const char *word,
+       size_t len)
+  {
+  SearchIndex *self = context;
+  if (len > SEARCHINDEX_MAX_WORD) return;
+  uint32_t hash = searchindex_hash (word, len);
+  uint64_t mask = self->table_size - 1;
+  uint64_t p = hash & mask;
+  IndexEntry *e = NULL;
+  while (self->table[p])
+    {
+    IndexEntry *candidate = &self->entries[self->table[p] - 1];
+    if (candidate->hash == hash && candidate->term_len == len
+         && memcmp (self->arena + candidate->term, word, len) == 0)
+      {
+      e = candidate;
+      break;
+      }
+    p = (p + 1) & mask;
+    }
+
+  if (!e)
+    {
+    uint64_t old_size = self->entries_size;
+    STORE_GROW (self->entries, self->entries_size, self->nentries + 1);
+    self->memory += (self->entries_size - old_size) * sizeof (IndexEntry);
+    e = &self->entries[self->nentries++];
+    memset (e, 0, sizeof (IndexEntry));
+    e->hash = hash;
+    e->term_len = len;
+    e->term = self->arena_len;
+    old_size = self->arena_size;
+    STORE_GROW (self->arena, self->arena_size, self->arena_len + len + 1);
+    self->memory += self->arena_size - old_size;
+    memcpy (self->arena + self->arena_len, word, len);
+    self->arena[self->arena_len + len] = 0;
+    self->arena_len += len + 1;
+    self->table[p] = self->nentries;
+    if (self->nentries * 2 >= self->table_size) searchindex_rehash (self);
+    }
+
+  uint32_t book = self->nbooks - 1;
+  uint64_t old_size = e->postings_size;
+  if (book != e->book || e->count == 0)
+    {
+    searchindex_put_varint (e, book - e->book);
+    searchindex_put_varint (e, self->section);
+    searchindex_put_varint (e, self->para);
+    searchindex_put_varint (e, self->word);
+    }
+  else if (self->section != e->section)
+    {
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, self->section - e->section);
+    searchindex_put_varint (e, self->para);
+    searchindex_put_varint (e, self->word);
+    }
+  else if (self->para != e->para)
+    {
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, self->para - e->para);
+    searchindex_put_varint (e, self->word);
+    }
+  else
+    {
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, 0);
+    searchindex_put_varint (e, self->word - e->word);
+    }
+  self->memory += e->postings_size - old_size;
+  e->count++;
+  e->book = book;
+  e->section = self->section;
+  e->para = self->para;
+  e->word = self->word;
+  self->word++;
+  }
+
+
+/*============================================================================
+  searchindex_finish_file
+  Write the parts of a segment that follow the postings, and the header
+============================================================================*/
+static BOOL searchindex_finish_file (FILE *f, SearchIndexFileHeader *header,
+       const Buffer *strings, const uint64_t *books,
+       const SearchIndexSection *sections, const SearchIndexTerm *terms)
+  {
+  header->strings_len = strings->len;
+  return store_write_chunk (f, strings->data, strings->len,
+       &header->strings_offset)
+    && store_write_chunk (f, books, header->nbooks * sizeof (uint64_t),
+       &header->books_offset)
+    && store_write_chunk (f, sections,
+       header->nsections * sizeof (SearchIndexSection),
+       &header->sections_offset)
+    && store_write_chunk (f, terms,
+       header->nterms * sizeof (SearchIndexTerm), &header->terms_offset)
+    && fseek (f, 0, SEEK_SET) == 0
+    && fwrite (header, sizeof (*header), 1, f) == 1;
+  }
+
+
+/*============================================================================
+  searchindex_start_file
+============================================================================*/
+static FILE *searchindex_start_file (const char *filename,
+       SearchIndexFileHeader *header)
+  {
+  memset (header, 0, sizeof (*header));
+  memcpy (header->magic, SEARCHINDEX_FILE_MAGIC, 4);
+  header->version = SEARCHINDEX_FILE_VERSION;
+  header->byte_order = SEARCHINDEX_FILE_BYTE_ORDER;
+  FILE *f = fopen (filename, "wb");
+  if (f && fwrite (header, sizeof (*header), 1, f) != 1)
+    {
+    fclose (f);
+    return NULL;
+    }
+  // The header is a multiple of eight bytes, so the postings follow it
+  header->postings_offset = sizeof (*header);
+  return f;
+  }
+
+
+typedef struct _IndexSortItem
+  {
+  const char *term;
+  IndexEntry *entry;
+  } IndexSortItem;
+
+/*============================================================================
+  searchindex_compare_items
+============================================================================*/
+static int searchindex_compare_items (const void *a, const void *b)
+  {
+  return strcmp (((const IndexSortItem *)a)->term,
+    ((const IndexSortItem *)b)->term);
+  }
+
+
+/*============================================================================
+  searchindex_write_memory
+  Write the terms in memory as a segment
+============================================================================*/
+static BOOL searchindex_write_memory (SearchIndex *self,
+       const char *filename)
+  {
+  uint64_t i, n = self->nentries;
+  IndexSortItem *items = malloc ((n + 1) * sizeof (IndexSortItem));
+  for (i = 0; i < n; i++)
+    {
+    items[i].term = self->arena + self->entries[i].term;
+    items[i].entry = &self->entries[i];
+    }
+  qsort (items, n, sizeof (IndexSortItem), searchindex_compare_items);
+
+  SearchIndexFileHeader header;
+  SearchIndexTerm *terms = malloc ((n + 1) * sizeof (SearchIndexTerm));
+  Buffer *strings = buffer_create ();
+  buffer_append (strings, self->strings->data, self->strings->len);
+  BOOL ok = FALSE;
+  FILE *f = searchindex_start_file (filename, &header);
+  if (f)
+    {
+    ok = TRUE;
+    for (i = 0; ok && i < n; i++)
+      {
+      const IndexEntry *e = items[i].entry;
+      terms[i].term = strings->len;
+      buffer_append (strings, items[i].term, e->term_len + 1);
+      terms[i].postings = header.postings_len;
+      terms[i].postings_len = e->postings_len;
+      terms[i].count = e->count;
+      terms[i].last_book = e->book;
+      header.postings_len += e->postings_len;
+      ok = fwrite (e->postings, e->postings_len, 1, f) == 1;
+      }
+    header.nbooks = self->nbooks;
+    header.nsections = self->nsections;
+    header.nterms = n;
+    ok = ok && searchindex_finish_file (f, &header, strings, self->books,
+      self->sections, terms);
+    if (fclose (f) != 0) ok = FALSE;
+    }
+  buffer_destroy (strings);
+  free (terms);
+  free (items);
+  return ok;
+  }
+
+
+/*============================================================================
+  searchindex_clear
+  Forget all the terms, books and spine items in memory
+============================================================================*/
+static void searchindex_clear (SearchIndex *self)
+  {
+  uint64_t i;
+  for (i = 0; i < self->nentries; i++)
+    free (self->entries[i].postings);
+  free (self->entries);
+  self->entries = NULL;
+  self->nentries = self->entries_size = 0;
+  free (self->table);
+  self->table = NULL;
+  self->table_size = 0;
+  free (self->arena);
+  self->arena = NULL;
+  self->arena_len = self->arena_size = 0;
+  self->memory = 0;
+  self->nbooks = 0;
+  self->nsections = 0;
+  buffer_clear (self->strings);
+  buffer_append (self->strings, "", 1);
+  searchindex_rehash (self);
+  }
+
+
+/*============================================================================
+  searchindex_write_run
+  Write the terms in memory as a temporary segment, and clear them
+============================================================================*/
+static void searchindex_write_run (SearchIndex *self)
+  {
+  char *filename;
+  asprintf (&filename, "%s/.run-%d-%d.tmp", self->dir, (int)getpid (),
+    self->nruns);
+  if (searchindex_write_memory (self, filename))
+    {
+    self->runs = realloc (self->runs, (self->nruns + 1) * sizeof (char *));
+    self->runs[self->nruns++] = filename;
+    }
+  else
+    {
+    if (!self->error)
+      asprintf (&self->error, "Can't write index file '%s': %s", filename,
+        strerror (errno));
+    unlink (filename);
+    free (filename);
+    }
+  searchindex_clear (self);
+  }
+
+
+/*============================================================================
+  SearchIndexFile
+  A segment, mapped into memory
+============================================================================*/
+typedef struct _SearchIndexFile
+  {
+  BYTE *data;
+  size_t len;
+  const SearchIndexFileHeader *header;
+  const BYTE *postings;
+  const char *strings;
+  const uint64_t *books;
+  const SearchIndexSection *sections;
+  const SearchIndexTerm *terms;
+  } SearchIndexFile;
+
+
+/*============================================================================
+  searchindex_chunk
+  Check that an array is inside the file, and return it
+============================================================================*/
+static const void *searchindex_chunk (const SearchIndexFile *file,
+       uint64_t offset, uint64_t count, size_t size)
+  {
+  if (offset > file->len || offset % 8
+       || count > (file->len - offset) / size)
+    return NULL;
+  return file->data + offset;
+  }
+
+
+/*============================================================================
+  searchindex_close_file
+============================================================================*/
+static void searchindex_close_file (SearchIndexFile *file)
+  {
+  if (file->data) munmap (file->data, file->len);
+  }
+
+
+/*============================================================================
+  searchindex_open_file
+============================================================================*/
+static BOOL searchindex_open_file (const char *filename,
+       SearchIndexFile *file, char **error)
+  {
+  memset (file, 0, sizeof (*file));
+  int fd = open (filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) != 0)
+    {
+    asprintf (error, "Can't open file '%s' for reading: %s",
+      filename, strerror (errno));
+    if (fd >= 0) close (fd);
+    return FALSE;
+    }
+  file->len = st.st_size;
+  if (file->len >= sizeof (SearchIndexFileHeader))
+    {
+    file->data = mmap (NULL, file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->data == MAP_FAILED) file->data = NULL;
+    }
+  close (fd);
+
+  const SearchIndexFileHeader *header = (void *)file->data;
+  if (!header || memcmp (header->magic, SEARCHINDEX_FILE_MAGIC, 4) != 0
+       || header->version != SEARCHINDEX_FILE_VERSION
+       || header->byte_order != SEARCHINDEX_FILE_BYTE_ORDER)
+    {
+    asprintf (error, "'%s' is not a usable index file", filename);
+    searchindex_close_file (file);
+    return FALSE;
+    }
+  file->header = header;
+  file->postings = searchindex_chunk (file, header->postings_offset,
+    header->postings_len, 1);
+  file->strings = searchindex_chunk (file, header->strings_offset,
+    header->strings_len, 1);
+  file->books = searchindex_chunk (file, header->books_offset,
+    header->nbooks, sizeof (uint64_t));
+  file->sections = searchindex_chunk (file, header->sections_offset,
+    header->nsections, sizeof (SearchIndexSection));
+  file->terms = searchindex_chunk (file, header->terms_offset,
+    header->nterms, sizeof (SearchIndexTerm));
+  // Every string must end inside the table
+  if (!file->postings || !file->strings || !file->books || !file->sections
+       || !file->terms || header->strings_len == 0
+       || file->strings[header->strings_len - 1] != 0)
+    {
+    asprintf (error, "'%s' is damaged", filename);
+    searchindex_close_file (file);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  searchindex_string
+============================================================================*/
+static const char *searchindex_string (const SearchIndexFile *file,
+       uint64_t offset)
+  {
+  if (offset >= file->header->strings_len) return "";
+  return file->strings + offset;
+  }
+
+
+/*============================================================================
+  searchindex_merge
+  Merge temporary segments into one, in order
+============================================================================*/
+static BOOL searchindex_merge (SearchIndex *self, const char *filename)
+  {
+  int k, n = self->nruns;
+  SearchIndexFile *runs = calloc (n, sizeof (SearchIndexFile));
+  uint64_t *next = calloc (n, sizeof (uint64_t));  // Next term of each
+  uint32_t *base = calloc (n, sizeof (uint32_t));  // First book of each
+  uint64_t nbooks = 0, nsections = 0, nterms = 0, books_size = 0,
+    sections_size = 0, terms_size = 0;
+  uint64_t *books = NULL;
+  SearchIndexSection *sections = NULL;
+  SearchIndexTerm *terms = NULL;
+  Buffer *strings = buffer_create ();
+  BOOL ok = TRUE;
+  buffer_append (strings, "", 1);
+
+  for (k = 0; ok && k < n; k++)
+    {
+    char *error = NULL;
+    if (!searchindex_open_file (self->runs[k], &runs[k], &error))
+      {
+      free (error);
+      ok = FALSE;
+      break;
+      }
+    const SearchIndexFile *run = &runs[k];
+    uint64_t i;
+    base[k] = nbooks;
+    for (i = 0; i < run->header->nbooks; i++)
+      {
+      STORE_GROW (books, books_size, nbooks + 1);
+      books[nbooks++] = strings->len;
+      const char *s = searchindex_string (run, run->books[i]);
+      buffer_append (strings, s, strlen (s) + 1);
+      }
+    for (i = 0; i < run->header->nsections; i++)
+      {
+      STORE_GROW (sections, sections_size, nsections + 1);
+      SearchIndexSection *section = &sections[nsections++];
+      *section = run->sections[i];
+      section->book += base[k];
+      const char *s = searchindex_string (run, section->href);
+      section->href = strings->len;
+      buffer_append (strings, s, strlen (s) + 1);
+      }
+    }
+
+  SearchIndexFileHeader header;
+  FILE *f = ok ? searchindex_start_file (filename, &header) : NULL;
+  ok = f != NULL;
+  while (ok)
+    {
+    // The least of the runs' next terms
+    const char *term = NULL;
+    for (k = 0; k < n; k++)
+      {
+      if (next[k] >= runs[k].header->nterms) continue;
+      const char *s = searchindex_string (&runs[k],
+        runs[k].terms[next[k]].term);
+      if (!term || strcmp (s, term) < 0) term = s;
+      }
+    if (!term) break;
+
+    STORE_GROW (terms, terms_size, nterms + 1);
+    SearchIndexTerm *out = &terms[nterms++];
+    memset (out, 0, sizeof (*out));
+    out->term = strings->len;
+    out->postings = header.postings_len;
+    BOOL started = FALSE;
+    for (k = 0; ok && k < n; k++)
+      {
+      const SearchIndexFile *run = &runs[k];
+      if (next[k] >= run->header->nterms) continue;
+      const SearchIndexTerm *t = &run->terms[next[k]];
+      if (strcmp (searchindex_string (run, t->term), term) != 0) continue;
+      next[k]++;
+      if (t->postings > run->header->postings_len
+           || t->postings_len > run->header->postings_len - t->postings)
+        {
+        ok = FALSE;
+        break;
+        }
+      // The first posting's book is relative to book 0 of the run, and
+      //  must be made relative to the last book so far
+      const BYTE *p = run->postings + t->postings;
+      uint64_t pos = 0, book;
+      if (!store_get_varint (p, t->postings_len, &pos, &book))
+        {
+        ok = FALSE;
+        break;
+        }
+      book += base[k];
+      IndexEntry e;
+      memset (&e, 0, sizeof (e));
+      searchindex_put_varint (&e, started ? book - out->last_book : book);
+      ok = fwrite (e.postings, e.postings_len, 1, f) == 1
+        && (t->postings_len == pos
+            || fwrite (p + pos, t->postings_len - pos, 1, f) == 1);
+      header.postings_len += e.postings_len + t->postings_len - pos;
+      free (e.postings);
+      out->count += t->count;
+      out->last_book = t->last_book + base[k];
+      started = TRUE;
+      }
+    out->postings_len = header.postings_len - out->postings;
+    buffer_append (strings, term, strlen (term) + 1);
+    }
+
+  if (f)
+    {
+    header.nbooks = nbooks;
+    header.nsections = nsections;
+    header.nterms = nterms;
+    ok = ok && searchindex_finish_file (f, &header, strings, books,
+      sections, terms);
+    if (fclose (f) != 0) ok = FALSE;
+    }
+
+  for (k = 0; k < n; k++)
+    searchindex_close_file (&runs[k]);
+  free (runs);
+  free (next);
+  free (base);
+  if (books) free (books);
+  if (sections) free (sections);
+  if (terms) free (terms);
+  buffer_destroy (strings);
+  return ok;
+  }
+
+
+/*============================================================================
+  searchindex_next_segment
+  The name of the next segment file in the directory
+============================================================================*/
+static char *searchindex_next_segment (const char *dir)
+  {
+  int number = 0;
+  DIR *d = opendir (dir);
+  if (d)
+    {
+    struct dirent *de;
+    while ((de = readdir (d)))
+      {
+      size_t len = strlen (de->d_name);
+      if (len > 4 && strcmp (de->d_name + len - 4, ".seg") == 0)
+        {
+        int n = atoi (de->d_name);
+        if (n >= number) number = n + 1;
+        }
+      }
+    closedir (d);
+    }
+  char *filename;
+  asprintf (&filename, "%s/%06d.seg", dir, number);
+  return filename;
+  }
+
+
+/*============================================================================
+  searchindex_write
+============================================================================*/
+BOOL searchindex_write (ParaSink *sink, char **error)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  if (!self->error && self->nbooks == 0 && self->nruns == 0) return TRUE;
+  if (self->nruns && self->nbooks) searchindex_write_run (self);
+  if (self->error)
+    {
+    *error = strdup (self->error);
+    return FALSE;
+    }
+
+  // Written under a temporary name, so that a query never sees half
+  //  of a segment
+  char *filename = searchindex_next_segment (self->dir);
+  char *temp;
+  asprintf (&temp, "%s.tmp", filename);
+  BOOL ok;
+  if (self->nruns)
+    ok = searchindex_merge (self, temp);
+  else
+    ok = searchindex_write_memory (self, temp);
+  if (ok && rename (temp, filename) == 0)
+    searchindex_clear (self);
+  else
+    {
+    asprintf (error, "Can't write index file '%s': %s", filename,
+      strerror (errno));
+    unlink (temp);
+    ok = FALSE;
+    }
+  free (temp);
+  free (filename);
+  return ok;
+  }
+
+
+/*============================================================================
+  searchindex_begin_book
+============================================================================*/
+static void searchindex_begin_book (ParaSink *sink, const char *book)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  STORE_GROW (self->books, self->books_size, self->nbooks + 1);
+  self->books[self->nbooks++] = self->strings->len;
+  buffer_append (self->strings, book, strlen (book) + 1);
+  self->in_section = FALSE;
+  }
+
+
+/*============================================================================
+  searchindex_end_book
+============================================================================*/
+static void searchindex_end_book (ParaSink *sink)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  if (self->memory >= SEARCHINDEX_RUN_MEMORY) searchindex_write_run (self);
+  }
+
+
+/*============================================================================
+  searchindex_begin_section
+============================================================================*/
+static void searchindex_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  self->in_section = href != NULL;
+  if (!href) return;
+  STORE_GROW (self->sections, self->sections_size, self->nsections + 1);
+  SearchIndexSection *section = &self->sections[self->nsections++];
+  section->book = self->nbooks - 1;
+  section->spine_index = spine_index;
+  section->href = self->strings->len;
+  buffer_append (self->strings, href, strlen (href) + 1);
+  self->section = spine_index;
+  self->para = 0;
+  }
+
+
+/*============================================================================
+  searchindex_para
+============================================================================*/
+static void searchindex_para (ParaSink *sink, ParaKind kind,
+       const char *text, size_t len)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  if (kind == PARA_META || !self->in_section) return;
+  self->word = 0;
+  fold_words (text, len, SEARCHINDEX_FOLD, self->token,
+    searchindex_add_word, self);
+  self->para++;
+  }
+
+
+/*============================================================================
+  searchindex_destroy
+============================================================================*/
+static void searchindex_destroy (ParaSink *sink)
+  {
+  SearchIndex *self = (SearchIndex *)sink;
+  int i;
+  for (i = 0; i < self->nruns; i++)
+    {
+    unlink (self->runs[i]);
+    free (self->runs[i]);
+    }
+  if (self->runs) free (self->runs);
+  searchindex_clear (self);
+  free (self->table);
+  if (self->books) free (self->books);
+  if (self->sections) free (self->sections);
+  buffer_destroy (self->strings);
+  buffer_destroy (self->token);
+  if (self->error) free (self->error);
+  free (self->dir);
+  free (self);
+  }
+
+
+/*============================================================================
+  searchindex_create
+============================================================================*/
+ParaSink *searchindex_create (const char *dir)
+  {
+  SearchIndex *self = malloc (sizeof (SearchIndex));
+  memset (self, 0, sizeof (SearchIndex));
+  parasink_init (&self->sink, NULL);
+  self->sink.begin_book = searchindex_begin_book;
+  self->sink.end_book = searchindex_end_book;
+  self->sink.begin_section = searchindex_begin_section;
+  self->sink.para = searchindex_para;
+  self->sink.destroy = searchindex_destroy;
+  self->dir = strdup (dir);
+  self->strings = buffer_create ();
+  self->token = buffer_create ();
+  searchindex_clear (self);
+  if (mkdir (dir, 0777) != 0 && errno != EEXIST)
+    asprintf (&self->error, "Can't create directory '%s': %s", dir,
+      strerror (errno));
+  return &self->sink;
+  }
+
+
+/*============================================================================
+  Queries
+============================================================================*/
+
+// A paragraph in which a term occurs
+typedef struct _SearchIndexHit
+  {
+  uint32_t book;
+  uint32_t section;
+  uint32_t para;
+  } SearchIndexHit;
+
+typedef struct _SearchIndexQuery
+  {
+  char **terms;
+  int nterms;
+  } SearchIndexQuery;
+
+
+/*============================================================================
+  searchindex_add_query_word
+============================================================================*/
+static void searchindex_add_query_word (void *context, const char *word,
+       size_t len)
+  {
+  SearchIndexQuery *query = context;
+  int i;
+  for (i = 0; i < query->nterms; i++)
+    if (strlen (query->terms[i]) == len
+         && memcmp (query->terms[i], word, len) == 0)
+      return;
+  query->terms = realloc (query->terms,
+    (query->nterms + 1) * sizeof (char *));
+  query->terms[query->nterms++] = strndup (word, len);
+  }
+
+
+/*============================================================================
+  searchindex_find_term
+============================================================================*/
+static const SearchIndexTerm *searchindex_find_term
+       (const SearchIndexFile *file, const char *term)
+  {
+  uint64_t lo = 0, hi = file->header->nterms;
+  while (lo < hi)
+    {
+    uint64_t mid = (lo + hi) / 2;
+    int c = strcmp (searchindex_string (file, file->terms[mid].term), term);
+    if (c == 0) return &file->terms[mid];
+    if (c < 0) lo = mid + 1; else hi = mid;
+    }
+  return NULL;
+  }
+
+
+/*============================================================================
+  searchindex_decode
+  The paragraphs in which a term occurs, each once, in order; returns
+  the number of them, or -1 if the postings are damaged
+============================================================================*/
+static long searchindex_decode (const SearchIndexFile *file,
+       const SearchIndexTerm *term, SearchIndexHit **hits)
+  {
+  const BYTE *p = file->postings + term->postings;
+  uint64_t len = term->postings_len, pos = 0, i;
+  if (term->postings > file->header->postings_len
+       || len > file->header->postings_len - term->postings)
+    return -1;
+  *hits = malloc ((term->count + 1) * sizeof (SearchIndexHit));
+  long n = 0;
+  uint64_t book = 0, section = 0, para = 0, word = 0;
+  for (i = 0; i < term->count; i++)
+    {
+    uint64_t v[4];
+    if (!store_get_varint (p, len, &pos, &v[0])
+         || !store_get_varint (p, len, &pos, &v[1])
+         || !store_get_varint (p, len, &pos, &v[2])
+         || !store_get_varint (p, len, &pos, &v[3]))
+      {
+      free (*hits);
+      return -1;
+      }
+    if (v[0])
+      {
+      book += v[0];
+      section = v[1]; para = v[2]; word = v[3];
+      }
+    else if (v[1])
+      {
+      section += v[1];
+      para = v[2]; word = v[3];
+      }
+    else if (v[2])
+      {
+      para += v[2];
+      word = v[3];
+      }
+    else
+      word += v[3];
+    if (n == 0 || v[0] || v[1] || v[2])
+      {
+      (*hits)[n].book = book;
+      (*hits)[n].section = section;
+      (*hits)[n].para = para;
+      n++;
+      }
+    }
+  return n;
+  }
+
+
+/*============================================================================
+  searchindex_compare_hits
+============================================================================*/
+static int searchindex_compare_hits (const SearchIndexHit *a,
+       const SearchIndexHit *b)
+  {
+  if (a->book != b->book) return a->book < b->book ? -1 : 1;
+  if (a->section != b->section) return a->section < b->section ? -1 : 1;
+  if (a->para != b->para) return a->para < b->para ? -1 : 1;
+  return 0;
+  }
+
+
+/*============================================================================
+  searchindex_href
+  The href of a book's spine item
+============================================================================*/
+static const char *searchindex_href (const SearchIndexFile *file,
+       uint32_t book, uint32_t spine_index)
+  {
+  uint64_t lo = 0, hi = file->header->nsections;
+  while (lo < hi)
+    {
+    uint64_t mid = (lo + hi) / 2;
+    const SearchIndexSection *s = &file->sections[mid];
+    if (s->book == book && (uint32_t)s->spine_index == spine_index)
+      return searchindex_string (file, s->href);
+    if (s->book < book
+         || (s->book == book && (uint32_t)s->spine_index < spine_index))
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+  return "";
+  }
+
+
+/*============================================================================
+  searchindex_query_file
+============================================================================*/
+static BOOL searchindex_query_file (const char *filename,
+       const SearchIndexFile *file, const BYTE *stale,
+       const SearchIndexQuery *query, BOOL *found, char **error)
+  {
+  // Start with the rarest term, and keep what the others also have
+  const SearchIndexTerm **terms = malloc (query->nterms * sizeof (void *));
+  int i;
+  for (i = 0; i < query->nterms; i++)
+    {
+    terms[i] = searchindex_find_term (file, query->terms[i]);
+    if (!terms[i]) break;
+    if (terms[i]->count < terms[0]->count)
+      {
+      const SearchIndexTerm *t = terms[0];
+      terms[0] = terms[i];
+      terms[i] = t;
+      }
+    }
+
+  BOOL ok = TRUE;
+  SearchIndexHit *hits = NULL;
+  long nhits = 0;
+  if (i == query->nterms)
+    {
+    nhits = searchindex_decode (file, terms[0], &hits);
+    ok = nhits >= 0;
+    }
+  for (i = 1; ok && nhits > 0 && i < query->nterms; i++)
+    {
+    SearchIndexHit *other;
+    long nother = searchindex_decode (file, terms[i], &other);
+    if (nother < 0)
+      {
+      ok = FALSE;
+      break;
+      }
+    long a = 0, b = 0, n = 0;
+    while (a < nhits && b < nother)
+      {
+      int c = searchindex_compare_hits (&hits[a], &other[b]);
+      if (c == 0) hits[n++] = hits[a];
+      if (c <= 0) a++;
+      if (c >= 0) b++;
+      }
+    nhits = n;
+    free (other);
+    }
+
+  long h;
+  for (h = 0; ok && h < nhits; h++)
+    {
+    const SearchIndexHit *hit = &hits[h];
+    if (hit->book >= file->header->nbooks)
+      {
+      ok = FALSE;
+      break;
+      }
+    if (stale[hit->book]) continue;
+    printf ("%s\t%s\t%u\n", searchindex_string (file,
+      file->books[hit->book]), searchindex_href (file, hit->book,
+      hit->section), hit->para);
+    *found = TRUE;
+    }
+  if (!ok) asprintf (error, "'%s' is damaged", filename);
+
+  if (hits) free (hits);
+  free (terms);
+  return ok;
+  }
+
+
+/*============================================================================
+  searchindex_compare_names
+============================================================================*/
+static int searchindex_compare_names (const void *a, const void *b)
+  {
+  return strcmp (*(char *const *)a, *(char *const *)b);
+  }
+
+
+/*============================================================================
+  searchindex_compare_books
+  By name, and then newest first
+============================================================================*/
+typedef struct _SearchIndexBook
+  {
+  const char *name;
+  int segment;
+  uint32_t book;
+  } SearchIndexBook;
+
+static int searchindex_compare_books (const void *a, const void *b)
+  {
+  const SearchIndexBook *x = a, *y = b;
+  int c = strcmp (x->name, y->name);
+  if (c) return c;
+  if (x->segment != y->segment) return x->segment > y->segment ? -1 : 1;
+  if (x->book != y->book) return x->book > y->book ? -1 : 1;
+  return 0;
+  }
+
+
+/*============================================================================
+  searchindex_mark_stale
+  A book that has been indexed again, in a later segment or later in
+  the same one, is left out of the results: stale[i][b] is set for
+  every copy of a book but the newest
+============================================================================*/
+static void searchindex_mark_stale (const SearchIndexFile *files,
+       int nfiles, BYTE **stale)
+  {
+  uint64_t n = 0, k;
+  int i;
+  for (i = 0; i < nfiles; i++)
+    {
+    n += files[i].header->nbooks;
+    stale[i] = calloc (files[i].header->nbooks + 1, 1);
+    }
+  SearchIndexBook *books = malloc ((n + 1) * sizeof (SearchIndexBook));
+  n = 0;
+  for (i = 0; i < nfiles; i++)
+    for (k = 0; k < files[i].header->nbooks; k++)
+      {
+      books[n].name = searchindex_string (&files[i], files[i].books[k]);
+      books[n].segment = i;
+      books[n].book = k;
+      n++;
+      }
+  qsort (books, n, sizeof (SearchIndexBook), searchindex_compare_books);
+  for (k = 1; k < n; k++)
+    if (strcmp (books[k].name, books[k - 1].name) == 0)
+      stale[books[k].segment][books[k].book] = 1;
+  free (books);
+  }
+
+
+/*============================================================================
+  searchindex_query
+============================================================================*/
+BOOL searchindex_query (const char *dir, const char *query, BOOL *found,
+       char **error)
+  {
+  *found = FALSE;
+  DIR *d = opendir (dir);
+  if (!d)
+    {
+    asprintf (error, "Can't open index directory '%s': %s", dir,
+      strerror (errno));
+    return FALSE;
+    }
+  char **segments = NULL;
+  int i, nsegments = 0;
+  struct dirent *de;
+  while ((de = readdir (d)))
+    {
+    size_t len = strlen (de->d_name);
+    if (len > 4 && de->d_name[0] != '.'
+         && strcmp (de->d_name + len - 4, ".seg") == 0)
+      {
+      segments = realloc (segments, (nsegments + 1) * sizeof (char *));
+      asprintf (&segments[nsegments++], "%s/%s", dir, de->d_name);
+      }
+    }
+  closedir (d);
+  if (nsegments)
+    qsort (segments, nsegments, sizeof (char *), searchindex_compare_names);
+
+  SearchIndexQuery q;
+  memset (&q, 0, sizeof (q));
+  Buffer *word = buffer_create ();
+  fold_words (query, strlen (query), SEARCHINDEX_FOLD, word, 
+    searchindex_add_query_word, &q);
+  buffer_destroy (word);
+
+  BOOL ok = TRUE;
+  if (q.nterms == 0)
+    {
+    asprintf (error, "The query has no words in it");
+    ok = FALSE;
+    }
+  SearchIndexFile *files = calloc (nsegments + 1, sizeof (SearchIndexFile));
+  BYTE **stale = calloc (nsegments + 1, sizeof (BYTE *));
+  int nfiles = 0;
+  while (ok && nfiles < nsegments)
+    {
+    ok = searchindex_open_file (segments[nfiles], &files[nfiles], error);
+    if (ok) nfiles++;
+    }
+  if (ok) searchindex_mark_stale (files, nfiles, stale);
+  for (i = 0; ok && i < nfiles; i++)
+    ok = searchindex_query_file (segments[i], &files[i], stale[i], &q,
+      found, error);
+
+  for (i = 0; i < nfiles; i++)
+    {
+    searchindex_close_file (&files[i]);
+    if (stale[i]) free (stale[i]);
+    }
+  free (stale);
+  free (files);
+  for (i = 0; i < nsegments; i++) free (segments[i]);
+  if (segments) free (segments);
+  for (i = 0; i < q.nterms; i++) free (q.terms[i]);
+  if (q.terms) free (q.terms);
+  return ok;
+  }
@@ -0,0 +1,104 @@
+/*============================================================================
+  epub2txt v2
+  searchindex.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Search index: an inverted index of the words in a library of books,
+  kept as a directory of segment files. Indexing is a paragraph sink,
+  which writes no text, but splits each paragraph into words, and
+  records where each word occurs: the book, the spine item, the
+  paragraph in the spine item (counted as --format=jsonl counts them),
+  and the word in the paragraph. Metadata is not indexed.
+
+  A word is a run of letters, digits and combining marks, or a single
+  ideograph, kana or emoji; words are folded to lower case, and without
+  accents (see fold.h), so that "Élan" is found by "elan". Each run of
+  epub2txt adds one segment to the directory. A book that is indexed
+  again, under the same name, is not removed from the older segment,
+  but a query uses only its newest postings.
+
+  While the books are read, the postings of each word are encoded as
+  they come in, in memory. If that grows beyond SEARCHINDEX_RUN_MEMORY,
+  it is written out, at the end of a book, as a temporary segment; at
+  the end of the run, the temporary segments are merged into one.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "parasink.h"
+
+#define SEARCHINDEX_RUN_MEMORY (64 * 1024 * 1024)
+
+/** Create a sink that indexes books, to be added to the index in dir
+    (which is created, if need be) by searchindex_write(). */
+ParaSink   *searchindex_create (const char *dir);
+
+/** Write what has been indexed as a new segment; then the sink should
+    be closed with parasink_close(). */
+BOOL        searchindex_write (ParaSink *sink, char **error);
+
+/** Look up the words of the query in the index in dir, and print a line
+    for each paragraph that has all of them:
+
+    book<TAB>href<TAB>paragraph
+
+    found is set to TRUE if there was any such paragraph. */
+BOOL        searchindex_query (const char *dir, const char *query,
+              BOOL *found, char **error);
+
+/*============================================================================
+  Segment files
+
+  A header, followed by five arrays, each aligned to eight bytes, in the
+  byte order of the machine that wrote the file: the postings, the
+  string table, the books (the offset of each one's name in the string
+  table), the spine items, and the terms, sorted by their bytes.
+
+  A term's postings are a list of (book, spine index, paragraph, word)
+  in order, each encoded as four unsigned LEB128 varints: the difference
+  from the previous posting's book and then, for each of the other
+  fields, the difference from the previous posting's value if the
+  fields before it are the same as in the previous posting, or else its
+  value. So a word that is repeated in a paragraph costs little more
+  than the distance between repetitions.
+============================================================================*/
+
+#define SEARCHINDEX_FILE_MAGIC "E2S\x1A"
+#define SEARCHINDEX_FILE_VERSION 1
+#define SEARCHINDEX_FILE_BYTE_ORDER 0x01020304
+
+typedef struct _SearchIndexFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t reserved;
+  uint64_t postings_offset;
+  uint64_t postings_len;
+  uint64_t strings_offset;
+  uint64_t strings_len;
+  uint64_t books_offset;    // Array of uint64_t
+  uint64_t nbooks;
+  uint64_t sections_offset; // Array of SearchIndexSection
+  uint64_t nsections;
+  uint64_t terms_offset;    // Array of SearchIndexTerm
+  uint64_t nterms;
+  } SearchIndexFileHeader;
+
+typedef struct _SearchIndexSection
+  {
+  uint32_t book;
+  int32_t spine_index;
+  uint64_t href;            // Offset in the string table
+  } SearchIndexSection;
+
+typedef struct _SearchIndexTerm
+  {
+  uint64_t term;            // Offset in the string table
+  uint64_t postings;        // Offset in the postings
+  uint64_t postings_len;
+  uint32_t count;           // Number of postings
+  uint32_t last_book;       // Book of the last posting
+  } SearchIndexTerm;
+
@@ -0,0 +1,311 @@
+/*============================================================================
+  epub2txt v2
+  sourcemap.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Writing and reading source maps; see sourcemap.h for the format. The
+  map is built in memory as the text is written, and saved at the end.
+  The XHTML parser gives each character it passes to the wrapper the
+  offset that it came from, and the wrapper passes on the offset of the
+  first character of each word as it writes the word out
+  (wraptext_wrap_utf32_marked), which is when the output offset is known.
+  Everything written is counted by xhtml_write().
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "sourcemap.h"
+#include "store.h"
+
+struct _SourceMap
+  {
+  char *filename;
+  int interval;
+  uint64_t output;       // Bytes written so far
+  BOOL in_section;       // The text comes from a spine item
+  BOOL para;             // The next word starts a paragraph
+  uint64_t ncheckpoints;
+  uint64_t last_output;  // Of the last checkpoint
+  uint32_t last_source;  // Of the last checkpoint in this section
+  SourceMapSection *sections;
+  uint64_t nsections;
+  uint64_t sections_size;
+  SourceMapBlock *blocks;
+  uint64_t nblocks;
+  uint64_t blocks_size;
+  BYTE *data;
+  uint64_t data_len;
+  uint64_t data_size;
+  char *strings;
+  uint64_t strings_len;
+  uint64_t strings_size;
+  };
+
+
+/*============================================================================
+  sourcemap_create
+============================================================================*/
+SourceMap *sourcemap_create (const char *filename, int interval)
+  {
+  SourceMap *self = malloc (sizeof (SourceMap));
+  memset (self, 0, sizeof (SourceMap));
+  self->filename = strdup (filename);
+  self->interval = interval > 0 ? interval : SOURCEMAP_DEFAULT_INTERVAL;
+  STORE_GROW (self->strings, self->strings_size, 1);
+  self->strings[0] = 0;
+  self->strings_len = 1;
+  return self;
+  }
+
+
+/*============================================================================
+  sourcemap_destroy
+============================================================================*/
+static void sourcemap_destroy (SourceMap *self)
+  {
+  free (self->filename);
+  if (self->sections) free (self->sections);
+  if (self->blocks) free (self->blocks);
+  if (self->data) free (self->data);
+  free (self->strings);
+  free (self);
+  }
+
+
+/*============================================================================
+  sourcemap_begin_section
+============================================================================*/
+void sourcemap_begin_section (SourceMap *self, const char *href)
+  {
+  self->in_section = href != NULL;
+  self->para = TRUE;
+  if (!href) return;
+  STORE_GROW (self->sections, self->sections_size, self->nsections + 1);
+  SourceMapSection *section = &self->sections[self->nsections++];
+  section->first = self->ncheckpoints;
+  section->href = self->strings_len;
+  section->reserved = 0;
+  size_t len = strlen (href) + 1;
+  STORE_GROW (self->strings, self->strings_size, self->strings_len + len);
+  memcpy (self->strings + self->strings_len, href, len);
+  self->strings_len += len;
+  self->last_source = 0;
+  }
+
+
+/*============================================================================
+  sourcemap_begin_para
+============================================================================*/
+void sourcemap_begin_para (SourceMap *self)
+  {
+  self->para = TRUE;
+  }
+
+
+/*============================================================================
+  sourcemap_mark
+============================================================================*/
+void sourcemap_mark (SourceMap *self, uint32_t offset)
+  {
+  if (!self->in_section) return;
+  if (!self->para && self->ncheckpoints > 0
+       && self->output - self->last_output < (uint64_t)self->interval)
+    return;
+
+  if (self->ncheckpoints % SOURCEMAP_BLOCK == 0)
+    {
+    STORE_GROW (self->blocks, self->blocks_size, self->nblocks + 1);
+    SourceMapBlock *block = &self->blocks[self->nblocks++];
+    block->output = self->output;
+    block->data = self->data_len;
+    block->source = offset;
+    block->section = self->nsections - 1;
+    }
+  int64_t delta = (int64_t)offset - (int64_t)self->last_source;
+  STORE_GROW (self->data, self->data_size,
+    self->data_len + 2 * STORE_VARINT_MAX);
+  self->data_len += store_put_varint (self->data + self->data_len,
+    ((self->output - self->last_output) << 1) | (self->para ? 1 : 0));
+  self->data_len += store_put_varint (self->data + self->data_len,
+    ((uint64_t)delta << 1) ^ (delta >> 63));
+  self->ncheckpoints++;
+  self->last_output = self->output;
+  self->last_source = offset;
+  self->para = FALSE;
+  }
+
+
+/*============================================================================
+  sourcemap_count
+============================================================================*/
+void sourcemap_count (SourceMap *self, size_t bytes)
+  {
+  self->output += bytes;
+  }
+
+
+/*============================================================================
+  sourcemap_close
+============================================================================*/
+BOOL sourcemap_close (SourceMap *self, char **error)
+  {
+  SourceMapFileHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, SOURCEMAP_FILE_MAGIC, 4);
+  header.version = SOURCEMAP_FILE_VERSION;
+  header.byte_order = SOURCEMAP_FILE_BYTE_ORDER;
+  header.interval = self->interval;
+  header.ncheckpoints = self->ncheckpoints;
+  header.nsections = self->nsections;
+  header.nblocks = self->nblocks;
+  header.data_len = self->data_len;
+  header.strings_len = self->strings_len;
+
+  BOOL ok = FALSE;
+  FILE *f = fopen (self->filename, "wb");
+  if (f)
+    {
+    ok = fwrite (&header, sizeof (header), 1, f) == 1
+      && store_write_chunk (f, self->sections,
+           self->nsections * sizeof (SourceMapSection),
+           &header.sections_offset)
+      && store_write_chunk (f, self->blocks,
+           self->nblocks * sizeof (SourceMapBlock), &header.blocks_offset)
+      && store_write_chunk (f, self->data, self->data_len,
+           &header.data_offset)
+      && store_write_chunk (f, self->strings, self->strings_len,
+           &header.strings_offset)
+      && fseek (f, 0, SEEK_SET) == 0
+      && fwrite (&header, sizeof (header), 1, f) == 1;
+    if (fclose (f) != 0) ok = FALSE;
+    }
+  if (!ok)
+    asprintf (error, "Can't write source map '%s': %s", self->filename,
+      strerror (errno));
+  sourcemap_destroy (self);
+  return ok;
+  }
+
+
+/*============================================================================
+  sourcemap_read_chunk
+============================================================================*/
+static void *sourcemap_read_chunk (FILE *f, uint64_t offset, uint64_t count,
+       size_t size, uint64_t file_len)
+  {
+  if (offset > file_len || count > (file_len - offset) / size) return NULL;
+  void *data = malloc (count * size + 1);
+  if (fseek (f, offset, SEEK_SET) != 0
+       || (count && fread (data, count * size, 1, f) != 1))
+    {
+    free (data);
+    return NULL;
+    }
+  return data;
+  }
+
+
+/*============================================================================
+  sourcemap_find
+============================================================================*/
+BOOL sourcemap_find (const char *filename, uint64_t offset,
+       char **href, uint32_t *source, uint64_t *distance, char **error)
+  {
+  FILE *f = fopen (filename, "rb");
+  if (!f)
+    {
+    asprintf (error, "Can't open file '%s' for reading: %s",
+      filename, strerror (errno));
+    return FALSE;
+    }
+  SourceMapFileHeader header;
+  fseek (f, 0, SEEK_END);
+  uint64_t file_len = ftell (f);
+  fseek (f, 0, SEEK_SET);
+  if (fread (&header, sizeof (header), 1, f) != 1
+       || memcmp (header.magic, SOURCEMAP_FILE_MAGIC, 4) != 0
+       || header.version != SOURCEMAP_FILE_VERSION
+       || header.byte_order != SOURCEMAP_FILE_BYTE_ORDER)
+    {
+    asprintf (error, "'%s' is not a usable source map", filename);
+    fclose (f);
+    return FALSE;
+    }
+
+  SourceMapSection *sections = sourcemap_read_chunk (f,
+    header.sections_offset, header.nsections, sizeof (SourceMapSection),
+    file_len);
+  SourceMapBlock *blocks = sourcemap_read_chunk (f, header.blocks_offset,
+    header.nblocks, sizeof (SourceMapBlock), file_len);
+  BYTE *data = sourcemap_read_chunk (f, header.data_offset, header.data_len,
+    1, file_len);
+  char *strings = sourcemap_read_chunk (f, header.strings_offset,
+    header.strings_len, 1, file_len);
+  fclose (f);
+
+  BOOL ok = FALSE;
+  if (!sections || !blocks || !data || !strings)
+    asprintf (error, "'%s' is damaged", filename);
+  else if (header.nblocks == 0 || blocks[0].output > offset)
+    asprintf (error, "No text at offset %llu", (unsigned long long)offset);
+  else
+    {
+    // The last block that starts at or before the offset
+    uint64_t lo = 0, hi = header.nblocks;
+    while (hi - lo > 1)
+      {
+      uint64_t mid = (lo + hi) / 2;
+      if (blocks[mid].output <= offset) lo = mid; else hi = mid;
+      }
+    const SourceMapBlock *block = &blocks[lo];
+    uint64_t k = lo * SOURCEMAP_BLOCK;
+    uint64_t end = k + SOURCEMAP_BLOCK;
+    if (end > header.ncheckpoints) end = header.ncheckpoints;
+    uint64_t pos = block->data, v, output = block->output;
+    uint32_t section = block->section;
+    uint32_t src = block->source;
+    // Skip the block's first checkpoint, whose values are in the index
+    ok = section < header.nsections
+      && store_get_varint (data, header.data_len, &pos, &v)
+      && store_get_varint (data, header.data_len, &pos, &v);
+    for (k++; ok && k < end; k++)
+      {
+      uint64_t d_out, d_src;
+      if (!store_get_varint (data, header.data_len, &pos, &d_out)
+           || !store_get_varint (data, header.data_len, &pos, &d_src))
+        {
+        ok = FALSE;
+        break;
+        }
+      if (output + (d_out >> 1) > offset) break;
+      output += d_out >> 1;
+      uint32_t s = section;
+      while (s + 1 < header.nsections && sections[s + 1].first <= k) s++;
+      if (s != section) src = 0;
+      section = s;
+      src += (int64_t)((d_src >> 1) ^ -(d_src & 1));
+      }
+    if (ok && sections[section].href < header.strings_len)
+      {
+      strings[header.strings_len] = 0;
+      *href = strdup (strings + sections[section].href);
+      *source = src;
+      *distance = offset - output;
+      }
+    else
+      {
+      ok = FALSE;
+      asprintf (error, "'%s' is damaged", filename);
+      }
+    }
+
+  if (sections) free (sections);
+  if (blocks) free (blocks);
+  if (data) free (data);
+  if (strings) free (strings);
+  return ok;
+  }
+
@@ -0,0 +1,113 @@
+/*============================================================================
+  epub2txt v2
+  sourcemap.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Source map: a side output that maps byte offsets in the text that
+  epub2txt writes back to the places in the EPUB that the text came
+  from, as a spine item (by its href, relative to the OPF) and a byte
+  offset in that XHTML file.
+
+  The map is a list of checkpoints, each of which pairs an output
+  offset with a source offset, at the start of a word. There is a
+  checkpoint at the start of every paragraph, and otherwise at the first
+  word after every N bytes of output. Text between two checkpoints came
+  from somewhere between their source offsets, in order, except where
+  markup intervened.
+============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "defs.h"
+
+#define SOURCEMAP_DEFAULT_INTERVAL 1024
+
+typedef struct _SourceMap SourceMap;
+
+/** Start a map, to be written to filename by sourcemap_close(); a
+    checkpoint is made at the first word after every interval bytes
+    of output. */
+SourceMap  *sourcemap_create (const char *filename, int interval);
+
+/** Write the map to its file, and destroy it. */
+BOOL        sourcemap_close (SourceMap *self, char **error);
+
+/** The text that follows comes from the spine item href; or, if href is
+    NULL, from no file, e.g., metadata. */
+void        sourcemap_begin_section (SourceMap *self, const char *href);
+
+/** The next word starts a paragraph. */
+void        sourcemap_begin_para (SourceMap *self);
+
+/** The next word written comes from this offset in the section's
+    file. */
+void        sourcemap_mark (SourceMap *self, uint32_t offset);
+
+/** Count bytes written to the output. */
+void        sourcemap_count (SourceMap *self, size_t bytes);
+
+/*============================================================================
+  Source map files
+
+  A header, followed by four arrays, each aligned to eight bytes, in
+  the byte order of the machine that wrote the file: the sections, the
+  block index, the checkpoint data, and the string table that holds the
+  sections' hrefs.
+
+  Each checkpoint is two unsigned LEB128 varints: the number of output
+  bytes since the previous checkpoint, shifted left by one, with the
+  low bit set if the checkpoint starts a paragraph; and the difference
+  between its source offset and that of the previous checkpoint in the
+  same section (or zero, for the first checkpoint of a section),
+  zigzag-encoded. The block index gives the absolute values for every
+  SOURCEMAP_BLOCK-th checkpoint, so a lookup is a binary search of the
+  blocks, and then the decoding of at most one block.
+============================================================================*/
+
+#define SOURCEMAP_FILE_MAGIC "E2M\x1A"
+#define SOURCEMAP_FILE_VERSION 1
+#define SOURCEMAP_FILE_BYTE_ORDER 0x01020304
+#define SOURCEMAP_BLOCK 64
+
+typedef struct _SourceMapFileHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t interval;
+  uint64_t ncheckpoints;
+  uint64_t sections_offset;
+  uint64_t nsections;
+  uint64_t blocks_offset;
+  uint64_t nblocks;
+  uint64_t data_offset;
+  uint64_t data_len;
+  uint64_t strings_offset;
+  uint64_t strings_len;
+  } SourceMapFileHeader;
+
+typedef struct _SourceMapSection
+  {
+  uint64_t first;    // Index of the section's first checkpoint
+  uint32_t href;     // Offset in the string table
+  uint32_t reserved;
+  } SourceMapSection;
+
+typedef struct _SourceMapBlock
+  {
+  uint64_t output;   // Output offset of the block's first checkpoint
+  uint64_t data;     // Offset of its encoding in the checkpoint data
+  uint32_t source;   // Its source offset
+  uint32_t section;  // Its section
+  } SourceMapBlock;
+
+/** Find the last checkpoint at or before the output offset, in a map
+    file. On success, href is set to the spine item (which should be
+    freed), source to the checkpoint's source offset, and distance to
+    the number of output bytes between the checkpoint and offset. */
+BOOL        sourcemap_find (const char *filename, uint64_t offset,
+              char **href, uint32_t *source, uint64_t *distance,
+              char **error);
+
@@ -0,0 +1,260 @@
+/*============================================================================
+  epub2txt v2
+  stats.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Words are recognized from the line-break class of each character, 
+  which already sorts letters, digits and ideographs from punctuation 
+  and spaces, for the whole of Unicode.
+============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stats.h"
+#include "linebreak.h"
+
+typedef enum { STATS_OTHER = 0, // Spaces and punctuation
+               STATS_WORD,      // Part of a word
+               STATS_IDEO,      // A word by itself
+               STATS_JOIN,      // Inside a word, if a word follows 
+               STATS_STOP,      // Ends a sentence
+               STATS_STOP_JOIN  // A full stop, which can be either
+               } StatsKind;
+
+typedef struct _Stats
+  {
+  ParaSink sink;
+  char *book;
+  uint64_t chapters;
+  uint64_t paragraphs;
+  uint64_t headings;
+  uint64_t sentences;
+  uint64_t words;
+  uint64_t characters;
+  BOOL chapter_counted; // This spine item has had some text
+  BOOL in_word;
+  BOOL joined;          // The last character joined a word
+  BOOL stop;            // A stop has ended the sentence, unless a word
+                        //  follows directly
+  uint64_t sentence_words;
+  } Stats;
+
+
+/*============================================================================
+  stats_kind
+============================================================================*/
+static StatsKind stats_kind (uint32_t c)
+  {
+  if (c < 0x80)
+    {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') 
+         || (c >= '0' && c <= '9'))
+      return STATS_WORD;
+    if (c == '.') return STATS_STOP_JOIN;
+    if (c == '!' || c == '?') return STATS_STOP;
+    if (c == '\'' || c == '-' || c == ',') return STATS_JOIN;
+    return STATS_OTHER;
+    }
+  switch (c)
+    {
+    case 0x00AD: // Soft hyphen
+    case 0x2010: // Hyphen
+    case 0x2011: // Non-breaking hyphen
+    case 0x2019: // Right single quote, used as an apostrophe
+      return STATS_JOIN;
+    case 0x2026: // Ellipsis
+    case 0x203C: // Double exclamation mark
+    case 0x3002: // Ideographic full stop
+    case 0xFF01: // Fullwidth exclamation mark
+    case 0xFF0E: // Fullwidth full stop
+    case 0xFF1F: // Fullwidth question mark
+      return STATS_STOP;
+    }
+  switch (linebreak_class (c))
+    {
+    case LB_AL: case LB_HL: case LB_NU: case LB_CM: case LB_ZWJ:
+    case LB_H2: case LB_H3: case LB_JL: case LB_JV: case LB_JT:
+      return STATS_WORD;
+    case LB_ID: case LB_EB: case LB_EM:
+      return STATS_IDEO;
+    default:
+      return STATS_OTHER;
+    }
+  }
+
+
+/*============================================================================
+  stats_char
+============================================================================*/
+static void stats_char (Stats *self, uint32_t c)
+  {
+  StatsKind kind = stats_kind (c);
+  self->characters++;
+  if (kind == STATS_WORD)
+    {
+    if (!self->in_word)
+      {
+      self->words++;
+      self->sentence_words++;
+      }
+    self->in_word = TRUE;
+    self->joined = FALSE;
+    self->stop = FALSE;
+    return;
+    }
+
+  // A joiner, or a full stop, directly after a word may be inside it
+  if (self->in_word && !self->joined 
+       && (kind == STATS_JOIN || kind == STATS_STOP_JOIN))
+    {
+    self->joined = TRUE;
+    if (kind == STATS_STOP_JOIN) self->stop = TRUE;
+    return;
+    }
+
+  // Anything else ends the word, and the sentence, if a stop ended it
+  if (self->stop)
+    {
+    self->sentences++;
+    self->sentence_words = 0;
+    self->stop = FALSE;
+    }
+  self->in_word = FALSE;
+  self->joined = FALSE;
+  if (kind == STATS_IDEO)
+    {
+    self->words++;
+    self->sentence_words++;
+    }
+  else if ((kind == STATS_STOP || kind == STATS_STOP_JOIN) 
+       && self->sentence_words)
+    self->stop = TRUE;
+  }
+
+
+/*============================================================================
+  stats_para
+============================================================================*/
+static void stats_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  Stats *self = (Stats *)sink;
+  if (kind == PARA_META) return;
+  if (!self->chapter_counted)
+    {
+    self->chapters++;
+    self->chapter_counted = TRUE;
+    }
+  if (kind == PARA_HEADING)
+    self->headings++;
+  else
+    self->paragraphs++;
+
+  const BYTE *s = (const BYTE *)text, *end = s + len;
+  while (s < end)
+    {
+    // Decode UTF-8; the text came from UTF-32, so it is well-formed
+    uint32_t c = *s++;
+    if (c >= 0xC0)
+      {
+      int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+      c &= 0x3F >> n;
+      while (n-- && s < end) c = (c << 6) | (*s++ & 0x3F);
+      }
+    stats_char (self, c);
+    }
+
+  // A paragraph ends its last sentence, but a heading is not a sentence
+  //  unless it ends like one
+  if (self->stop || (kind == PARA_TEXT && self->sentence_words))
+    self->sentences++;
+  self->sentence_words = 0;
+  self->in_word = FALSE;
+  self->joined = FALSE;
+  self->stop = FALSE;
+  }
+
+
+/*============================================================================
+  stats_begin_section
+============================================================================*/
+static void stats_begin_section (ParaSink *sink, int spine_index, 
+       const char *href)
+  {
+  (void)spine_index; (void)href;
+  ((Stats *)sink)->chapter_counted = FALSE;
+  }
+
+
+/*============================================================================
+  stats_begin_book
+============================================================================*/
+static void stats_begin_book (ParaSink *sink, const char *book)
+  {
+  Stats *self = (Stats *)sink;
+  free (self->book);
+  self->book = strdup (book);
+  self->chapters = self->paragraphs = self->headings = 0;
+  self->sentences = self->words = self->characters = 0;
+  self->chapter_counted = FALSE;
+  }
+
+
+/*============================================================================
+  stats_end_book
+============================================================================*/
+static void stats_end_book (ParaSink *sink)
+  {
+  Stats *self = (Stats *)sink;
+  Buffer *b = buffer_create ();
+  char *record;
+  buffer_append (b, "{\"book\": ", 9);
+  buffer_append_json (b, self->book);
+  int len = asprintf (&record, ", \"chapters\": %llu, \"paragraphs\": %llu, "
+    "\"headings\": %llu, \"sentences\": %llu, \"words\": %llu, "
+    "\"characters\": %llu, \"reading_minutes\": %.1f}\n",
+    (unsigned long long)self->chapters, 
+    (unsigned long long)self->paragraphs,
+    (unsigned long long)self->headings, 
+    (unsigned long long)self->sentences,
+    (unsigned long long)self->words, 
+    (unsigned long long)self->characters,
+    (double)self->words / STATS_WORDS_PER_MINUTE);
+  buffer_append (b, record, len);
+  parasink_write (sink, b->data, b->len);
+  free (record);
+  buffer_destroy (b);
+  }
+
+
+/*============================================================================
+  stats_destroy
+============================================================================*/
+static void stats_destroy (ParaSink *sink)
+  {
+  Stats *self = (Stats *)sink;
+  free (self->book);
+  free (self);
+  }
+
+
+/*============================================================================
+  stats_create
+============================================================================*/
+ParaSink *stats_create (Compressor *compressor)
+  {
+  Stats *self = malloc (sizeof (Stats));
+  memset (self, 0, sizeof (Stats));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_book = stats_begin_book;
+  self->sink.end_book = stats_end_book;
+  self->sink.begin_section = stats_begin_section;
+  self->sink.para = stats_para;
+  self->sink.destroy = stats_destroy;
+  self->book = strdup ("");
+  linebreak_init ();
+  return &self->sink;
+  }
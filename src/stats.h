@@ -0,0 +1,30 @@
+/*============================================================================
+  epub2txt v2
+  stats.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Text statistics: a paragraph sink that writes no text, but counts
+  what there is, and writes one JSON record per book:
+
+  {"book": ..., "chapters": N, "paragraphs": N, "headings": N, 
+   "sentences": N, "words": N, "characters": N, "reading_minutes": N}
+
+  chapters are spine items with any text in them; paragraphs do not 
+  include headings, and neither includes metadata, which is not counted
+  at all. characters are Unicode code points, including spaces between
+  words, but not the breaks between paragraphs. A word is a run of 
+  letters and digits, which may have apostrophes, hyphens and full 
+  stops inside it, or a single ideograph, kana, or emoji. A sentence 
+  ends at a full stop, exclamation or question mark, or ellipsis, after
+  at least one word, or at the end of a paragraph; abbreviations are
+  counted as the ends of sentences. The reading time is at 
+  STATS_WORDS_PER_MINUTE.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define STATS_WORDS_PER_MINUTE 238
+
+ParaSink *stats_create (Compressor *compressor);
@@ -0,0 +1,70 @@
+/*============================================================================
+  epub2txt v2
+  store.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+============================================================================*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "store.h"
+
+
+/*============================================================================
+  store_write_chunk
+  Write an array, padded to eight bytes, and note where it went
+============================================================================*/
+BOOL store_write_chunk (FILE *f, const void *data, uint64_t len,
+       uint64_t *offset)
+  {
+  static const char pad [8];
+  long pos = ftell (f);
+  if (pos % 8 && fwrite (pad, 8 - pos % 8, 1, f) != 1) return FALSE;
+  *offset = ftell (f);
+  return len == 0 || fwrite (data, len, 1, f) == 1;
+  }
+
+
+/*============================================================================
+  store_put_varint
+============================================================================*/
+int store_put_varint (BYTE *b, uint64_t v)
+  {
+  int n = 0;
+  do
+    {
+    BYTE c = v & 0x7F;
+    v >>= 7;
+    b[n++] = v ? c | 0x80 : c;
+    } while (v);
+  return n;
+  }
+
+
+/*============================================================================
+  store_get_varint
+============================================================================*/
+BOOL store_get_varint (const BYTE *data, uint64_t len, uint64_t *pos,
+       uint64_t *v)
+  {
+  int shift = 0;
+  *v = 0;
+  while (*pos < len && shift < 64)
+    {
+    BYTE b = data[(*pos)++];
+    *v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return TRUE;
+    shift += 7;
+    }
+  return FALSE;
+  }
+
+
+/*============================================================================
+  store_mix
+============================================================================*/
+uint64_t store_mix (uint64_t x)
+  {
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+  }
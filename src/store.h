@@ -0,0 +1,52 @@
+/*============================================================================
+  epub2txt v2
+  store.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Helpers shared by the modules that build arrays in memory and write
+  them to files of their own: the document, source map, line index,
+  search index and Bloom filter. Each such file is a header followed by
+  arrays, each starting on an eight-byte boundary, so that it can be
+  mapped and its arrays read in place. Numbers that are mostly small are
+  kept as unsigned LEB128 varints: seven bits to a byte, low bits first,
+  with the top bit set on every byte but the last.
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "defs.h"
+
+// The most bytes that a varint of 64 bits takes
+#define STORE_VARINT_MAX 10
+
+// Grow an array, if necessary, to hold at least n elements
+#define STORE_GROW(array, size, n) \
+  do \
+    { \
+    if ((n) > (size)) \
+      { \
+      while ((n) > (size)) (size) = (size) ? (size) * 2 : 256; \
+      (array) = realloc ((array), (size) * sizeof (*(array))); \
+      } \
+    } while (0)
+
+/** Write len bytes of data, after enough zeros to bring the file to an
+    eight-byte boundary, and set offset to where the data went. */
+BOOL        store_write_chunk (FILE *f, const void *data, uint64_t len,
+              uint64_t *offset);
+
+/** Encode v as a varint at b, which must have room for STORE_VARINT_MAX
+    bytes; returns the number of bytes. */
+int         store_put_varint (BYTE *b, uint64_t v);
+
+/** Decode a varint at *pos in data, of len bytes, and move pos past it;
+    returns FALSE if the data ends first, or the varint is too long. */
+BOOL        store_get_varint (const BYTE *data, uint64_t len, 
+              uint64_t *pos, uint64_t *v);
+
+/** Mix the bits of x, so that each bit of the result depends on all of
+    them: the splitmix64 finalizer. */
+uint64_t    store_mix (uint64_t x);
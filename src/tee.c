@@ -0,0 +1,209 @@
+/*============================================================================
+  epub2txt v2
+  tee.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  A branch with a thread has two blocks of recorded calls: the parser
+  fills one while the thread makes the calls in the other, and they are
+  swapped when the first is full and the second has been made. The
+  calls are recorded with parasink_record().
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tee.h"
+#include "log.h"
+
+typedef struct _TeeBranch
+  {
+  ParaSink *sink;
+  BOOL threaded;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  Buffer *calls;         // Recorded, and not yet handed over
+  Buffer *ready;         // Handed over to the thread
+  BOOL pending;          // The thread has not yet made the calls in ready
+  BOOL closing;
+  } TeeBranch;
+
+typedef struct _Tee
+  {
+  ParaSink sink;
+  BOOL threads;
+  TeeBranch **branches;
+  int nbranches;
+  } Tee;
+
+
+/*============================================================================
+  tee_replay
+  Make the calls recorded in a block
+============================================================================*/
+static void tee_replay (ParaSink *sink, const Buffer *block)
+  {
+  size_t pos = 0;
+  ParaSinkCall call;
+  while (parasink_recorded (block, &pos, &call, NULL))
+    parasink_call (sink, &call);
+  }
+
+
+/*============================================================================
+  tee_worker
+============================================================================*/
+static void *tee_worker (void *arg)
+  {
+  TeeBranch *branch = arg;
+  pthread_mutex_lock (&branch->mutex);
+  for (;;)
+    {
+    while (!branch->pending && !branch->closing)
+      pthread_cond_wait (&branch->cond, &branch->mutex);
+    if (!branch->pending) break;
+    pthread_mutex_unlock (&branch->mutex);
+    tee_replay (branch->sink, branch->ready);
+    buffer_clear (branch->ready);
+    pthread_mutex_lock (&branch->mutex);
+    branch->pending = FALSE;
+    pthread_cond_broadcast (&branch->cond);
+    }
+  pthread_mutex_unlock (&branch->mutex);
+  return NULL;
+  }
+
+
+/*============================================================================
+  tee_hand_over
+  Hand the recorded calls to the branch's thread, once it has made the
+  last ones
+============================================================================*/
+static void tee_hand_over (TeeBranch *branch)
+  {
+  pthread_mutex_lock (&branch->mutex);
+  while (branch->pending)
+    pthread_cond_wait (&branch->cond, &branch->mutex);
+  Buffer *t = branch->ready;
+  branch->ready = branch->calls;
+  branch->calls = t;
+  branch->pending = TRUE;
+  pthread_cond_broadcast (&branch->cond);
+  pthread_mutex_unlock (&branch->mutex);
+  }
+
+
+/*============================================================================
+  tee_record
+============================================================================*/
+static void tee_record (TeeBranch *branch, const ParaSinkCall *call)
+  {
+  parasink_record (branch->calls, call, 0);
+  if (branch->calls->len >= TEE_BLOCK_SIZE) tee_hand_over (branch);
+  }
+
+
+/*============================================================================
+  tee_forward
+============================================================================*/
+static void tee_forward (ParaSink *sink, const ParaSinkCall *call)
+  {
+  Tee *self = (Tee *)sink;
+  BOOL done = self->nbranches > 0;
+  int i;
+  for (i = 0; i < self->nbranches; i++)
+    {
+    TeeBranch *branch = self->branches[i];
+    if (branch->threaded)
+      {
+      tee_record (branch, call);
+      done = FALSE;
+      }
+    else
+      {
+      parasink_call (branch->sink, call);
+      if (!branch->sink->done) done = FALSE;
+      }
+    }
+  // The book can be left once no sink needs any more of it
+  self->sink.done = done;
+  }
+
+
+/*============================================================================
+  tee_destroy
+============================================================================*/
+static void tee_destroy (ParaSink *sink)
+  {
+  Tee *self = (Tee *)sink;
+  int i;
+  for (i = 0; i < self->nbranches; i++)
+    {
+    TeeBranch *branch = self->branches[i];
+    if (branch->threaded)
+      {
+      if (branch->calls->len) tee_hand_over (branch);
+      pthread_mutex_lock (&branch->mutex);
+      branch->closing = TRUE;
+      pthread_cond_broadcast (&branch->cond);
+      pthread_mutex_unlock (&branch->mutex);
+      pthread_join (branch->thread, NULL);
+      pthread_mutex_destroy (&branch->mutex);
+      pthread_cond_destroy (&branch->cond);
+      }
+    parasink_close (branch->sink);
+    buffer_destroy (branch->calls);
+    buffer_destroy (branch->ready);
+    free (branch);
+    }
+  free (self->branches);
+  free (self);
+  }
+
+
+/*============================================================================
+  tee_add
+============================================================================*/
+void tee_add (ParaSink *sink, ParaSink *add)
+  {
+  Tee *self = (Tee *)sink;
+  TeeBranch *branch = malloc (sizeof (TeeBranch));
+  memset (branch, 0, sizeof (TeeBranch));
+  branch->sink = add;
+  branch->calls = buffer_create ();
+  branch->ready = buffer_create ();
+  if (self->threads)
+    {
+    pthread_mutex_init (&branch->mutex, NULL);
+    pthread_cond_init (&branch->cond, NULL);
+    if (pthread_create (&branch->thread, NULL, tee_worker, branch) == 0)
+      branch->threaded = TRUE;
+    else
+      {
+      log_warning ("Can't start a thread for an output; it will be "
+        "written without one");
+      pthread_mutex_destroy (&branch->mutex);
+      pthread_cond_destroy (&branch->cond);
+      }
+    }
+  self->branches = realloc (self->branches,
+    (self->nbranches + 1) * sizeof (TeeBranch *));
+  self->branches[self->nbranches++] = branch;
+  }
+
+
+/*============================================================================
+  tee_create
+============================================================================*/
+ParaSink *tee_create (BOOL threads)
+  {
+  Tee *self = malloc (sizeof (Tee));
+  memset (self, 0, sizeof (Tee));
+  parasink_init (&self->sink, NULL);
+  self->sink.forward = tee_forward;
+  self->sink.destroy = tee_destroy;
+  self->threads = threads;
+  return &self->sink;
+  }
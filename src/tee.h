@@ -0,0 +1,29 @@
+/*============================================================================
+  epub2txt v2
+  tee.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Fan-out: a paragraph sink that passes everything it is given to 
+  several others, so that one parse of a book can feed several outputs
+  (--out). What is passed on is the calls themselves, not the collected
+  paragraphs, so each sink collects the text in its own way, in its own
+  buffers; a Markdown sink, for example, still gets its escaping.
+
+  With threads, each sink runs on a thread of its own: the calls are
+  recorded, and handed over in blocks of TEE_BLOCK_SIZE bytes, so that
+  slow sinks run alongside the parser and each other. A sink on a 
+  thread cannot stop the reading of a book early, as --grep -l does.
+  The tee owns the sinks, and closes them when it is closed, but not 
+  their files or compressors, which the caller must close after it.
+============================================================================*/
+
+#pragma once
+
+#include "parasink.h"
+
+#define TEE_BLOCK_SIZE (256 * 1024)
+
+ParaSink   *tee_create (BOOL threads);
+
+/** Pass everything to sink, as well as to those already added. */
+void        tee_add (ParaSink *self, ParaSink *sink);
@@ -0,0 +1,238 @@
+/*============================================================================
+  epub2txt v2
+  textsink.c
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  The wrapper is driven as xhtml_to_stdout() drives it, with a new
+  context for each spine item, but from whole paragraphs. Its upcalls
+  take the options from the context, so the sink keeps a copy of them.
+
+  With ANSI codes, the sink asks for the paragraphs in Markdown, whose
+  emphasis markers say where bold and italic text starts and ends; the
+  text between them is unescaped, and wrapped as the text between <b>
+  and <i> tags would be.
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "textsink.h"
+#include "wrap.h"
+#include "wstring.h"
+#include "xhtml.h"
+
+typedef struct _TextWriter
+  {
+  ParaSink sink;
+  Epub2TxtOptions options;
+  WrapTextContext *context;  // NULL between spine items
+  Buffer *para;              // The paragraph, NUL-terminated
+  BOOL bold;                 // Emphasis, from the Markdown markers
+  BOOL italic;
+  } TextWriter;
+
+
+/*============================================================================
+  textsink_output_fn
+  The wrapper's output function; the app data is the writer
+============================================================================*/
+static void textsink_output_fn (void *app_data, WT_UTF32 c)
+  {
+  TextWriter *self = app_data;
+  WT_UTF8 buff [WT_UTF8_MAX_BYTES];
+  wraptext_context_utf32_char_to_utf8 (c, buff);
+  parasink_write (&self->sink, buff, strlen (buff));
+  }
+
+
+/*============================================================================
+  textsink_end_context
+  Write out what the wrapper is holding, and free its context
+============================================================================*/
+static void textsink_end_context (TextWriter *self)
+  {
+  if (!self->context) return;
+  wraptext_flush (self->context);
+  wraptext_context_free (self->context);
+  self->context = NULL;
+  }
+
+
+/*============================================================================
+  textsink_context
+============================================================================*/
+static WrapTextContext *textsink_context (TextWriter *self)
+  {
+  if (self->context) return self->context;
+  const Epub2TxtOptions *options = &self->options;
+  WrapTextContext *context = wraptext_context_new ();
+  // Raw text is laid out at no width, as xhtml_to_stdout() does
+  wraptext_context_set_width (context,
+    options->width <= 0 || options->raw ? INT_MAX : options->width - 1);
+  wraptext_context_set_app_opts (context, (void *)options);
+  if (options->optimal)
+    wraptext_context_set_flags (context, WT_FLAG_OPTIMAL
+      | (options->justify ? WT_FLAG_JUSTIFY : 0));
+  wraptext_context_set_hyphenator (context, options->hyphenator);
+  wraptext_context_set_output_fn (context, textsink_output_fn);
+  wraptext_context_set_app_data (context, self);
+  self->context = context;
+  return context;
+  }
+
+
+/*============================================================================
+  textsink_wrap_run
+  Wrap the text collected in para, if there is any
+============================================================================*/
+static void textsink_wrap_run (TextWriter *self, WrapTextContext *context)
+  {
+  if (!self->para->len) return;
+  buffer_append (self->para, "", 1);
+  WString *s = wstring_create_from_utf8 (self->para->data);
+  wraptext_wrap_utf32 (context, wstring_wstr (s));
+  wraptext_eof (context);
+  wstring_destroy (s);
+  buffer_clear (self->para);
+  }
+
+
+/*============================================================================
+  textsink_wrap_line
+  Wrap a line of a paragraph; in Markdown, its markers change the 
+  emphasis, and its escapes are removed
+============================================================================*/
+static void textsink_wrap_line (TextWriter *self, WrapTextContext *context,
+       const char *s, size_t len)
+  {
+  const char *end = s + len;
+  buffer_clear (self->para);
+  if (!self->sink.markdown)
+    {
+    buffer_append (self->para, s, len);
+    textsink_wrap_run (self, context);
+    return;
+    }
+  while (s < end)
+    {
+    if (*s == '\\' && s + 1 < end)
+      {
+      buffer_append (self->para, s + 1, 1);
+      s += 2;
+      }
+    else if (*s == '*')
+      {
+      textsink_wrap_run (self, context);
+      BOOL bold = s + 1 < end && s[1] == '*';
+      BOOL *on = bold ? &self->bold : &self->italic;
+      *on = !*on;
+      xhtml_emphasis (context, &self->options, bold, *on);
+      s += bold ? 2 : 1;
+      }
+    else
+      buffer_append (self->para, s++, 1);
+    }
+  textsink_wrap_run (self, context);
+  }
+
+
+/*============================================================================
+  textsink_begin_section
+============================================================================*/
+static void textsink_begin_section (ParaSink *sink, int spine_index,
+       const char *href)
+  {
+  TextWriter *self = (TextWriter *)sink;
+  (void)spine_index;
+  textsink_end_context (self);
+  if (href && self->options.section_separator)
+    {
+    const char *separator = self->options.section_separator;
+    parasink_write (sink, separator, strlen (separator));
+    parasink_write (sink, "\n", 1);
+    }
+  }
+
+
+/*============================================================================
+  textsink_para
+============================================================================*/
+static void textsink_para (ParaSink *sink, ParaKind kind, const char *text,
+       size_t len)
+  {
+  static const WT_UTF32 line_break [2] = { WT_HARD_LINE_BREAK, 0 };
+  static const WT_UTF32 para_break [3] = { '\n', '\n', 0 };
+  TextWriter *self = (TextWriter *)sink;
+
+  WrapTextContext *context = textsink_context (self);
+  const char *end = text + len;
+  // Headings are bold, as h1 to h5 are
+  if (kind == PARA_HEADING) 
+    xhtml_emphasis (context, &self->options, TRUE, TRUE);
+  while (text < end)
+    {
+    const char *nl = memchr (text, '\n', end - text);
+    if (!nl) nl = end;
+    textsink_wrap_line (self, context, text, nl - text);
+    if (nl < end)
+      {
+      wraptext_wrap_utf32 (context, line_break);
+      wraptext_eof (context);
+      }
+    text = nl + 1;
+    }
+  if (kind == PARA_HEADING) 
+    xhtml_emphasis (context, &self->options, TRUE, FALSE);
+  self->bold = self->italic = FALSE;
+  wraptext_wrap_utf32 (context, para_break);
+  }
+
+
+/*============================================================================
+  textsink_end_book
+============================================================================*/
+static void textsink_end_book (ParaSink *sink)
+  {
+  TextWriter *self = (TextWriter *)sink;
+  textsink_end_context (self);
+  }
+
+
+/*============================================================================
+  textsink_destroy
+============================================================================*/
+static void textsink_destroy (ParaSink *sink)
+  {
+  TextWriter *self = (TextWriter *)sink;
+  textsink_end_context (self);
+  buffer_destroy (self->para);
+  free (self);
+  }
+
+
+/*============================================================================
+  textsink_create
+============================================================================*/
+ParaSink *textsink_create (const Epub2TxtOptions *options,
+       Compressor *compressor)
+  {
+  TextWriter *self = malloc (sizeof (TextWriter));
+  memset (self, 0, sizeof (TextWriter));
+  parasink_init (&self->sink, compressor);
+  self->sink.begin_section = textsink_begin_section;
+  self->sink.para = textsink_para;
+  self->sink.end_book = textsink_end_book;
+  self->sink.destroy = textsink_destroy;
+  self->options = *options;
+  self->sink.markdown = options->ansi && !options->raw;
+  self->options.para_sink = NULL;
+  self->options.output = NULL;
+  self->options.compressor = NULL;
+  self->options.io = NULL;
+  self->options.source_map = NULL;
+  self->options.line_index = NULL;
+  self->options.document = NULL;
+  self->para = buffer_create ();
+  return &self->sink;
+  }
@@ -0,0 +1,21 @@
+/*============================================================================
+  epub2txt v2
+  textsink.h
+  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+
+  Wrapped text, as a paragraph sink, so that text can be written 
+  alongside other outputs from the same parse (see tee.h). Each 
+  paragraph is wrapped as the text output would wrap it, at the same
+  width, and with the same wrapping and hyphenation options, and 
+  followed by a blank line; spine items are separated by the section
+  separator, if there is one. Without ANSI codes, the two are the same;
+  with them, what differs is that bold text that goes on after italic
+  text inside it ends is shown as bold, as it should be.
+============================================================================*/
+
+#pragma once
+
+#include "epub2txt.h"
+
+ParaSink *textsink_create (const Epub2TxtOptions *options, 
+            Compressor *compressor);
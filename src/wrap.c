@@ -20,12 +20,39 @@
 #include "defs.h" 
 #include "wrap.h"
 #include "convertutf.h"
+#include "linebreak.h"
+#include "hyphen.h"
+#include "document.h"
+#include "store.h"
 #include "xhtml.h"
 
 #define WT_STATE_START 0
 #define WT_STATE_WORD 1
 #define WT_STATE_WHITE 2
 
+// A line that is too long, in optimal-fit mode
+#define WT_INFINITE_COST (INT64_MAX / 4)
+
+// A token in the paragraph buffer, in optimal-fit mode. The text is
+//  stored separately, in a single array for the whole paragraph
+typedef struct _WrapTextToken
+  {
+  int start;         // Offset of the first character in the text buffer
+  int len;           // Number of characters
+  int width;         // Display width, in columns
+  unsigned int fmt;  // Format in effect when the token was read
+  BOOL space;        // Token is followed by a space
+  BOOL join;         // Token follows the one before with no break
+  uint32_t mark;     // Mark of the first character
+  } WrapTextToken;
+
+// An entry in the candidate queue used by _wraptext_layout_para 
+typedef struct _WrapTextCandidate
+  {
+  int token;         // Break before this token...
+  int from;          // ...is the best choice for lines ending here onwards
+  } WrapTextCandidate;
+
 typedef struct _WrapTextContextPriv 
   {
   WrapTextOutputFn outputFn;
@@ -40,6 +67,37 @@ typedef struct _WrapTextContextPriv
   BOOL blank_line;
   WT_UTF32 last;
   WT_UTF32 *token;
+  int token_len;
+  int token_size;
+  int token_width;
+  unsigned int token_fmt; // Format when the token was started
+  BOOL held;         // The token ran up to the end of the input, and 
+                     //  may go on in the next input
+  BOOL join;         // The next token follows the last with no break
+  char *codes;       // ANSI codes written while the token was held, 
+  int codes_len;     //  which go inside it if the word goes on, or 
+  int codes_size;    //  after it, and its space, if not
+  LineBreakState lb_state;
+  // Paragraph buffer and work space for optimal-fit mode; these are
+  //  reused from one paragraph to the next
+  WT_UTF32 *para_text;
+  int para_text_len;
+  int para_text_size;
+  WrapTextToken *para;
+  int para_len;
+  int para_size;
+  int64_t *para_cost;
+  int *para_pred;
+  int *para_pos;
+  WrapTextCandidate *para_queue;
+  unsigned int out_fmt; // Format most recently written out
+  Hyphenator *hyphenator; // Not owned; may be NULL
+  Document *document;     // Not owned; if set, record rather than output
+  WrapTextMarkFn markFn;  // May be NULL
+  const uint32_t *marks;  // Marks of the characters being wrapped
+  uint32_t mark;          // Mark of the character being wrapped
+  uint32_t token_mark;    // Mark of the first character of the token
+  BOOL mark_pending;      // The token's mark has not been passed on yet
   } WrapTextContextPriv;
 
 
@@ -64,41 +122,82 @@ void wraptext_context_utf32_char_to_utf8 (const uint32_t c, WT_UTF8* utf8)
   }
 
 
-void _stdout_output_fn (void *app_data, WT_UTF32 c)
+void wraptext_stdout_output_fn (void *app_data, WT_UTF32 c)
   {
   WT_UTF8 buff [WT_UTF8_MAX_BYTES];  
+  (void)app_data;
   wraptext_context_utf32_char_to_utf8 (c, buff);
   fputs (buff, stdout); 
   }
 
 
-static void _wraptext_append_token (WrapTextContext *context, const WT_UTF32 c)
+// Make room for n more characters in the token buffer, and a terminator.
+//  The buffer grows geometrically, and keeps track of its own length, 
+//  so building a long token is not quadratic
+static void _wraptext_grow_token (WrapTextContextPriv *priv, int n)
   {
-  WT_UTF32 *token = context->priv->token;
-  if (!token)
+  if (priv->token_len + n + 1 > priv->token_size)
     {
-    token = malloc (sizeof (WT_UTF32));
-    token[0] = 0;
+    while (priv->token_len + n + 1 > priv->token_size)
+      priv->token_size = priv->token_size ? priv->token_size * 2 : 32;
+    priv->token = realloc (priv->token, 
+      priv->token_size * sizeof (WT_UTF32));
     }
-   
-  int l = wraptext_utf32_length (token);
-   
-  token = realloc (token, (l+2) * sizeof (WT_UTF32));
+  }
 
-  token [l] = c;
-  token [l+1] = 0;
 
-  context->priv->token = token;
+// The word that was held goes on, so the codes written while it was held
+//  go inside it, taking up no room
+static void _wraptext_take_codes (WrapTextContextPriv *priv)
+  {
+  int i;
+  _wraptext_grow_token (priv, priv->codes_len);
+  for (i = 0; i < priv->codes_len; i++)
+    priv->token [priv->token_len++] = (BYTE)priv->codes[i];
+  priv->token [priv->token_len] = 0;
+  priv->codes_len = 0;
   }
 
 
-// Whitespace other than newline
+// A space inside a token, before any codes that were written after it
+static void _wraptext_append_space (WrapTextContext *context)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  _wraptext_grow_token (priv, 1);
+  priv->token [priv->token_len++] = ' ';
+  priv->token [priv->token_len] = 0;
+  priv->token_width++;
+  }
+
+
+static void _wraptext_append_token (WrapTextContext *context, const WT_UTF32 c)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  if (priv->codes_len) _wraptext_take_codes (priv);
+  _wraptext_grow_token (priv, 1);
+  if (priv->token_len == 0)
+    {
+    priv->token_mark = priv->mark;
+    priv->token_fmt = priv->fmt;
+    }
+  priv->token [priv->token_len++] = c;
+  priv->token [priv->token_len] = 0;
+  priv->token_width += linebreak_width (c);
+  }
+
+
+// Whitespace other than newline. These are the breaking spaces of
+//  Unicode category Zs; no-break spaces (U+00A0, U+2007, U+202F) are 
+//  not whitespace for this purpose, as they glue words together
 BOOL _wraptext_is_white (WT_UTF32 c)
   {
-  if (c == 160) return TRUE; // nbsp
   if (c == 32) return TRUE;
   if (c == 9) return TRUE;
-  //TODO -- other unicode whitespace chars
+  if (c < 0x1680) return FALSE;
+  if (c == 0x1680) return TRUE; // ogham space mark
+  if (c >= 0x2000 && c <= 0x200A && c != 0x2007) return TRUE; // en quad...
+  if (c == 0x205F) return TRUE; // medium mathematical space 
+  if (c == 0x3000) return TRUE; // ideographic space 
   return FALSE;
   }
 
@@ -135,25 +234,74 @@ void _wraptext_new_line (WrapTextContext *context)
   }
 
 
-void _wraptext_flush_string (WrapTextContext *context, WT_UTF32 *s)
+void _wraptext_flush_string (WrapTextContext *context, const WT_UTF32 *s,
+       int len, int width)
   {
-  int i, l = wraptext_utf32_length (s);
+  int i;
+  WrapTextContextPriv *priv = context->priv;
+
+  // A token that was held over a change of format has the ANSI codes
+  //  for it inside; until they are written, the format in effect is the
+  //  one that the token started in
+  unsigned int fmt = priv->fmt;
+  priv->fmt = priv->token_fmt;
+
+  // If the token will not fit, and can be hyphenated, put as much of it
+  //  on this line as will fit, followed by a hyphen. Tokens with 
+  //  double-width or zero-width characters are left alone
+  if (priv->hyphenator && width == len 
+       && width + priv->column + 1 >= priv->width)
+    {
+    uint64_t points = hyphenator_hyphenate (priv->hyphenator, s, len);
+    while (points && width + priv->column + 1 >= priv->width)
+      {
+      // The prefix, and its hyphen, must satisfy the same test as
+      //  a whole token
+      int room = priv->width - priv->column - 3;
+      int cut = 0;
+      for (i = 1; i <= room && i < len && i < 64; i++)
+        if (points & ((uint64_t)1 << i)) cut = i;
+      if (cut == 0) break;
+      if (priv->mark_pending)
+        {
+        priv->markFn (priv->app_data, priv->token_mark);
+        priv->mark_pending = FALSE;
+        }
+      for (i = 0; i < cut; i++)
+        priv->outputFn (priv->app_data, s[i]);
+      priv->outputFn (priv->app_data, '-');
+      xhtml_emit_fmt_eol_pre (context);
+      _wraptext_emit_newline (context);
+      xhtml_emit_fmt_eol_post (context);
+      priv->column = 0;
+      s += cut;
+      len -= cut;
+      width -= cut;
+      points >>= cut;
+      }
+    }
 
-  if (l + context->priv->column + 1 >= context->priv->width)
+  if (width + context->priv->column + 1 >= context->priv->width)
     {
     xhtml_emit_fmt_eol_pre (context);    /* upcall: turn-off all ANSI highlghting before EOL */
     _wraptext_emit_newline (context);
     xhtml_emit_fmt_eol_post (context);   /* upcall: restore ANSI highlighting after EOL */
     context->priv->column = 0;
     }
+  priv->fmt = fmt;
  
-  for (i = 0; i < l; i++)
+  if (priv->mark_pending)
+    {
+    priv->markFn (priv->app_data, priv->token_mark);
+    priv->mark_pending = FALSE;
+    }
+  for (i = 0; i < len; i++)
     {
     WT_UTF32 c = s[i];
     context->priv->outputFn (context->priv->app_data, c); 
     }
 
-  context->priv->column += l;
+  context->priv->column += width;
   }
 
 
@@ -167,25 +315,432 @@ void _wraptext_flush_space (WrapTextContext *context, BOOL allowAtStart)
   }
 
 
-void _wraptext_flush_token (WrapTextContext *context)
+/*============================================================================
+  Optimal-fit layout
+
+  In optimal-fit mode (WT_FLAG_OPTIMAL) tokens are not written out as
+  they arrive, but collected until the end of the paragraph. The
+  paragraph is then broken into lines so as to minimize the sum of the
+  squares of the space left at the end of each line, except the last.
+  This is the "minimum raggedness" problem, and it is solved here as a
+  least-weight subsequence: cost[j], the least cost of setting tokens
+  0..j-1, is the minimum over i of cost[i] + badness(i, j). Because 
+  badness is a convex function of the line length, a candidate break
+  that is beaten by a later one is beaten for all longer lines as well.
+  So the candidates can be kept in a queue, each owning a range of line
+  ends, and each token is pushed and popped at most once. Where two
+  candidates' ranges meet is found by a search that never extends 
+  beyond a single line, so the cost per token is logarithmic in the 
+  number of tokens per line, not in the length of the paragraph: for a
+  given width, the layout is linear in the length of the paragraph.
+
+  Formatting is carried with each token, because the ANSI codes can no
+  longer be written out at the point where the format changes. The
+  upcall xhtml_emit_fmt_change writes them when the text is written.
+============================================================================*/
+
+// The longest line (in columns) the layout will produce. This is the
+//  same limit as the greedy wrapper, which always keeps a column spare
+//  for a trailing space
+static int _wraptext_line_limit (const WrapTextContext *context)
+  {
+  return context->priv->width - 2;
+  }
+
+// Length of a line of tokens i..j-1, not counting any trailing space.
+//  pos[k] is the total width of tokens 0..k-1, with their spaces
+static inline int _wraptext_line_length (const WrapTextContextPriv *priv, 
+       int i, int j)
+  {
+  const WrapTextToken *last = &priv->para[j - 1];
+  return priv->para_pos[j] - (last->space ? 1 : 0) - priv->para_pos[i];
+  }
+
+// Cost of a line of tokens i..j-1 that is not the last in the paragraph
+static inline int64_t _wraptext_badness (const WrapTextContextPriv *priv, 
+       int limit, int i, int j)
+  {
+  int len = _wraptext_line_length (priv, i, j);
+  if (len > limit) return WT_INFINITE_COST;
+  int64_t slack = limit - len;
+  return slack * slack;
+  }
+
+static inline int64_t _wraptext_total (const WrapTextContextPriv *priv, 
+       int limit, int i, int j)
+  {
+  return priv->para_cost[i] + _wraptext_badness (priv, limit, i, j);
+  }
+
+// Add the token just completed to the paragraph buffer
+static void _wraptext_buffer_token (WrapTextContext *context, BOOL space)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  if (priv->para_len + 1 >= priv->para_size)
+    {
+    priv->para_size = priv->para_size ? priv->para_size * 2 : 256;
+    priv->para = realloc (priv->para, 
+      priv->para_size * sizeof (WrapTextToken));
+    priv->para_cost = realloc (priv->para_cost,
+      (priv->para_size + 1) * sizeof (int64_t));
+    priv->para_pred = realloc (priv->para_pred, 
+      (priv->para_size + 1) * sizeof (int));
+    priv->para_pos = realloc (priv->para_pos, 
+      (priv->para_size + 1) * sizeof (int));
+    priv->para_queue = realloc (priv->para_queue, 
+      (priv->para_size + 1) * sizeof (WrapTextCandidate));
+    }
+  if (priv->para_text_len + priv->token_len > priv->para_text_size)
+    {
+    while (priv->para_text_len + priv->token_len > priv->para_text_size)
+      priv->para_text_size = priv->para_text_size 
+        ? priv->para_text_size * 2 : 1024;
+    priv->para_text = realloc (priv->para_text, 
+      priv->para_text_size * sizeof (WT_UTF32));
+    }
+
+  WrapTextToken *t = &priv->para [priv->para_len++];
+  t->start = priv->para_text_len;
+  t->len = priv->token_len;
+  t->width = priv->token_width;
+  t->fmt = priv->fmt;
+  t->space = space;
+  t->join = priv->join;
+  t->mark = priv->token_mark;
+  memcpy (priv->para_text + priv->para_text_len, priv->token, 
+    priv->token_len * sizeof (WT_UTF32));
+  priv->para_text_len += priv->token_len;
+  }
+
+// Find the least cost of each line end s+1..end, given the cost of a
+//  break before token s, where no group of tokens from s to end-1 is 
+//  wider than a line. A token joined to the one before it can't start
+//  a line, so it is never a candidate
+static void _wraptext_find_range (WrapTextContextPriv *priv, int limit, 
+       int s, int end)
+  {
+  WrapTextCandidate *queue = priv->para_queue;
+  int head = 0, tail = 0;
+  queue[tail].token = s;
+  queue[tail].from = s + 1;
+  tail++;
+
+  int j;
+  for (j = s + 1; j <= end; j++)
+    {
+    while (tail - head > 1 && queue[head + 1].from <= j) head++;
+    int i = queue[head].token;
+    priv->para_cost[j] = _wraptext_total (priv, limit, i, j);
+    priv->para_pred[j] = i;
+    if (j == end) break;
+    if (priv->para[j].join) continue;
+
+    // Candidate j replaces any earlier candidate that it beats at the
+    //  start of that candidate's range, and takes over the rest of
+    //  the range of the first one it does not beat, from the point
+    //  where it starts to win
+    int from = j + 1;
+    while (tail > head)
+      {
+      WrapTextCandidate *back = &queue[tail - 1];
+      int at = back->from > from ? back->from : from;
+      if (at > end) break;
+      if (_wraptext_total (priv, limit, j, at) 
+            > _wraptext_total (priv, limit, back->token, at))
+        {
+        // back wins at the start of its range. j must win by the point
+        //  where back's lines become too long, so find that first, by
+        //  galloping forward, and then search between the two. Both
+        //  searches stay within one line's worth of tokens
+        int lo = at, hi = at + 1, step = 1;
+        while (hi <= end && _wraptext_line_length (priv, back->token, hi) 
+                 <= limit)
+          {
+          lo = hi;
+          hi += step;
+          step *= 2;
+          }
+        if (hi > end + 1) hi = end + 1;
+        while (lo + 1 < hi)
+          {
+          int mid = lo + (hi - lo) / 2;
+          if (_wraptext_line_length (priv, back->token, mid) <= limit)
+            lo = mid;
+          else
+            hi = mid;
+          }
+        lo = at + 1;
+        while (lo < hi)
+          {
+          int mid = lo + (hi - lo) / 2;
+          if (_wraptext_total (priv, limit, j, mid) 
+                <= _wraptext_total (priv, limit, back->token, mid))
+            hi = mid;
+          else
+            lo = mid + 1;
+          }
+        from = lo;
+        break;
+        }
+      tail--;
+      }
+    if (from <= end)
+      {
+      if (tail == head) from = j + 1;
+      queue[tail].token = j;
+      queue[tail].from = from;
+      tail++;
+      }
+    }
+  }
+
+// Find the line breaks for the buffered paragraph. On return, 
+//  para_pred[j] is the start of the line that ends before token j,
+//  for each line end j, following the chain back from para_len
+static void _wraptext_find_breaks (WrapTextContext *context)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  int n = priv->para_len;
+  int limit = _wraptext_line_limit (context);
+  int j;
+
+  priv->para_pos[0] = 0;
+  for (j = 0; j < n; j++)
+    priv->para_pos[j + 1] = priv->para_pos[j] + priv->para[j].width 
+      + (priv->para[j].space ? 1 : 0);
+
+  // Nothing to do if the whole paragraph fits on one line. This is
+  //  always the case if the width is unlimited
+  if (_wraptext_line_length (priv, 0, n) <= limit)
+    {
+    priv->para_pred[n] = 0;
+    return;
+    }
+
+  // A token, or a group of tokens joined together, that won't fit on a
+  //  line by itself has to go somewhere: it gets a line of its own, and
+  //  the tokens between two such are laid out apart from the rest
+  int s = 0, e;
+  priv->para_cost[0] = 0;
+  for (j = 0; j < n; j = e)
+    {
+    e = j + 1;
+    while (e < n && priv->para[e].join) e++;
+    if (_wraptext_line_length (priv, j, e) <= limit) continue;
+    if (j > s) _wraptext_find_range (priv, limit, s, j);
+    priv->para_cost[e] = priv->para_cost[j];
+    priv->para_pred[e] = j;
+    s = e;
+    }
+  if (s == n) return;
+  if (n - 1 > s) _wraptext_find_range (priv, limit, s, n - 1);
+
+  // The last line costs nothing, provided that it fits
+  int best = -1;
+  int64_t best_cost = 0;
+  for (j = n - 1; j >= s; j--)
+    {
+    if (best >= 0 && _wraptext_line_length (priv, j, n) > limit) break;
+    if (j > s && priv->para[j].join) continue;
+    if (best < 0 || priv->para_cost[j] <= best_cost)
+      {
+      best = j;
+      best_cost = priv->para_cost[j];
+      }
+    }
+  priv->para_pred[n] = best;
+  }
+
+// Write out tokens first..last-1 as one line. If justify is set, spaces
+//  are widened to bring the line out to limit columns
+static void _wraptext_emit_line (WrapTextContext *context, int first, 
+       int last, BOOL justify, int limit)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  int k, gaps = 0, pad = 0;
+  if (justify)
+    {
+    pad = limit;
+    for (k = first; k < last; k++)
+      {
+      pad -= priv->para[k].width;
+      if (k < last - 1 && priv->para[k].space)
+        {
+        gaps++;
+        pad--;
+        }
+      }
+    if (pad < 0 || gaps == 0) pad = 0;
+    }
+
+  int gap = 0;
+  for (k = first; k < last; k++)
+    {
+    const WrapTextToken *t = &priv->para[k];
+    if (t->fmt != priv->out_fmt)
+      {
+      xhtml_emit_fmt_change (context, priv->out_fmt, t->fmt); /* upcall */
+      priv->out_fmt = t->fmt;
+      }
+    int i;
+    if (priv->markFn) priv->markFn (priv->app_data, t->mark);
+    for (i = 0; i < t->len; i++)
+      priv->outputFn (priv->app_data, priv->para_text[t->start + i]);
+    priv->column += t->width;
+    if (k < last - 1 && t->space)
+      {
+      // The space between two tokens only gets the formatting that
+      //  they have in common
+      unsigned int common = priv->out_fmt & t[1].fmt;
+      if (common != priv->out_fmt)
+        {
+        xhtml_emit_fmt_change (context, priv->out_fmt, common); /* upcall */
+        priv->out_fmt = common;
+        }
+      int spaces = 1;
+      if (pad > 0)
+        spaces += pad / gaps + (gap < pad % gaps ? 1 : 0);
+      gap++;
+      for (i = 0; i < spaces; i++)
+        priv->outputFn (priv->app_data, ' ');
+      priv->column += spaces;
+      }
+    }
+  }
+
+// Lay out and write the buffered paragraph, if there is one. The last
+//  line is not terminated: the caller decides what follows it
+static void _wraptext_layout_para (WrapTextContext *context)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  int n = priv->para_len;
+  if (n == 0) return;
+
+  int limit = _wraptext_line_limit (context);
+  _wraptext_find_breaks (context);
+
+  // Follow the chain of breaks back from the end, reusing para_pos
+  //  (which is no longer needed) to hold the line starts in order
+  int lines = 0, j;
+  for (j = n; j > 0; j = priv->para_pred[j]) lines++;
+  int *starts = priv->para_pos;
+  int l = lines;
+  starts[l] = n;
+  for (j = n; j > 0; j = priv->para_pred[j]) starts[--l] = priv->para_pred[j];
+
+  BOOL justify = (priv->flags & WT_FLAG_JUSTIFY) != 0;
+  for (l = 0; l < lines; l++)
+    {
+    if (priv->column > 0)
+      {
+      if (priv->out_fmt)
+        {
+        xhtml_emit_fmt_change (context, priv->out_fmt, 0); /* upcall */
+        priv->out_fmt = 0;
+        }
+      _wraptext_new_line (context);
+      }
+    _wraptext_emit_line (context, starts[l], starts[l + 1], 
+      justify && l < lines - 1, limit);
+    }
+
+  // Leave the output in whatever format the input is now in, as the 
+  //  greedy wrapper would
+  if (priv->out_fmt != priv->fmt)
+    {
+    xhtml_emit_fmt_change (context, priv->out_fmt, priv->fmt); /* upcall */
+    priv->out_fmt = priv->fmt;
+    }
+
+  priv->para_len = 0;
+  priv->para_text_len = 0;
+  }
+
+// End of a paragraph, or of a line ended by a hard break
+static void _wraptext_end_para (WrapTextContext *context)
+  {
+  if (context->priv->document)
+    document_end_para (context->priv->document, DOC_BREAK_PARA, 
+      context->priv->fmt);
+  else if (context->priv->flags & WT_FLAG_OPTIMAL)
+    _wraptext_layout_para (context);
+  }
+
+/* Write out the current token, if there is one. If space is TRUE, the
+   token was ended by whitespace, and a space follows it; otherwise it
+   was ended at a break opportunity inside a run of text, such as between
+   two CJK ideographs, and nothing follows it. */
+void _wraptext_flush_token (WrapTextContext *context, BOOL space)
   {
-  WT_UTF32 *token = context->priv->token;
+  WrapTextContextPriv *priv = context->priv;
+  priv->held = FALSE;
   // Don't flush anything -- even a space -- if the token is
   //  null. This will only happen at end-of-line or end-of-file
   //  states (hopefully)
-  if (token)
+  if (priv->token_len > 0)
     {
-    if (token[0])
+    if (!_wraptext_is_all_white (priv->token))
+      priv->blank_line = FALSE;
+    if (priv->document)
+      document_add_token (priv->document, priv->token, priv->token_len,
+        priv->token_width, priv->fmt, (space ? DOC_TOKEN_SPACE : 0)
+        | (priv->join ? DOC_TOKEN_JOIN : 0));
+    else if (priv->flags & WT_FLAG_OPTIMAL)
+      _wraptext_buffer_token (context, space);
+    else
       {
-      if (!_wraptext_is_all_white (token))
-        context->priv->blank_line = FALSE;
+      priv->mark_pending = priv->markFn != NULL;
+      _wraptext_flush_string (context, priv->token, priv->token_len, 
+        priv->token_width);
+      if (space) _wraptext_flush_space (context, FALSE);
+      int i;
+      for (i = 0; i < priv->codes_len; i++)
+        priv->outputFn (priv->app_data, (BYTE)priv->codes[i]);
+      priv->codes_len = 0;
       }
-    _wraptext_flush_string (context, token);
-    _wraptext_flush_space (context, FALSE);
-    free (context->priv->token);
     }
+  else if (space && priv->join)
+    {
+    // The last token was ended by a change of format, and white space
+    //  came after it, so a space follows it after all
+    if (priv->document)
+      document_add_space (priv->document);
+    else if (priv->para_len > 0)
+      priv->para[priv->para_len - 1].space = TRUE;
+    }
+
+  priv->join = FALSE;
+  priv->token_len = 0;
+  priv->token_width = 0;
+  }
+
+
+// A hard line break, e.g., <br/>, ends a paragraph in the same way,
+//  but the next text always starts on a new line
+static void _wraptext_hard_break (WrapTextContext *context)
+  {
+  _wraptext_flush_token (context, TRUE);
+  if (context->priv->document)
+    document_end_para (context->priv->document, DOC_BREAK_LINE, 
+      context->priv->fmt);
+  else
+    {
+    _wraptext_end_para (context);
+    _wraptext_new_line (context);
+    }
+  }
 
-  context->priv->token = NULL;
+// A blank line between paragraphs
+static void _wraptext_gap (WrapTextContext *context)
+  {
+  if (context->priv->document)
+    document_end_para (context->priv->document, DOC_BREAK_GAP, 
+      context->priv->fmt);
+  else
+    {
+    _wraptext_new_line (context); 
+    _wraptext_new_line (context); 
+    }
   }
 
 
@@ -220,10 +775,10 @@ void _wraptext_wrap_next (WrapTextContext *context, const WT_UTF32 c)
        }
      else
        {
-       _wraptext_new_line (context); 
-       _wraptext_new_line (context); 
+       _wraptext_gap (context);
        context->priv->blank_line = TRUE;
        }
+     linebreak_state_reset (&context->priv->lb_state);
      state = WT_STATE_WHITE;
      }
   else if (state == WT_STATE_START && _wraptext_is_white (c))
@@ -233,6 +788,7 @@ void _wraptext_wrap_next (WrapTextContext *context, const WT_UTF32 c)
      }
   else if (state == WT_STATE_START)
      {
+     linebreak_next (&context->priv->lb_state, c);
      _wraptext_append_token (context, c);
      state = WT_STATE_WORD;
      }
@@ -241,31 +797,47 @@ void _wraptext_wrap_next (WrapTextContext *context, const WT_UTF32 c)
 
   else if (state == WT_STATE_WORD && c == WT_HARD_LINE_BREAK)
      {
-     _wraptext_flush_token (context);
-     _wraptext_new_line (context);
+     _wraptext_hard_break (context);
+     linebreak_state_reset (&context->priv->lb_state);
      state = WT_STATE_START;
      }
   else if (state == WT_STATE_WORD && _wraptext_is_newline (c))
      {
-     _wraptext_flush_token (context);
+     _wraptext_flush_token (context, TRUE);
+     _wraptext_end_para (context);
+     linebreak_state_reset (&context->priv->lb_state);
      state = WT_STATE_START;
      }
   else if (state == WT_STATE_WORD && _wraptext_is_white (c))
      {
-     _wraptext_flush_token (context);
+     // Don't flush the token yet -- whether we can break at this
+     //  space depends on what follows it
+     linebreak_next (&context->priv->lb_state, ' ');
      state = WT_STATE_WHITE;
      }
   else if (state == WT_STATE_WORD)
      {
+     // A break opportunity inside a run of non-white characters, e.g., 
+     //  between CJK ideographs, or after a hyphen
+     if (linebreak_next (&context->priv->lb_state, c) == LB_BREAK_ALLOWED)
+       _wraptext_flush_token (context, FALSE);
      _wraptext_append_token (context, c);
      state = WT_STATE_WORD;
      }
   
   // STATE_WHITE
 
+  else if (state == WT_STATE_WHITE && c == WT_HARD_LINE_BREAK)
+     {
+     _wraptext_hard_break (context);
+     linebreak_state_reset (&context->priv->lb_state);
+     state = WT_STATE_START;
+     }
   else if (state == WT_STATE_WHITE && _wraptext_is_newline (c))
      {
-     _wraptext_flush_token (context);
+     _wraptext_flush_token (context, TRUE);
+     _wraptext_end_para (context);
+     linebreak_state_reset (&context->priv->lb_state);
      state = WT_STATE_START;
      }
   else if (state == WT_STATE_WHITE && _wraptext_is_white (c))
@@ -274,6 +846,23 @@ void _wraptext_wrap_next (WrapTextContext *context, const WT_UTF32 c)
      }
   else if (state == WT_STATE_WHITE)
      {
+     // Usually we can break at a space; but not, for example, between 
+     //  an opening bracket and what follows, or before a closing
+     //  one. In that case the space becomes part of the token
+     BOOL allowed = linebreak_next (&context->priv->lb_state, c) 
+       == LB_BREAK_ALLOWED;
+     if (context->priv->token_len == 0 && context->priv->join)
+       {
+       // The token before was ended by a change of format: a space 
+       //  follows it, but it is joined to what comes next, unless a 
+       //  break is allowed here
+       _wraptext_flush_token (context, TRUE);
+       context->priv->join = !allowed;
+       }
+     else if (allowed || context->priv->token_len == 0)
+       _wraptext_flush_token (context, TRUE);
+     else
+       _wraptext_append_space (context);
      _wraptext_append_token (context, c);
      state = WT_STATE_WORD;
      }
@@ -290,10 +879,129 @@ void _wraptext_wrap_next (WrapTextContext *context, const WT_UTF32 c)
   }
 
 
+/* End of this input, e.g., at a change of format. The token is held
+   until the next input shows where it ends: a word that runs up to the
+   end, as "word" does in "<i>word</i>,", may go on, and whether a break
+   can follow a space depends on what comes after it. */
 void wraptext_eof (WrapTextContext *context)
   {
-  // Handle any input that has not been handled already
-  _wraptext_flush_token (context);
+  context->priv->held = context->priv->token_len > 0;
+  }
+
+
+/* End of input: write out anything that is still buffered. 
+   wraptext_eof, by contrast, may hold back the last token, and in
+   optimal-fit mode does not end the paragraph, because it may be called
+   in the middle of one (e.g., at a change of format). */
+void wraptext_flush (WrapTextContext *context)
+  {
+  _wraptext_flush_token (context, TRUE);
+  _wraptext_end_para (context);
+  }
+
+
+/* Lay out paragraphs first..last-1 of a document that was recorded
+   earlier, at the current width. The tokens go to the same place that 
+   they would have gone when the text was first wrapped, so the output 
+   is the same, except that format changes are written as the tokens 
+   are, rather than as the tags that caused them were read. */
+void wraptext_wrap_document (WrapTextContext *context, const Document *doc,
+       int first, int last)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  int p;
+
+  _wraptext_flush_token (context, TRUE);
+  for (p = first; p < last; p++)
+    {
+    const DocumentPara *para = &doc->paras[p];
+    const DocumentRun *run = &doc->runs[para->run];
+    const DocumentRun *end_run = &doc->runs[doc->paras[p + 1].run];
+    const char *text = doc->text + para->text;
+    uint32_t t, ntokens = doc->paras[p + 1].token - para->token;
+
+    for (t = 0; t < ntokens; t++)
+      {
+      const DocumentToken *token = &doc->tokens[para->token + t];
+      while (run + 1 < end_run && run[1].token <= t) run++;
+      if (priv->fmt != run->fmt)
+        {
+        priv->fmt = run->fmt;
+        if (!(priv->flags & WT_FLAG_OPTIMAL) && priv->out_fmt != priv->fmt)
+          {
+          xhtml_emit_fmt_change (context, priv->out_fmt, priv->fmt); /* upcall */
+          priv->out_fmt = priv->fmt;
+          }
+        }
+
+      // In greedy mode, a token joined to the one before is added to it,
+      //  which is held back, as it was when the text was first wrapped
+      if (priv->codes_len) _wraptext_take_codes (priv);
+      int start = priv->token_len;
+      if (start == 0)
+        {
+        priv->token_fmt = priv->fmt;
+        priv->token_width = 0;
+        }
+
+      // There are never more characters than bytes of UTF-8
+      _wraptext_grow_token (priv, token->len);
+      if (text + token->len > doc->text + doc->text_len) return;
+      const UTF8 *in = (const UTF8 *)text;
+      UTF32 *out = (UTF32 *)priv->token + start;
+      ConvertUTF8toUTF32 (&in, in + token->len, &out, 
+        (UTF32 *)priv->token + priv->token_size, lenientConversion);
+      int len = out - ((UTF32 *)priv->token + start);
+      priv->token_len = start + len;
+      priv->token [priv->token_len] = 0;
+      priv->token_width += token->width;
+      text += token->len;
+
+      WString *transformed = xhtml_transform_token (context, 
+        priv->token + start, len); /* upcall */
+      if (transformed)
+        {
+        const WT_UTF32 *s = wstring_wstr (transformed);
+        int i, l = wstring_length (transformed);
+        priv->token_len = start;
+        priv->token_width -= token->width;
+        for (i = 0; i < l; i++)
+          _wraptext_append_token (context, s[i]);
+        wstring_destroy (transformed);
+        }
+
+      priv->held = !(priv->flags & WT_FLAG_OPTIMAL) && t + 1 < ntokens
+        && (doc->tokens[para->token + t + 1].flags & DOC_TOKEN_JOIN);
+      if (priv->held)
+        {
+        if (token->flags & DOC_TOKEN_SPACE) _wraptext_append_space (context);
+        continue;
+        }
+      priv->join = (token->flags & DOC_TOKEN_JOIN) != 0;
+      _wraptext_flush_token (context, token->flags & DOC_TOKEN_SPACE);
+      }
+
+    // The format at the end of the paragraph
+    priv->fmt = end_run[-1].fmt;
+    if (!(priv->flags & WT_FLAG_OPTIMAL) && priv->out_fmt != priv->fmt)
+      {
+      xhtml_emit_fmt_change (context, priv->out_fmt, priv->fmt); /* upcall */
+      priv->out_fmt = priv->fmt;
+      }
+
+    switch (para->brk)
+      {
+      case DOC_BREAK_PARA:
+        _wraptext_end_para (context);
+        break;
+      case DOC_BREAK_LINE:
+        _wraptext_hard_break (context);
+        break;
+      case DOC_BREAK_GAP:
+        _wraptext_gap (context);
+        break;
+      }
+    }
   }
 
 
@@ -308,21 +1016,36 @@ void wraptext_wrap_utf32 (WrapTextContext *context, const WT_UTF32 *utf32)
   }
 
 
+/* As wraptext_wrap_utf32, but each character has a mark, which is 
+   passed to the mark function when the token it starts is written. */
+void wraptext_wrap_utf32_marked (WrapTextContext *context, 
+       const WT_UTF32 *utf32, const uint32_t *marks)
+  {
+  int i, len = wraptext_utf32_length (utf32);
+  for (i = 0; i < len; i++)
+    {
+    context->priv->mark = marks[i];
+    _wraptext_wrap_next (context, utf32[i]);
+    }
+  }
+
+
 void wraptext_easy_stdout_utf32 (const int width, const WT_UTF32 *utf32,
      int flags)
   {
   WrapTextContext *context = wraptext_context_new();
-  wraptext_context_set_output_fn (context, _stdout_output_fn);
+  wraptext_context_set_output_fn (context, wraptext_stdout_output_fn);
   wraptext_context_set_flags (context, flags);
   wraptext_context_set_width (context, width);
   wraptext_wrap_utf32 (context, utf32);
-  wraptext_eof (context);
+  wraptext_flush (context);
   wraptext_context_free (context);
   }
 
 
 WrapTextContext *wraptext_context_new (void)
   {
+  linebreak_init ();
   WrapTextContext *self = malloc (sizeof (WrapTextContext));
   memset (self, 0, sizeof (WrapTextContext));
   WrapTextContextPriv *priv = malloc (sizeof (WrapTextContextPriv));
@@ -330,7 +1053,7 @@ WrapTextContext *wraptext_context_new (void)
   self->priv = priv;
   self->priv->width = 80;
   self->priv->blank_line = TRUE; // Assume that we are starting on a new line
-  self->priv->outputFn = _stdout_output_fn;
+  self->priv->outputFn = wraptext_stdout_output_fn;
   wraptext_context_reset (self);
   return self;
   }
@@ -344,31 +1067,87 @@ void wraptext_context_reset (WrapTextContext *self)
   self->priv->white_count = 0;
   self->priv->fmt = 0;
   self->priv->blank_line = TRUE;
-  if (self->priv->token) free (self->priv->token);
-  self->priv->token = NULL;
+  self->priv->token_len = 0;
+  self->priv->token_width = 0;
+  self->priv->para_len = 0;
+  self->priv->para_text_len = 0;
+  self->priv->out_fmt = 0;
+  linebreak_state_reset (&self->priv->lb_state);
   }
 
 
+/* Write a string of ASCII characters, such as an ANSI escape sequence, 
+   to the output as it is. */
+void wraptext_output_string (WrapTextContext *context, const char *s)
+  {
+  WrapTextContextPriv *priv = context->priv;
+  if (priv->held)
+    {
+    // Whether the codes go inside the token that is held back, or after
+    //  it, depends on what comes next
+    int len = strlen (s);
+    STORE_GROW (priv->codes, priv->codes_size, priv->codes_len + len);
+    memcpy (priv->codes + priv->codes_len, s, len);
+    priv->codes_len += len;
+    return;
+    }
+  while (*s)
+    priv->outputFn (priv->app_data, (BYTE)*s++);
+  }
+
 void wraptext_context_set_output_fn (WrapTextContext *self, 
     WrapTextOutputFn fn)
   {
   self->priv->outputFn = fn;
   }
 
+void wraptext_context_set_mark_fn (WrapTextContext *self, WrapTextMarkFn fn)
+  {
+  self->priv->markFn = fn;
+  }
+
 
 void wraptext_context_set_width (WrapTextContext *self, int width)
   {
   self->priv->width = width;
   }
 
+void wraptext_context_set_hyphenator (WrapTextContext *self, 
+       Hyphenator *hyphenator)
+  {
+  self->priv->hyphenator = hyphenator;
+  }
+
+void wraptext_context_set_document (WrapTextContext *self, 
+       Document *document)
+  {
+  self->priv->document = document;
+  }
+
 void wraptext_context_set_flags (WrapTextContext *self, int flags)
   {
   self->priv->flags = flags;
   }
 
+/* Each token has one format, so in optimal-fit mode, or when recording
+   a document, a change of format ends a token that is held back. The 
+   rest of the word follows it with no break. In greedy mode, the token 
+   goes on, with the ANSI codes for the change inside it. */
+static void _wraptext_change_fmt (WrapTextContext *self, unsigned int fmt)
+  {
+  WrapTextContextPriv *priv = self->priv;
+  if (fmt != priv->fmt && priv->held 
+       && (priv->document || (priv->flags & WT_FLAG_OPTIMAL)))
+    {
+    _wraptext_flush_token (self, priv->state == WT_STATE_WHITE);
+    priv->join = TRUE;
+    }
+  priv->fmt = fmt;
+  }
+
 void wraptext_context_zero_fmt (WrapTextContext *self)
   {
-  self->priv->fmt = 0;
+  _wraptext_change_fmt (self, 0);
   }
 
 unsigned int wraptext_context_get_fmt (WrapTextContext *self)
@@ -378,12 +1157,12 @@ unsigned int wraptext_context_get_fmt (WrapTextContext *self)
 
 void wraptext_context_set_fmt (WrapTextContext *self, unsigned int fmt)
   {
-  self->priv->fmt |= fmt;
+  _wraptext_change_fmt (self, self->priv->fmt | fmt);
   }
 
 void wraptext_context_reset_fmt (WrapTextContext *self, unsigned int fmt)
   {
-  self->priv->fmt &= ~fmt;
+  _wraptext_change_fmt (self, self->priv->fmt & ~fmt);
   }
 
 void wraptext_context_set_app_opts (WrapTextContext *self, void *app_opts)
@@ -396,6 +1175,23 @@ void *wraptext_context_get_app_opts (WrapTextContext *self)
   return self->priv->app_opts;
   }
 
+void wraptext_context_get_state (WrapTextContext *self, WrapTextState *state)
+  {
+  state->column = self->priv->column;
+  state->fmt = self->priv->fmt;
+  state->out_fmt = self->priv->out_fmt;
+  state->blank_line = self->priv->blank_line;
+  }
+
+void wraptext_context_set_state (WrapTextContext *self, 
+       const WrapTextState *state)
+  {
+  self->priv->column = state->column;
+  self->priv->fmt = state->fmt;
+  self->priv->out_fmt = state->out_fmt;
+  self->priv->blank_line = state->blank_line;
+  }
+
 void wraptext_context_set_app_data (WrapTextContext *self, void *app_data)
   {
   self->priv->app_data = app_data;
@@ -406,6 +1202,14 @@ void wraptext_context_free (WrapTextContext *self)
   if (!self) return;
   if (self->priv)
     {
+    if (self->priv->token) free (self->priv->token);
+    if (self->priv->para_text) free (self->priv->para_text);
+    if (self->priv->para) free (self->priv->para);
+    if (self->priv->para_cost) free (self->priv->para_cost);
+    if (self->priv->para_pred) free (self->priv->para_pred);
+    if (self->priv->para_pos) free (self->priv->para_pos);
+    if (self->priv->para_queue) free (self->priv->para_queue);
+    if (self->priv->codes) free (self->priv->codes);
     free (self->priv);
     self->priv = NULL;
     }
@@ -16,12 +16,32 @@
 // Hard line break should be an unusued code point
 #define WT_HARD_LINE_BREAK 9999
 
+// Flags for wraptext_context_set_flags
+#define WT_FLAG_OPTIMAL 0x0001 // Optimal-fit, rather than greedy, wrapping 
+#define WT_FLAG_JUSTIFY 0x0002 // Justify lines (optimal-fit mode only) 
+
 typedef uint32_t WT_UTF32;
 typedef char WT_UTF8;
 
 typedef void (*WrapTextOutputFn) (void *app_data, WT_UTF32 c);
 
+// Called with the mark of a token's first character, just before the 
+//  token is written out
+typedef void (*WrapTextMarkFn) (void *app_data, uint32_t mark);
+
+// The state of the wrapper between paragraphs, which is all that needs
+//  to be restored to lay out a recorded document from part-way through
+typedef struct _WrapTextState
+  {
+  int column;
+  unsigned int fmt;      // Format of the input
+  unsigned int out_fmt;  // Format of the output, when laying out a document
+  int blank_line;        // Nothing has been written since the last blank line
+  } WrapTextState;
+
 struct _WrapTextContextPriv;
+struct _Hyphenator;
+struct _Document;
 
 typedef struct _WrapTextContext
   {
@@ -33,6 +53,8 @@ extern "C" {
 #endif
 
 void wraptext_wrap_utf32 (WrapTextContext *context, const WT_UTF32 *utf32);
+void wraptext_wrap_utf32_marked (WrapTextContext *context, 
+  const WT_UTF32 *utf32, const uint32_t *marks);
 
 WrapTextContext *wraptext_context_new (void);
 
@@ -40,6 +62,8 @@ void wraptext_context_free (WrapTextContext *self);
 
 void wraptext_context_set_output_fn (WrapTextContext *self, 
   WrapTextOutputFn fn);
+void wraptext_context_set_mark_fn (WrapTextContext *self, 
+  WrapTextMarkFn fn);
 
 unsigned int wraptext_context_get_fmt (WrapTextContext *self);
 void wraptext_context_zero_fmt (WrapTextContext *self);
@@ -52,12 +76,41 @@ void wraptext_context_set_flags (WrapTextContext *self, int flags);
 
 void wraptext_context_set_width (WrapTextContext *self, int width);
 
+/** Hyphenate words that do not fit at the end of a line, in greedy
+    mode. The hyphenator is not owned by the context. */
+void wraptext_context_set_hyphenator (WrapTextContext *self, 
+       struct _Hyphenator *hyphenator);
+
+/** Record the tokens and breaks in a document, rather than writing them
+    out. The width is irrelevant, since nothing is laid out yet. The 
+    document is not owned by the context. */
+void wraptext_context_set_document (WrapTextContext *self, 
+       struct _Document *document);
+
 void wraptext_context_set_app_data (WrapTextContext *self, void *app_data);
 
+/** Convert c to UTF-8, in a buffer of at least WT_UTF8_MAX_BYTES. */
+void wraptext_context_utf32_char_to_utf8 (const uint32_t c, WT_UTF8* utf8);
+
+/** The default output function: write the character to stdout, as UTF-8. */
+void wraptext_stdout_output_fn (void *app_data, WT_UTF32 c);
+
+void wraptext_context_get_state (WrapTextContext *self, WrapTextState *state);
+void wraptext_context_set_state (WrapTextContext *self, 
+       const WrapTextState *state);
+
 void wraptext_context_reset (WrapTextContext *self);
 
 void wraptext_eof (WrapTextContext *context);
 
+void wraptext_output_string (WrapTextContext *context, const char *s);
+
+void wraptext_flush (WrapTextContext *context);
+
+/** Lay out paragraphs [first, last) of a recorded document. */
+void wraptext_wrap_document (WrapTextContext *context, 
+       const struct _Document *doc, int first, int last);
+
 WT_UTF32 *wraptext_convert_utf8_to_utf32 (const WT_UTF8 *utf8);
 
 const int wraptext_utf32_length (const WT_UTF32 *s);
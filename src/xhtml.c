@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -21,6 +22,7 @@
 #include "wstring.h"
 #include "wrap.h"
 #include "xhtml.h"
+#include "boilerplate.h"
 
 /*============================================================================
   Format definition stuff 
@@ -39,6 +41,15 @@ typedef enum { FORMAT_NONE,
 enum { FMT_BOLD = 1 << 0,
        FMT_ITAL = 1 << 1 };
 
+// Where each character of a paragraph came from in the XHTML file,
+//  for the source map
+typedef struct _XhtmlSource
+  {
+  uint32_t *offsets;
+  int len;
+  int size;
+  } XhtmlSource;
+
 /*============================================================================
   xhtml_is_start_format_tag
 ============================================================================*/
@@ -169,25 +180,26 @@ BOOL xhtml_is_start_breaking_tag (const char *tag, Format *format)
 /*============================================================================
   xhtml_emit_format
 ============================================================================*/
-void xhtml_emit_format (const Epub2TxtOptions *options, Format format)
+void xhtml_emit_format (WrapTextContext *context, Format format)
   {
   IN
+  const Epub2TxtOptions *options = (Epub2TxtOptions *) wraptext_context_get_app_opts (context);
   
   if (options->ansi && !options->raw)
     {
     switch (format)
       {
       case FORMAT_BOLD_ON:
-	 printf ("\x1B[1m"); break;
+	 wraptext_output_string (context, "\x1B[1m"); break;
 
       case FORMAT_BOLD_OFF:
-	 printf ("\x1B[0m"); break;
+	 wraptext_output_string (context, "\x1B[0m"); break;
 
       case FORMAT_ITALIC_ON:
-	printf ("\x1B[3m"); break;
+	wraptext_output_string (context, "\x1B[3m"); break;
 
       case FORMAT_ITALIC_OFF:
-	 printf ("\x1B[0m"); break;
+	 wraptext_output_string (context, "\x1B[0m"); break;
 
       case FORMAT_NONE:
 	 break;
@@ -197,14 +209,14 @@ void xhtml_emit_format (const Epub2TxtOptions *options, Format format)
       case FORMAT_H3_ON:
       case FORMAT_H4_ON:
       case FORMAT_H5_ON:
-	 printf ("\x1B[1m"); break;
+	 wraptext_output_string (context, "\x1B[1m"); break;
 
       case FORMAT_H1_OFF:
       case FORMAT_H2_OFF:
       case FORMAT_H3_OFF:
       case FORMAT_H4_OFF:
       case FORMAT_H5_OFF:
-	 printf ("\x1B[0m"); break;
+	 wraptext_output_string (context, "\x1B[0m"); break;
 
       }
     }
@@ -224,7 +236,7 @@ void xhtml_emit_fmt_eol_pre (WrapTextContext *context)
   if (options->ansi && !options->raw && fmt)
     {
     /* reset ANSI escape-sequence at EOL. */
-    xhtml_emit_format (options, FORMAT_BOLD_OFF);
+    xhtml_emit_format (context, FORMAT_BOLD_OFF);
     }
   OUT
   }
@@ -243,15 +255,66 @@ void xhtml_emit_fmt_eol_post (WrapTextContext *context)
     {
     /* turn those set, back on at BOL. */
     if (fmt & FMT_BOLD)
-      xhtml_emit_format (options, FORMAT_BOLD_ON);
+      xhtml_emit_format (context, FORMAT_BOLD_ON);
     if (fmt & FMT_ITAL)
       {
-      xhtml_emit_format (options, FORMAT_ITALIC_ON);
+      xhtml_emit_format (context, FORMAT_ITALIC_ON);
       }
     }
   OUT
   }
 
+/*============================================================================
+  xhtml_emit_fmt_change
+  Upcall from the wrapper when it lays out whole paragraphs, and writes
+  the formatting along with the text, rather than as the tags are read
+============================================================================*/
+void xhtml_emit_fmt_change (WrapTextContext *context, unsigned int from,
+       unsigned int to)
+  {
+  IN
+  
+  const Epub2TxtOptions *options = (Epub2TxtOptions *) wraptext_context_get_app_opts (context);
+
+  if (options->ansi && !options->raw)
+    {
+    /* ANSI codes can only be turned off all together */
+    if (from & ~to)
+      xhtml_emit_format (context, FORMAT_BOLD_OFF);
+    else
+      to &= ~from;
+    if (to & FMT_BOLD)
+      xhtml_emit_format (context, FORMAT_BOLD_ON);
+    if (to & FMT_ITAL)
+      xhtml_emit_format (context, FORMAT_ITALIC_ON);
+    }
+  OUT
+  }
+
+/*============================================================================
+  xhtml_transform_token
+  Upcall from the wrapper when it lays out a recorded document. The 
+  document holds the text as it was in the EPUB, so it must be 
+  transformed here as it would have been when it was read. Returns
+  NULL if there is nothing to do.
+============================================================================*/
+WString *xhtml_transform_token (WrapTextContext *context, 
+       const uint32_t *s, int len)
+  {
+  const Epub2TxtOptions *options = (Epub2TxtOptions *) wraptext_context_get_app_opts (context);
+  if (!options->ascii) return NULL;
+
+  WString *ret = wstring_create_empty();
+  int i;
+  for (i = 0; i < len; i++)
+    {
+    WString *t = xhtml_transform_char (s[i], TRUE);
+    wstring_append (ret, t);
+    wstring_destroy (t);
+    }
+  return ret;
+  }
+
 /*============================================================================
   xhtml_set_format
 ============================================================================*/
@@ -307,6 +370,40 @@ void xhtml_set_format (const Epub2TxtOptions *options, Format format, WrapTextCo
 
 
 
+/*============================================================================
+  xhtml_change_format
+  Record a format change in the wrap context and, unless the wrapper is
+  holding text back to lay out a whole paragraph, emit the ANSI codes
+  for it. In optimal-fit mode the wrapper emits them itself, by 
+  upcall, when it writes the text; when recording a document, they
+  are emitted when the document is laid out.
+============================================================================*/
+static void xhtml_change_format (const Epub2TxtOptions *options, 
+       Format format, WrapTextContext *context)
+  {
+  if (!options->optimal && !options->document)
+    xhtml_emit_format (context, format);
+  xhtml_set_format (options, format, context);
+  }
+
+
+/*============================================================================
+  xhtml_emphasis
+  Start or end bold or italic text, as <b> or <i> does, for text that
+  is wrapped from elsewhere
+============================================================================*/
+void xhtml_emphasis (WrapTextContext *context, 
+       const Epub2TxtOptions *options, BOOL bold, BOOL on)
+  {
+  Format format;
+  if (bold)
+    format = on ? FORMAT_BOLD_ON : FORMAT_BOLD_OFF;
+  else
+    format = on ? FORMAT_ITALIC_ON : FORMAT_ITALIC_OFF;
+  xhtml_change_format (options, format, context);
+  }
+
+
 /*============================================================================
   xhtml_transform_char
 ============================================================================*/
@@ -588,25 +685,136 @@ WString *xhtml_translate_entity (const WString *entity)
   }
 
 
+/*============================================================================
+  xhtml_write
+  Write text to stdout, or to the output buffer, compressor, or batched
+  output, counting it for the source map and line index, if there are 
+  any
+============================================================================*/
+void xhtml_write (const Epub2TxtOptions *options, const char *s, size_t len)
+  {
+  if (options->output)
+    buffer_append (options->output, s, len);
+  else if (options->compressor)
+    compressor_write (options->compressor, s, len);
+  else if (options->io)
+    batchio_write (options->io, s, len);
+  else
+    fwrite (s, 1, len, stdout);
+  if (options->source_map) sourcemap_count (options->source_map, len);
+  if (options->line_index) lineindex_count (options->line_index, s, len);
+  }
+
+
+/*============================================================================
+  xhtml_write_separator
+============================================================================*/
+void xhtml_write_separator (const Epub2TxtOptions *options)
+  {
+  if (options->section_separator)
+    {
+    xhtml_write (options, options->section_separator, 
+      strlen (options->section_separator));
+    xhtml_write (options, "\n", 1);
+    }
+  }
+
+
+/*============================================================================
+  xhtml_output_fn
+  The wrapper's output function; the app data is the options
+============================================================================*/
+static void xhtml_output_fn (void *app_data, WT_UTF32 c)
+  {
+  WT_UTF8 buff [WT_UTF8_MAX_BYTES];
+  wraptext_context_utf32_char_to_utf8 (c, buff);
+  xhtml_write (app_data, buff, strlen (buff));
+  }
+
+
+/*============================================================================
+  xhtml_mark_fn
+  The wrapper's mark function; the app data is the options
+============================================================================*/
+static void xhtml_mark_fn (void *app_data, uint32_t mark)
+  {
+  sourcemap_mark (((const Epub2TxtOptions *)app_data)->source_map, mark);
+  }
+
+
+/*============================================================================
+  xhtml_utf8_length
+  The number of bytes that c takes up in UTF-8
+============================================================================*/
+static inline uint32_t xhtml_utf8_length (uint32_t c)
+  {
+  if (c < 0x80) return 1;
+  if (c < 0x800) return 2;
+  if (c < 0x10000) return 3;
+  return 4;
+  }
+
+
+/*============================================================================
+  xhtml_source_note
+  Note that the characters added to para since the last call came from 
+  offset in the file
+============================================================================*/
+static void xhtml_source_note (XhtmlSource *self, const WString *para, 
+       uint32_t offset)
+  {
+  if (!self) return;
+  int l = wstring_length (para);
+  if (l + 1 > self->size)
+    {
+    while (l + 1 > self->size) self->size = self->size ? self->size * 2 : 256;
+    self->offsets = realloc (self->offsets, self->size * sizeof (uint32_t));
+    }
+  while (self->len < l) self->offsets[self->len++] = offset;
+  }
+
+
 /*============================================================================
   xhtml_flush_line
 ============================================================================*/
 void xhtml_flush_line (const WString *para, const Epub2TxtOptions *options,
-     WrapTextContext *context) 
+     WrapTextContext *context, XhtmlSource *source) 
   {
   IN
 
-  if (options->raw)
+  if (options->para_sink)
     {
     char *s = wstring_to_utf8 (para);
-    fputs (s, stdout); 
+    parasink_text (options->para_sink, s, strlen (s));
+    free (s);
+    }
+  else if (options->raw)
+    {
+    char *s = wstring_to_utf8 (para);
+    if (source && wstring_length (para) > 0)
+      {
+      xhtml_source_note (source, para, 
+        source->len ? source->offsets[source->len - 1] : 0);
+      sourcemap_mark (options->source_map, source->offsets[0]);
+      }
+    xhtml_write (options, s, strlen (s));
     free (s);
     }
   else
     {
-    wraptext_wrap_utf32 (context, wstring_wstr (para));
+    if (source)
+      {
+      // Anything not accounted for came from where the last text did
+      xhtml_source_note (source, para, 
+        source->len ? source->offsets[source->len - 1] : 0);
+      wraptext_wrap_utf32_marked (context, wstring_wstr (para), 
+        source->offsets);
+      }
+    else
+      wraptext_wrap_utf32 (context, wstring_wstr (para));
     wraptext_eof (context);
     }
+  if (source) source->len = 0;
 
   OUT
   }
@@ -616,11 +824,11 @@ void xhtml_flush_line (const WString *para, const Epub2TxtOptions *options,
   xhtml_flush_para
 ============================================================================*/
 void xhtml_flush_para (const WString *para, const Epub2TxtOptions *options,
-     WrapTextContext *context) 
+     WrapTextContext *context, XhtmlSource *source) 
   {
   IN
 
-  xhtml_flush_line (para, options, context);
+  xhtml_flush_line (para, options, context, source);
 
   OUT
   }
@@ -634,8 +842,20 @@ void xhtml_line_break (WrapTextContext *context)
   IN
   //static uint32_t s[2] = { '\n', 0 };
   static uint32_t s[2] = { WT_HARD_LINE_BREAK, 0 };
+  const Epub2TxtOptions *options = wraptext_context_get_app_opts (context);
+  if (options->para_sink)
+    {
+    parasink_line_break (options->para_sink);
+    OUT
+    return;
+    }
   wraptext_wrap_utf32 (context, s);
-  wraptext_eof (context);
+  // Raw text does not go through the wrapper, so nothing can be held
+  //  back here for it to follow: it would come out after the text
+  if (options->raw)
+    wraptext_flush (context);
+  else
+    wraptext_eof (context);
   OUT
   }
 
@@ -648,14 +868,20 @@ void xhtml_para_break (WrapTextContext *context,
   {
   IN
   static uint32_t s[3] = { '\n', '\n', 0 };
-  if (options->raw)
+  if (options->para_sink)
+    {
+    parasink_end_para (options->para_sink);
+    }
+  else if (options->raw)
     {
-    printf ("\n\n");
+    xhtml_write (options, "\n\n", 2);
     }
   else
     { 
     wraptext_wrap_utf32 (context, s);
     }
+  if (options->source_map)
+    sourcemap_begin_para (options->source_map);
   OUT
   }
 
@@ -713,6 +939,32 @@ void xhtml_file_to_stdout (const char *filename, const Epub2TxtOptions *options,
   OUT
   }
 
+/*============================================================================
+  xhtml_record_raw
+  Add the text of s, exactly as --raw would write it, to the document
+  being recorded
+============================================================================*/
+static void xhtml_record_raw (const WString *s, 
+       const Epub2TxtOptions *options)
+  {
+  IN
+  Epub2TxtOptions raw_options = *options;
+  Buffer *buffer = buffer_create ();
+  char *error = NULL;
+  raw_options.document = NULL;
+  raw_options.source_map = NULL;
+  raw_options.line_index = NULL;
+  raw_options.para_sink = NULL;
+  raw_options.output = buffer;
+  raw_options.raw = TRUE;
+  raw_options.ascii = FALSE;
+  xhtml_to_stdout (s, &raw_options, &error);
+  if (error) free (error);
+  document_add_raw (options->document, buffer->data, buffer->len);
+  buffer_destroy (buffer);
+  OUT
+  }
+
 /*============================================================================
   xhtml_to_stdout
 ============================================================================*/
@@ -724,6 +976,19 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 
   typedef enum {MODE_ANY=0, MODE_INTAG = 1, MODE_ENTITY = 2} Mode;
 
+  // A recorded document holds all the formatting, and the text as it
+  //  is; what is shown is decided when the document is laid out
+  Epub2TxtOptions record_options;
+  if (options->document)
+    {
+    if (options->document->keep_raw) xhtml_record_raw (s, options);
+    record_options = *options;
+    record_options.raw = FALSE;
+    record_options.ansi = TRUE;
+    record_options.ascii = FALSE;
+    options = &record_options;
+    }
+
   if (TRUE)
      {
      int width;
@@ -735,10 +1000,33 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
      WrapTextContext *context = wraptext_context_new();
      wraptext_context_set_width (context, width);
      wraptext_context_set_app_opts (context, (void *)options);
+     if (options->optimal)
+       wraptext_context_set_flags (context, WT_FLAG_OPTIMAL 
+         | (options->justify ? WT_FLAG_JUSTIFY : 0));
+     wraptext_context_set_hyphenator (context, options->hyphenator);
+     wraptext_context_set_document (context, options->document);
+
+     // For a source map, note where each character of para came from,
+     //  as a byte offset in the UTF-8 text, and count what is written 
+     XhtmlSource source_buff, *source = NULL;
+     uint32_t offset = 0, entity_offset = 0;
+     int offset_pos = 0;
+     wraptext_context_set_output_fn (context, xhtml_output_fn);
+     wraptext_context_set_app_data (context, (void *)options);
+     if (options->source_map && !options->document)
+       {
+       memset (&source_buff, 0, sizeof (source_buff));
+       source = &source_buff;
+       wraptext_context_set_mark_fn (context, xhtml_mark_fn);
+       }
 
      Mode mode = MODE_ANY;
      BOOL inbody = FALSE;
      BOOL can_newline = FALSE;
+     // Text of the paragraph was written before a change of format, so
+     //  its end is a paragraph break even if nothing follows. Raw text
+     //  has always run on, and still does
+     BOOL flushed = FALSE;
      WString *tag = wstring_create_empty();
      WString *entity = wstring_create_empty();
      WString *para = wstring_create_empty();
@@ -752,6 +1040,10 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
      for (i = 0; i < l; i++)
        {
        uint32_t c = text[i];  
+       if (source)
+         {
+         while (offset_pos < i) offset += xhtml_utf8_length (text[offset_pos++]);
+         }
        if (c == 13) // DOS EOL
          continue;
 
@@ -771,11 +1063,13 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    if (last_c != ' ')
 	      {
 	      wstring_append_c (para, ' ');
+	      xhtml_source_note (source, para, offset);
 	      }
 	    }
 	  }
 	else if (mode == MODE_ANY && c == '&')
 	  {
+	  entity_offset = offset;
 	  mode = MODE_ENTITY;
 	  }
 	else if (mode == MODE_ANY)
@@ -790,6 +1084,7 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	      WString *s = xhtml_transform_char (c, options->ascii);
 	      wstring_append (inruby ? ruby : para, s);
 	      wstring_destroy (s);
+	      if (!inruby) xhtml_source_note (source, para, offset);
 	      }
 	    }
 	  }
@@ -800,6 +1095,7 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    WString *trans = xhtml_translate_entity (entity);
 	    wstring_append (inruby ? ruby : para, trans);
 	    wstring_destroy (trans);
+	    if (!inruby) xhtml_source_note (source, para, entity_offset);
 	    }
 	  wstring_clear (entity);
 	  mode = MODE_ANY;
@@ -821,11 +1117,12 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    }
 	  else if (strcasecmp (ss_tag, "/body") == 0) 
 	    {
-	    if (xhtml_all_white (para))
+	    if (xhtml_all_white (para) && !flushed)
 	      can_newline = FALSE; 
 	    else
 	      can_newline = TRUE; 
-	    xhtml_flush_para (para, options, context); 
+	    flushed = FALSE;
+	    xhtml_flush_para (para, options, context, source); 
 	    wstring_clear (para);
 	    if (can_newline)
 	      {
@@ -839,19 +1136,25 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    {
 	    if (inbody)
 	      {
-	      if (xhtml_all_white (para))
+	      if (xhtml_all_white (para) && !flushed)
 		can_newline = FALSE; 
 	      else
 		{
 		can_newline = TRUE; 
 		}
-	      xhtml_flush_para (para, options, context);
+	      flushed = FALSE;
+	      xhtml_flush_para (para, options, context, source);
 	      wstring_clear (para);
 	      if (can_newline)
 		{
 		xhtml_para_break (context, options);
 		can_newline = FALSE;
 		}
+              // Text before the end of emphasis has already been flushed,
+              //  so the sink must be told that the paragraph has ended
+              //  even if para is empty; it ignores an empty paragraph
+              else if (options->para_sink)
+                parasink_end_para (options->para_sink);
 	      }
 	    }
 	  else if ((strcasecmp (ss_tag, "br/") == 0) 
@@ -860,11 +1163,12 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    {
 	    if (inbody)
 	      {
-	      if (xhtml_all_white (para))
+	      if (xhtml_all_white (para) && !flushed)
 		can_newline = FALSE; 
 	      else
 		can_newline = TRUE; 
-	      xhtml_flush_para (para, options, context);
+	      flushed = FALSE;
+	      xhtml_flush_para (para, options, context, source);
 	      wstring_clear (para);
 	      if (can_newline)
 		{
@@ -877,37 +1181,57 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	    {
 	    if (inbody)
 	      {
-	      xhtml_flush_line (para, options, context); 
+	      if (!xhtml_all_white (para) && !options->raw) flushed = TRUE;
+	      xhtml_flush_line (para, options, context, source); 
 	      wstring_clear (para);
-              xhtml_emit_format (options, format);
-              xhtml_set_format (options, format, context);
+              if (options->para_sink)
+                parasink_emphasis (options->para_sink, 
+                  format == FORMAT_BOLD_ON ? PARASINK_STRONG : PARASINK_EM,
+                  TRUE);
+              xhtml_change_format (options, format, context);
 	      }
 	    }
 	  else if (xhtml_is_end_format_tag (ss_tag, &format))
 	    {
 	    if (inbody)
 	      {
-	      xhtml_flush_line (para, options, context); 
-              xhtml_emit_format (options, format);
-	      xhtml_set_format (options, format, context);
+	      if (!xhtml_all_white (para) && !options->raw) flushed = TRUE;
+	      xhtml_flush_line (para, options, context, source); 
+              if (options->para_sink)
+                parasink_emphasis (options->para_sink, 
+                  format == FORMAT_BOLD_OFF ? PARASINK_STRONG : PARASINK_EM,
+                  FALSE);
+              xhtml_change_format (options, format, context);
 	      wstring_clear (para);
 	      }
             }
 	  else if (xhtml_is_end_breaking_tag (ss_tag, &format))
 	    {
-            xhtml_flush_line (para, options, context);
-            xhtml_emit_format (options, format);
-            xhtml_set_format (options, format, context);
+            xhtml_flush_line (para, options, context, source);
+            xhtml_change_format (options, format, context);
 	    wstring_clear (para);
+	    flushed = FALSE;
 	    xhtml_para_break (context, options);
+            if (options->para_sink && strcasecmp (ss_tag, "/blockquote") == 0)
+              parasink_end_quote (options->para_sink);
             }
 
 	  else if (xhtml_is_start_breaking_tag (ss_tag, &format))
 	    {
-            xhtml_flush_line (para, options, context);
+            xhtml_flush_line (para, options, context, source);
 	    wstring_clear (para);
-            xhtml_emit_format (options, format);
-            xhtml_set_format (options, format, context);
+            // A new block is a new paragraph, whether or not the last 
+            //  one was closed
+            if (options->para_sink)
+              {
+              if (tolower (ss_tag[0]) == 'h')
+                parasink_begin_heading (options->para_sink, ss_tag[1] - '0');
+              else if (strcasecmp (ss_tag, "blockquote") == 0)
+                parasink_begin_quote (options->para_sink);
+              else
+                parasink_end_para (options->para_sink);
+              }
+            xhtml_change_format (options, format, context);
             }
 
     else if (strcasecmp(ss_tag, "ruby") == 0)
@@ -920,6 +1244,7 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
       wstring_append_c (para, '(');
       wstring_append (para, ruby);
       wstring_append_c (para, ')');
+      xhtml_source_note (source, para, offset);
       wstring_clear (ruby);
       }
     else if (strcasecmp(ss_tag, "rt") == 0)
@@ -961,22 +1286,145 @@ void xhtml_to_stdout (const WString *s, const Epub2TxtOptions *options,
 	last_c = c;
         }
      if (wstring_length (para) > 0)
-      xhtml_flush_para (para, options, context); 
+      xhtml_flush_para (para, options, context, source); 
+     if (options->para_sink)
+       parasink_end_para (options->para_sink);
+     if (source && source->offsets) free (source->offsets);
 
      wstring_destroy (tag);
      wstring_destroy (entity);
      wstring_destroy (para);
      wstring_destroy (ruby);
 
-     wraptext_eof (context);
+     wraptext_flush (context);
      wraptext_context_free (context);
      }
   OUT
   }
 
 
+/*============================================================================
+  xhtml_section_shown
+  A document holds everything that can be shown; the options decide 
+  what is
+============================================================================*/
+BOOL xhtml_section_shown (const DocumentSection *section, 
+       const Epub2TxtOptions *options)
+  {
+  if (section->kind == DOC_SECTION_SPINE) return !options->notext;
+  if (section->kind == DOC_SECTION_META) return options->meta;
+  if (section->kind == DOC_SECTION_CALIBRE) 
+    return options->meta && options->calibre;
+  return FALSE;
+  }
 
+/*============================================================================
+  xhtml_document_context_new
+  Create a wrap context to lay out a section of a recorded document
+============================================================================*/
+WrapTextContext *xhtml_document_context_new (const Epub2TxtOptions *options)
+  {
+  int width;
+  if (options->width <= 0 || options->raw)
+    width = INT_MAX;
+  else
+    width = options->width - 1;
+
+  WrapTextContext *context = wraptext_context_new();
+  wraptext_context_set_width (context, width);
+  wraptext_context_set_app_opts (context, (void *)options);
+  if (options->optimal)
+    wraptext_context_set_flags (context, WT_FLAG_OPTIMAL 
+      | (options->justify ? WT_FLAG_JUSTIFY : 0));
+  wraptext_context_set_hyphenator (context, options->hyphenator);
+  wraptext_context_set_output_fn (context, xhtml_output_fn);
+  wraptext_context_set_app_data (context, (void *)options);
+  return context;
+  }
 
+/*============================================================================
+  xhtml_write_raw
+  Write raw text kept in a document, reduced to ASCII if the options say
+  so, as it would have been when it was read
+============================================================================*/
+static void xhtml_write_raw (const Epub2TxtOptions *options, 
+       const char *s, size_t len)
+  {
+  if (!options->ascii)
+    {
+    xhtml_write (options, s, len);
+    return;
+    }
+  char *text = strndup (s, len);
+  WString *in = wstring_create_from_utf8 (text);
+  WString *out = wstring_create_empty ();
+  const uint32_t *w = wstring_wstr (in);
+  int i, l = wstring_length (in);
+  for (i = 0; i < l; i++)
+    {
+    WString *t = xhtml_transform_char (w[i], TRUE);
+    wstring_append (out, t);
+    wstring_destroy (t);
+    }
+  char *ascii = wstring_to_utf8 (out);
+  xhtml_write (options, ascii, strlen (ascii));
+  free (ascii);
+  wstring_destroy (out);
+  wstring_destroy (in);
+  free (text);
+  }
 
+/*============================================================================
+  xhtml_document_to_stdout
+  Lay out a document recorded earlier, section by section, as 
+  xhtml_to_stdout would have done when it was read, leaving out any
+  boilerplate, if the options say so. 
+============================================================================*/
+void xhtml_document_to_stdout (const Document *doc, 
+       const Epub2TxtOptions *options)
+  {
+  IN
+  int i, spine_index = 0;
+  BOOL *boilerplate = options->boilerplate > 0 
+    ? boilerplate_find (doc, options->boilerplate) : NULL;
+  for (i = 0; i < (int)doc->nsections; i++)
+    {
+    const DocumentSection *section = &doc->sections[i];
+    if (!xhtml_section_shown (section, options)) continue;
+    if (section->kind == DOC_SECTION_SPINE)
+      {
+      if (options->line_index)
+        lineindex_begin_section (options->line_index, spine_index);
+      spine_index++;
+      xhtml_write_separator (options);
+      }
 
+    if (options->raw && !boilerplate && doc->keep_raw)
+      {
+      // Raw text was kept as it was written, and is written as it is
+      xhtml_write_raw (options, doc->raw + section->raw, 
+        section[1].raw - section->raw);
+      continue;
+      }
 
+    WrapTextContext *context = xhtml_document_context_new (options);
+    if (boilerplate)
+      {
+      // Lay out each run of paragraphs between the boilerplate
+      uint32_t p = section->para, end = section[1].para;
+      while (p < end)
+        {
+        uint32_t first = p;
+        while (p < end && !boilerplate[p]) p++;
+        if (p > first) wraptext_wrap_document (context, doc, first, p);
+        while (p < end && boilerplate[p]) p++;
+        }
+      }
+    else
+      wraptext_wrap_document (context, doc, section->para, section[1].para);
+    wraptext_flush (context);
+    wraptext_context_free (context);
+    }
+  if (boilerplate) free (boilerplate);
+  OUT
+  }
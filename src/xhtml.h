@@ -17,7 +17,23 @@ void     xhtml_utf8_to_stdout (const char *s, const Epub2TxtOptions *options,
              char **error);
 void     xhtml_file_to_stdout (const char *file, 
              const Epub2TxtOptions *options, char **error);
+void     xhtml_document_to_stdout (const Document *doc, 
+             const Epub2TxtOptions *options);
+BOOL     xhtml_section_shown (const DocumentSection *section, 
+             const Epub2TxtOptions *options);
+struct _WrapTextContext *xhtml_document_context_new 
+             (const Epub2TxtOptions *options);
+void     xhtml_write (const Epub2TxtOptions *options, const char *s, 
+             size_t len);
+void     xhtml_write_separator (const Epub2TxtOptions *options);
 WString *xhtml_translate_entity (const WString *entity);
+WString *xhtml_transform_char (uint32_t c, BOOL to_ascii);
 void     xhtml_emit_fmt_eol_pre (struct _WrapTextContext *context);
 void     xhtml_emit_fmt_eol_post (struct _WrapTextContext *context);
+void     xhtml_emit_fmt_change (struct _WrapTextContext *context, 
+             unsigned int from, unsigned int to);
+WString *xhtml_transform_token (struct _WrapTextContext *context, 
+             const uint32_t *s, int len);
+void     xhtml_emphasis (struct _WrapTextContext *context, 
+             const Epub2TxtOptions *options, BOOL bold, BOOL on);
 
@@ -0,0 +1,774 @@
+#!/bin/sh
+#============================================================================
+#  epub2txt v2
+#  tests/run.sh
+#  Copyright (c)2020-2024 Kevin Boone, GPL v3.0
+#
+#  Regression tests, run by "make check". Each test builds a small EPUB
+#  from XHTML given inline, runs epub2txt on it, and compares the output
+#  with what is expected. Needs zip.
+#============================================================================
+
+BIN=${BIN:-./epub2txt}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+passed=0
+
+# make_epub file.epub chapter.xhtml... -- each chapter is a file of XHTML;
+#  the tests stop if one is missing
+make_epub ()
+  {
+  out=$1; shift
+  dir=$TMP/epub.$$
+  rm -rf "$dir"
+  mkdir -p "$dir/META-INF" "$dir/OEBPS"
+  printf 'application/epub+zip' > "$dir/mimetype"
+  cat > "$dir/META-INF/container.xml" <<END
+<?xml version="1.0"?>
+<container version="1.0" xmlns="urn:oasis:names:tc:opendocument:xmlns:container"><rootfiles><rootfile full-path="OEBPS/content.opf" media-type="application/oebps-package+xml"/></rootfiles></container>
+END
+  manifest=""
+  spine=""
+  n=0
+  for chapter in "$@"; do
+    n=$((n + 1))
+    cp "$chapter" "$dir/OEBPS/c$n.xhtml" || exit 1
+    manifest="$manifest<item id=\"c$n\" href=\"c$n.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    spine="$spine<itemref idref=\"c$n\"/>"
+  done
+  cat > "$dir/OEBPS/content.opf" <<END
+<?xml version="1.0"?>
+<package xmlns="http://www.idpf.org/2007/opf" version="2.0"><metadata xmlns:dc="http://purl.org/dc/elements/1.1/"><dc:title>Test</dc:title></metadata><manifest>$manifest</manifest><spine>$spine</spine></package>
+END
+  rm -f "$out"
+  (cd "$dir" && zip -qX0 "$out" mimetype && zip -qXr9 "$out" META-INF OEBPS)
+  rm -rf "$dir"
+  }
+
+# chapter name -- write stdin to a chapter file, wrapped in a body
+chapter ()
+  {
+  { printf '<html><body>'; cat; printf '</body></html>\n'; } > "$TMP/$1"
+  }
+
+# check name expected actual
+check ()
+  {
+  if [ "$2" = "$3" ]; then
+    passed=$((passed + 1))
+  else
+    failed=$((failed + 1))
+    echo "FAIL: $1"
+    echo "  expected: $2"
+    echo "  got:      $3"
+  fi
+  }
+
+
+#----------------------------------------------------------------------------
+# Line breaking (UAX #14): between ideographs, after a hyphen, and never
+#  at a no-break space. Pictographs are two columns wide
+#----------------------------------------------------------------------------
+chapter linebreak.xhtml <<END
+<p>あいうえおかきくけこさしす</p><p>well-known fact</p><p>abc 100&#160;km</p>
+<p>🚀🚀🚀🚀🚀🚀 🪐🪐🪐🪐</p>
+END
+make_epub "$TMP/linebreak.epub" "$TMP/linebreak.xhtml"
+for wrap in greedy optimal; do
+  check "line breaking, $wrap" \
+    "あいうえ|おかきく|けこさし|す|well-|known|fact|abc|$(printf '100\302\240km')|🚀🚀🚀🚀|🚀🚀 🪐🪐|🪐🪐" \
+    "$($BIN -n -w 12 --wrap=$wrap "$TMP/linebreak.epub" | sed 's/ *$//' \
+       | grep . | paste -sd '|')"
+done
+# A skin-tone modifier stays with its emoji, even where the line would
+#  otherwise end between them
+echo '<p>👋🏽👋🏽👋🏽</p>' | chapter emoji.xhtml
+make_epub "$TMP/emoji.epub" "$TMP/emoji.xhtml"
+for wrap in greedy optimal; do
+  check "line breaking, emoji modifiers, $wrap" "👋🏽|👋🏽|👋🏽" \
+    "$($BIN -n -w 9 --wrap=$wrap "$TMP/emoji.epub" | sed 's/ *$//' \
+       | grep . | paste -sd '|')"
+done
+
+#----------------------------------------------------------------------------
+# --page: the pages, one after another, are the whole text, with or without
+#  a --page-index, which is made again when the height changes
+#----------------------------------------------------------------------------
+seq 1 12 | sed 's|.*|<p>line&</p>|' | chapter pages.xhtml
+make_epub "$TMP/pages.epub" "$TMP/pages.xhtml"
+pages ()
+  {
+  for page in 1 2 3 4 5; do
+    $BIN -n --height=5 --page=$page "$@" "$TMP/pages.epub"
+  done | od -c
+  }
+check "pages, count" 5 "$($BIN -n --height=5 --page=0 "$TMP/pages.epub")"
+check "pages, page 2" "|line4||line5|" \
+  "$($BIN -n --height=5 --page=2 "$TMP/pages.epub" | sed 's/ *$//' \
+     | paste -sd '|')"
+check "pages, all" "$($BIN -n "$TMP/pages.epub" | od -c)" "$(pages)"
+check "pages, past the end" 255 \
+  "$($BIN -n --height=5 --page=6 "$TMP/pages.epub" 2> /dev/null; echo $?)"
+$BIN -n --height=5 --page-index="$TMP/pages.idx" "$TMP/pages.epub" > /dev/null
+check "pages, with an index" "$($BIN -n "$TMP/pages.epub" | od -c)" \
+  "$(pages --page-index="$TMP/pages.idx")"
+check "pages, index for another height" 6 \
+  "$($BIN -n --height=4 --page-index="$TMP/pages.idx" --page=0 \
+     "$TMP/pages.epub")"
+# An index is made again for other hyphenation patterns, or for other
+#  words of the same lengths, which hyphenate differently
+printf '\\patterns{a1ľ x y}\n\\hyphenation{xa-yyyyy}\n' > "$TMP/hyph1.tex"
+printf '\\patterns{a1ľ x y}\n\\hyphenation{xayyyyy}\n' > "$TMP/hyph2.tex"
+seq 1 6 | sed 's|.*|<p>a xayyyyy a xayyyyy</p>|' | chapter hpages.xhtml
+make_epub "$TMP/hpages.epub" "$TMP/hpages.xhtml"
+hpages ()
+  {
+  $BIN -n -w 10 --wrap=greedy --height=5 --page-index="$TMP/hpages.idx" \
+    --page=0 "$@"
+  }
+hpages --hyphenate="$TMP/hyph1.tex" "$TMP/hpages.epub" > /dev/null
+check "pages, index for other patterns" 6 \
+  "$(hpages --hyphenate="$TMP/hyph2.tex" "$TMP/hpages.epub")"
+hpages --hyphenate="$TMP/hyph1.tex" "$TMP/hpages.epub" > /dev/null
+seq 1 6 | sed 's|.*|<p>a xbyyyyy a xbyyyyy</p>|' | chapter hpages2.xhtml
+make_epub "$TMP/hpages.epub" "$TMP/hpages2.xhtml"
+check "pages, index for other words" 6 \
+  "$(hpages --hyphenate="$TMP/hyph1.tex" "$TMP/hpages.epub")"
+
+#----------------------------------------------------------------------------
+# --pager: not used when the output is not a terminal, or with --page; on a
+#  terminal, the page count comes from the layout thread, and is the same
+#  as --page=0 gives at the height of the screen
+#----------------------------------------------------------------------------
+check "pager, not a terminal" "$($BIN -n "$TMP/pages.epub" | od -c)" \
+  "$($BIN -n -p "$TMP/pages.epub" | od -c)"
+check "pager, with --page" \
+  "$($BIN -n --height=5 --page=2 "$TMP/pages.epub" | od -c)" \
+  "$($BIN -n -p --height=5 --page=2 "$TMP/pages.epub" | od -c)"
+if script -qec true /dev/null > /dev/null 2>&1; then
+  # 'G' goes to the end, which waits for the layout thread, then 'q'
+  screen=$( (sleep 1; printf G; sleep 1; printf q) \
+    | script -qec "stty rows 6 cols 80; $BIN -n -p '$TMP/pages.epub'" \
+      /dev/null | tr '\033' '\n')
+  check "pager, last screen" "line12" \
+    "$(echo "$screen" | grep -o 'line1[0-9]' | tail -1)"
+  check "pager, page count" \
+    "$($BIN -n --height=5 --page=0 "$TMP/pages.epub")" \
+    "$(echo "$screen" | sed -n 's|.* page [0-9]*/\([0-9]*\) .*|\1|p' \
+       | tail -1)"
+else
+  echo "SKIP: pager, terminal"
+fi
+
+#----------------------------------------------------------------------------
+# --source-map: each word of the text maps back to the same word in its
+#  spine item
+#----------------------------------------------------------------------------
+chapter map1.xhtml <<END
+<p>alpha beta</p><p>gamma <i>delta</i></p>
+END
+chapter map2.xhtml <<END
+<p>second chapter</p>
+END
+make_epub "$TMP/map.epub" "$TMP/map1.xhtml" "$TMP/map2.xhtml"
+$BIN -n --source-map="$TMP/map" --source-map-interval=1 "$TMP/map.epub" \
+  > "$TMP/map.txt"
+words=""
+for word in alpha beta gamma delta second chapter; do
+  offset=$(grep -bo $word "$TMP/map.txt" | cut -d : -f 1)
+  found=$($BIN --source-map="$TMP/map" --find-source=$offset)
+  href=$(echo "$found" | cut -f 1)
+  at=$(echo "$found" | cut -f 2)
+  words="$words $href:$(tail -c +$((offset + 1)) "$TMP/map.txt" | head -c 4)"
+  words="$words=$(tail -c +$((at + 1)) "$TMP/map${href#c}" | head -c 4)"
+done
+check "source map" " c1.xhtml:alph=alph c1.xhtml:beta=beta \
+c1.xhtml:gamm=gamm c1.xhtml:delt=delt c2.xhtml:seco=seco c2.xhtml:chap=chap" \
+  "$words"
+check "source map, can't write" 255 \
+  "$($BIN -n --source-map="$TMP/none/map" "$TMP/map.epub" > /dev/null \
+     2> /dev/null; echo $?)"
+
+#----------------------------------------------------------------------------
+# --line-index: line k * interval starts where the index says, and the
+#  marks for spine items and books point at their separators and names
+#----------------------------------------------------------------------------
+seq 1 6 | sed 's|.*|<p>first &</p>|' | chapter lines1.xhtml
+seq 1 3 | sed 's|.*|<p>second &</p>|' | chapter lines2.xhtml
+make_epub "$TMP/lines.epub" "$TMP/lines1.xhtml" "$TMP/lines2.xhtml"
+$BIN -n -s '@@@' --line-index="$TMP/lines.idx" --line-index-interval=4 \
+  "$TMP/lines.epub" "$TMP/pages.epub" > "$TMP/lines.txt"
+# u64 offset -- a number in the index
+u64 ()
+  {
+  od -An -t u8 -j "$1" -N 8 "$TMP/lines.idx" | tr -d ' '
+  }
+# marks offset count -- each mark's byte offset, line and number
+marks ()
+  {
+  i=0
+  while [ $i -lt "$2" ]; do
+    at=$(($1 + 24 * i))
+    number=$(od -An -t u4 -j $((at + 20)) -N 4 "$TMP/lines.idx" | tr -d ' ')
+    echo "$(u64 $at) $(u64 $((at + 8))) $number"
+    i=$((i + 1))
+  done
+  }
+# what offset line -- the line of the text that starts at a byte offset,
+#  if it is also the line with that number
+line_at ()
+  {
+  by_offset=$(tail -c +$(($1 + 1)) "$TMP/lines.txt" | head -1)
+  by_line=$(sed -n "$(($2 + 1))p" "$TMP/lines.txt")
+  [ "$by_offset" = "$by_line" ] && echo "$by_offset" || echo "($1 $2)"
+  }
+check "line index, size" \
+  "$(wc -c < "$TMP/lines.txt" | tr -d ' ') $(wc -l < "$TMP/lines.txt" | tr -d ' ')" \
+  "$(u64 16) $(u64 24)"
+check "line index, lines" \
+  "$(LC_ALL=C awk '{ if (NR % 4 == 1) print o + 0; o += length ($0) + 1 }
+     END { if (NR % 4 == 0) print o }' "$TMP/lines.txt" | paste -sd ' ')" \
+  "$(od -An -t u8 -j $(u64 32) -N $(($(u64 40) * 8)) "$TMP/lines.idx" \
+     | tr -s ' \n' '\n\n' | grep . | paste -sd ' ')"
+check "line index, sections" "@@@ 0|@@@ 1|@@@ 0" \
+  "$(marks $(u64 48) $(u64 56) | while read offset line number; do
+       echo "$(line_at $offset $line) $number"; done | paste -sd '|')"
+check "line index, books" "@@@ $TMP/lines.epub|@@@ $TMP/pages.epub" \
+  "$(marks $(u64 64) $(u64 72) | while read offset line number; do
+       echo "$(line_at $offset $line) $(tail -c +$(($(u64 80) + number + 1)) \
+         "$TMP/lines.idx" | tr '\0' '\n' | head -1)"; done | paste -sd '|')"
+check "line index, can't write" 255 \
+  "$($BIN -n --line-index="$TMP/none/lines.idx" "$TMP/lines.epub" \
+     > /dev/null 2> /dev/null; echo $?)"
+
+#----------------------------------------------------------------------------
+# --compress: more than one block, decompressed, is the same as the text;
+#  each method is skipped if epub2txt, or the tool, was built without it
+#----------------------------------------------------------------------------
+seq 1 40000 | sed 's|.*|<p>Paragraph & of the book</p>|' | chapter long.xhtml
+make_epub "$TMP/long.epub" "$TMP/long.xhtml"
+for method in gzip zstd; do
+  if ! $BIN --compress=$method "$TMP/long.epub" > /dev/null 2>&1 \
+       || ! $method --version > /dev/null 2>&1; then
+    echo "SKIP: compression, $method"
+    continue
+  fi
+  check "compression, $method" "$($BIN -n "$TMP/long.epub" | cksum)" \
+    "$($BIN -n --compress=$method:1 "$TMP/long.epub" | $method -dc | cksum)"
+  $BIN --compress=$method --out=jsonl:"$TMP/long.jsonl.$method" \
+    "$TMP/long.epub" > /dev/null
+  check "compression, $method, --out" \
+    "$($BIN --format=jsonl "$TMP/long.epub" | cksum)" \
+    "$($method -dc < "$TMP/long.jsonl.$method" | cksum)"
+  check "compression, $method, can't write" 255 \
+    "$($BIN --compress=$method "$TMP/long.epub" > /dev/full 2> /dev/null
+       echo $?)"
+done
+
+#----------------------------------------------------------------------------
+# --stats-only: abbreviations, numbers and apostrophes are inside words,
+#  ideographs are words by themselves, and a spine item with no text is
+#  not a chapter
+#----------------------------------------------------------------------------
+chapter stats1.xhtml <<END
+<h1>Chapter One</h1><p>He left the U.S.A. It wasn&#8217;t 3,000 miles away!</p>
+<p>こんにちは。世界です。</p>
+END
+chapter stats2.xhtml <<END
+<p> </p>
+END
+chapter stats3.xhtml <<END
+<h2>Part Two</h2><p>Is it? Yes, it's.</p>
+END
+make_epub "$TMP/stats.epub" "$TMP/stats1.xhtml" "$TMP/stats2.xhtml" \
+  "$TMP/stats3.xhtml"
+check "stats" "{\"book\": \"$TMP/stats.epub\", \"chapters\": 2, \
+\"paragraphs\": 3, \"headings\": 2, \"sentences\": 6, \"words\": 26, \
+\"characters\": 93, \"reading_minutes\": 0.1}" \
+  "$($BIN --stats-only "$TMP/stats.epub")"
+
+#----------------------------------------------------------------------------
+# --grep: a literal pattern, with and without case and accents, the
+#  context around each match, and the exit status
+#----------------------------------------------------------------------------
+chapter grep1.xhtml <<END
+<h1>Chapter One</h1><p>The café was closed.<br/>It was late</p>
+END
+chapter grep2.xhtml <<END
+<p>Another CAFE, and another cafe</p>
+END
+make_epub "$TMP/grep.epub" "$TMP/grep1.xhtml" "$TMP/grep2.xhtml"
+grep_out ()
+  {
+  $BIN -n "$@" "$TMP/grep.epub"; echo "status $?"
+  }
+check "grep" "c2.xhtml Another CAFE, and another cafe|status 0" \
+  "$(grep_out --grep=cafe | cut -f 2- | tr '\t' ' ' | paste -sd '|')"
+check "grep, ignoring case and accents" \
+  "c1.xhtml The café was...|c2.xhtml ...her CAFE, an...|c2.xhtml ...her cafe|status 0" \
+  "$(grep_out -i --ignore-diacritics --grep=cafe --grep-context=4 \
+     | cut -f 2- | tr '\t' ' ' | paste -sd '|')"
+check "grep, line breaks" "c1.xhtml The café was closed. It was late" \
+  "$(grep_out --grep=café --grep-context=100 | cut -f 2- | tr '\t' ' ' \
+     | head -1)"
+check "grep, no match" "status 1" "$(grep_out --grep=cafés)"
+check "grep, files with matches" "$TMP/grep.epub|status 0" \
+  "$(grep_out -i --grep=cafe --files-with-matches | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --bloom-file: a book that can't match is passed over without being read,
+#  unless it has changed since its filter was built. The book is replaced
+#  by zeros of the same size and time, which can't be read
+#----------------------------------------------------------------------------
+chapter bloom.xhtml <<END
+<p>The quick brown fox</p>
+END
+make_epub "$TMP/bloom.epub" "$TMP/bloom.xhtml"
+$BIN --bloom-file="$TMP/bloom" "$TMP/bloom.epub" "$TMP/grep.epub"
+check "bloom filter, match" "$TMP/bloom.epub|$TMP/grep.epub" \
+  "$($BIN --bloom-file="$TMP/bloom" -i --grep=the --files-with-matches \
+     "$TMP/bloom.epub" "$TMP/grep.epub" | paste -sd '|')"
+cp -p "$TMP/bloom.epub" "$TMP/bloom.keep"
+head -c $(wc -c < "$TMP/bloom.epub") /dev/zero > "$TMP/bloom.epub"
+touch -r "$TMP/bloom.keep" "$TMP/bloom.epub"
+read_book ()
+  {
+  $BIN --bloom-file="$TMP/bloom" --grep="$1" "$TMP/bloom.epub" 2>&1 \
+    | grep -q . && echo read || echo "passed over"
+  }
+check "bloom filter, no match" "passed over" "$(read_book zebra)"
+check "bloom filter, a word of the book" read "$(read_book brown)"
+touch -t 200001010000 "$TMP/bloom.epub"
+check "bloom filter, book changed" read "$(read_book zebra)"
+
+#----------------------------------------------------------------------------
+# --freq: counts by book and by chapter, n-grams, and the binary format
+#----------------------------------------------------------------------------
+chapter freq1.xhtml <<END
+<p>The cat and the dog. The cat sat.</p>
+END
+chapter freq2.xhtml <<END
+<p>A dog and a cat</p>
+END
+make_epub "$TMP/freq.epub" "$TMP/freq1.xhtml" "$TMP/freq2.xhtml"
+freq ()
+  {
+  $BIN "$@" "$TMP/freq.epub" | cut -f 2- | tr '\t' ' ' | paste -sd '|'
+  }
+check "freq, by book" \
+  " 1 3 cat| 1 2 The| 1 2 and| 1 2 dog| 1 1 A| 1 1 a| 1 1 sat| 1 1 the" \
+  "$(freq --freq=book)"
+check "freq, by chapter" \
+  "c1.xhtml 1 3 the|c1.xhtml 1 2 cat|c2.xhtml 1 2 a|c2.xhtml 1 1 and" \
+  "$(freq --freq=chapter --fold-case --top=2)"
+check "freq, n-grams" \
+  " 1 3 cat| 1 3 the| 1 2 a| 1 2 and| 1 2 dog| 2 2 the cat| 2 1 a cat" \
+  "$(freq --freq=book --fold-case --ngram=2 --top=7)"
+check "freq, binary" \
+  "45 32 46 1a|00 02 01 03 03 63 61 74 01 02 03 54 68 65" \
+  "$({ $BIN --freq=book --freq-format=binary --top=2 "$TMP/freq.epub" \
+       | head -c 4 | od -An -tx1
+     $BIN --freq=book --freq-format=binary --top=2 "$TMP/freq.epub" \
+       | tail -c 14 | od -An -tx1; } | sed 's/^ *//' | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --fingerprint and --near-duplicates: case, accents, punctuation and
+#  paragraph breaks make no difference; one word in sixty makes a little
+#----------------------------------------------------------------------------
+text=$(seq 1 60 | sed 's/.*/word&/' | paste -sd ' ')
+echo "<p>$text</p>" | chapter dup1.xhtml
+echo "<p>$text</p>" | sed 's/word10 /Wörd10<\/p><p>/; s/word30 /word30, /' \
+  | chapter dup2.xhtml
+echo "<p>$text</p>" | sed 's/word45 /other /' | chapter dup3.xhtml
+echo "<p>$(seq 100 160 | sed 's/.*/term&/' | paste -sd ' ')</p>" \
+  | chapter dup4.xhtml
+for i in 1 2 3 4; do make_epub "$TMP/dup$i.epub" "$TMP/dup$i.xhtml"; done
+$BIN --fingerprint "$TMP/dup1.epub" "$TMP/dup2.epub" "$TMP/dup3.epub" \
+  "$TMP/dup4.epub" > "$TMP/dup.tsv"
+check "fingerprint, the same text" \
+  "$(grep dup1 "$TMP/dup.tsv" | cut -f 2-)" \
+  "$(grep dup2 "$TMP/dup.tsv" | cut -f 2-)"
+near ()
+  {
+  $BIN --near-duplicates "$@"; echo "status $?"
+  }
+check "near duplicates" "dup1.epub dup2.epub 1.000|dup1.epub dup3.epub 0.812|\
+dup2.epub dup3.epub 0.812|status 0" \
+  "$(near "$TMP/dup.tsv" | grep -v xhtml | sed "s|$TMP/||g" | cut -f 1,3,5 \
+     | tr '\t' ' ' | paste -sd '|')"
+check "near duplicates, similarity" "dup1.epub dup2.epub|status 0" \
+  "$(near --similarity=0.95 "$TMP/dup.tsv" | grep -v xhtml \
+     | sed "s|$TMP/||g" | cut -f 1,3 | tr '\t' ' ' | paste -sd '|')"
+grep -v 'dup[23]' "$TMP/dup.tsv" > "$TMP/nodup.tsv"
+check "near duplicates, none" "status 1" "$(near "$TMP/nodup.tsv")"
+
+#----------------------------------------------------------------------------
+# --format=markdown: headings, emphasis, quotes and line breaks are marked,
+#  and text that Markdown would take for markup is escaped
+#----------------------------------------------------------------------------
+chapter md.xhtml <<END
+<h1>Title</h1><h3>A <i>third</i> level</h3>
+<p>Some <b>bold and <i>both</i></b> and <i>italic</i></p>
+<p>Ends in <b>bold</b></p>
+<blockquote><p>Quoted</p><p>and more</p></blockquote>
+<p>one<br/>two</p>
+<p># not a heading</p><p>* not a list</p><p>_under_</p><p>- dash</p>
+<p>+ plus</p><p>1984. A year</p>
+END
+make_epub "$TMP/md.epub" "$TMP/md.xhtml"
+check "markdown" "$(cat <<'END'
+# Title
+
+### A *third* level
+
+Some **bold and *both*** and *italic*
+
+Ends in **bold**
+
+> Quoted
+>
+> and more
+
+one\
+two
+
+\# not a heading
+
+\* not a list
+
+\_under\_
+
+\- dash
+
+\+ plus
+
+1984\. A year
+END
+)" "$($BIN --format=markdown "$TMP/md.epub")"
+
+#----------------------------------------------------------------------------
+# --format=arrow: a stream that ends as Arrow's must, with the same rows as
+#  --format=jsonl, in more than one batch; the rows are read back with
+#  pyarrow, and skipped if it is not installed
+#----------------------------------------------------------------------------
+cp "$TMP/long.epub" "$TMP/long2.epub"
+set -- "$TMP/grep.epub" "$TMP/long.epub" "$TMP/long2.epub"
+$BIN --format=arrow "$@" > "$TMP/rows.arrow"
+check "arrow, end of stream" "ff ff ff ff 00 00 00 00" \
+  "$(tail -c 8 "$TMP/rows.arrow" | od -An -tx1 | sed 's/^ *//')"
+if python3 -c 'import pyarrow' 2> /dev/null; then
+  check "arrow, rows" \
+    "$($BIN --format=jsonl "$@" | python3 -c '
+import json, sys
+books = []
+for line in sys.stdin:
+  r = json.loads (line)
+  if r["book"] not in books: books.append (r["book"])
+  print (books.index (r["book"]), r["spine_index"], r["para_index"],
+    r["kind"], repr (r["text"]))
+print (2)')" \
+    "$(python3 -c '
+import sys, pyarrow
+batches = list (pyarrow.ipc.open_stream (sys.stdin.buffer))
+for r in pyarrow.Table.from_batches (batches).to_pylist ():
+  print (r["book_id"], r["spine_index"], r["para_index"], r["kind"],
+    repr (r["text"]))
+print (len (batches))' < "$TMP/rows.arrow")"
+else
+  echo "SKIP: arrow, rows"
+fi
+set --
+
+#----------------------------------------------------------------------------
+# --io: the output, over several books and more than a megabyte, and a
+#  book that is missing, is the same as without it
+#----------------------------------------------------------------------------
+set -- "$TMP/grep.epub" "$TMP/long.epub" "$TMP/missing.epub" \
+  "$TMP/pages.epub"
+for io in uring threads; do
+  for options in "-n" "-w 40 --wrap=optimal" "--format=jsonl" \
+       "--format=markdown"; do
+    check "io=$io, $options" "$($BIN $options "$@" 2> /dev/null | cksum)" \
+      "$($BIN --io=$io $options "$@" 2> /dev/null | cksum)"
+  done
+  $BIN -n --io=$io --out=text --out=jsonl:"$TMP/io.jsonl" "$@" \
+    > "$TMP/io.txt" 2> /dev/null
+  check "io=$io, --out" \
+    "$($BIN -n "$@" 2> /dev/null; $BIN --format=jsonl "$@" 2> /dev/null)" \
+    "$(cat "$TMP/io.txt" "$TMP/io.jsonl")"
+done
+set --
+
+#----------------------------------------------------------------------------
+# --prefetch: reading ahead changes nothing, even for books that are
+#  missing, empty, not archives at all, or cut short
+#----------------------------------------------------------------------------
+: > "$TMP/empty.epub"
+printf 'PK\005\006 not a zip' > "$TMP/junk.epub"
+head -c 300 "$TMP/long.epub" > "$TMP/short.epub"
+set -- "$TMP/grep.epub" "$TMP/missing.epub" "$TMP/empty.epub" \
+  "$TMP/long.epub" "$TMP/junk.epub" "$TMP/short.epub" "$TMP/pages.epub" \
+  "$TMP/grep.epub"
+for prefetch in 1 4 16; do
+  check "prefetch=$prefetch" "$($BIN -n --prefetch=0 "$@" 2>&1 | cksum)" \
+    "$($BIN -n --prefetch=$prefetch "$@" 2>&1 | cksum)"
+done
+set --
+
+#----------------------------------------------------------------------------
+# Paragraph sinks: a paragraph that ends with emphasis is still a paragraph
+#----------------------------------------------------------------------------
+chapter emph.xhtml <<END
+<p><b>whole</b></p><p>end</p><p>a <i>b</i></p><p>next</p>
+END
+make_epub "$TMP/emph.epub" "$TMP/emph.xhtml"
+check "paragraphs ending with emphasis" "whole|end|a b|next" \
+  "$($BIN --format=jsonl "$TMP/emph.epub" \
+     | sed 's/.*"text": "\(.*\)"}$/\1/' | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --grep --regex: escapes and brackets are not folded with -i
+#----------------------------------------------------------------------------
+chapter regex.xhtml <<END
+<p>Head &amp; shoulders</p><p>nbsp 100</p>
+END
+make_epub "$TMP/regex.epub" "$TMP/regex.xhtml"
+found ()
+  {
+  $BIN "$@" --files-with-matches "$TMP/regex.epub" > /dev/null \
+    && echo yes || echo no
+  }
+check "regex \\W" yes "$(found --regex --grep='Head\W')"
+check "regex \\W, ignoring case" yes "$(found -i --regex --grep='head\W')"
+check "regex \\S, ignoring case" no "$(found -i --regex --grep='nbsp\S+')"
+check "regex bracket, ignoring case" yes "$(found -i --regex --grep='[A-H]EAD')"
+check "regex, ignoring accents" yes \
+  "$(found --ignore-diacritics --regex --grep='Héad\W')"
+
+#----------------------------------------------------------------------------
+# --hyphenate: entries right after a brace, and case pairs in Latin
+#  Extended-A that start on an odd code point
+#----------------------------------------------------------------------------
+printf '\\patterns{a1ľ\nx y z w}\n\\hyphenation{xa-yyyyy}\n' \
+  > "$TMP/hyph.tex"
+chapter hyph.xhtml <<END
+<p>a XAĽYZW</p><p>a xayyyyy</p>
+END
+make_epub "$TMP/hyph.epub" "$TMP/hyph.xhtml"
+check "hyphenation" "a XA-|ĽYZW|a xa-|yyyyy" \
+  "$($BIN --noansi -w 8 --wrap=greedy --hyphenate="$TMP/hyph.tex" \
+     "$TMP/hyph.epub" | sed 's/ *$//' | grep . | paste -sd '|')"
+
+# A very long word at a wide width: the only point is at character 42,
+#  and one after 70 characters of punctuation cannot be reported
+open=$(printf '%070d' 0 | tr 0 '(')
+close=$(printf '%0200d' 0 | tr 0 ')')
+chapter hyphlong.xhtml <<END
+<p>$(echo "$open" | cut -c 1-40)xaľyz$close</p><p>${open}xaľyz$close</p>
+END
+make_epub "$TMP/hyphlong.epub" "$TMP/hyphlong.xhtml"
+check "hyphenation, long words" \
+  "$(echo "$open" | cut -c 1-40)xa-|ľyz$close|${open}xaľyz$close" \
+  "$($BIN --noansi -w 200 --wrap=greedy --hyphenate="$TMP/hyph.tex" \
+     "$TMP/hyphlong.epub" | sed 's/ *$//' | grep . | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --chunk: a sentence longer than the overlap is split to make it
+#----------------------------------------------------------------------------
+chapter chunk.xhtml <<END
+<p>$(seq -s ' w' 0 30 | cut -c 3-)</p>
+END
+make_epub "$TMP/chunk.epub" "$TMP/chunk.xhtml"
+check "chunk overlap" "w1-w10|w7-w16|w13-w20|w17-w26|w23-w30" \
+  "$($BIN --chunk=words=10,overlap=4 "$TMP/chunk.epub" \
+     | sed 's/.*"text": "\(w[0-9]*\) .* \(w[0-9]*\)"}$/\1-\2/' \
+     | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --boilerplate, with a paragraph sink
+#----------------------------------------------------------------------------
+chapter bp1.xhtml <<END
+<h1>One</h1><p>first</p><p>Back to contents</p>
+END
+chapter bp2.xhtml <<END
+<h1>Two</h1><p>second</p><p>Back <b>to</b>  Contents</p>
+END
+make_epub "$TMP/bp.epub" "$TMP/bp1.xhtml" "$TMP/bp2.xhtml"
+check "boilerplate, jsonl" \
+  "heading One|paragraph first|heading Two|paragraph second" \
+  "$($BIN --boilerplate=1 --format=jsonl "$TMP/bp.epub" \
+     | sed 's/.*"kind": "\(.*\)", "text": "\(.*\)"}$/\1 \2/' | paste -sd '|')"
+
+#----------------------------------------------------------------------------
+# --out=text: ANSI codes, as the usual text has, unless --noansi
+#----------------------------------------------------------------------------
+chapter ansi.xhtml <<END
+<h2>A heading</h2>
+<p>Some <b>bold</b> text, with a * and \\, and <i>more</i> of it</p>
+END
+make_epub "$TMP/ansi.epub" "$TMP/ansi.xhtml"
+check "out=text, ANSI" "$($BIN -w 20 "$TMP/ansi.epub" | od -c)" \
+  "$($BIN -w 20 --out=text "$TMP/ansi.epub" | od -c)"
+check "out=text, no ANSI" "$($BIN -n -w 20 "$TMP/ansi.epub" | od -c)" \
+  "$($BIN -n -w 20 --out=text:"$TMP/ansi.txt" "$TMP/ansi.epub"; \
+     od -c < "$TMP/ansi.txt")"
+
+#----------------------------------------------------------------------------
+# Emphasis in the middle of a paragraph, or at its end, changes neither the
+#  spacing nor the paragraphs, in the text or in --out=text
+#----------------------------------------------------------------------------
+chapter spacing.xhtml <<END
+<p>It was <i>Victory Mansions</i>, though <b>bold</b>.</p><p>And <i>it</i></p><p>Next</p>
+END
+make_epub "$TMP/spacing.epub" "$TMP/spacing.xhtml"
+check "emphasis and spacing" \
+  "It was Victory Mansions, though bold.|And it|Next" \
+  "$($BIN -n "$TMP/spacing.epub" | sed 's/ *$//' | grep . | paste -sd '|')"
+check "out=text, emphasis and spacing" \
+  "$($BIN -n -w 24 --wrap=optimal "$TMP/spacing.epub" | od -c)" \
+  "$($BIN -n -w 24 --wrap=optimal --out=text "$TMP/spacing.epub" | od -c)"
+
+#----------------------------------------------------------------------------
+# --output-dir: books of the same name, and files from an earlier run
+#----------------------------------------------------------------------------
+mkdir -p "$TMP/d1" "$TMP/d2"
+make_epub "$TMP/d1/book.epub" "$TMP/emph.xhtml" "$TMP/regex.xhtml"
+make_epub "$TMP/d2/book.epub" "$TMP/emph.xhtml"
+$BIN --output-dir="$TMP/od" "$TMP/d1/book.epub" "$TMP/d2/book.epub"
+check "output-dir, same names" "$TMP/d1/book.epub $TMP/d2/book.epub" \
+  "$(sed -n 's/.*"book": "\(.*\)",/\1/p' "$TMP/od/book/manifest.json" \
+     "$TMP/od/book-2/manifest.json" | paste -sd ' ')"
+$BIN --output-dir="$TMP/od" "$TMP/d2/book.epub"
+check "output-dir, earlier files removed" "0001.txt manifest.json" \
+  "$(ls "$TMP/od/book" | paste -sd ' ')"
+
+#----------------------------------------------------------------------------
+# --emit-ir: a saved document gives the same raw text as the EPUB
+#----------------------------------------------------------------------------
+chapter raw.xhtml <<END
+<h1>Title</h1>
+<p>a   b
+   c <b>bold</b> d</p>
+<p>x<br/>y </p>
+END
+make_epub "$TMP/raw.epub" "$TMP/raw.xhtml" "$TMP/emph.xhtml"
+$BIN -m --emit-ir="$TMP/raw.e2t" "$TMP/raw.epub" > /dev/null
+check "raw round trip" "$($BIN -r -m "$TMP/raw.epub" | od -c)" \
+  "$($BIN -r -m --from-ir "$TMP/raw.e2t" | od -c)"
+
+#----------------------------------------------------------------------------
+# --raw: the text is written as it is, not laid out by the wrapper
+#----------------------------------------------------------------------------
+printf '<p>It was <i>Victory Mansions</i>, though   <b>bold</b>.\nAnd so</p>%s' \
+  '<p>one<br/>two<br/>three four</p>' | chapter verbatim.xhtml
+make_epub "$TMP/verbatim.epub" "$TMP/verbatim.xhtml"
+check "raw text verbatim" \
+  "$(printf 'It was Victory Mansions, though bold. And so\n\n%b' \
+     'one\342\234\217 two\nthree four\n\n' | od -c)" \
+  "$($BIN -r "$TMP/verbatim.epub" | od -c)"
+
+#----------------------------------------------------------------------------
+# --from-ir: a document whose tokens do not match its text is rejected
+#----------------------------------------------------------------------------
+cp "$TMP/raw.e2t" "$TMP/bad.e2t"
+# The offset of the tokens, from the header, and the length of the first
+offset=$(od -An -t u8 -j 32 -N 8 "$TMP/bad.e2t" | tr -d ' ')
+printf '\377' | dd of="$TMP/bad.e2t" bs=1 seek="$offset" conv=notrunc \
+  2> /dev/null
+check "damaged document" "'$TMP/bad.e2t' is damaged" \
+  "$($BIN --from-ir "$TMP/bad.e2t" 2>&1 | sed 's/^[^:]*: //')"
+
+#----------------------------------------------------------------------------
+# --wrap=optimal: each paragraph costs no more than the best layout found
+#  by trying every break, and only a word wider than a line is wider
+#  than a line. The cost is the sum of the squares of the space left at
+#  the end of each line but the last, and the longest line is three
+#  columns narrower than -w
+#----------------------------------------------------------------------------
+awk 'BEGIN { srand (8); 
+  for (p = 0; p < 40; p++) { s = ""; n = 1 + int (rand () * 50);
+    for (w = 0; w < n; w++) { l = 1 + int (rand () * (rand () < 0.2 ? 50 : 12));
+      t = ""
+      for (k = 0; k < l; k++) t = t sprintf ("%c", 97 + int (rand () * 10))
+      s = s (w ? " " : "") t }
+    print "<p>" s "</p>" } }' | chapter optimal.xhtml
+make_epub "$TMP/optimal.epub" "$TMP/optimal.xhtml"
+optimal_check ()
+  {
+  awk -v limit=$(($1 - 3)) '
+    function fits (a, b) { return pos[b] - pos[a] - 1 <= limit || b - a == 1 }
+    function cost (a, b,   l) 
+      { l = pos[b] - pos[a] - 1; return l > limit ? 0 : (limit - l) ^ 2 }
+    function para (  i, j, c)
+      {
+      if (!nw) return
+      for (i = 0; i < nw; i++) pos[i + 1] = pos[i] + length (w[i]) + 1
+      for (j = 1; j <= nw; j++)
+        {
+        best[j] = -1
+        for (i = j - 1; i >= 0 && fits(i, j); i--)
+          {
+          c = best[i] + (j == nw ? 0 : cost(i, j))
+          if (best[j] < 0 || c < best[j]) best[j] = c
+          }
+        }
+      if (over || got != best[nw]) worse++
+      nw = got = over = 0
+      }
+    BEGIN { pos[0] = best[0] = 0 }
+    /^$/ { para(); next }
+      {
+      if (nw) got += last
+      n = split ($0, t, " ")
+      for (i = 1; i <= n; i++) w[nw++] = t[i]
+      if (length ($0) > limit && n > 1) over = 1
+      last = length ($0) > limit ? 0 : (limit - length ($0)) ^ 2
+      }
+    END { para(); print worse ? "worse" : "optimal" }'
+  }
+for width in 12 24 33 60; do
+  check "optimal wrap, -w $width" optimal \
+    "$($BIN --noansi --wrap=optimal -w $width "$TMP/optimal.epub" \
+       | optimal_check $width)"
+done
+
+#----------------------------------------------------------------------------
+# --from-ir: a saved document, wrapped again at another width, in any
+#  mode, is the text that the EPUB gives at that width
+#----------------------------------------------------------------------------
+make_epub "$TMP/reflow.epub" "$TMP/raw.xhtml" "$TMP/spacing.xhtml" \
+  "$TMP/ansi.xhtml" "$TMP/linebreak.xhtml" "$TMP/optimal.xhtml"
+$BIN --emit-ir="$TMP/reflow.e2t" "$TMP/reflow.epub" > /dev/null
+for wrap in --wrap=greedy --wrap=optimal --justify; do
+  for width in 12 30 57 80; do
+    check "re-flow, $wrap -w $width" \
+      "$($BIN -n -w $width $wrap "$TMP/reflow.epub" | od -c)" \
+      "$($BIN -n -w $width $wrap --from-ir "$TMP/reflow.e2t" | od -c)"
+  done
+done
+
+#----------------------------------------------------------------------------
+# --index-dir: a book that is indexed again is listed once, as it is now
+#----------------------------------------------------------------------------
+chapter reindex.xhtml <<END
+<p>alpha beta</p><p>beta</p>
+END
+make_epub "$TMP/reindex.epub" "$TMP/reindex.xhtml"
+$BIN --index-dir="$TMP/index" "$TMP/reindex.epub"
+$BIN --index-dir="$TMP/index" "$TMP/reindex.epub" "$TMP/reindex.epub"
+check "re-indexing" "c1.xhtml 0|c1.xhtml 1" \
+  "$($BIN --index-dir="$TMP/index" --query=beta | cut -f 2- | tr '\t' ' ' \
+     | paste -sd '|')"
+chapter reindex.xhtml <<END
+<p>gamma beta</p>
+END
+make_epub "$TMP/reindex.epub" "$TMP/reindex.xhtml"
+$BIN --index-dir="$TMP/index" "$TMP/reindex.epub"
+check "re-indexing, changed" "1|c1.xhtml 0" \
+  "$({ $BIN --index-dir="$TMP/index" --query=alpha; echo $?
+     $BIN --index-dir="$TMP/index" --query=beta; } | cut -f 2- \
+     | tr '\t' ' ' | paste -sd '|')"
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]